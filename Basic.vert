@@ -10,29 +10,16 @@ out vec3 normal_wcs;
 out vec3 lightDir_tcs;
 out vec3 viewDir_tcs;
 out float varyingHeight;
+out vec3 position_wcs;
 
 // Uniforms
 uniform mat4 MVP;
 uniform mat4 Model;
-uniform sampler2D heightMapSampler;
-uniform float heightMapScale;
+#include "TerrainHeight.glsl"
 uniform int numOfVertices;
 uniform vec3 lightDir_wcs;
 uniform vec3 viewPos_wcs;
 
-// Function to get the height value at specific texture coordinates uv from a height map
-float getHeightFromHeightMap(vec2 uv)
-{
-    vec3 heightRGB = texture(heightMapSampler, uv).rgb;
-
-    int dataByR = int(heightRGB.x * 255.0) << 16;
-    int dataByG = int(heightRGB.y * 255.0) << 8;
-    int dataByB = int(heightRGB.z * 255.0);
-
-    // Height value scaling: Convert the normalized value read from the height map to the actual height value
-    return (dataByR + dataByG + dataByB) * heightMapScale;
-}
-
 void main()
 {
     // Task 1
@@ -46,7 +33,7 @@ void main()
     gl_Position = MVP * vec4(position_ocs, 1);
 
     // Calculate and store the vertex position in world coordinate system
-    vec3 position_wcs = (Model * vec4(position_ocs, 1)).xyz;
+    position_wcs = (Model * vec4(position_ocs, 1)).xyz;
     UV = vertexUV;
 
     // Task 2
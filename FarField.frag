@@ -0,0 +1,41 @@
+#version 400 core
+
+// Far field impostor: the terrain beyond the near field, rendered into a cube map around farFieldCentre a few
+// sectors per frame (main.cpp, UpdateFarField). Drawn after the near field with the depth it was rendered at,
+// so the depth test decides between the two where they overlap
+
+// Output
+out vec3 color;
+
+uniform samplerCube farFieldColorSampler;
+uniform samplerCube farFieldDepthSampler;
+uniform float farFieldNear;
+uniform float farFieldFar;
+
+uniform mat4 MVP;
+uniform mat4 invMVP;
+uniform vec3 viewPos_wcs;
+uniform vec2 viewportSize;
+
+void main()
+{
+    // View ray of the pixel
+    vec2 ndc = gl_FragCoord.xy / viewportSize * 2.0 - 1.0;
+    vec4 farPoint = invMVP * vec4(ndc, 1.0, 1.0);
+    vec3 direction = normalize(farPoint.xyz / farPoint.w - viewPos_wcs);
+
+    // Cleared texels are sky or the hole of the near field
+    float depth = texture(farFieldDepthSampler, direction).r;
+    if (depth >= 1.0)
+        discard;
+
+    // Face depth is measured along the major axis of the face, turn it into a distance along the ray
+    float z = 2.0 * farFieldNear * farFieldFar / (farFieldFar + farFieldNear - (depth * 2.0 - 1.0) * (farFieldFar - farFieldNear));
+    vec3 axis = abs(direction);
+    float rayDistance = z / max(axis.x, max(axis.y, axis.z));
+
+    // The camera is close to the cube centre, the sample is put on the view ray at the same distance
+    vec4 position = MVP * vec4(viewPos_wcs + direction * rayDistance, 1.0);
+    gl_FragDepth = position.z / position.w * 0.5 + 0.5;
+    color = texture(farFieldColorSampler, direction).rgb;
+}
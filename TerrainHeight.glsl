@@ -0,0 +1,18 @@
+// Height map decoding shared by the terrain stages (#include "TerrainHeight.glsl", see readAndCompileShader)
+
+uniform sampler2D heightMapSampler;
+uniform float heightMapScale;
+
+// Function to get the height value at specific texture coordinates uv from a height map.
+// Always from the base level: blending packed 24 bit heights would be meaningless
+float getHeightFromHeightMap(vec2 uv)
+{
+    vec3 heightRGB = textureLod(heightMapSampler, uv, 0.0).rgb;
+
+    int dataByR = int(heightRGB.x * 255.0) << 16;
+    int dataByG = int(heightRGB.y * 255.0) << 8;
+    int dataByB = int(heightRGB.z * 255.0);
+
+    // Height value scaling: Convert the normalized value read from the height map to the actual height value
+    return (dataByR + dataByG + dataByB) * heightMapScale;
+}
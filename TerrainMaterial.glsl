@@ -0,0 +1,178 @@
+// Material blending, lighting and analysis overlays shared by the forward pass (Texture.frag) and the shading pass
+// of the visibility buffer (TerrainShade.frag), #include "TerrainMaterial.glsl" (see readAndCompileShader)
+
+uniform sampler2D rockDiffSampler;
+uniform sampler2D rockSpecSampler;
+uniform sampler2D rockNormSampler;
+
+uniform sampler2D grassDiffSampler;
+uniform sampler2D grassSpecSampler;
+uniform sampler2D grassNormSampler;
+
+uniform sampler2D snowDiffSampler;
+uniform sampler2D snowSpecSampler;
+uniform sampler2D snowNormSampler;
+
+// Virtual texturing of the materials (common/virtualtexture.hpp): layers in the order of the samplers above,
+// pages come from the physical cache through the indirection table instead of the classic textures
+uniform bool virtualTexturing;
+uniform sampler2D vtPhysicalSampler;
+uniform usamplerBuffer vtIndirectionSampler;
+uniform vec2 vtPhysicalSize;
+uniform int vtPageSize;
+uniform int vtBorder;
+uniform int vtLayerSize[9];
+uniform int vtLayerOffset[9];
+uniform int vtLayerMips[9];
+
+int vtPagesAcross(int layer, int mip)
+{
+    return max(1, (vtLayerSize[layer] >> mip) / vtPageSize);
+}
+
+vec4 sampleVirtual(int layer, vec2 uv)
+{
+    // Same mip selection as VTFeedback.frag
+    vec2 dx = dFdx(uv) * float(vtLayerSize[layer]);
+    vec2 dy = dFdy(uv) * float(vtLayerSize[layer]);
+    float lod = 0.5 * log2(max(max(dot(dx, dx), dot(dy, dy)), 1e-8));
+    int mip = clamp(int(floor(lod + 0.5)), 0, vtLayerMips[layer] - 1);
+
+    int offset = vtLayerOffset[layer];
+    for (int m = 0; m < mip; m++)
+        offset += vtPagesAcross(layer, m) * vtPagesAcross(layer, m);
+    vec2 wrapped = fract(uv);
+    int pages = vtPagesAcross(layer, mip);
+    ivec2 page = min(ivec2(wrapped * float(pages)), ivec2(pages - 1));
+    uint entry = texelFetch(vtIndirectionSampler, offset + page.y * pages + page.x).r;
+    if (entry == 0xffffffffu)
+        return vec4(0.5, 0.5, 1.0, 1.0); // nothing resident yet: mid gray, flat normal
+
+    // The entry may point at a coarser ancestor, find the position inside that page
+    int residentMip = int(entry >> 16);
+    vec2 inPage = fract(wrapped * float(vtPagesAcross(layer, residentMip)));
+    vec2 slot = vec2(float(entry & 0xffu), float((entry >> 8) & 0xffu));
+    vec2 physical = slot * float(vtPageSize + 2 * vtBorder) + float(vtBorder) + inPage * float(vtPageSize);
+    return textureLod(vtPhysicalSampler, physical / vtPhysicalSize, 0.0);
+}
+
+vec4 sampleMaterial(sampler2D classic, int layer, vec2 uv)
+{
+    if (virtualTexturing)
+        return sampleVirtual(layer, uv);
+    return texture(classic, uv);
+}
+
+uniform sampler2D viewshedSampler;
+uniform bool viewshedOverlay;
+
+uniform sampler2D terrainLayerSampler;
+uniform int terrainLayerOverlay;
+
+// Viewshed overlay: texels are 0 where no observer sees the terrain, otherwise the share of observers that do
+vec3 applyViewshed(vec3 baseColor, vec2 uv)
+{
+    if (!viewshedOverlay)
+        return baseColor;
+    float seen = texture(viewshedSampler, uv).r;
+    if (seen <= 0.0)
+        return baseColor * 0.4;
+    return mix(baseColor, vec3(0.1, 0.9, 0.2), 0.2 + 0.4 * seen);
+}
+
+// Analysis overlays of the derived terrain layers: r = slope / 90 deg, g = aspect (0 = flat), b = curvature, a = log flow
+vec3 applyTerrainLayerOverlay(vec3 baseColor, vec4 layers)
+{
+    vec3 overlay;
+    if (terrainLayerOverlay == 1)
+        overlay = mix(vec3(0.1, 0.7, 0.1), vec3(0.9, 0.1, 0.1), clamp(layers.r * 2.0, 0.0, 1.0));
+    else if (terrainLayerOverlay == 2)
+        overlay = layers.g == 0.0 ? vec3(0.5) : clamp(abs(fract(layers.g + vec3(1.0, 2.0 / 3.0, 1.0 / 3.0)) * 6.0 - 3.0) - 1.0, 0.0, 1.0);
+    else if (terrainLayerOverlay == 3)
+        overlay = mix(vec3(1.0), layers.b > 0.5 ? vec3(0.9, 0.2, 0.1) : vec3(0.1, 0.3, 0.9), abs(layers.b * 2.0 - 1.0));
+    else if (terrainLayerOverlay == 4)
+        return mix(baseColor, vec3(0.1, 0.3, 1.0), smoothstep(0.4, 0.9, layers.a));
+    else
+        return baseColor;
+    return mix(baseColor, overlay, 0.6);
+}
+
+vec3 getPhong(vec3 diffuseColor, vec3 specularDetail, vec3 normalDetail, vec3 lightDir_tcs, vec3 viewDir_tcs)
+{
+    // get normal (TCS)
+    vec3 normal_tcs = normalize(normalDetail * 2.0 - 1.0);
+
+    // get half vector (TCS)
+    vec3 halfVector_tcs = normalize(lightDir_tcs + viewDir_tcs);
+
+    // ambient
+    vec3 ambient = diffuseColor * 0.1;
+
+    // diffuse
+    float diff = max(dot(normal_tcs, lightDir_tcs), 0.0);
+    vec3 diffuse = diff * diffuseColor;
+
+    // specular
+    vec3 specularColour = vec3(0.3, 0.3, 0.3);
+    float roughness = specularDetail.x;
+    float shininess = clamp((2/(pow(roughness,4)+1e-2))-2,0,500.0f);
+    float specularIntensity = pow(max(dot(normal_tcs, halfVector_tcs), 0.0), shininess);
+    vec3 specular = specularIntensity * specularColour;
+
+    // phong color
+    //return ambient + diffuse + specular;
+
+    // just diffuse
+     return diffuse;
+}
+
+// Colour of the terrain at UV and the displaced height currHeight, with the light and view directions in tangent space
+vec3 shadeTerrain(vec2 UV, float currHeight, vec3 lightDir_tcs, vec3 viewDir_tcs)
+{
+    vec3 rockDiff = sampleMaterial(rockDiffSampler, 0, UV * 10).rgb;
+    vec3 rockSpecDetail = sampleMaterial(rockSpecSampler, 1, UV * 10).rgb;
+    vec3 rockNormDetail = sampleMaterial(rockNormSampler, 2, UV * 10).rgb;
+    
+    vec3 grassDiff = sampleMaterial(grassDiffSampler, 3, UV * 20).rgb;
+    vec3 grassSpecDetail = sampleMaterial(grassSpecSampler, 4, UV * 20).rgb;
+    vec3 grassNormDetail = sampleMaterial(grassNormSampler, 5, UV * 20).rgb;
+
+    vec3 snowDiff = sampleMaterial(snowDiffSampler, 6, UV * 10).rgb;
+    vec3 snowSpecDetail = sampleMaterial(snowSpecSampler, 7, UV * 10).rgb;
+    vec3 snowNormDetail = sampleMaterial(snowNormSampler, 8, UV * 10).rgb;
+
+    vec3 rockPhongColor = getPhong(rockDiff, rockSpecDetail, rockNormDetail, lightDir_tcs, viewDir_tcs);
+    vec3 grassPhongColor = getPhong(grassDiff, grassSpecDetail, grassNormDetail, lightDir_tcs, viewDir_tcs);
+    vec3 snowPhongColor = getPhong(snowDiff, snowSpecDetail, snowNormDetail, lightDir_tcs, viewDir_tcs);
+
+    float rockHeight = 1;
+    float snowHeight = 2;
+    
+    vec3 shaded;
+    if(currHeight < 0.0f + 0.001f){
+        shaded = grassPhongColor;
+    }
+    else if (currHeight > 0 && currHeight <= rockHeight + 0.25)
+    {
+        float blendRock = smoothstep(rockHeight - 0.25, rockHeight + 0.25, currHeight);
+        float blendGrass = 1 - blendRock;
+        shaded = blendGrass * grassPhongColor + blendRock * rockPhongColor;
+    } 
+    else if (currHeight <= snowHeight + 0.25)
+    {
+        float blendSnow = smoothstep(snowHeight - 0.25, snowHeight + 0.25, currHeight);
+        float blendRock = 1 - blendSnow;
+        shaded = blendSnow * snowPhongColor + blendRock * rockPhongColor;
+    }
+    else
+    {
+        shaded = snowPhongColor;
+    }
+
+    // Steep ground shows rock whatever its height
+    vec4 layers = texture(terrainLayerSampler, UV);
+    shaded = mix(shaded, rockPhongColor, smoothstep(0.35, 0.5, layers.r));
+
+    shaded = applyTerrainLayerOverlay(shaded, layers);
+    return applyViewshed(shaded, UV);
+}
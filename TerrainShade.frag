@@ -0,0 +1,63 @@
+#version 400 core
+
+// Shading pass of the visibility buffer: material blending and lighting of Texture.frag,
+// run exactly once per covered pixel whatever the triangle density or overdraw
+
+// Output
+out vec3 color;
+
+// Visibility buffer
+uniform sampler2D visibilitySampler;
+uniform sampler2D depthSampler;
+uniform vec2 viewportSize;
+uniform mat4 invMVP;
+
+// Same terrain uniforms as Basic.vert
+#include "TerrainHeight.glsl"
+uniform int numOfVertices;
+uniform vec3 lightDir_wcs;
+uniform vec3 viewPos_wcs;
+
+#include "TerrainMaterial.glsl"
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    vec4 visibility = texelFetch(visibilitySampler, pixel, 0);
+    if (visibility.a == 0.0)
+        discard;
+
+    vec2 UV = visibility.xy;
+    float currHeight = visibility.z;
+
+    // World position from the stored depth
+    float depth = texelFetch(depthSampler, pixel, 0).r;
+    vec4 position_ndc = vec4(gl_FragCoord.xy / viewportSize * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+    vec4 position = invMVP * position_ndc;
+    vec3 position_wcs = position.xyz / position.w;
+
+    // Normal and tangent frame exactly as Basic.vert builds them, but per pixel
+    vec2 pixelSize = 1.0 / textureSize(heightMapSampler, 0) * numOfVertices;
+    float l  = getHeightFromHeightMap(UV - vec2(pixelSize.x, 0.0));
+    float r  = getHeightFromHeightMap(UV + vec2(pixelSize.x, 0.0));
+    float b  = getHeightFromHeightMap(UV - vec2(0.0, pixelSize.y));
+    float t  = getHeightFromHeightMap(UV + vec2(0.0, pixelSize.y));
+    float dx = (l - r) / (2.0 * pixelSize.x);
+    float dz = (t - b) / (2.0 * pixelSize.y);
+
+    vec3 N = normalize(vec3(dx, 1, dz));
+    vec3 B = vec3(1, 0, 0);
+    vec3 T = vec3(0, 0, 1);
+    T = normalize(T - dot(T, N) * N);
+    B = normalize(B - dot(B, N) * N - dot(B, T) * T);
+    mat3 TBN = mat3(T, B, N);
+
+    vec3 lightDir_tcs = TBN * (-lightDir_wcs);
+    vec3 viewDir_tcs = TBN * (viewPos_wcs - position_wcs);
+
+    // Materials and height blending of Texture.frag
+    color = shadeTerrain(UV, currHeight, lightDir_tcs, viewDir_tcs);
+
+    // Keep the depth so later passes can still test against the terrain
+    gl_FragDepth = depth;
+}
@@ -0,0 +1,35 @@
+#version 400 core
+
+// Feedback pass of the virtual texturing, drawn at a fraction of the window resolution: every pixel
+// reports one material page it would sample, packed like makeVirtualPage() in common/virtualtexture.hpp.
+// The pixels take turns over the 9 layers, shifted every frame, so all of them are covered within a few frames.
+in vec2 te_UV;
+
+// Output, the target is cleared to 0xffffffff (no page)
+layout(location = 0) out uint page;
+
+uniform int vtFrame;
+uniform float vtLodBias; // log2 of the resolution divider, derivatives here are that much larger
+uniform int vtPageSize;
+uniform int vtLayerSize[9];
+uniform int vtLayerMips[9];
+
+// UV tiling of each layer in Texture.frag
+const float vtTiling[9] = float[9](10.0, 10.0, 10.0, 20.0, 20.0, 20.0, 10.0, 10.0, 10.0);
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    int layer = (pixel.x + 3 * pixel.y + vtFrame) % 9;
+
+    // Derivatives of the shared UV, the layer differs between neighbouring pixels
+    float scale = vtTiling[layer] * float(vtLayerSize[layer]);
+    vec2 dx = dFdx(te_UV) * scale;
+    vec2 dy = dFdy(te_UV) * scale;
+    float lod = 0.5 * log2(max(max(dot(dx, dx), dot(dy, dy)), 1e-8)) - vtLodBias;
+    int mip = clamp(int(floor(lod + 0.5)), 0, vtLayerMips[layer] - 1);
+
+    int pages = max(1, (vtLayerSize[layer] >> mip) / vtPageSize);
+    ivec2 xy = min(ivec2(fract(te_UV * vtTiling[layer]) * float(pages)), ivec2(pages - 1));
+    page = (uint(layer) << 26) | (uint(mip) << 22) | (uint(xy.y) << 11) | uint(xy.x);
+}
@@ -0,0 +1,15 @@
+#version 400 core
+
+// Geometry pass of the visibility buffer: store only what the shading pass cannot rebuild
+// (UV and displaced height), depth comes from the depth attachment
+in vec2 te_UV;
+in float te_varyingHeight;
+
+// Output
+layout(location = 0) out vec4 visibility;
+
+void main()
+{
+    // alpha marks covered pixels, the buffer is cleared to 0
+    visibility = vec4(te_UV, te_varyingHeight, 1.0);
+}
@@ -0,0 +1,45 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "harness.hpp"
+using namespace std;
+
+// Replacement of the global allocation functions for the whole bench executable, counting every allocation.
+// Kept apart from the code that allocates, so the compiler does not inline them into it.
+namespace
+{
+	atomic<unsigned long long> allocations(0);
+	atomic<unsigned long long> allocatedBytes(0);
+
+	void* countedAlloc(size_t size)
+	{
+		allocations.fetch_add(1, memory_order_relaxed);
+		allocatedBytes.fetch_add(size, memory_order_relaxed);
+		return malloc(size ? size : 1);
+	}
+}
+
+void* operator new(size_t size)
+{
+	if (void* p = countedAlloc(size))
+		return p;
+	throw bad_alloc();
+}
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new(size_t size, const nothrow_t&) noexcept { return countedAlloc(size); }
+void* operator new[](size_t size, const nothrow_t&) noexcept { return countedAlloc(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+unsigned long long benchAllocations()
+{
+	return allocations.load(memory_order_relaxed);
+}
+
+unsigned long long benchAllocatedBytes()
+{
+	return allocatedBytes.load(memory_order_relaxed);
+}
@@ -0,0 +1,156 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+
+#include "harness.hpp"
+using namespace std;
+
+namespace
+{
+	const void* volatile sink = nullptr;
+}
+
+void benchKeep(const void* p)
+{
+	sink = p;
+}
+
+BenchRunner::BenchRunner(const BenchOptions& options)
+	: options(options)
+{
+}
+
+void BenchRunner::run(const string& name, size_t bytesPerOp, const function<void()>& fn)
+{
+	if (!options.filter.empty() && name.find(options.filter) == string::npos)
+		return;
+
+	for (int i = 0; i < options.warmup; i++)
+		fn();
+
+	auto batch = [&](long long count) {
+		auto start = chrono::steady_clock::now();
+		for (long long i = 0; i < count; i++)
+			fn();
+		return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+	};
+
+	// Grow the batch until it fills the minimum time
+	const double minNs = options.minTimeMs * 1e6;
+	long long iterations = 1;
+	double ns = batch(iterations);
+	while (ns < minNs && iterations < options.maxIterations)
+	{
+		double factor = ns > 0.0 ? min(10.0, max(2.0, 1.2 * minNs / ns)) : 10.0;
+		iterations = min(options.maxIterations, (long long)(iterations * factor));
+		ns = batch(iterations);
+	}
+
+	// Fastest batch of the final size, the allocations of the last one
+	double best = ns;
+	unsigned long long allocs = 0, bytes = 0;
+	for (int s = 1; s < options.samples; s++)
+	{
+		unsigned long long a0 = benchAllocations(), b0 = benchAllocatedBytes();
+		best = min(best, batch(iterations));
+		allocs = benchAllocations() - a0;
+		bytes = benchAllocatedBytes() - b0;
+	}
+	if (options.samples <= 1)
+	{
+		unsigned long long a0 = benchAllocations(), b0 = benchAllocatedBytes();
+		batch(1);
+		allocs = (benchAllocations() - a0) * iterations;
+		bytes = (benchAllocatedBytes() - b0) * iterations;
+	}
+
+	BenchResult result;
+	result.name = name;
+	result.warmup = options.warmup;
+	result.iterations = iterations;
+	result.nsPerOp = best / iterations;
+	result.bytesPerSecond = bytesPerOp ? bytesPerOp / (result.nsPerOp * 1e-9) : 0.0;
+	result.allocationsPerOp = double(allocs) / iterations;
+	result.allocatedBytesPerOp = double(bytes) / iterations;
+	results.push_back(result);
+
+	char line[256];
+	snprintf(line, sizeof(line), "%-28s %10lld %14.1f %12.1f %10.1f %12.0f", name.c_str(), iterations, result.nsPerOp,
+		result.bytesPerSecond / 1e6, result.allocationsPerOp, result.allocatedBytesPerOp);
+	cout << line << endl;
+}
+
+bool BenchRunner::writeJSON(const char* path) const
+{
+	ofstream out(path);
+	if (!out)
+	{
+		cerr << path << " could not be opened for writing" << endl;
+		return false;
+	}
+	// One case per line, compareBaseline() relies on it
+	out << "{\n  \"benchmarks\": [\n";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const BenchResult& r = results[i];
+		char line[512];
+		snprintf(line, sizeof(line), "    {\"name\": \"%s\", \"warmup\": %d, \"iterations\": %lld, \"ns_per_op\": %.3f, "
+			"\"bytes_per_second\": %.1f, \"allocations_per_op\": %.3f, \"allocated_bytes_per_op\": %.1f}%s\n",
+			r.name.c_str(), r.warmup, r.iterations, r.nsPerOp, r.bytesPerSecond, r.allocationsPerOp, r.allocatedBytesPerOp,
+			i + 1 < results.size() ? "," : "");
+		out << line;
+	}
+	out << "  ]\n}\n";
+	return bool(out);
+}
+
+int BenchRunner::compareBaseline(const char* path, double threshold) const
+{
+	ifstream in(path);
+	if (!in)
+	{
+		cerr << "Baseline " << path << " could not be opened" << endl;
+		return -1;
+	}
+
+	// Only the name and time of every case are needed
+	map<string, double> baseline;
+	string line;
+	while (getline(in, line))
+	{
+		size_t name = line.find("\"name\": \"");
+		size_t time = line.find("\"ns_per_op\": ");
+		if (name == string::npos || time == string::npos)
+			continue;
+		name += 9;
+		size_t end = line.find('"', name);
+		if (end == string::npos)
+			continue;
+		baseline[line.substr(name, end - name)] = atof(line.c_str() + time + 13);
+	}
+
+	int regressions = 0;
+	cout << "Compared with " << path << " (threshold " << threshold * 100.0 << "%)" << endl;
+	for (const BenchResult& r : results)
+	{
+		auto it = baseline.find(r.name);
+		if (it == baseline.end() || it->second <= 0.0)
+		{
+			cout << "  " << r.name << ": not in the baseline" << endl;
+			continue;
+		}
+		double change = r.nsPerOp / it->second - 1.0;
+		const char* verdict = change > threshold ? "REGRESSION" : (change < -threshold ? "faster" : "same");
+		char text[256];
+		snprintf(text, sizeof(text), "  %-28s %12.1f -> %12.1f ns %+7.1f%%  %s", r.name.c_str(), it->second, r.nsPerOp,
+			change * 100.0, verdict);
+		cout << text << endl;
+		if (change > threshold)
+			regressions++;
+	}
+	return regressions;
+}
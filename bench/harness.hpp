@@ -0,0 +1,60 @@
+#ifndef HARNESS_HPP
+#define HARNESS_HPP
+
+#include <vector>
+#include <string>
+#include <functional>
+#include <cstddef>
+
+// Microbenchmark harness for the CPU paths. Every case runs a few warmup operations, then batches of operations
+// growing until one batch fills the minimum time; the best of a few batches of that size is reported. Heap
+// allocations are counted by the global operator new of allocations.cpp. Results can be saved as JSON and compared
+// with a baseline saved the same way, so regressions show up before they reach the renderer.
+
+struct BenchOptions
+{
+	int warmup = 3;              // operations run before measuring
+	double minTimeMs = 100.0;    // a measured batch lasts at least this long
+	int samples = 5;             // batches of the final size, the fastest one counts
+	long long maxIterations = 10000000;
+	std::string filter;          // only cases whose name contains it
+};
+
+struct BenchResult
+{
+	std::string name;
+	int warmup;
+	long long iterations;        // operations per measured batch
+	double nsPerOp;
+	double bytesPerSecond;       // 0 when the case has no byte size
+	double allocationsPerOp;
+	double allocatedBytesPerOp;
+};
+
+class BenchRunner
+{
+public:
+	BenchRunner(const BenchOptions& options = BenchOptions());
+
+	// fn is one operation processing bytesPerOp bytes of input (0 = no throughput). Prints the result
+	void run(const std::string& name, size_t bytesPerOp, const std::function<void()>& fn);
+
+	const std::vector<BenchResult>& getResults() const { return results; }
+	bool writeJSON(const char* path) const;
+	// Compare with a file written by writeJSON: cases slower than the baseline by more than threshold (0.1 = 10%)
+	// are reported as regressions. Returns their number, or -1 when the baseline cannot be read
+	int compareBaseline(const char* path, double threshold) const;
+
+private:
+	BenchOptions options;
+	std::vector<BenchResult> results;
+};
+
+// Keeps the optimizer from dropping a result that is otherwise unused
+void benchKeep(const void* p);
+
+// Heap allocations since the start of the program (allocations.cpp)
+unsigned long long benchAllocations();
+unsigned long long benchAllocatedBytes();
+
+#endif
@@ -0,0 +1,490 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <limits>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <functional>
+
+#include <glm/glm.hpp>
+
+#include "common/utils.hpp"
+#include "common/heightcodec.hpp"
+#include "common/terrainmesh.hpp"
+#include "common/camera.hpp"
+#include "common/simulation.hpp"
+#include "common/softraster.hpp"
+#include "common/jobsystem.hpp"
+#include "common/terrainlayers.hpp"
+#include "bench/harness.hpp"
+
+using namespace std;
+
+namespace
+{
+	// Synthetic height map of size x size 24 bit heights: a few octaves of ridges plus hashed noise, so the codec
+	// sees realistic residuals and the timings do not depend on the assets in the working directory
+	void makeSyntheticHeights(int size, vector<int32_t>& heights)
+	{
+		heights.resize(size_t(size) * size);
+		uint32_t state = 0x9e3779b9u;
+		for (int y = 0; y < size; y++)
+		{
+			for (int x = 0; x < size; x++)
+			{
+				float u = float(x) / size, v = float(y) / size;
+				float h = 0.0f, amplitude = 0.5f, frequency = 3.0f;
+				for (int octave = 0; octave < 4; octave++)
+				{
+					h += amplitude * (1.0f - std::fabs(std::sin(frequency * u * 6.2831853f) * std::cos(frequency * v * 5.1f)));
+					amplitude *= 0.5f;
+					frequency *= 2.1f;
+				}
+				state = state * 1664525u + 1013904223u;
+				float noise = float(state >> 8) / float(1 << 24) - 0.5f;
+				heights[size_t(y) * size + x] = int32_t(std::min(float(0xFFFFFF), std::max(0.0f, (h / 0.95f + 0.002f * noise) * 0xFFFFFF)));
+			}
+		}
+	}
+
+	// loadBMP_custom reports every file it reads, the report would flood the table
+	struct NullBuffer : streambuf
+	{
+		int overflow(int c) override { return c; }
+	};
+	NullBuffer nullBuffer;
+
+	// Frame t of the scripted camera path with the defaults of main.cpp (MakeTerrainFrame)
+	TerrainFrame makePathFrame(float t)
+	{
+		computeMatricesFromPath(t);
+		TerrainFrame frame;
+		frame.Model = glm::mat4(1.0);
+		frame.MVP = getProjectionMatrix() * getViewMatrix() * frame.Model;
+		frame.lightDir = glm::normalize(glm::vec3(0, -0.15, 1));
+		frame.viewPos = getCameraPosition();
+		frame.heightMapScale = 0.000002f;
+		frame.numOfVertices = 200;
+		frame.tessLevel = 1.0f;
+		frame.field = FIELD_ALL;
+		frame.fieldCentre = frame.viewPos;
+		frame.fieldRadius = 0.0f;
+		return frame;
+	}
+
+	// Mean absolute difference per channel and PSNR of two BGR images of the same layout
+	void compareImages(const vector<unsigned char>& a, const vector<unsigned char>& b, double& meanError, double& psnr)
+	{
+		double sum = 0.0, squares = 0.0;
+		for (size_t i = 0; i < a.size(); i++)
+		{
+			const double d = double(a[i]) - double(b[i]);
+			sum += std::fabs(d);
+			squares += d * d;
+		}
+		meanError = sum / std::max<size_t>(a.size(), 1);
+		const double mse = squares / std::max<size_t>(a.size(), 1);
+		psnr = mse > 0.0 ? 10.0 * std::log10(255.0 * 255.0 / mse) : numeric_limits<double>::infinity();
+	}
+
+	// 1, 2, 4 ... threads and all of them
+	vector<unsigned int> threadCounts()
+	{
+		vector<unsigned int> counts;
+		for (unsigned int threads = 1; threads < jobSystem().getThreadCount(); threads *= 2)
+			counts.push_back(threads);
+		counts.push_back(jobSystem().getThreadCount());
+		return counts;
+	}
+
+	// Software rasterizer on the assets of the working directory: one frame of the camera path on 1, 2, 4 ... threads.
+	// Every thread count has to produce the image of the single thread run, tiles share no pixels. With
+	// gl_frame_NNN.bmp from main --capture present the frames are also compared with the GL ones.
+	// Returns the number of failed checks
+	int benchSoftwareRasterizer(BenchRunner& runner, double minPsnr)
+	{
+		const int width = 800, height = 600;
+		SoftwareBackend backend(width, height, 200, 5.0f, 1);
+		streambuf* out = cout.rdbuf(&nullBuffer);
+		const bool loaded = backend.Load();
+		cout.rdbuf(out);
+		if (!loaded)
+		{
+			cout << "softraster: skipped, the height map and material textures are not in the working directory" << endl;
+			return 0;
+		}
+
+		int failures = 0;
+		const TerrainFrame frame = makePathFrame(0.25f);
+		vector<unsigned char> reference, pixels;
+		backend.DrawFrame(frame);
+		backend.ReadPixels(width, height, reference);
+
+		double singleThreadNs = 0.0;
+		for (unsigned int threads : threadCounts())
+		{
+			backend.SetThreadCount(threads);
+			runner.run("softraster/frame/" + to_string(threads) + "t", 0, [&]() { backend.DrawFrame(frame); });
+			if (runner.getResults().empty() || runner.getResults().back().name != "softraster/frame/" + to_string(threads) + "t")
+				continue;
+			const double ns = runner.getResults().back().nsPerOp;
+			if (threads == 1)
+				singleThreadNs = ns;
+			backend.ReadPixels(width, height, pixels);
+			const bool same = pixels == reference;
+			char line[160];
+			snprintf(line, sizeof(line), "%-28s %10.2f x speedup, image %s", ("softraster/scaling/" + to_string(threads) + "t").c_str(),
+				singleThreadNs > 0.0 ? singleThreadNs / ns : 0.0, same ? "identical" : "DIFFERS from the single thread one");
+			cout << line << endl;
+			failures += same ? 0 : 1;
+		}
+
+		// Captured GL frames: the path is split into as many frames as there are files
+		int frames = 0;
+		char path[64];
+		for (;; frames++)
+		{
+			snprintf(path, sizeof(path), "gl_frame_%03d.bmp", frames);
+			if (FILE* file = fopen(path, "rb"))
+				fclose(file);
+			else
+				break;
+		}
+		if (frames == 0)
+		{
+			cout << "softraster/diff: skipped, no gl_frame_NNN.bmp from main --capture in the working directory" << endl;
+			return failures;
+		}
+		backend.SetThreadCount(0);
+		double worstPsnr = numeric_limits<double>::infinity(), totalError = 0.0;
+		int compared = 0;
+		for (int i = 0; i < frames; i++)
+		{
+			snprintf(path, sizeof(path), "gl_frame_%03d.bmp", i);
+			int w = 0, h = 0;
+			unsigned char* data = nullptr;
+			out = cout.rdbuf(&nullBuffer);
+			const bool read = loadBMP_custom(path, w, h, data);
+			cout.rdbuf(out);
+			if (!read || w != width || h != height)
+			{
+				delete[] data;
+				continue;
+			}
+			vector<unsigned char> gl(data, data + heightmapRowStride(w) * h);
+			delete[] data;
+			backend.DrawFrame(makePathFrame(i / float(frames)));
+			backend.ReadPixels(width, height, pixels);
+			double meanError, psnr;
+			compareImages(pixels, gl, meanError, psnr);
+			worstPsnr = std::min(worstPsnr, psnr);
+			totalError += meanError;
+			compared++;
+		}
+		const bool similar = compared == frames && worstPsnr >= minPsnr;
+		char line[200];
+		snprintf(line, sizeof(line), "%-28s %d of %d frames, mean abs error %.2f, worst PSNR %.1f dB (minimum %.1f) %s", "softraster/diff",
+			compared, frames, totalError / std::max(compared, 1), worstPsnr, minPsnr, similar ? "ok" : "MISMATCH");
+		cout << line << endl;
+		return failures + (similar ? 0 : 1);
+	}
+
+	// Parallel loops of the job system on 1 to all threads: a synthetic compute bound one and the slope layer of a
+	// synthetic height map. The speedup is printed against the single thread run of the same case
+	void benchJobScaling(BenchRunner& runner)
+	{
+		JobSystem& jobs = jobSystem();
+		vector<double> partial(4096);
+		vector<int32_t> heights;
+		const int size = 2048;
+		makeSyntheticHeights(size, heights);
+		vector<float> slope(heights.size());
+		TerrainLayerOptions options;
+		options.cellSize = 1200.0f;
+
+		struct Case
+		{
+			const char* name;
+			function<void(unsigned int)> run;
+			double singleThreadNs;
+		};
+		Case cases[] = {
+			{ "jobs/parallel-for", [&](unsigned int threads) {
+				jobs.parallelFor(int(partial.size()), threads, [&](int i) {
+					double v = 0.0;
+					for (int k = 1; k < 2000; k++)
+						v += std::sqrt(double(i + k));
+					partial[i] = v;
+				});
+				benchKeep(partial.data());
+			}, 0.0 },
+			{ "layers/slope/2048", [&](unsigned int threads) {
+				options.threads = threads;
+				computeSlopeAspectCurvature(heights.data(), size, size, options, slope.data(), nullptr, nullptr);
+				benchKeep(slope.data());
+			}, 0.0 },
+		};
+		for (unsigned int threads : threadCounts())
+			for (Case& c : cases)
+			{
+				const string name = string(c.name) + "/" + to_string(threads) + "t";
+				runner.run(name, 0, [&]() { c.run(threads); });
+				if (runner.getResults().empty() || runner.getResults().back().name != name)
+					continue;
+				const double ns = runner.getResults().back().nsPerOp;
+				if (threads == 1)
+					c.singleThreadNs = ns;
+				char line[160];
+				snprintf(line, sizeof(line), "%-28s %10.2f x speedup", (string(c.name) + "/scaling/" + to_string(threads) + "t").c_str(),
+					c.singleThreadNs > 0.0 ? c.singleThreadNs / ns : 0.0);
+				cout << line << endl;
+			}
+		cout << jobs.jobsRun() << " jobs run, " << jobs.jobsStolen() << " stolen" << endl;
+	}
+
+	// Every derived layer of UpdateTerrainLayers() in main.cpp on a synthetic 2048 map, all threads. The curvature
+	// case computes slope and aspect along with it, as the renderer does
+	void benchTerrainLayers(BenchRunner& runner)
+	{
+		const int size = 2048;
+		vector<int32_t> heights;
+		makeSyntheticHeights(size, heights);
+		const size_t count = heights.size();
+		const size_t heightBytes = count * sizeof(int32_t);
+		TerrainLayerOptions options;
+		options.cellSize = 1200.0f;
+		vector<float> slope(count), aspect(count), curvature(count);
+		vector<unsigned char> directions(count), rgba;
+		vector<uint32_t> accumulation(count);
+
+		runner.run("layers/curvature/2048", heightBytes, [&]() {
+			computeSlopeAspectCurvature(heights.data(), size, size, options, slope.data(), aspect.data(), curvature.data());
+			benchKeep(curvature.data());
+		});
+		runner.run("layers/flow-dir/2048", heightBytes, [&]() {
+			computeFlowDirections(heights.data(), size, size, options, directions.data());
+			benchKeep(directions.data());
+		});
+		runner.run("layers/flow-acc/2048", heightBytes, [&]() {
+			computeFlowAccumulation(heights.data(), size, size, options, accumulation.data());
+			benchKeep(accumulation.data());
+		});
+		// The inputs of the pack are only filled when their cases ran
+		computeSlopeAspectCurvature(heights.data(), size, size, options, slope.data(), aspect.data(), curvature.data());
+		computeFlowAccumulation(heights.data(), size, size, options, accumulation.data());
+		options.curvatureRange = terrainCurvatureRange(curvature.data(), count);
+		runner.run("layers/pack/2048", heightBytes, [&]() {
+			packTerrainLayers(slope.data(), aspect.data(), curvature.data(), accumulation.data(), size, size, options, rgba);
+			benchKeep(rgba.data());
+		});
+	}
+
+	// Same work as BuildTerrainModel() in main.cpp: the grid, the coarser LOD strips and the triangle lists
+	void buildModel(int nPoints, vector<glm::vec3>& vertices, vector<glm::vec2>& uvs, vector<unsigned int>& indices)
+	{
+		const unsigned int restartIndex = numeric_limits<unsigned int>::max();
+		vector<unsigned int> strips, triangles;
+		buildTerrainGrid(nPoints, 5.0f, restartIndex, vertices, uvs, strips);
+		for (int lod = 0; lod < 3; lod++)
+		{
+			if (lod > 0)
+				buildTerrainStrips(nPoints, 1 << lod, restartIndex, strips);
+			stripToTriangles(strips, restartIndex, triangles);
+			indices.insert(indices.end(), triangles.begin(), triangles.end());
+		}
+	}
+}
+
+//CPU microbenchmarks of the terrain hot paths
+//  --filter TEXT       only run the cases whose name contains TEXT
+//  --json FILE         write the results as JSON
+//  --baseline FILE     compare with results saved by --json, exits with 1 when a case regressed
+//  --threshold PCT     slowdown counted as a regression (default 10)
+//  --min-time MS       minimum duration of a measured batch (default 100)
+//  --warmup N          operations before measuring (default 3)
+//  --min-psnr DB       smallest PSNR of a software frame against gl_frame_NNN.bmp (default 30)
+//Exits with 1 when a case regressed or a software rasterizer check failed
+int main(int argc, char** argv)
+{
+	BenchOptions options;
+	const char* jsonPath = nullptr;
+	const char* baselinePath = nullptr;
+	double threshold = 0.1;
+	double minPsnr = 30.0;
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		if (arg == "--filter" && i + 1 < argc)
+			options.filter = argv[++i];
+		else if (arg == "--json" && i + 1 < argc)
+			jsonPath = argv[++i];
+		else if (arg == "--baseline" && i + 1 < argc)
+			baselinePath = argv[++i];
+		else if (arg == "--threshold" && i + 1 < argc)
+			threshold = std::max(0.0, atof(argv[++i]) / 100.0);
+		else if (arg == "--min-time" && i + 1 < argc)
+			options.minTimeMs = std::max(1.0, atof(argv[++i]));
+		else if (arg == "--warmup" && i + 1 < argc)
+			options.warmup = std::max(0, atoi(argv[++i]));
+		else if (arg == "--min-psnr" && i + 1 < argc)
+			minPsnr = atof(argv[++i]);
+		else
+		{
+			cerr << "Unknown argument " << arg << endl;
+			return 2;
+		}
+	}
+
+	BenchRunner runner(options);
+	char header[256];
+	snprintf(header, sizeof(header), "%-28s %10s %14s %12s %10s %12s", "case", "iterations", "ns/op", "MB/s", "allocs/op", "bytes/op");
+	cout << header << endl;
+
+	const int sizes[] = { 256, 1024, 2048 };
+	for (int size : sizes)
+	{
+		vector<int32_t> heights;
+		makeSyntheticHeights(size, heights);
+		const size_t heightBytes = heights.size() * sizeof(int32_t);
+		const size_t stride = heightmapRowStride(size);
+		vector<unsigned char> bgr(stride * size);
+		packHeightsBGR(heights.data(), size, size, bgr.data());
+		const string suffix = "/" + to_string(size);
+
+		// BMP loading, from a file written once (it stays in the page cache, so this is the parsing and copying)
+		char path[64];
+		snprintf(path, sizeof(path), "bench_heights_%d.bmp", size);
+		if (saveBMP_custom(path, size, size, bgr.data()))
+		{
+			runner.run("bmp/load" + suffix, bgr.size(), [&]() {
+				streambuf* out = cout.rdbuf(&nullBuffer);
+				int w, h;
+				unsigned char* data = nullptr;
+				loadBMP_custom(path, w, h, data);
+				cout.rdbuf(out);
+				benchKeep(data);
+				delete[] data;
+			});
+			remove(path);
+		}
+
+		// Height decoding
+		vector<int32_t> unpacked(heights.size());
+		runner.run("heights/unpack" + suffix, bgr.size(), [&]() {
+			unpackHeightsBGR(bgr.data(), size, size, unpacked.data());
+			benchKeep(unpacked.data());
+		});
+		runner.run("heights/pack" + suffix, bgr.size(), [&]() {
+			packHeightsBGR(heights.data(), size, size, bgr.data());
+			benchKeep(bgr.data());
+		});
+
+		vector<unsigned char> encoded;
+		runner.run("thm/encode" + suffix, heightBytes, [&]() {
+			encodeHeights(heights.data(), size, size, HeightCodecOptions(), encoded);
+			benchKeep(encoded.data());
+		});
+		vector<int32_t> decoded;
+		runner.run("thm/decode" + suffix, heightBytes, [&]() {
+			int w, h;
+			decodeHeights(encoded.data(), encoded.size(), w, h, decoded);
+			benchKeep(decoded.data());
+		});
+
+		// Size of the .thm file against the BMP it caches, lossless and with the quantized mode
+		if (!options.filter.empty() && ("thm/ratio" + suffix).find(options.filter) == string::npos)
+			continue;
+		vector<unsigned char> lossless, quantized;
+		HeightCodecOptions quantizedOptions;
+		quantizedOptions.maxError = 4;
+		encodeHeights(heights.data(), size, size, HeightCodecOptions(), lossless);
+		encodeHeights(heights.data(), size, size, quantizedOptions, quantized);
+		char ratio[160];
+		snprintf(ratio, sizeof(ratio), "%-28s %10.2f : 1 lossless (%zu bytes), %.2f : 1 max error %u (%zu bytes)", ("thm/ratio" + suffix).c_str(),
+			double(bgr.size() + 54) / lossless.size(), lossless.size(), double(bgr.size() + 54) / quantized.size(), quantizedOptions.maxError, quantized.size());
+		cout << ratio << endl;
+	}
+
+	// Mesh loops of LoadModel(), with fresh buffers like at load time
+	const int gridSizes[] = { 100, 200, 800 };
+	for (int nPoints : gridSizes)
+	{
+		runner.run("mesh/build/" + to_string(nPoints), 0, [&]() {
+			vector<glm::vec3> vertices;
+			vector<glm::vec2> uvs;
+			vector<unsigned int> indices;
+			buildModel(nPoints, vertices, uvs, indices);
+			benchKeep(indices.data());
+		});
+	}
+
+	// Camera math of the simulation step and the scripted path
+	int step = 0;
+	runner.run("camera/step", 0, [&]() {
+		CameraInput input;
+		input.turnX = float(step % 7 - 3);
+		input.turnY = float(step % 5 - 2);
+		input.forward = (step & 1) != 0;
+		input.right = (step & 2) != 0;
+		step++;
+		stepCamera(input, 0.016f);
+	});
+	runner.run("camera/path", 0, [&]() {
+		computeMatricesFromPath(float(step++ % 1000) / 1000.0f);
+		glm::mat4 view = getViewMatrix();
+		benchKeep(&view);
+	});
+
+	// One step of the simulation thread with a turn and a key event queued, driven without the thread
+	Simulation simulation;
+	runner.run("simulation/step", 0, [&]() {
+		SimulationEvent event;
+		event.time = 0.0;
+		event.type = SimulationEvent::TURN;
+		event.turnX = float(step % 7 - 3);
+		event.turnY = float(step % 5 - 2);
+		simulation.pushEvent(event);
+		event.type = SimulationEvent::BUTTON;
+		event.button = SimulationButton(step % SIM_BUTTON_COUNT);
+		event.down = (step / SIM_BUTTON_COUNT) % 2 == 0;
+		simulation.pushEvent(event);
+		simulation.step(step * simulation.getSettings().stepSeconds);
+		step++;
+		benchKeep(&simulation.snapshot());
+	});
+
+	// Derived terrain layers, then the thread scaling of the job system
+	const string filter = options.filter;
+	auto selects = [&](const string& prefix) { return filter.empty() || filter.find(prefix) != string::npos || prefix.find(filter) != string::npos; };
+	if (selects("layers/"))
+		benchTerrainLayers(runner);
+	if (selects("jobs/parallel-for") || selects("layers/slope"))
+		benchJobScaling(runner);
+
+	// Whole frames of the software rasterizer, with the assets only
+	int checkFailures = 0;
+	if (selects("softraster"))
+		checkFailures = benchSoftwareRasterizer(runner, minPsnr);
+
+	if (jsonPath && !runner.writeJSON(jsonPath))
+		return 2;
+	if (baselinePath)
+	{
+		int regressions = runner.compareBaseline(baselinePath, threshold);
+		if (regressions < 0)
+			return 2;
+		if (regressions > 0)
+		{
+			cout << regressions << " regression(s)" << endl;
+			return 1;
+		}
+	}
+	if (checkFailures > 0)
+	{
+		cout << checkFailures << " software rasterizer check(s) failed" << endl;
+		return 1;
+	}
+	return 0;
+}
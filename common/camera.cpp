@@ -0,0 +1,146 @@
+// Include GLM
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+using namespace glm;
+
+#include "camera.hpp"
+
+glm::mat4 ViewMatrix;
+glm::mat4 ProjectionMatrix;
+
+glm::mat4 getViewMatrix() {
+	return ViewMatrix;
+}
+glm::mat4 getProjectionMatrix() {
+	return ProjectionMatrix;
+}
+
+
+// Initial position : on +Z
+glm::vec3 position = glm::vec3(3, 8, 0);
+// Initial horizontal angle : toward -Z
+float horizontalAngle = 0;
+// Initial vertical angle : none
+float verticalAngle = 0.0f;
+// Initial Field of View
+float initialFoV = 45.0f;
+
+glm::vec3 getCameraPosition() {
+	return position;
+}
+float speed = 3.0f; // 3 units / second
+float mouseSpeed = 0.005f;
+
+namespace
+{
+	// Direction : Spherical coordinates to Cartesian coordinates conversion
+	glm::vec3 viewDirection(const CameraState& state) {
+		return glm::vec3(
+			cos(state.verticalAngle) * sin(state.horizontalAngle),
+			sin(state.verticalAngle),
+			cos(state.verticalAngle) * cos(state.horizontalAngle)
+		);
+	}
+
+	// Right vector
+	glm::vec3 rightDirection(const CameraState& state) {
+		return glm::vec3(
+			sin(state.horizontalAngle - 3.14f / 2.0f),
+			0,
+			cos(state.horizontalAngle - 3.14f / 2.0f)
+		);
+	}
+}
+
+bool advanceCamera(CameraState& state, const CameraInput& input, float deltaTime) {
+
+	// Compute new orientation
+	state.horizontalAngle += mouseSpeed * input.turnX;
+	state.verticalAngle += mouseSpeed * input.turnY;
+	bool changed = input.turnX != 0.0f || input.turnY != 0.0f;
+
+	glm::vec3 direction = viewDirection(state);
+	glm::vec3 right = rightDirection(state);
+
+	// Move forward
+	if (input.forward) {
+		state.position += direction * deltaTime * speed;
+		changed = true;
+	}
+	// Move backward
+	if (input.backward) {
+		state.position -= direction * deltaTime * speed;
+		changed = true;
+	}
+	// Strafe right
+	if (input.right) {
+		state.position += right * deltaTime * speed;
+		changed = true;
+	}
+	// Strafe left
+	if (input.left) {
+		state.position -= right * deltaTime * speed;
+		changed = true;
+	}
+	return changed;
+}
+
+CameraState interpolateCamera(const CameraState& from, const CameraState& to, float t) {
+	CameraState state;
+	state.position = glm::mix(from.position, to.position, t);
+	state.horizontalAngle = from.horizontalAngle + (to.horizontalAngle - from.horizontalAngle) * t;
+	state.verticalAngle = from.verticalAngle + (to.verticalAngle - from.verticalAngle) * t;
+	return state;
+}
+
+CameraState getCameraState() {
+	CameraState state;
+	state.position = position;
+	state.horizontalAngle = horizontalAngle;
+	state.verticalAngle = verticalAngle;
+	return state;
+}
+
+void setCameraState(const CameraState& state) {
+	position = state.position;
+	horizontalAngle = state.horizontalAngle;
+	verticalAngle = state.verticalAngle;
+
+	glm::vec3 direction = viewDirection(state);
+	// Up vector
+	glm::vec3 up = glm::cross(rightDirection(state), direction);
+
+	float FoV = initialFoV;// - 5 * glfwGetMouseWheel(); // Now GLFW 3 requires setting up a callback for this. It's a bit too complicated for this beginner's tutorial, so it's disabled instead.
+
+	// Projection matrix : 45� Field of View, 4:3 ratio, display range : 0.1 unit <-> 100 units
+	ProjectionMatrix = glm::perspective(glm::radians(FoV), 4.0f / 3.0f, 0.1f, 500.0f);
+	// Camera matrix
+	ViewMatrix = glm::lookAt(
+		position,           // Camera is here
+		position + direction, // and looks here : at the same position, plus "direction"
+		up                  // Head is up (set to 0,-1,0 to look upside-down)
+	);
+}
+
+bool stepCamera(const CameraInput& input, float deltaTime) {
+	CameraState state = getCameraState();
+	bool changed = advanceCamera(state, input, deltaTime);
+	setCameraState(state);
+	return changed;
+}
+
+void computeMatricesFromPath(float t) {
+
+	// Scripted fly-around used to render the same frames with every backend: one orbit around
+	// the terrain centre for t in [0, 1), bobbing up and down a little so the horizon moves too
+	float angle = t * 2.0f * 3.14159265f;
+	position = glm::vec3(7.0f * sin(angle), 4.0f + 1.5f * sin(2.0f * angle), 7.0f * cos(angle));
+	glm::vec3 target = glm::vec3(0, 1, 0);
+
+	glm::vec3 direction = glm::normalize(target - position);
+	horizontalAngle = atan2(direction.x, direction.z);
+	verticalAngle = asin(direction.y);
+
+	ProjectionMatrix = glm::perspective(glm::radians(initialFoV), 4.0f / 3.0f, 0.1f, 500.0f);
+	ViewMatrix = glm::lookAt(position, target, glm::vec3(0, 1, 0));
+}
@@ -0,0 +1,39 @@
+#ifndef CAMERA_HPP
+#define CAMERA_HPP
+
+#include <glm/glm.hpp>
+
+// Fly camera: position, orientation and the matrices derived from them. Nothing here depends on the window
+// system: the simulation thread (simulation.hpp) steps a CameraState with the GLFW input gathered by controls.cpp,
+// the render loop sets the current camera from its snapshots, the benchmarks feed synthetic input.
+
+// Where the camera is and where it looks
+struct CameraState
+{
+	glm::vec3 position;
+	float horizontalAngle = 0.0f, verticalAngle = 0.0f;
+};
+
+// Input of one camera step
+struct CameraInput
+{
+	float turnX = 0.0f, turnY = 0.0f; // cursor movement to the left / up since the last step, in pixels
+	bool forward = false, backward = false, right = false, left = false;
+};
+
+// Turn and move a camera state by one step of deltaTime seconds, no global state involved.
+// Returns true when the camera moved or turned
+bool advanceCamera(CameraState& state, const CameraInput& input, float deltaTime);
+CameraState interpolateCamera(const CameraState& from, const CameraState& to, float t);
+
+// The current camera: setting it rebuilds the matrices
+CameraState getCameraState();
+void setCameraState(const CameraState& state);
+// advanceCamera() on the current camera
+bool stepCamera(const CameraInput& input, float deltaTime);
+void computeMatricesFromPath(float t);
+glm::mat4 getViewMatrix();
+glm::mat4 getProjectionMatrix();
+glm::vec3 getCameraPosition();
+
+#endif
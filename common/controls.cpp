@@ -4,106 +4,43 @@ extern GLFWwindow* window; // The "extern" keyword here is to access the variabl
 
 // Include GLM
 #include <glm/glm.hpp>
-#include <glm/gtc/matrix_transform.hpp>
-using namespace glm;
 
 #include "controls.hpp"
 
-glm::mat4 ViewMatrix;
-glm::mat4 ProjectionMatrix;
-
-glm::mat4 getViewMatrix() {
-	return ViewMatrix;
-}
-glm::mat4 getProjectionMatrix() {
-	return ProjectionMatrix;
-}
-
-
-// Initial position : on +Z
-glm::vec3 position = glm::vec3(3, 8, 0);
-// Initial horizontal angle : toward -Z
-float horizontalAngle = 0;
-// Initial vertical angle : none
-float verticalAngle = 0.0f;
-// Initial Field of View
-float initialFoV = 45.0f;
-
-glm::vec3 getCameraPosition() {
-	return position;
-}
-float speed = 3.0f; // 3 units / second
-float mouseSpeed = 0.005f;
+void pollSimulationInput(Simulation& simulation) {
 
+	const double now = simulationClock();
 
-
-void computeMatricesFromInputs() {
-
-	// glfwGetTime is called only once, the first time this function is called
-	static double lastTime = glfwGetTime();
-
-	// Compute time difference between current and last frame
-	double currentTime = glfwGetTime();
-	float deltaTime = float(currentTime - lastTime);
-
-	// Get mouse position
+	// Cursor movement since the last poll, measured from the centre of the window it is put back to
+	int width, height;
+	glfwGetWindowSize(window, &width, &height);
 	double xpos, ypos;
 	glfwGetCursorPos(window, &xpos, &ypos);
-
-	// Reset mouse position for next frame
-	glfwSetCursorPos(window, 1024 / 2, 768 / 2);
-
-	// Compute new orientation
-	horizontalAngle += mouseSpeed * float(1024 / 2 - xpos);
-	verticalAngle += mouseSpeed * float(768 / 2 - ypos);
-
-	// Direction : Spherical coordinates to Cartesian coordinates conversion
-	glm::vec3 direction(
-		cos(verticalAngle) * sin(horizontalAngle),
-		sin(verticalAngle),
-		cos(verticalAngle) * cos(horizontalAngle)
-	);
-
-	// Right vector
-	glm::vec3 right = glm::vec3(
-		sin(horizontalAngle - 3.14f / 2.0f),
-		0,
-		cos(horizontalAngle - 3.14f / 2.0f)
-	);
-
-	// Up vector
-	glm::vec3 up = glm::cross(right, direction);
-
-	// Move forward
-	if (glfwGetKey(window, GLFW_KEY_UP) == GLFW_PRESS) {
-		position += direction * deltaTime * speed;
-	}
-	// Move backward
-	if (glfwGetKey(window, GLFW_KEY_DOWN) == GLFW_PRESS) {
-		position -= direction * deltaTime * speed;
-	}
-	// Strafe right
-	if (glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS) {
-		position += right * deltaTime * speed;
-	}
-	// Strafe left
-	if (glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS) {
-		position -= right * deltaTime * speed;
+	glfwSetCursorPos(window, width / 2, height / 2);
+
+	SimulationEvent event;
+	event.time = now;
+	event.type = SimulationEvent::TURN;
+	event.turnX = float(width / 2 - xpos);
+	event.turnY = float(height / 2 - ypos);
+	if (event.turnX != 0.0f || event.turnY != 0.0f)
+		simulation.pushEvent(event);
+
+	// Held keys are integrated by the simulation, it only needs to hear about presses and releases.
+	// Sticky keys report a press that was released again before this poll once, so a tap still arrives
+	static const int keys[SIM_BUTTON_COUNT] = {
+		GLFW_KEY_UP, GLFW_KEY_DOWN, GLFW_KEY_RIGHT, GLFW_KEY_LEFT, GLFW_KEY_W, GLFW_KEY_S, GLFW_KEY_A, GLFW_KEY_D
+	};
+	static bool down[SIM_BUTTON_COUNT] = {};
+	event.type = SimulationEvent::BUTTON;
+	for (int b = 0; b < SIM_BUTTON_COUNT; b++)
+	{
+		bool pressed = glfwGetKey(window, keys[b]) == GLFW_PRESS;
+		if (pressed == down[b])
+			continue;
+		event.button = SimulationButton(b);
+		event.down = pressed;
+		if (simulation.pushEvent(event))
+			down[b] = pressed;
 	}
-
-
-
-	float FoV = initialFoV;// - 5 * glfwGetMouseWheel(); // Now GLFW 3 requires setting up a callback for this. It's a bit too complicated for this beginner's tutorial, so it's disabled instead.
-
-	// Projection matrix : 45� Field of View, 4:3 ratio, display range : 0.1 unit <-> 100 units
-	ProjectionMatrix = glm::perspective(glm::radians(FoV), 4.0f / 3.0f, 0.1f, 500.0f);
-	// Camera matrix
-	ViewMatrix = glm::lookAt(
-		position,           // Camera is here
-		position + direction, // and looks here : at the same position, plus "direction"
-		up                  // Head is up (set to 0,-1,0 to look upside-down)
-	);
-
-	// For the next frame, the "last time" will be "now"
-	lastTime = currentTime;
-}
\ No newline at end of file
+}
@@ -1,8 +1,9 @@
 #ifndef CONTROLS_HPP
 #define CONTROLS_HPP
 
-void computeMatricesFromInputs();
-glm::mat4 getViewMatrix();
-glm::mat4 getProjectionMatrix();
-glm::vec3 getCameraPosition();
-#endif
\ No newline at end of file
+#include "camera.hpp"
+#include "simulation.hpp"
+
+// Turn the GLFW cursor movement and the camera / light keys into events for the simulation thread
+void pollSimulationInput(Simulation& simulation);
+#endif
@@ -0,0 +1,281 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "farfield.hpp"
+using namespace std;
+
+namespace
+{
+	// View direction and up vector of every face, the usual cube map layout: with these the rendered
+	// image lands in the face the way texture(samplerCube, direction) reads it
+	const glm::vec3 faceDirection[6] = {
+		glm::vec3(1, 0, 0), glm::vec3(-1, 0, 0), glm::vec3(0, 1, 0), glm::vec3(0, -1, 0), glm::vec3(0, 0, 1), glm::vec3(0, 0, -1)
+	};
+	const glm::vec3 faceUp[6] = {
+		glm::vec3(0, -1, 0), glm::vec3(0, -1, 0), glm::vec3(0, 0, 1), glm::vec3(0, 0, -1), glm::vec3(0, -1, 0), glm::vec3(0, -1, 0)
+	};
+
+	// The face image is d + u * right + v * up for u, v in [-1, 1], u along the texel columns and v along the rows
+	// from the bottom, as lookAt and the 90 degree projection of faceViewProjection() lay it out
+	glm::vec3 faceRight(int face)
+	{
+		return glm::cross(faceDirection[face], faceUp[face]);
+	}
+
+	float horizontalDistance(const glm::vec3& a, const glm::vec3& b)
+	{
+		return glm::length(glm::vec2(a.x - b.x, a.z - b.z));
+	}
+}
+
+FarField::FarField(const FarFieldSettings& settings)
+	: settings(settings), boundsMin(0.0f), boundsMax(0.0f), rendered(0), copied(0), built(0)
+{
+	this->settings.sectors = max(1, settings.sectors);
+	reset();
+}
+
+void FarField::setBounds(const glm::vec3& minimum, const glm::vec3& maximum)
+{
+	boundsMin = minimum;
+	boundsMax = maximum;
+}
+
+void FarField::invalidate()
+{
+	stale = true;
+}
+
+void FarField::invalidateRegion(const glm::vec3& minimum, const glm::vec3& maximum)
+{
+	// Sectors of the cube being built that are still to do render or copy afterwards, a copy takes the flag along
+	for (int c = 0; c < 2; c++)
+	{
+		if (c != shown && c != building)
+			continue;
+		for (int f = 0; f < 6; f++)
+			for (int y = 0; y < settings.sectors; y++)
+				for (int x = 0; x < settings.sectors; x++)
+				{
+					Sector& sector = cubes[c].sectors[sectorIndex(f, x, y)];
+					if (!sector.terrain || sector.stale)
+						continue;
+					float u0, u1, v0, v1;
+					sectorBounds(x, y, u0, u1, v0, v1);
+					sector.stale = pyramidSeesBox(f, u0, u1, v0, v1, sector.centre, minimum, maximum);
+				}
+	}
+}
+
+void FarField::reset()
+{
+	shown = -1;
+	building = -1;
+	buildCentre = glm::vec3(0.0f);
+	// A new texture may hold anything, every sector is cleared the first time
+	Sector unknown = { glm::vec3(0.0f), true, false };
+	for (Cube& cube : cubes)
+		cube.sectors.assign(6 * settings.sectors * settings.sectors, unknown);
+	todo.clear();
+	stale = false;
+}
+
+bool FarField::plan(const glm::vec3& camera, vector<FarFieldSector>& sectors)
+{
+	sectors.clear();
+	const int n = settings.sectors;
+	if (building < 0)
+	{
+		// Small movements are covered by nearRadius(), a new cube is only needed once a sector of the shown one
+		// is off by too much or far terrain came into view of an empty one
+		bool outdated = shown < 0 || stale;
+		for (int f = 0; f < 6 && !outdated; f++)
+			for (int y = 0; y < n && !outdated; y++)
+				for (int x = 0; x < n && !outdated; x++)
+				{
+					const Sector& sector = cubes[shown].sectors[sectorIndex(f, x, y)];
+					outdated = sector.terrain ? sector.stale || sectorNeedsRender(f, x, y, sector.centre, camera) :
+						sectorSeesTerrain(f, x, y, camera);
+				}
+		if (!outdated)
+			return false;
+
+		building = shown < 0 ? 0 : 1 - shown;
+		buildCentre = camera;
+		todo.clear();
+		for (int f = 0; f < 6; f++)
+			for (int y = 0; y < n; y++)
+				for (int x = 0; x < n; x++)
+				{
+					const int i = sectorIndex(f, x, y);
+					if (!sectorSeesTerrain(f, x, y, camera))
+					{
+						if (cubes[building].sectors[i].terrain)
+							todo.push_back({ f, x, y, FarFieldSector::CLEAR });
+						continue;
+					}
+					const bool reuse = shown >= 0 && !stale && cubes[shown].sectors[i].terrain && !cubes[shown].sectors[i].stale &&
+						!sectorNeedsRender(f, x, y, cubes[shown].sectors[i].centre, camera);
+					todo.push_back({ f, x, y, reuse ? FarFieldSector::COPY : FarFieldSector::RENDER });
+				}
+		stale = false;
+	}
+
+	int budget = max(1, settings.sectorsPerFrame);
+	for (size_t i = 0; i < todo.size();)
+	{
+		const FarFieldSector& sector = todo[i];
+		if (sector.action == FarFieldSector::RENDER && budget == 0)
+		{
+			i++;
+			continue;
+		}
+		Sector& target = cubes[building].sectors[sectorIndex(sector.face, sector.x, sector.y)];
+		switch (sector.action)
+		{
+		case FarFieldSector::RENDER:
+			budget--;
+			rendered++;
+			target.centre = buildCentre;
+			target.terrain = true;
+			target.stale = false;
+			break;
+		case FarFieldSector::COPY:
+			copied++;
+			target = cubes[shown].sectors[sectorIndex(sector.face, sector.x, sector.y)];
+			break;
+		case FarFieldSector::CLEAR:
+			target.centre = buildCentre;
+			target.terrain = false;
+			target.stale = false;
+			break;
+		}
+		sectors.push_back(sector);
+		todo.erase(todo.begin() + i);
+	}
+	return todo.empty();
+}
+
+void FarField::swap()
+{
+	if (building < 0)
+		return;
+	shown = building;
+	building = -1;
+	built++;
+}
+
+float FarField::nearRadius(const glm::vec3& camera) const
+{
+	if (shown < 0)
+		return numeric_limits<float>::max();
+	// Every point closer than radius to the centre of its sector is at most this far from the camera
+	float drift = 0.0f;
+	for (const Sector& sector : cubes[shown].sectors)
+		if (sector.terrain)
+			drift = max(drift, horizontalDistance(camera, sector.centre));
+	return settings.radius + drift;
+}
+
+void FarField::sectorBounds(int x, int y, float& u0, float& u1, float& v0, float& v1) const
+{
+	const float size = 2.0f / settings.sectors;
+	u0 = -1.0f + x * size;
+	u1 = u0 + size;
+	v0 = -1.0f + y * size;
+	v1 = v0 + size;
+}
+
+void FarField::sectorRect(int x, int y, int faceSize, int& x0, int& y0, int& width, int& height) const
+{
+	const int n = settings.sectors;
+	x0 = x * faceSize / n;
+	y0 = y * faceSize / n;
+	width = (x + 1) * faceSize / n - x0;
+	height = (y + 1) * faceSize / n - y0;
+}
+
+bool FarField::faceSeesTerrain(int face, const glm::vec3& centre) const
+{
+	return pyramidSeesTerrain(face, -1.0f, 1.0f, -1.0f, 1.0f, centre);
+}
+
+bool FarField::sectorSeesTerrain(int face, int x, int y, const glm::vec3& centre) const
+{
+	float u0, u1, v0, v1;
+	sectorBounds(x, y, u0, u1, v0, v1);
+	return pyramidSeesTerrain(face, u0, u1, v0, v1, centre);
+}
+
+bool FarField::pyramidSeesTerrain(int face, float u0, float u1, float v0, float v1, const glm::vec3& centre) const
+{
+	return pyramidSeesBox(face, u0, u1, v0, v1, centre, boundsMin, boundsMax);
+}
+
+bool FarField::pyramidSeesBox(int face, float u0, float u1, float v0, float v1, const glm::vec3& centre,
+	const glm::vec3& boxMin, const glm::vec3& boxMax) const
+{
+	// Nothing of the box beyond the radius: the farthest point of the box is one of its corners in the xz plane
+	float farthest = 0.0f;
+	for (int c = 0; c < 4; c++)
+	{
+		glm::vec3 corner((c & 1) ? boxMax.x : boxMin.x, 0.0f, (c & 2) ? boxMax.z : boxMin.z);
+		farthest = max(farthest, horizontalDistance(corner, centre));
+	}
+	if (farthest <= settings.radius)
+		return false;
+
+	// The sector sees the pyramid p.d > 0, u0 <= p.right / p.d <= u1, v0 <= p.up / p.d <= v1. The box is outside when
+	// all its corners are behind one of its planes
+	const glm::vec3 d = faceDirection[face];
+	const glm::vec3 up = faceUp[face];
+	const glm::vec3 right = faceRight(face);
+	const glm::vec3 planes[5] = { d, right - u0 * d, u1 * d - right, up - v0 * d, v1 * d - up };
+	for (const glm::vec3& plane : planes)
+	{
+		bool outside = true;
+		for (int c = 0; c < 8 && outside; c++)
+		{
+			glm::vec3 corner((c & 1) ? boxMax.x : boxMin.x, (c & 2) ? boxMax.y : boxMin.y, (c & 4) ? boxMax.z : boxMin.z);
+			outside = glm::dot(corner - centre, plane) < 0.0f;
+		}
+		if (outside)
+			return false;
+	}
+	return true;
+}
+
+bool FarField::sectorNeedsRender(int face, int x, int y, const glm::vec3& centre, const glm::vec3& camera) const
+{
+	const glm::vec3 offset = camera - centre;
+	if (horizontalDistance(camera, centre) > settings.maxDrift)
+		return true;
+
+	// Far terrain is at least the radius away. Moving across the sector axis shifts all of it by about the sideways
+	// distance over the radius, moving along the axis only spreads it out from the axis, by the sine of the largest
+	// angle in the sector. Both are compared with the tolerance at the radius
+	float u0, u1, v0, v1;
+	sectorBounds(x, y, u0, u1, v0, v1);
+	const glm::vec3 d = faceDirection[face];
+	const glm::vec3 up = faceUp[face];
+	const glm::vec3 right = faceRight(face);
+	const glm::vec3 axis = glm::normalize(d + 0.5f * (u0 + u1) * right + 0.5f * (v0 + v1) * up);
+	float spread = 0.0f;
+	for (int c = 0; c < 4; c++)
+	{
+		const glm::vec3 corner = glm::normalize(d + ((c & 1) ? u1 : u0) * right + ((c & 2) ? v1 : v0) * up);
+		spread = max(spread, glm::length(glm::cross(corner, axis)));
+	}
+	const float along = glm::dot(offset, axis);
+	const float sideways = glm::length(offset - along * axis);
+	return sideways + fabs(along) * spread > settings.tolerance;
+}
+
+glm::mat4 FarField::faceViewProjection(int face, const glm::vec3& centre) const
+{
+	glm::mat4 projection = glm::perspective(glm::radians(90.0f), 1.0f, settings.nearPlane, settings.farPlane);
+	return projection * glm::lookAt(centre, centre + faceDirection[face], faceUp[face]);
+}
@@ -0,0 +1,120 @@
+#ifndef FARFIELD_HPP
+#define FARFIELD_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+
+// Far field impostor: terrain further than a radius from the camera is rendered into a cube map centred on the
+// camera and drawn from there, so the cost of a frame hardly depends on how much distant terrain is in view.
+// Every face is split into sectors x sectors rectangles that remember the centre they were rendered from. Once the
+// camera moved far enough that the far terrain of a sector would visibly shift, a second cube is built: sectors
+// whose view is still good are copied over from the shown cube, sectors that see no terrain beyond the radius are
+// cleared, and only the rest is rendered, a few per frame. The new cube replaces the shown one when it is complete.
+// When the picture changed (light, height scale) every sector is rendered again, after an edit of the heights only
+// the sectors that see the edited region. Only plans the work, the GL side is in main.cpp.
+
+struct FarFieldSettings
+{
+	float radius = 2.5f;      // horizontal distance from the cube centre where the far field starts
+	float tolerance = 0.25f;  // sideways camera movement, as seen from a sector, before the sector is rendered again
+	float maxDrift = 0.5f;    // camera distance from a sector centre before it is rendered again anyway, the near field grows by it
+	int sectors = 4;          // sectors along each edge of a face
+	int sectorsPerFrame = 8;  // sectors rendered per frame while a cube is being built
+	float nearPlane = 0.1f;   // projection of the cube faces
+	float farPlane = 500.0f;
+};
+
+struct FarFieldSector
+{
+	enum Action
+	{
+		RENDER, // draw the terrain into the sector
+		COPY,   // take the sector of the shown cube, it was rendered close enough to the camera
+		CLEAR   // the sector sees no far terrain any more
+	};
+	int face;     // cube map order: +X, -X, +Y, -Y, +Z, -Z
+	int x, y;     // sector of the face, x along the texel columns, y along the rows from the bottom (as glViewport)
+	Action action;
+};
+
+class FarField
+{
+public:
+	FarField(const FarFieldSettings& settings = FarFieldSettings());
+
+	// World bounds of the terrain, sectors that see none of it beyond the radius stay empty
+	void setBounds(const glm::vec3& minimum, const glm::vec3& maximum);
+	// The shown cube no longer matches the terrain, a new one is built around the camera with every sector rendered
+	void invalidate();
+	// Only the terrain in a box changed: the sectors of both cubes whose view from their centre reaches it beyond the
+	// radius are rendered again, the others are still copied
+	void invalidateRegion(const glm::vec3& minimum, const glm::vec3& maximum);
+	// Forget both cubes, nothing is shown until a new one is complete
+	void reset();
+
+	// Work of one frame: the sectors of the cube being built to handle now. Copies and clears are included for free,
+	// the sectors to render are limited to sectorsPerFrame. Returns true when they complete the cube, swap() then has
+	// to be called once they are done
+	bool plan(const glm::vec3& camera, std::vector<FarFieldSector>& sectors);
+	void swap();
+
+	bool hasCube() const { return shown >= 0; }
+	bool isBuilding() const { return building >= 0; }
+	int shownCube() const { return shown; }
+	int buildingCube() const { return building; }
+	// Where the sectors rendered for the cube being built are rendered from
+	const glm::vec3& buildingCentre() const { return buildCentre; }
+	// Where a sector of the shown cube was rendered from
+	const glm::vec3& sectorCentre(int face, int x, int y) const { return cubes[shown].sectors[sectorIndex(face, x, y)].centre; }
+
+	// Near field radius around the camera that leaves no gap to the terrain of the shown cube
+	float nearRadius(const glm::vec3& camera) const;
+
+	// Does the face or a sector of it see terrain beyond the radius from centre? Conservative, a corner of the box
+	// may be reported
+	bool faceSeesTerrain(int face, const glm::vec3& centre) const;
+	bool sectorSeesTerrain(int face, int x, int y, const glm::vec3& centre) const;
+	// Would the far terrain of a sector rendered from centre shift by more than the tolerance seen from camera?
+	bool sectorNeedsRender(int face, int x, int y, const glm::vec3& centre, const glm::vec3& camera) const;
+
+	// Texels of a sector on a face of the given size: [x0, x0 + width) x [y0, y0 + height)
+	void sectorRect(int x, int y, int faceSize, int& x0, int& y0, int& width, int& height) const;
+
+	glm::mat4 faceViewProjection(int face, const glm::vec3& centre) const;
+	const FarFieldSettings& getSettings() const { return settings; }
+
+	// Statistics since the start
+	unsigned long long sectorsRendered() const { return rendered; }
+	unsigned long long sectorsCopied() const { return copied; }
+	unsigned long long cubesBuilt() const { return built; }
+
+private:
+	struct Sector
+	{
+		glm::vec3 centre;   // camera position it was rendered from
+		bool terrain;       // the last render drew terrain, an empty sector is not cleared again
+		bool stale;         // sees a region edited since, never copied
+	};
+	struct Cube
+	{
+		std::vector<Sector> sectors; // face by face, rows from the bottom
+	};
+
+	int sectorIndex(int face, int x, int y) const { return (face * settings.sectors + y) * settings.sectors + x; }
+	// Face coordinates in [-1, 1] of the sector edges
+	void sectorBounds(int x, int y, float& u0, float& u1, float& v0, float& v1) const;
+	bool pyramidSeesTerrain(int face, float u0, float u1, float v0, float v1, const glm::vec3& centre) const;
+	bool pyramidSeesBox(int face, float u0, float u1, float v0, float v1, const glm::vec3& centre,
+		const glm::vec3& minimum, const glm::vec3& maximum) const;
+
+	FarFieldSettings settings;
+	glm::vec3 boundsMin, boundsMax;
+	int shown, building;
+	Cube cubes[2];
+	glm::vec3 buildCentre;
+	std::vector<FarFieldSector> todo;
+	bool stale;
+	unsigned long long rendered, copied, built;
+};
+
+#endif
@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <cmath>
+
+#include "framegovernor.hpp"
+
+FrameGovernor::FrameGovernor(const FrameGovernorSettings& settings)
+	: settings(settings)
+{
+	reset();
+}
+
+void FrameGovernor::reset()
+{
+	scale = settings.maxScale;
+	lod = 0;
+	average = 0.0f;
+	hasAverage = false;
+	settle = 0;
+}
+
+bool FrameGovernor::setMaxLod(int maxLod)
+{
+	settings.maxLod = std::max(0, maxLod);
+	if (lod <= settings.maxLod)
+		return false;
+	lod = settings.maxLod;
+	settle = settings.settleFrames;
+	return true;
+}
+
+bool FrameGovernor::update(float frameMs)
+{
+	// Exponential moving average, a single slow frame (shader compile, swap hiccup) must not trigger a change
+	if (!hasAverage)
+	{
+		average = frameMs;
+		hasAverage = true;
+	}
+	else
+	{
+		// Limited to twice the average first, otherwise one hiccup many times the usual frame time would still
+		// drag the average past the budget. A lasting increase gets through within a few frames anyway
+		average += (std::min(frameMs, 2.0f * average) - average) * settings.smoothing;
+	}
+
+	// Measurements lag behind a change by a few frames (queries are read late), wait for them
+	if (settle > 0)
+	{
+		settle--;
+		return false;
+	}
+
+	const float ratio = average / settings.targetMs;
+	const float oldScale = scale;
+	const int oldLod = lod;
+
+	if (ratio > settings.overBudget)
+	{
+		// Over budget: pixel cost goes with scale^2, so aim for scale * sqrt(target / measured)
+		if (scale > settings.minScale)
+		{
+			// At least a percent, smaller steps would leave the frame over budget for good
+			float wanted = scale * std::sqrt(1.0f / ratio);
+			scale = std::max(settings.minScale, std::min(scale - 0.01f, scale + (wanted - scale) * settings.gain));
+		}
+		else
+			lod = std::min(settings.maxLod, lod + 1);
+	}
+	else if (ratio < settings.underBudget)
+	{
+		// Headroom: restore geometry first, then resolution, with half the gain so it creeps back up
+		if (lod > 0)
+			lod--;
+		else if (scale < settings.maxScale)
+		{
+			// Only go as far as the target with the hysteresis margin, otherwise the next step would overshoot
+			float wanted = scale * std::sqrt(settings.overBudget / ratio * 0.95f);
+			scale = std::min(settings.maxScale, scale + (wanted - scale) * settings.gain * 0.5f);
+		}
+	}
+
+	// Ignore improvements below a percent of resolution, they are not worth a new viewport size,
+	// unless the step reaches the limit. Reductions are at least a percent already
+	if (scale > oldScale && scale - oldScale < 0.01f && scale != settings.maxScale)
+		scale = oldScale;
+
+	bool changed = scale != oldScale || lod != oldLod;
+	if (changed)
+		settle = settings.settleFrames;
+	return changed;
+}
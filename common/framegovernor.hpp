@@ -0,0 +1,46 @@
+#ifndef FRAMEGOVERNOR_HPP
+#define FRAMEGOVERNOR_HPP
+
+// Frame time governor: keeps the measured GPU frame time inside a budget by trading
+// internal render resolution first and geometric detail (LOD / tessellation) second.
+// It only sees numbers, so it runs the same with GL timer queries or a synthetic cost model.
+struct FrameGovernorSettings
+{
+	float targetMs = 16.6f;        // frame budget
+	float minScale = 0.5f;         // lowest internal resolution, per axis
+	float maxScale = 1.0f;
+	int maxLod = 2;                // coarsest LOD level, every level has to be cheaper than the one before (setMaxLod)
+	float overBudget = 1.05f;      // degrade above targetMs * overBudget ...
+	float underBudget = 0.85f;     // ... and only improve below targetMs * underBudget (hysteresis band)
+	float smoothing = 0.25f;       // weight of a new sample in the moving average
+	float gain = 0.5f;             // fraction of the estimated correction applied per step
+	int settleFrames = 8;          // frames to wait after a change so the average reflects it
+};
+
+class FrameGovernor
+{
+public:
+	FrameGovernor(const FrameGovernorSettings& settings = FrameGovernorSettings());
+
+	// Feed the time of one rendered frame, returns true when the scale or LOD changed
+	bool update(float frameMs);
+	void reset();
+	// Coarsest LOD level that still changes the cost, e.g. after the tessellation level changed. Returns true
+	// when the current level was beyond it and had to be lowered
+	bool setMaxLod(int maxLod);
+
+	float renderScale() const { return scale; }
+	int lodLevel() const { return lod; }
+	float averageMs() const { return average; }
+	const FrameGovernorSettings& getSettings() const { return settings; }
+
+private:
+	FrameGovernorSettings settings;
+	float scale;
+	int lod;
+	float average;
+	bool hasAverage;
+	int settle;
+};
+
+#endif
@@ -0,0 +1,60 @@
+#include "framescheduler.hpp"
+
+FrameScheduler::FrameScheduler()
+	: dirty(DIRTY_ALL), continuous(false), drawn(0), skipped(0)
+{
+}
+
+void FrameScheduler::setWakeCallback(std::function<void()> callback)
+{
+	wake = callback;
+}
+
+void FrameScheduler::setContinuous(bool value)
+{
+	continuous = value;
+	markDirty(DIRTY_SETTINGS);
+}
+
+bool FrameScheduler::isContinuous() const
+{
+	return continuous;
+}
+
+void FrameScheduler::markDirty(unsigned int flags)
+{
+	// Only the first flag set since the last frame needs to wake the loop
+	if (flags == 0)
+		return;
+	unsigned int previous = dirty.fetch_or(flags);
+	if (previous == 0 && wake)
+		wake();
+}
+
+unsigned int FrameScheduler::beginFrame()
+{
+	unsigned int flags = dirty.exchange(0);
+	if (continuous)
+		flags |= DIRTY_SETTINGS;
+
+	if (flags)
+		drawn++;
+	else
+		skipped++;
+	return flags;
+}
+
+bool FrameScheduler::isIdle() const
+{
+	return !continuous && dirty.load() == 0;
+}
+
+unsigned long long FrameScheduler::framesDrawn() const
+{
+	return drawn;
+}
+
+unsigned long long FrameScheduler::framesSkipped() const
+{
+	return skipped;
+}
@@ -0,0 +1,54 @@
+#ifndef FRAMESCHEDULER_HPP
+#define FRAMESCHEDULER_HPP
+
+#include <atomic>
+#include <functional>
+
+// Reasons for drawing a new frame
+enum FrameDirtyFlags
+{
+	DIRTY_CAMERA = 1 << 0,       // a simulation snapshot moved or turned the camera
+	DIRTY_LIGHT = 1 << 1,        // a simulation snapshot turned the light
+	DIRTY_HEIGHT_SCALE = 1 << 2, // AdjustHeightMapScaling()
+	DIRTY_STREAMING = 1 << 3,    // background work finished and has new data to show
+	DIRTY_WINDOW = 1 << 4,       // expose / resize, the last frame has to be presented again
+	DIRTY_SETTINGS = 1 << 5,     // render mode toggles, shader reloads...
+	DIRTY_TERRAIN = 1 << 6,      // heights edited by a brush, undo or redo
+	DIRTY_ALL = 0xFFFF
+};
+
+// Render on demand: frames are only drawn when something they depend on changed. markDirty() may be
+// called from any thread, so background loaders can wake the render loop through the wake callback
+// (glfwPostEmptyEvent in main.cpp) while it is blocked waiting for events.
+class FrameScheduler
+{
+public:
+	FrameScheduler();
+
+	void setWakeCallback(std::function<void()> wake);
+
+	// Draw every frame regardless of the dirty state (benchmarks, profiling)
+	void setContinuous(bool continuous);
+	bool isContinuous() const;
+
+	void markDirty(unsigned int flags);
+
+	// Should this iteration draw? Returns the dirty flags and clears them
+	unsigned int beginFrame();
+
+	// Nothing to draw right now, the loop may block on input
+	bool isIdle() const;
+
+	// Statistics since the start
+	unsigned long long framesDrawn() const;
+	unsigned long long framesSkipped() const;
+
+private:
+	std::atomic<unsigned int> dirty;
+	std::atomic<bool> continuous;
+	std::function<void()> wake;
+	unsigned long long drawn;
+	unsigned long long skipped;
+};
+
+#endif
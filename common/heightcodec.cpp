@@ -0,0 +1,543 @@
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <cstdio>
+#include <filesystem>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "heightcodec.hpp"
+#include "jobsystem.hpp"
+#include "utils.hpp"
+using namespace std;
+
+namespace
+{
+	// File layout: header, (tileCount + 1) payload offsets, payload, kPadBytes of zeros
+	// The trailing padding lets the block unpacker always load 8 bytes at once
+	const char kMagic[4] = { 'T', 'H', 'M', '2' };
+	const int kBlock = 16;
+	const int kMaxTileSize = 1024;
+	const size_t kPadBytes = 8;
+
+	struct Header
+	{
+		char magic[4];
+		uint32_t width;
+		uint32_t height;
+		uint32_t tileSize;
+		uint32_t step;
+		uint32_t tilesX;
+		uint32_t tilesY;
+		// File the heights were encoded from (saveTHM_custom), 0 when unknown. A cache only matches a source
+		// of the same size and modification time
+		uint64_t sourceSize;
+		int64_t sourceTime;
+	};
+
+	// Size and modification time of a file, in the units of the header
+	bool sourceStamp(const char* path, uint64_t& size, int64_t& time)
+	{
+		error_code sizeError, timeError;
+		size = uint64_t(filesystem::file_size(path, sizeError));
+		time = int64_t(filesystem::last_write_time(path, timeError).time_since_epoch().count());
+		return !sizeError && !timeError;
+	}
+
+	// The header of a .thm file alone, without reading the tiles
+	bool readHeader(const char* path, Header& header)
+	{
+		FILE* file = fopen(path, "rb");
+		if (!file)
+			return false;
+		bool ok = fread(&header, sizeof(Header), 1, file) == 1 && memcmp(header.magic, kMagic, 4) == 0;
+		fclose(file);
+		return ok;
+	}
+
+	inline uint32_t zigzag(uint32_t v)
+	{
+		return (v << 1) ^ (0u - (v >> 31));
+	}
+
+	inline uint32_t unzigzag(uint32_t v)
+	{
+		return (v >> 1) ^ (0u - (v & 1));
+	}
+
+	inline int64_t floorDiv(int64_t a, int64_t b)
+	{
+		int64_t q = a / b;
+		return (a % b != 0 && a < 0) ? q - 1 : q;
+	}
+
+	// Run fn(i) for i in [0, count) on the job system, false when any of the tiles failed
+	template<typename F>
+	bool parallelTiles(int count, F&& fn)
+	{
+		atomic<bool> ok(true);
+		jobSystem().parallelFor(count, 0, [&](int i) {
+			if (!fn(i))
+				ok = false;
+		});
+		return ok;
+	}
+
+	// Residuals of one tile: second difference against W + N - NW, 16 per block, bit packed
+	void encodeTile(const int32_t* heights, int width, int x0, int y0, int tw, int th, vector<unsigned char>& out)
+	{
+		const int padded = (tw + kBlock - 1) / kBlock * kBlock;
+		vector<uint32_t> residuals(padded, 0);
+
+		for (int y = 0; y < th; y++)
+		{
+			const int32_t* row = heights + size_t(y0 + y) * width + x0;
+			const int32_t* up = y > 0 ? row - width : nullptr;
+
+			for (int x = 0; x < tw; x++)
+			{
+				uint32_t w = x > 0 ? uint32_t(row[x - 1]) : 0u;
+				uint32_t n = up ? uint32_t(up[x]) : 0u;
+				uint32_t nw = (up && x > 0) ? uint32_t(up[x - 1]) : 0u;
+				residuals[x] = zigzag(uint32_t(row[x]) - (w + n - nw));
+			}
+
+			for (int b = 0; b < padded; b += kBlock)
+			{
+				uint32_t maxValue = 0;
+				for (int i = 0; i < kBlock; i++)
+					maxValue |= residuals[b + i];
+
+				int bits = 0;
+				while (bits < 32 && (maxValue >> bits) != 0)
+					bits++;
+				out.push_back((unsigned char)bits);
+
+				// 16 values of "bits" bits always end on a byte boundary
+				uint64_t acc = 0;
+				int accBits = 0;
+				for (int i = 0; i < kBlock; i++)
+				{
+					acc |= uint64_t(residuals[b + i]) << accBits;
+					accBits += bits;
+					while (accBits >= 8)
+					{
+						out.push_back((unsigned char)(acc & 0xFF));
+						acc >>= 8;
+						accBits -= 8;
+					}
+				}
+			}
+		}
+	}
+
+	// Unpack one block of 16 residuals, returns nullptr if the block runs past the end of the tile. Loads may read
+	// up to 8 bytes past the block, the file padding covers the last one
+	inline const unsigned char* unpackBlock(const unsigned char* src, const unsigned char* end, uint32_t* dst)
+	{
+		if (src >= end)
+			return nullptr;
+
+		int bits = *src++;
+		if (bits > 32 || src + 2 * bits > end)
+			return nullptr;
+
+		if (bits == 0)
+		{
+			memset(dst, 0, kBlock * sizeof(uint32_t));
+			return src;
+		}
+
+#if defined(__AVX2__)
+		// Value i starts at bit i * bits. Up to 25 bits it fits in the 32 bit word loaded from its first byte, so
+		// 8 values are gathered, shifted and masked at once. Wider residuals only occur on rough tiles
+		if (bits <= 25)
+		{
+			const __m256i width = _mm256_set1_epi32(bits);
+			const __m256i seven = _mm256_set1_epi32(7);
+			const __m256i valueMask = _mm256_set1_epi32(int((1u << bits) - 1));
+			for (int half = 0; half < kBlock; half += 8)
+			{
+				const __m256i bit = _mm256_mullo_epi32(_mm256_setr_epi32(half, half + 1, half + 2, half + 3, half + 4, half + 5, half + 6, half + 7), width);
+				const __m256i words = _mm256_i32gather_epi32((const int*)src, _mm256_srli_epi32(bit, 3), 1);
+				const __m256i values = _mm256_and_si256(_mm256_srlv_epi32(words, _mm256_and_si256(bit, seven)), valueMask);
+				_mm256_storeu_si256((__m256i*)(dst + half), values);
+			}
+			return src + 2 * bits;
+		}
+#endif
+		const uint64_t mask = (uint64_t(1) << bits) - 1;
+		for (int i = 0; i < kBlock; i++)
+		{
+			size_t bit = size_t(i) * bits;
+			uint64_t word;
+			memcpy(&word, src + (bit >> 3), sizeof(word));
+			dst[i] = uint32_t((word >> (bit & 7)) & mask);
+		}
+		return src + 2 * bits;
+	}
+
+	// Rebuild one row from its zigzagged residuals: h[x] = h[x-1] + (N[x] - N[x-1]) + r[x]
+	// which is a prefix sum, so it vectorizes in spite of the W dependency
+	void reconstructRow(const uint32_t* zz, const int32_t* up, int32_t* row, int n)
+	{
+		int x = 0;
+		uint32_t acc = 0;
+
+#if defined(__SSE2__)
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i one = _mm_set1_epi32(1);
+		__m128i carry = zero;
+
+		for (; x + 4 <= n; x += 4)
+		{
+			__m128i u = _mm_loadu_si128((const __m128i*)(zz + x));
+			__m128i d = _mm_xor_si128(_mm_srli_epi32(u, 1), _mm_sub_epi32(zero, _mm_and_si128(u, one)));
+
+			if (up)
+			{
+				__m128i north = _mm_loadu_si128((const __m128i*)(up + x));
+				__m128i northWest = x > 0 ? _mm_loadu_si128((const __m128i*)(up + x - 1)) : _mm_slli_si128(north, 4);
+				d = _mm_add_epi32(d, _mm_sub_epi32(north, northWest));
+			}
+
+			// In-register prefix sum plus the running total of the previous group
+			d = _mm_add_epi32(d, _mm_slli_si128(d, 4));
+			d = _mm_add_epi32(d, _mm_slli_si128(d, 8));
+			d = _mm_add_epi32(d, carry);
+			_mm_storeu_si128((__m128i*)(row + x), d);
+			carry = _mm_shuffle_epi32(d, _MM_SHUFFLE(3, 3, 3, 3));
+		}
+
+		if (x > 0)
+			acc = uint32_t(row[x - 1]);
+#endif
+
+		uint32_t prevUp = (up && x > 0) ? uint32_t(up[x - 1]) : 0u;
+		for (; x < n; x++)
+		{
+			uint32_t d = unzigzag(zz[x]);
+			if (up)
+			{
+				d += uint32_t(up[x]) - prevUp;
+				prevUp = uint32_t(up[x]);
+			}
+			acc += d;
+			row[x] = int32_t(acc);
+		}
+	}
+
+	bool decodeTile(const unsigned char* src, const unsigned char* end, int tw, int th, uint32_t step, int32_t* dst, size_t stride)
+	{
+		alignas(16) uint32_t zz[kMaxTileSize + kBlock];
+		const int padded = (tw + kBlock - 1) / kBlock * kBlock;
+
+		for (int y = 0; y < th; y++)
+		{
+			for (int b = 0; b < padded; b += kBlock)
+			{
+				src = unpackBlock(src, end, zz + b);
+				if (!src)
+					return false;
+			}
+
+			int32_t* row = dst + y * stride;
+			reconstructRow(zz, y > 0 ? row - stride : nullptr, row, tw);
+		}
+
+		// Prediction runs on quantized values, so the rescale waits until the whole tile is rebuilt
+		if (step > 1)
+		{
+			for (int y = 0; y < th; y++)
+			{
+				int32_t* row = dst + y * stride;
+				for (int x = 0; x < tw; x++)
+					row[x] = int32_t(uint32_t(row[x]) * step);
+			}
+		}
+		return true;
+	}
+
+	// Validate the header and offset table, returns the payload start or nullptr
+	const unsigned char* parseHeader(const unsigned char* in, size_t size, Header& header, const uint32_t*& offsets)
+	{
+		if (!in || size < sizeof(Header))
+			return nullptr;
+
+		memcpy(&header, in, sizeof(Header));
+		if (memcmp(header.magic, kMagic, 4) != 0 || header.width == 0 || header.height == 0 || header.step == 0 ||
+			header.tileSize == 0 || header.tileSize > kMaxTileSize || header.width > 65536 || header.height > 65536)
+			return nullptr;
+
+		if (header.tilesX != (header.width + header.tileSize - 1) / header.tileSize ||
+			header.tilesY != (header.height + header.tileSize - 1) / header.tileSize)
+			return nullptr;
+
+		size_t tileCount = size_t(header.tilesX) * header.tilesY;
+		size_t tableBytes = (tileCount + 1) * sizeof(uint32_t);
+		if (size < sizeof(Header) + tableBytes + kPadBytes)
+			return nullptr;
+
+		offsets = reinterpret_cast<const uint32_t*>(in + sizeof(Header));
+		size_t payloadSize = size - sizeof(Header) - tableBytes - kPadBytes;
+		if (offsets[0] != 0 || offsets[tileCount] > payloadSize)
+			return nullptr;
+		for (size_t i = 0; i < tileCount; i++)
+			if (offsets[i] > offsets[i + 1])
+				return nullptr;
+
+		return in + sizeof(Header) + tableBytes;
+	}
+}
+
+bool encodeHeights(const int32_t* heights, int width, int height, const HeightCodecOptions& options, vector<unsigned char>& out)
+{
+	if (!heights || width <= 0 || height <= 0 || width > 65536 || height > 65536 ||
+		options.tileSize < kBlock || options.tileSize > kMaxTileSize || options.maxError > (1u << 30))
+		return false;
+
+	// Error bounded quantization: every height moves by at most maxError
+	const uint32_t step = 2 * options.maxError + 1;
+	vector<int32_t> quantized;
+	const int32_t* source = heights;
+	if (step > 1)
+	{
+		quantized.resize(size_t(width) * height);
+		for (size_t i = 0; i < quantized.size(); i++)
+			quantized[i] = int32_t(floorDiv(int64_t(heights[i]) + options.maxError, step));
+		source = quantized.data();
+	}
+
+	const int tileSize = options.tileSize;
+	const int tilesX = (width + tileSize - 1) / tileSize;
+	const int tilesY = (height + tileSize - 1) / tileSize;
+	const int tileCount = tilesX * tilesY;
+
+	vector<vector<unsigned char>> tiles(tileCount);
+	parallelTiles(tileCount, [&](int i) {
+		int x0 = (i % tilesX) * tileSize;
+		int y0 = (i / tilesX) * tileSize;
+		encodeTile(source, width, x0, y0, min(tileSize, width - x0), min(tileSize, height - y0), tiles[i]);
+		return true;
+	});
+
+	Header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, kMagic, 4);
+	header.width = width;
+	header.height = height;
+	header.tileSize = tileSize;
+	header.step = step;
+	header.tilesX = tilesX;
+	header.tilesY = tilesY;
+
+	vector<uint32_t> offsets(tileCount + 1, 0);
+	for (int i = 0; i < tileCount; i++)
+	{
+		if (uint64_t(offsets[i]) + tiles[i].size() > UINT32_MAX)
+			return false;
+		offsets[i + 1] = offsets[i] + uint32_t(tiles[i].size());
+	}
+
+	out.clear();
+	out.reserve(sizeof(Header) + offsets.size() * sizeof(uint32_t) + offsets.back() + kPadBytes);
+	out.insert(out.end(), (const unsigned char*)&header, (const unsigned char*)&header + sizeof(Header));
+	out.insert(out.end(), (const unsigned char*)offsets.data(), (const unsigned char*)(offsets.data() + offsets.size()));
+	for (auto& tile : tiles)
+		out.insert(out.end(), tile.begin(), tile.end());
+	out.insert(out.end(), kPadBytes, 0);
+	return true;
+}
+
+bool decodeHeights(const unsigned char* in, size_t size, int& width, int& height, vector<int32_t>& heights)
+{
+	Header header;
+	const uint32_t* offsets = nullptr;
+	const unsigned char* payload = parseHeader(in, size, header, offsets);
+	if (!payload)
+		return false;
+
+	width = header.width;
+	height = header.height;
+	heights.assign(size_t(width) * height, 0);
+
+	const int tileSize = header.tileSize;
+	const int tilesX = header.tilesX;
+	return parallelTiles(tilesX * header.tilesY, [&](int i) {
+		int x0 = (i % tilesX) * tileSize;
+		int y0 = (i / tilesX) * tileSize;
+		return decodeTile(payload + offsets[i], payload + offsets[i + 1], min(tileSize, width - x0), min(tileSize, height - y0),
+			header.step, heights.data() + size_t(y0) * width + x0, width);
+	});
+}
+
+size_t heightmapRowStride(int width)
+{
+	// Same 4 byte row alignment as BMP files and GL_UNPACK_ALIGNMENT 4
+	return (size_t(width) * 3 + 3) & ~size_t(3);
+}
+
+void unpackHeightsBGR(const unsigned char* bgr, int width, int height, int32_t* heights)
+{
+	const size_t stride = heightmapRowStride(width);
+	for (int y = 0; y < height; y++)
+	{
+		const unsigned char* src = bgr + y * stride;
+		int32_t* dst = heights + size_t(y) * width;
+		for (int x = 0; x < width; x++, src += 3)
+			dst[x] = (int32_t(src[2]) << 16) | (int32_t(src[1]) << 8) | int32_t(src[0]);
+	}
+}
+
+void packHeightsBGR(const int32_t* heights, int width, int height, unsigned char* bgr)
+{
+	const size_t stride = heightmapRowStride(width);
+	for (int y = 0; y < height; y++)
+	{
+		const int32_t* src = heights + size_t(y) * width;
+		unsigned char* dst = bgr + y * stride;
+		for (int x = 0; x < width; x++, dst += 3)
+		{
+			// Lossy files may round slightly outside the 24-bit range
+			int32_t h = min(max(src[x], 0), 0xFFFFFF);
+			dst[0] = (unsigned char)(h & 0xFF);
+			dst[1] = (unsigned char)((h >> 8) & 0xFF);
+			dst[2] = (unsigned char)((h >> 16) & 0xFF);
+		}
+		memset(dst, 0, stride - size_t(width) * 3);
+	}
+}
+
+bool loadTHM_custom(const char* imagepath, int& width, int& height, unsigned char*& data)
+{
+	cout << "Reading image " << imagepath << endl;
+
+	FILE* file = fopen(imagepath, "rb");
+	if (!file) {
+		cout << imagepath << " could not be opened." << endl;
+		return false;
+	}
+
+	fseek(file, 0, SEEK_END);
+	long fileSize = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	if (fileSize <= 0) {
+		fclose(file);
+		return false;
+	}
+
+	vector<unsigned char> contents(fileSize);
+	size_t read = fread(contents.data(), 1, contents.size(), file);
+	fclose(file);
+
+	Header header;
+	const uint32_t* offsets = nullptr;
+	const unsigned char* payload = parseHeader(contents.data(), read, header, offsets);
+	if (!payload) {
+		cout << "Not a correct THM file" << endl;
+		return false;
+	}
+
+	width = header.width;
+	height = header.height;
+	const size_t stride = heightmapRowStride(width);
+	data = new unsigned char[stride * height];
+
+	// Each tile is decoded into a small per-thread buffer and packed straight into the BGR image
+	const int tileSize = header.tileSize;
+	const int tilesX = header.tilesX;
+	bool ok = parallelTiles(tilesX * header.tilesY, [&](int i) {
+		thread_local vector<int32_t> scratch;
+		scratch.resize(size_t(tileSize) * tileSize);
+
+		int x0 = (i % tilesX) * tileSize;
+		int y0 = (i / tilesX) * tileSize;
+		int tw = min(tileSize, width - x0);
+		int th = min(tileSize, height - y0);
+		if (!decodeTile(payload + offsets[i], payload + offsets[i + 1], tw, th, header.step, scratch.data(), tileSize))
+			return false;
+
+		for (int y = 0; y < th; y++)
+		{
+			unsigned char* dst = data + (y0 + y) * stride + size_t(x0) * 3;
+			const int32_t* src = scratch.data() + size_t(y) * tileSize;
+			for (int x = 0; x < tw; x++, dst += 3)
+			{
+				int32_t h = min(max(src[x], 0), 0xFFFFFF);
+				dst[0] = (unsigned char)(h & 0xFF);
+				dst[1] = (unsigned char)((h >> 8) & 0xFF);
+				dst[2] = (unsigned char)((h >> 16) & 0xFF);
+			}
+		}
+		return true;
+	});
+
+	if (!ok) {
+		cout << "Corrupted THM file" << endl;
+		delete[] data;
+		data = nullptr;
+		return false;
+	}
+
+	// Row padding is never touched by the tiles
+	for (int y = 0; y < height; y++)
+		memset(data + y * stride + size_t(width) * 3, 0, stride - size_t(width) * 3);
+	return true;
+}
+
+bool saveTHM_custom(const char* imagepath, const unsigned char* data, int width, int height, unsigned int maxError, const char* sourcepath)
+{
+	cout << "Writing image " << imagepath << endl;
+
+	vector<int32_t> heights(size_t(width) * height);
+	unpackHeightsBGR(data, width, height, heights.data());
+
+	HeightCodecOptions options;
+	options.maxError = maxError;
+	vector<unsigned char> encoded;
+	if (!encodeHeights(heights.data(), width, height, options, encoded)) {
+		cout << "Could not encode " << imagepath << endl;
+		return false;
+	}
+	Header header;
+	memcpy(&header, encoded.data(), sizeof(Header));
+	if (sourcepath && sourceStamp(sourcepath, header.sourceSize, header.sourceTime))
+		memcpy(encoded.data(), &header, sizeof(Header));
+
+	FILE* file = fopen(imagepath, "wb");
+	if (!file) {
+		cout << imagepath << " could not be opened for writing." << endl;
+		return false;
+	}
+	bool ok = fwrite(encoded.data(), 1, encoded.size(), file) == encoded.size();
+	fclose(file);
+	return ok;
+}
+
+bool loadHeightmapCached(const char* bmppath, const char* thmpath, int& width, int& height, unsigned char*& data)
+{
+	// The cache is current when it was encoded from a BMP of the same size and modification time. Comparing the
+	// times for equality also catches a BMP copied or restored with an older time than the cache
+	uint64_t bmpSize = 0;
+	int64_t bmpTime = 0;
+	const bool bmpFound = sourceStamp(bmppath, bmpSize, bmpTime);
+	Header header;
+	const bool current = readHeader(thmpath, header) &&
+		(!bmpFound || (header.sourceSize == bmpSize && header.sourceTime == bmpTime));
+	data = nullptr;
+	if (current && loadTHM_custom(thmpath, width, height, data))
+		return true;
+	if (!bmpFound) {
+		cout << bmppath << " could not be opened." << endl;
+		return false;
+	}
+	if (!loadBMP_custom(bmppath, width, height, data))
+		return false;
+	saveTHM_custom(thmpath, data, width, height, 0, bmppath);
+	return true;
+}
@@ -0,0 +1,43 @@
+#ifndef HEIGHTCODEC_HPP
+#define HEIGHTCODEC_HPP
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// Terrain heightmap codec (.thm files)
+// Heights are the 24-bit values the shaders rebuild from the heightmap texture (R << 16 | G << 8 | B).
+// The image is split into independently decodable square tiles. Inside a tile every sample is predicted
+// with the planar predictor W + N - NW, so the residual is the second difference of the heights. Residuals
+// are zigzag mapped and bit packed in blocks of 16 with one bit width byte per block: fixed width packing, there
+// is no entropy coder. Decoding unpacks 8 residuals at a time with AVX2 (blocks up to 25 bits wide) and rebuilds
+// the rows with an SSE2 prefix sum, encoding is scalar.
+// With maxError > 0 heights are first quantized to steps of (2 * maxError + 1), which bounds the
+// absolute reconstruction error by maxError.
+
+struct HeightCodecOptions
+{
+	int tileSize = 64;           // Tile edge in samples, every tile can be decoded on its own
+	unsigned int maxError = 0;   // 0 = lossless, otherwise the largest allowed absolute height error
+};
+
+// Encode / decode raw signed heights (row major, width * height samples)
+bool encodeHeights(const int32_t* heights, int width, int height, const HeightCodecOptions& options, std::vector<unsigned char>& out);
+bool decodeHeights(const unsigned char* in, size_t size, int& width, int& height, std::vector<int32_t>& heights);
+
+// Conversion between the BGR byte layout returned by loadBMP_custom (rows padded to 4 bytes) and heights
+size_t heightmapRowStride(int width);
+void unpackHeightsBGR(const unsigned char* bgr, int width, int height, int32_t* heights);
+void packHeightsBGR(const int32_t* heights, int width, int height, unsigned char* bgr);
+
+// File helpers with the same contract as loadBMP_custom: data is allocated with new[] and owned by the caller
+bool loadTHM_custom(const char* imagepath, int& width, int& height, unsigned char*& data);
+// With a sourcepath its size and modification time are stored in the header, for loadHeightmapCached
+bool saveTHM_custom(const char* imagepath, const unsigned char* data, int width, int height, unsigned int maxError = 0,
+	const char* sourcepath = nullptr);
+
+// Height map with a .thm cache of the BMP: the cache is read when it records the current size and modification
+// time of the BMP, otherwise the BMP is read and the cache rewritten. Without the BMP the cache alone is used
+bool loadHeightmapCached(const char* bmppath, const char* thmpath, int& width, int& height, unsigned char*& data);
+
+#endif
@@ -0,0 +1,324 @@
+#include <algorithm>
+
+#include "jobsystem.hpp"
+using namespace std;
+
+struct Job
+{
+	function<void()> fn;
+	JobPriority priority;
+	atomic<int> pending;             // dependencies not finished yet, plus one while submit() registers them
+	atomic<bool> done;
+	mutex lock;                      // done and continuations change together
+	vector<JobHandle> continuations; // jobs depending on this one
+};
+
+namespace
+{
+	// Which worker of which scheduler the current thread is, -1 for the main thread and other threads
+	thread_local const JobSystem* currentSystem = nullptr;
+	thread_local int currentWorker = -1;
+}
+
+JobSystem::JobSystem(unsigned int workerCount)
+	: queuedNormal(0), queuedBackground(0), outstanding(0), sleepingWorkers(0), sleepingWaiters(0), stop(false), executed(0), stolen(0)
+{
+	const unsigned int hardware = max(1u, thread::hardware_concurrency());
+	if (workerCount == 0)
+	{
+		// Background jobs need a worker even on a single core
+		workerCount = max(1u, hardware - 1);
+		threadCount = hardware;
+	}
+	else
+		threadCount = workerCount + 1;
+
+	for (unsigned int i = 0; i <= workerCount; i++)
+		queues.emplace_back(new Queue);
+	for (unsigned int i = 0; i < workerCount; i++)
+		workers.emplace_back(&JobSystem::workerMain, this, int(i));
+}
+
+JobSystem::~JobSystem()
+{
+	{
+		lock_guard<mutex> lock(sleepMutex);
+		stop = true;
+	}
+	workerWake.notify_all();
+	for (thread& worker : workers)
+		worker.join();
+}
+
+JobHandle JobSystem::submit(function<void()> fn, JobPriority priority)
+{
+	return submit(move(fn), vector<JobHandle>(), priority);
+}
+
+JobHandle JobSystem::submit(function<void()> fn, const vector<JobHandle>& dependencies, JobPriority priority)
+{
+	JobHandle job = make_shared<Job>();
+	job->fn = move(fn);
+	job->priority = priority;
+	job->pending = 1;
+	job->done = false;
+	outstanding++;
+
+	// A dependency that finishes meanwhile either sees the continuation or was already done
+	for (const JobHandle& dependency : dependencies)
+	{
+		if (!dependency)
+			continue;
+		lock_guard<mutex> lock(dependency->lock);
+		if (!dependency->done)
+		{
+			job->pending++;
+			dependency->continuations.push_back(job);
+		}
+	}
+	if (--job->pending == 0)
+		push(job);
+	return job;
+}
+
+bool JobSystem::isDone(const JobHandle& job)
+{
+	return !job || job->done;
+}
+
+void JobSystem::wait(const JobHandle& job)
+{
+	if (!job)
+		return;
+
+	// Workers may pick up background jobs while they wait, the main thread only takes work somebody waits for
+	const bool background = currentSystem == this && currentWorker >= 0;
+	while (!job->done)
+	{
+		if (tryRun(background))
+			continue;
+
+		unique_lock<mutex> lock(sleepMutex);
+		sleepingWaiters++;
+		waiterWake.wait(lock, [&]() { return job->done || queuedNormal > 0 || (background && queuedBackground > 0); });
+		sleepingWaiters--;
+	}
+}
+
+void JobSystem::wait(const vector<JobHandle>& jobs)
+{
+	for (const JobHandle& job : jobs)
+		wait(job);
+}
+
+void JobSystem::waitIdle()
+{
+	// Same as wait(): the caller helps with the jobs somebody waits for, background jobs are left to the workers
+	while (outstanding > 0)
+	{
+		if (tryRun(false))
+			continue;
+
+		unique_lock<mutex> lock(sleepMutex);
+		sleepingWaiters++;
+		waiterWake.wait(lock, [&]() { return outstanding == 0 || queuedNormal > 0; });
+		sleepingWaiters--;
+	}
+}
+
+void JobSystem::parallelRanges(int count, unsigned int threads, int grain, const function<void(int, int)>& fn)
+{
+	if (count <= 0)
+		return;
+	unsigned int participants = min(threads ? threads : threadCount, getWorkerCount() + 1);
+	if (grain <= 0)
+		grain = max(1, count / int(participants * 8));
+	const int chunks = (count + grain - 1) / grain;
+	participants = min(participants, unsigned(chunks));
+
+	// Chunks are handed out through an atomic counter, helpers that start late find nothing left and return
+	atomic<int> next(0);
+	auto work = [&]() {
+		for (int c = next++; c < chunks; c = next++)
+			fn(c * grain, min(count, (c + 1) * grain));
+	};
+	if (participants <= 1)
+	{
+		work();
+		return;
+	}
+
+	vector<JobHandle> helpers;
+	helpers.reserve(participants - 1);
+	for (unsigned int t = 1; t < participants; t++)
+		helpers.push_back(submit(work));
+	work();
+	wait(helpers);
+}
+
+void JobSystem::push(const JobHandle& job)
+{
+	const bool normal = job->priority != JOB_BACKGROUND;
+	if (normal)
+	{
+		// Workers keep what they spawn, everybody else shares the last queue
+		Queue& queue = (currentSystem == this && currentWorker >= 0) ? *queues[currentWorker] : *queues.back();
+		lock_guard<mutex> lock(queue.mutex);
+		queue.jobs.push_back(job);
+		queuedNormal++;
+	}
+	else
+	{
+		lock_guard<mutex> lock(backgroundQueue.mutex);
+		backgroundQueue.jobs.push_back(job);
+		queuedBackground++;
+	}
+
+	if (sleepingWorkers > 0)
+	{
+		lock_guard<mutex> lock(sleepMutex);
+		workerWake.notify_one();
+	}
+	if (normal && sleepingWaiters > 0)
+	{
+		lock_guard<mutex> lock(sleepMutex);
+		waiterWake.notify_all();
+	}
+}
+
+bool JobSystem::tryRun(bool background)
+{
+	const int own = currentSystem == this ? currentWorker : -1;
+	const int count = int(queues.size());
+	JobHandle job;
+
+	if (queuedNormal > 0)
+	{
+		// Own jobs newest first
+		if (own >= 0)
+		{
+			Queue& queue = *queues[own];
+			lock_guard<mutex> lock(queue.mutex);
+			if (!queue.jobs.empty())
+			{
+				job = move(queue.jobs.back());
+				queue.jobs.pop_back();
+			}
+		}
+		// Then the oldest job of another queue, starting after the own one so the thieves spread out.
+		// Other threads look at the shared queue first
+		const int start = own >= 0 ? own + 1 : count - 1;
+		for (int i = 0; i < count && !job; i++)
+		{
+			const int index = (start + i) % count;
+			if (index == own)
+				continue;
+			Queue& queue = *queues[index];
+			lock_guard<mutex> lock(queue.mutex);
+			if (!queue.jobs.empty())
+			{
+				job = move(queue.jobs.front());
+				queue.jobs.pop_front();
+				if (index != count - 1)
+					stolen++;
+			}
+		}
+		if (job)
+			queuedNormal--;
+	}
+
+	if (!job && background && queuedBackground > 0)
+	{
+		lock_guard<mutex> lock(backgroundQueue.mutex);
+		if (!backgroundQueue.jobs.empty())
+		{
+			job = move(backgroundQueue.jobs.front());
+			backgroundQueue.jobs.pop_front();
+			queuedBackground--;
+		}
+	}
+
+	if (!job)
+		return false;
+	run(job);
+	return true;
+}
+
+void JobSystem::run(const JobHandle& job)
+{
+	job->fn();
+	job->fn = nullptr; // release the captures now, handles may be kept around for a long time
+
+	vector<JobHandle> next;
+	{
+		lock_guard<mutex> lock(job->lock);
+		job->done = true;
+		next.swap(job->continuations);
+	}
+	executed++;
+	for (const JobHandle& continuation : next)
+		if (--continuation->pending == 0)
+			push(continuation);
+	outstanding--;
+
+	if (sleepingWaiters > 0)
+	{
+		lock_guard<mutex> lock(sleepMutex);
+		waiterWake.notify_all();
+	}
+}
+
+void JobSystem::workerMain(int index)
+{
+	currentSystem = this;
+	currentWorker = index;
+	while (true)
+	{
+		if (tryRun(true))
+			continue;
+
+		unique_lock<mutex> lock(sleepMutex);
+		if (stop && queuedNormal == 0 && queuedBackground == 0)
+			return;
+		sleepingWorkers++;
+		workerWake.wait(lock, [&]() { return stop || queuedNormal > 0 || queuedBackground > 0; });
+		sleepingWorkers--;
+	}
+}
+
+void JobSystem::setMainThreadWakeCallback(function<void()> wake)
+{
+	lock_guard<mutex> lock(mainMutex);
+	mainWake = wake;
+}
+
+void JobSystem::postToMainThread(function<void()> fn)
+{
+	function<void()> wake;
+	{
+		lock_guard<mutex> lock(mainMutex);
+		mainJobs.push_back(move(fn));
+		wake = mainWake;
+	}
+	if (wake)
+		wake();
+}
+
+int JobSystem::runMainThreadJobs()
+{
+	// Jobs posted while these run wait for the next call
+	vector<function<void()>> jobs;
+	{
+		lock_guard<mutex> lock(mainMutex);
+		jobs.swap(mainJobs);
+	}
+	for (function<void()>& fn : jobs)
+		fn();
+	return int(jobs.size());
+}
+
+JobSystem& jobSystem()
+{
+	static JobSystem system;
+	return system;
+}
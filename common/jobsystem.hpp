@@ -0,0 +1,108 @@
+#ifndef JOBSYSTEM_HPP
+#define JOBSYSTEM_HPP
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+
+// Work-stealing job scheduler shared by loading, baking and streaming. Every worker owns a deque: it pushes and
+// pops its own jobs at the back (the most recent ones, still in cache) while idle threads steal from the front.
+// A thread waiting for a job runs other jobs in the meantime, so jobs may wait for jobs (a parallelFor inside a
+// job) without tying up a worker. Jobs can depend on other jobs and are queued once all of them finished.
+// Work that needs the GL context is posted to the main thread queue and run by the render loop.
+
+struct Job;
+typedef std::shared_ptr<Job> JobHandle;
+
+enum JobPriority
+{
+	JOB_NORMAL,
+	JOB_BACKGROUND // streaming and other work nobody waits for: run by the workers only, never by the main thread while it waits
+};
+
+class JobSystem
+{
+public:
+	// workers = 0: one less than the hardware threads, the calling thread is the other one (at least one worker)
+	explicit JobSystem(unsigned int workers = 0);
+	// Runs the jobs that are still queued, then joins the workers
+	~JobSystem();
+
+	// Threads a parallelFor uses by default: every hardware thread, or the workers plus the caller if given
+	unsigned int getThreadCount() const { return threadCount; }
+	unsigned int getWorkerCount() const { return unsigned(workers.size()); }
+
+	JobHandle submit(std::function<void()> fn, JobPriority priority = JOB_NORMAL);
+	// Queued once every dependency finished, null handles are ignored
+	JobHandle submit(std::function<void()> fn, const std::vector<JobHandle>& dependencies, JobPriority priority = JOB_NORMAL);
+	// Block until the job(s) finished, running other jobs in the meantime
+	void wait(const JobHandle& job);
+	void wait(const std::vector<JobHandle>& jobs);
+	static bool isDone(const JobHandle& job);
+	// Block until every job submitted so far finished, the ones still waiting for dependencies and the ones they
+	// submit included. Not from a job, it would wait for itself. Main thread jobs they post are not run
+	void waitIdle();
+
+	// fn(i) for i in [0, count) on up to "threads" threads (0 = getThreadCount()), the calling thread included.
+	// Indices are handed out in chunks of "grain" (0 = about 8 chunks per thread). Returns when all of them ran.
+	template<typename F>
+	void parallelFor(int count, unsigned int threads, F&& fn, int grain = 0)
+	{
+		parallelRanges(count, threads, grain, [&](int begin, int end) {
+			for (int i = begin; i < end; i++)
+				fn(i);
+		});
+	}
+
+	// Main thread queue. wake is called from the posting thread (glfwPostEmptyEvent in main.cpp)
+	void setMainThreadWakeCallback(std::function<void()> wake);
+	void postToMainThread(std::function<void()> fn);
+	// Runs the jobs posted so far, from the main thread only. Returns how many ran
+	int runMainThreadJobs();
+
+	// Statistics since the start
+	unsigned long long jobsRun() const { return executed; }
+	unsigned long long jobsStolen() const { return stolen; }
+
+private:
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<JobHandle> jobs;
+	};
+
+	void parallelRanges(int count, unsigned int threads, int grain, const std::function<void(int, int)>& fn);
+	void push(const JobHandle& job);
+	bool tryRun(bool background);
+	void run(const JobHandle& job);
+	void workerMain(int index);
+
+	unsigned int threadCount;
+	std::vector<std::thread> workers;
+	std::vector<std::unique_ptr<Queue>> queues; // one per worker, the last one takes the jobs of other threads
+	Queue backgroundQueue;
+
+	// Sleeping workers and waiting threads, the counters tell pushes and finished jobs whom to wake
+	std::mutex sleepMutex;
+	std::condition_variable workerWake, waiterWake;
+	std::atomic<int> queuedNormal, queuedBackground;
+	std::atomic<int> outstanding; // submitted and not finished yet
+	std::atomic<int> sleepingWorkers, sleepingWaiters;
+	std::atomic<bool> stop;
+
+	std::mutex mainMutex;
+	std::vector<std::function<void()>> mainJobs;
+	std::function<void()> mainWake;
+
+	std::atomic<unsigned long long> executed, stolen;
+};
+
+// Process wide scheduler used by common/ and main.cpp, created on first use
+JobSystem& jobSystem();
+
+#endif
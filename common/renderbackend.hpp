@@ -0,0 +1,46 @@
+#ifndef RENDERBACKEND_HPP
+#define RENDERBACKEND_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+
+// Part of the terrain a frame draws, the far field impostor in main.cpp splits it at a radius around a centre
+enum TerrainField
+{
+	FIELD_ALL,
+	FIELD_NEAR, // patches reaching into fieldRadius
+	FIELD_FAR   // fragments beyond fieldRadius
+};
+
+// Everything one terrain frame needs, i.e. the uniforms of Basic.vert and Texture.frag
+struct TerrainFrame
+{
+	glm::mat4 MVP;
+	glm::mat4 Model;
+	glm::vec3 lightDir;
+	glm::vec3 viewPos;
+	float heightMapScale;
+	int numOfVertices;
+	float tessLevel; // GL only, the software rasterizer draws the patches untessellated
+	TerrainField field; // GL only, the software rasterizer always draws everything
+	glm::vec3 fieldCentre;
+	float fieldRadius;
+};
+
+// A way of drawing the terrain: the OpenGL path in main.cpp or the CPU rasterizer in softraster.cpp
+class RenderBackend
+{
+public:
+	virtual ~RenderBackend() {}
+
+	// Load model, textures and whatever programs the backend needs
+	virtual bool Load() = 0;
+	virtual void Unload() = 0;
+
+	virtual void DrawFrame(const TerrainFrame& frame) = 0;
+
+	// Current colour buffer as BGR bytes, rows padded to 4 bytes and bottom row first (the BMP layout)
+	virtual void ReadPixels(int width, int height, std::vector<unsigned char>& bgr) = 0;
+};
+
+#endif
@@ -0,0 +1,250 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "simulation.hpp"
+using namespace std;
+
+double simulationClock()
+{
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Simulation::Simulation(const SimulationSettings& settings)
+	: settings(settings), sleeping(false), stopping(false), steps(0), dropped(0), skipped(0)
+{
+	SimulationState initial;
+	initial.lightDir = glm::vec3(0, 0, 1);
+	reset(initial);
+}
+
+Simulation::~Simulation()
+{
+	stop();
+}
+
+void Simulation::reset(const SimulationState& initial)
+{
+	state = initial;
+	for (bool& button : held)
+		button = false;
+	inputCount = 0;
+	lastInputTime = 0.0;
+
+	// The reader starts with this state too
+	SimulationSnapshot& snapshot = snapshots.writeBuffer();
+	snapshot = SimulationSnapshot();
+	snapshot.previous = snapshot.current = state;
+	snapshots.publish();
+}
+
+bool Simulation::pushEvent(const SimulationEvent& event)
+{
+	if (!events.push(event))
+	{
+		dropped++;
+		return false;
+	}
+	// Pairs with the fence in threadMain: either the thread sees the event or this sees it sleeping
+	atomic_thread_fence(memory_order_seq_cst);
+	if (sleeping)
+	{
+		lock_guard<mutex> lock(sleepMutex);
+		wake.notify_one();
+	}
+	return true;
+}
+
+void Simulation::start(function<void()> callback)
+{
+	if (thread.joinable())
+		return;
+	published = callback;
+	stopping = false;
+	thread = std::thread(&Simulation::threadMain, this);
+}
+
+void Simulation::stop()
+{
+	if (!thread.joinable())
+		return;
+	{
+		lock_guard<mutex> lock(sleepMutex);
+		stopping = true;
+	}
+	wake.notify_one();
+	thread.join();
+}
+
+void Simulation::step(double time)
+{
+	// Buttons pressed and released within one step still count for that step, a tap is never lost
+	bool pressed[SIM_BUTTON_COUNT] = {};
+	CameraInput input;
+	bool consumed = false;
+	SimulationEvent event;
+	while (events.pop(event))
+	{
+		consumed = true;
+		inputCount++;
+		lastInputTime = max(lastInputTime, event.time);
+		if (event.type == SimulationEvent::TURN)
+		{
+			input.turnX += event.turnX;
+			input.turnY += event.turnY;
+		}
+		else
+		{
+			held[event.button] = event.down;
+			pressed[event.button] |= event.down;
+		}
+	}
+	auto active = [&](SimulationButton button) { return held[button] || pressed[button]; };
+
+	const SimulationState previous = state;
+	const float seconds = float(settings.stepSeconds);
+	input.forward = active(SIM_FORWARD);
+	input.backward = active(SIM_BACKWARD);
+	input.right = active(SIM_RIGHT);
+	input.left = active(SIM_LEFT);
+	bool changed = advanceCamera(state.camera, input, seconds);
+
+	// Same axes as the keys used to rotate the light by, now at a fixed speed while they are held
+	glm::vec3 axis(0.0f);
+	if (active(SIM_LIGHT_UP)) axis += glm::vec3(1, 0, 0);
+	if (active(SIM_LIGHT_DOWN)) axis += glm::vec3(-1, 0, 0);
+	if (active(SIM_LIGHT_LEFT)) axis += glm::vec3(0, 1, 0);
+	if (active(SIM_LIGHT_RIGHT)) axis += glm::vec3(0, -1, 0);
+	if (axis != glm::vec3(0.0f))
+	{
+		state.lightDir = glm::vec3(glm::rotate(glm::mat4(1.0f), glm::radians(settings.lightSpeed * seconds), glm::normalize(axis)) * glm::vec4(state.lightDir, 0.0f));
+		changed = true;
+	}
+
+	SimulationSnapshot& snapshot = snapshots.writeBuffer();
+	snapshot.previous = previous;
+	snapshot.current = state;
+	snapshot.time = time;
+	snapshot.step = ++steps;
+	snapshot.changed = changed;
+	snapshot.inputCount = inputCount;
+	snapshot.lastInputTime = lastInputTime;
+	snapshots.publish();
+
+	if ((changed || consumed) && published)
+		published();
+}
+
+SimulationState Simulation::interpolate(double time) const
+{
+	const SimulationSnapshot& snapshot = snapshots.read();
+	if (!snapshot.changed)
+		return snapshot.current;
+	// previous is due one step before current
+	float t = float((time - snapshot.time) / settings.stepSeconds);
+	t = min(1.0f, max(0.0f, t));
+	SimulationState result;
+	result.camera = interpolateCamera(snapshot.previous.camera, snapshot.current.camera, t);
+	result.lightDir = glm::normalize(glm::mix(snapshot.previous.lightDir, snapshot.current.lightDir, t));
+	return result;
+}
+
+bool Simulation::atRest() const
+{
+	for (bool button : held)
+		if (button)
+			return false;
+	return true;
+}
+
+void Simulation::threadMain()
+{
+	double next = simulationClock();
+	while (!stopping)
+	{
+		// Nothing held and nothing queued: sleep until an event arrives, the idle time is not simulated
+		if (atRest() && events.empty())
+		{
+			unique_lock<mutex> lock(sleepMutex);
+			sleeping = true;
+			atomic_thread_fence(memory_order_seq_cst);
+			wake.wait(lock, [&]() { return stopping || !events.empty(); });
+			sleeping = false;
+			if (stopping)
+				return;
+			next = simulationClock();
+		}
+
+		// Every step due by now, a stalled thread gives up on catching up after a few of them
+		const double now = simulationClock();
+		int due = 0;
+		while (next <= now && due < settings.maxCatchUpSteps)
+		{
+			step(next);
+			next += settings.stepSeconds;
+			due++;
+		}
+		if (next <= now)
+		{
+			skipped += (unsigned long long)((now - next) / settings.stepSeconds) + 1;
+			next = now + settings.stepSeconds;
+		}
+		this_thread::sleep_for(chrono::duration<double>(max(0.0, next - simulationClock())));
+	}
+}
+
+TimingStats::TimingStats(size_t capacity)
+	: capacity(max<size_t>(1, capacity)), next(0), added(0)
+{
+}
+
+void TimingStats::add(double ms)
+{
+	// The statistics do not depend on the order, the oldest sample is simply overwritten
+	if (samples.size() < capacity)
+		samples.push_back(ms);
+	else
+	{
+		samples[next] = ms;
+		next = (next + 1) % capacity;
+	}
+	added++;
+}
+
+double TimingStats::mean() const
+{
+	if (samples.empty())
+		return 0.0;
+	double sum = 0.0;
+	for (double s : samples)
+		sum += s;
+	return sum / samples.size();
+}
+
+double TimingStats::deviation() const
+{
+	if (samples.size() < 2)
+		return 0.0;
+	const double m = mean();
+	double sum = 0.0;
+	for (double s : samples)
+		sum += (s - m) * (s - m);
+	return sqrt(sum / (samples.size() - 1));
+}
+
+double TimingStats::percentile(double p) const
+{
+	if (samples.empty())
+		return 0.0;
+	vector<double> sorted = samples;
+	size_t index = min(sorted.size() - 1, size_t(p / 100.0 * (sorted.size() - 1) + 0.5));
+	nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+	return sorted[index];
+}
+
+double TimingStats::maximum() const
+{
+	return samples.empty() ? 0.0 : *max_element(samples.begin(), samples.end());
+}
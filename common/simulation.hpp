@@ -0,0 +1,222 @@
+#ifndef SIMULATION_HPP
+#define SIMULATION_HPP
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <glm/glm.hpp>
+
+#include "camera.hpp"
+
+// Fixed timestep simulation of the camera and the light on its own thread. The window thread pushes input events
+// into a lock-free queue, every step consumes them and publishes a snapshot of the state before and after the step
+// through a triple buffer. The render loop takes the latest snapshot without waiting and interpolates between the
+// two states, so the motion does not depend on how long a frame took. step() is deterministic and can be driven
+// without the thread or a window.
+// Only the camera and the light live here. Page streaming and the far field stay on the render thread: the virtual
+// texture feedback is read back from the frame just drawn and the far field sectors are rendered with GL, both
+// driven by the interpolated camera of the frame. Their CPU side (page loads, planning) is already off the frame
+// through the job system and FarField, a step here would only add a frame of lag to the feedback.
+// Interpolating puts the picture one step (stepSeconds) behind the newest state.
+
+// Seconds on the clock the events and steps are stamped with (steady, any thread)
+double simulationClock();
+
+// Single producer, single consumer ring of fixed capacity (a power of two). push() from one thread, pop() from
+// another, neither ever blocks
+template<typename T, unsigned int Capacity>
+class SpscQueue
+{
+public:
+	SpscQueue() : head(0), tail(0) {}
+
+	// False when the queue is full, the item is dropped
+	bool push(const T& item)
+	{
+		const unsigned int t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) == Capacity)
+			return false;
+		items[t % Capacity] = item;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(T& item)
+	{
+		const unsigned int h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+			return false;
+		item = items[h % Capacity];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool empty() const { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); }
+
+private:
+	static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+	T items[Capacity];
+	std::atomic<unsigned int> head, tail; // free running, only their difference matters
+};
+
+// Triple buffer for one writer and one reader: the writer fills its buffer and swaps it with the middle one,
+// the reader swaps the middle one with its buffer when it holds something newer. Nobody waits for anybody
+template<typename T>
+class TripleBuffer
+{
+public:
+	TripleBuffer() : back(0), middle(1), front(2) {}
+
+	T& writeBuffer() { return buffers[back]; }
+	void publish()
+	{
+		back = middle.exchange(back | fresh, std::memory_order_acq_rel) & ~fresh;
+	}
+
+	// True when a newer buffer was published since the last call, read() is the latest one either way
+	bool update()
+	{
+		if (!(middle.load(std::memory_order_relaxed) & fresh))
+			return false;
+		front = middle.exchange(front, std::memory_order_acq_rel) & ~fresh;
+		return true;
+	}
+	const T& read() const { return buffers[front]; }
+
+private:
+	static const int fresh = 4; // flag next to the index of the middle buffer
+	T buffers[3];
+	int back;
+	std::atomic<int> middle;
+	int front;
+};
+
+// Buttons the simulation integrates while they are held
+enum SimulationButton
+{
+	SIM_FORWARD,
+	SIM_BACKWARD,
+	SIM_RIGHT,
+	SIM_LEFT,
+	SIM_LIGHT_UP,    // light rotations of the W / S / A / D keys
+	SIM_LIGHT_DOWN,
+	SIM_LIGHT_LEFT,
+	SIM_LIGHT_RIGHT,
+	SIM_BUTTON_COUNT
+};
+
+struct SimulationEvent
+{
+	enum Type { TURN, BUTTON } type;
+	float turnX, turnY;  // TURN: cursor movement to the left / up, in pixels
+	SimulationButton button;
+	bool down;           // BUTTON: pressed or released
+	double time;         // simulationClock() when it happened
+};
+
+struct SimulationState
+{
+	CameraState camera;
+	glm::vec3 lightDir;
+};
+
+// What one step publishes
+struct SimulationSnapshot
+{
+	SimulationState previous, current; // before and after the step
+	double time = 0.0;                 // clock time of the step, current is due then
+	unsigned long long step = 0;
+	bool changed = false;              // current differs from previous
+	unsigned long long inputCount = 0; // events consumed up to this step
+	double lastInputTime = 0.0;        // time of the newest of them
+};
+
+struct SimulationSettings
+{
+	double stepSeconds = 1.0 / 120.0;
+	int maxCatchUpSteps = 8;     // steps in a row before a stalled simulation drops the rest of its backlog
+	float lightSpeed = 18.0f;    // degrees per second while a light key is held
+};
+
+class Simulation
+{
+public:
+	Simulation(const SimulationSettings& settings = SimulationSettings());
+	~Simulation();
+
+	// Start from this state, before the thread is started or without it
+	void reset(const SimulationState& state);
+
+	// Window thread. False when the queue is full and the event was dropped
+	bool pushEvent(const SimulationEvent& event);
+
+	// Run the steps on a thread of their own. published is called from it after every step that consumed
+	// input or changed the state (the render loop wakes up through it). The thread sleeps while nothing is held
+	void start(std::function<void()> published);
+	void stop();
+
+	// One step at the given clock time: consume the queued events, integrate stepSeconds and publish
+	void step(double time);
+
+	// Render thread: true when a newer snapshot arrived, snapshot() is the latest one either way
+	bool acquire() { return snapshots.update(); }
+	const SimulationSnapshot& snapshot() const { return snapshots.read(); }
+	// The snapshot interpolated to the given clock time, one step behind the simulation
+	SimulationState interpolate(double time) const;
+
+	const SimulationSettings& getSettings() const { return settings; }
+
+	// Statistics since the start, from the simulation thread
+	unsigned long long stepCount() const { return steps; }
+	unsigned long long droppedEvents() const { return dropped; }
+	unsigned long long droppedSteps() const { return skipped; }
+
+private:
+	void threadMain();
+	bool atRest() const;
+
+	SimulationSettings settings;
+	SimulationState state;
+	bool held[SIM_BUTTON_COUNT];
+	unsigned long long inputCount;
+	double lastInputTime;
+
+	SpscQueue<SimulationEvent, 256> events;
+	TripleBuffer<SimulationSnapshot> snapshots;
+
+	std::thread thread;
+	std::function<void()> published;
+	// Only for sleeping while at rest, the events themselves go through the queue
+	std::mutex sleepMutex;
+	std::condition_variable wake;
+	std::atomic<bool> sleeping, stopping;
+
+	std::atomic<unsigned long long> steps, dropped, skipped;
+};
+
+// Input latency and frame time samples in milliseconds, summarized at the end. Only the newest capacity samples are
+// kept, a long session does not grow it
+class TimingStats
+{
+public:
+	explicit TimingStats(size_t capacity = 4096);
+
+	void add(double ms);
+	size_t count() const { return samples.size(); }         // samples the statistics are over
+	unsigned long long total() const { return added; }      // samples added since the start
+	double mean() const;
+	double deviation() const; // standard deviation, the jitter of frame times
+	double percentile(double p) const;
+	double maximum() const;
+
+private:
+	size_t capacity;
+	std::vector<double> samples; // ring once it is full, next is the oldest
+	size_t next;
+	unsigned long long added;
+};
+
+#endif
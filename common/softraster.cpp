@@ -0,0 +1,630 @@
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <cmath>
+#include <cstring>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#define SOFTRASTER_AVX2 1
+#include <immintrin.h>
+#endif
+
+#include "softraster.hpp"
+#include "terrainmesh.hpp"
+#include "heightcodec.hpp"
+#include "terrainlayers.hpp"
+#include "utils.hpp"
+#include "jobsystem.hpp"
+using namespace std;
+
+namespace
+{
+	const int kTileSize = 64;
+	const int kChunkTriangles = 4096;
+	const int kVaryings = 6; // UV, lightDir_tcs, height
+
+	// Texture slots, same order as the samplers of Texture.frag (the specular maps are not used by its output)
+	enum { ROCK_DIFF, ROCK_NORM, GRASS_DIFF, GRASS_NORM, SNOW_DIFF, SNOW_NORM, TEXTURE_COUNT };
+	const char* kTextureFiles[TEXTURE_COUNT] = { "rocks.bmp", "rocks-n.bmp", "grass.bmp", "grass-n.bmp", "snow.bmp", "snow-n.bmp" };
+}
+
+struct SoftwareBackend::Texture
+{
+	// Mip chain of tightly packed BGR texels, built with a 2x2 box filter like glGenerateMipmap
+	vector<int> widths, heights;
+	vector<vector<unsigned char>> levels;
+
+	bool load(const char* path)
+	{
+		int w, h;
+		unsigned char* data = nullptr;
+		if (!loadBMP_custom(path, w, h, data))
+			return false;
+
+		const size_t stride = (size_t(w) * 3 + 3) & ~size_t(3);
+		vector<unsigned char> base(size_t(w) * h * 3);
+		for (int y = 0; y < h; y++)
+			memcpy(&base[size_t(y) * w * 3], data + y * stride, size_t(w) * 3);
+		delete[] data;
+
+		widths.assign(1, w);
+		heights.assign(1, h);
+		levels.assign(1, move(base));
+
+		while (w > 1 || h > 1)
+		{
+			int nw = max(1, w / 2), nh = max(1, h / 2);
+			const vector<unsigned char>& src = levels.back();
+			vector<unsigned char> dst(size_t(nw) * nh * 3);
+			for (int y = 0; y < nh; y++)
+				for (int x = 0; x < nw; x++)
+				{
+					int x0 = min(2 * x, w - 1), x1 = min(2 * x + 1, w - 1);
+					int y0 = min(2 * y, h - 1), y1 = min(2 * y + 1, h - 1);
+					for (int c = 0; c < 3; c++)
+					{
+						int sum = src[(size_t(y0) * w + x0) * 3 + c] + src[(size_t(y0) * w + x1) * 3 + c] +
+							src[(size_t(y1) * w + x0) * 3 + c] + src[(size_t(y1) * w + x1) * 3 + c];
+						dst[(size_t(y) * nw + x) * 3 + c] = (unsigned char)((sum + 2) / 4);
+					}
+				}
+			widths.push_back(nw);
+			heights.push_back(nh);
+			levels.push_back(move(dst));
+			w = nw;
+			h = nh;
+		}
+		return true;
+	}
+
+	// One texel of the given colour, stands in for a material image
+	void fill(unsigned char b, unsigned char g, unsigned char r)
+	{
+		widths.assign(1, 1);
+		heights.assign(1, 1);
+		levels.assign(1, vector<unsigned char>({ b, g, r }));
+	}
+
+	float baseLod() const
+	{
+		return log2(float(max(widths[0], heights[0])));
+	}
+
+	// GL_REPEAT + bilinear filtering inside one mip level, returns rgb like texture(...).rgb
+	glm::vec3 sample(float u, float v, int level) const
+	{
+		level = min(max(level, 0), int(levels.size()) - 1);
+		const int w = widths[level], h = heights[level];
+		const unsigned char* texels = levels[level].data();
+
+		float fx = u * w - 0.5f, fy = v * h - 0.5f;
+		float x0f = floor(fx), y0f = floor(fy);
+		float ax = fx - x0f, ay = fy - y0f;
+		int x0 = int(x0f) % w; if (x0 < 0) x0 += w;
+		int y0 = int(y0f) % h; if (y0 < 0) y0 += h;
+		int x1 = x0 + 1 == w ? 0 : x0 + 1;
+		int y1 = y0 + 1 == h ? 0 : y0 + 1;
+
+		auto fetch = [&](int x, int y) {
+			const unsigned char* t = texels + (size_t(y) * w + x) * 3;
+			return glm::vec3(t[2], t[1], t[0]);
+		};
+		glm::vec3 top = glm::mix(fetch(x0, y0), fetch(x1, y0), ax);
+		glm::vec3 bottom = glm::mix(fetch(x0, y1), fetch(x1, y1), ax);
+		return glm::mix(top, bottom, ay) * (1.0f / 255.0f);
+	}
+};
+
+struct SoftwareBackend::Vertex
+{
+	glm::vec4 clip;
+	float varyings[kVaryings];
+};
+
+struct SoftwareBackend::Triangle
+{
+	// Edge function i is zero on the edge opposite vertex i: e = A * x + B * y + C
+	float A[3], B[3], C[3];
+	bool topLeft[3];
+	float invArea;
+	float z[3];
+	float invW[3];
+	float varyings[3][kVaryings]; // already divided by w
+	float lodBase;                // log2 of base UV units per pixel
+	int minX, minY, maxX, maxY;
+};
+
+SoftwareBackend::SoftwareBackend(int width, int height, int nPoints, float scale, unsigned int threads)
+	: width(width), height(height), nPoints(nPoints), scale(scale), threadCount(1),
+	heightmapWidth(0), heightmapHeight(0), slopesScale(-1.0f)
+{
+	SetThreadCount(threads);
+
+	tilesX = (width + kTileSize - 1) / kTileSize;
+	tilesY = (height + kTileSize - 1) / kTileSize;
+	// Whole groups of 8 per row, the masked lanes past the end of a row are never touched anyway
+	depthStride = (width + 7) / 8 * 8 + 8;
+	depth.assign(size_t(depthStride) * height, 1.0f);
+	color.assign(((size_t(width) * 3 + 3) & ~size_t(3)) * height, 0);
+}
+
+SoftwareBackend::~SoftwareBackend()
+{
+}
+
+void SoftwareBackend::SetThreadCount(unsigned int threads)
+{
+	threadCount = threads ? threads : jobSystem().getThreadCount();
+}
+
+void SoftwareBackend::buildModel()
+{
+	// Same grid LoadModel() uploads, with the strips resolved into triangles once
+	const uint32_t restartIndex = numeric_limits<uint32_t>::max();
+	vector<unsigned int> strip;
+	buildTerrainGrid(nPoints, scale, restartIndex, positions, uvs, strip);
+
+	stripToTriangles(strip, restartIndex, triangleIndices);
+
+	vertices.resize(positions.size());
+	int chunks = int((triangleIndices.size() / 3 + kChunkTriangles - 1) / kChunkTriangles);
+	chunkTriangles.assign(chunks, vector<Triangle>());
+	chunkBins.assign(chunks, vector<vector<uint32_t>>(tilesX * tilesY));
+}
+
+bool SoftwareBackend::Load()
+{
+	// Height map: same sources as LoadTextures()
+	int w, h;
+	unsigned char* data = nullptr;
+	if (!loadHeightmapCached("mountains_height.bmp", "mountains_height.thm", w, h, data))
+		return false;
+	heights.resize(size_t(w) * h);
+	unpackHeightsBGR(data, w, h, heights.data());
+	heightmapWidth = w;
+	heightmapHeight = h;
+	delete[] data;
+
+	// The images are decoded and their mip chains built in parallel
+	textures.resize(TEXTURE_COUNT);
+	atomic<bool> loaded(true);
+	jobSystem().parallelFor(TEXTURE_COUNT, threadCount, [&](int i) {
+		if (!textures[i].load(kTextureFiles[i]))
+			loaded = false;
+	}, 1);
+	if (!loaded)
+		return false;
+
+	buildModel();
+	return true;
+}
+
+bool SoftwareBackend::LoadHeightmap(const vector<int32_t>& heightmap, int w, int h)
+{
+	if (w <= 0 || h <= 0 || heightmap.size() != size_t(w) * h)
+		return false;
+	heights = heightmap;
+	heightmapWidth = w;
+	heightmapHeight = h;
+	slopesScale = -1.0f;
+
+	// Mid gray diffuse, normal maps pointing straight out of the surface
+	textures.resize(TEXTURE_COUNT);
+	for (int i = 0; i < TEXTURE_COUNT; i++)
+	{
+		if (i == ROCK_NORM || i == GRASS_NORM || i == SNOW_NORM)
+			textures[i].fill(255, 128, 128);
+		else
+			textures[i].fill(128, 128, 128);
+	}
+
+	buildModel();
+	return true;
+}
+
+void SoftwareBackend::ReadDepth(vector<float>& values) const
+{
+	values.resize(size_t(width) * height);
+	for (int y = 0; y < height; y++)
+		copy_n(&depth[size_t(y) * depthStride], width, &values[size_t(y) * width]);
+}
+
+void SoftwareBackend::Unload()
+{
+	positions.clear();
+	uvs.clear();
+	triangleIndices.clear();
+	heights.clear();
+	slopes.clear();
+	slopesScale = -1.0f;
+	textures.clear();
+	vertices.clear();
+	chunkTriangles.clear();
+	chunkBins.clear();
+}
+
+void SoftwareBackend::DrawFrame(const TerrainFrame& frame)
+{
+	if (heights.empty())
+		return;
+
+	// Same layer options as the GL path: the grid spans 2 * scale over the height map width
+	if (frame.heightMapScale != slopesScale)
+	{
+		TerrainLayerOptions options;
+		options.cellSize = 2.0f * scale / heightmapWidth;
+		options.zFactor = frame.heightMapScale;
+		options.threads = threadCount;
+		slopes.resize(heights.size());
+		computeSlopeAspectCurvature(heights.data(), heightmapWidth, heightmapHeight, options, slopes.data(), nullptr, nullptr);
+		slopesScale = frame.heightMapScale;
+	}
+
+	// Vertex stage: port of Basic.vert
+	const glm::vec2 pixelSize = glm::vec2(1.0f / heightmapWidth, 1.0f / heightmapHeight) * float(frame.numOfVertices);
+	auto getHeightFromHeightMap = [&](glm::vec2 uv) {
+		// The vertex shader always samples level 0, which is the GL_NEAREST magnification filter
+		int x = min(max(int(floor(uv.x * heightmapWidth)), 0), heightmapWidth - 1);
+		int y = min(max(int(floor(uv.y * heightmapHeight)), 0), heightmapHeight - 1);
+		return float(heights[size_t(y) * heightmapWidth + x]) * frame.heightMapScale;
+	};
+
+	const int vertexBlocks = int((vertices.size() + 1023) / 1024);
+	jobSystem().parallelFor(vertexBlocks, threadCount, [&](int block) {
+		size_t end = min(vertices.size(), size_t(block + 1) * 1024);
+		for (size_t i = size_t(block) * 1024; i < end; i++)
+		{
+			glm::vec2 UV = uvs[i];
+			float height = getHeightFromHeightMap(UV);
+
+			glm::vec3 position_ocs = positions[i];
+			position_ocs.y += height;
+
+			float l = getHeightFromHeightMap(UV - glm::vec2(pixelSize.x, 0.0f));
+			float r = getHeightFromHeightMap(UV + glm::vec2(pixelSize.x, 0.0f));
+			float b = getHeightFromHeightMap(UV - glm::vec2(0.0f, pixelSize.y));
+			float t = getHeightFromHeightMap(UV + glm::vec2(0.0f, pixelSize.y));
+			float dx = (l - r) / (2.0f * pixelSize.x);
+			float dz = (t - b) / (2.0f * pixelSize.y);
+
+			// Graham-Schmidt tangent frame, as in the shader
+			glm::vec3 N = glm::normalize(glm::vec3(dx, 1, dz));
+			glm::vec3 B = glm::vec3(1, 0, 0);
+			glm::vec3 T = glm::vec3(0, 0, 1);
+			T = glm::normalize(T - glm::dot(T, N) * N);
+			B = glm::normalize(B - glm::dot(B, N) * N - glm::dot(B, T) * T);
+			// viewDir_tcs is skipped: it only feeds the specular term, which Texture.frag does not output
+			glm::vec3 lightDir_tcs = glm::mat3(T, B, N) * (-frame.lightDir);
+
+			Vertex& v = vertices[i];
+			v.clip = frame.MVP * glm::vec4(position_ocs, 1);
+			v.varyings[0] = UV.x;
+			v.varyings[1] = UV.y;
+			v.varyings[2] = lightDir_tcs.x;
+			v.varyings[3] = lightDir_tcs.y;
+			v.varyings[4] = lightDir_tcs.z;
+			v.varyings[5] = height;
+		}
+	});
+
+	// Setup and binning, chunks keep primitive order so the result does not depend on the thread count
+	jobSystem().parallelFor(int(chunkTriangles.size()), threadCount, [&](int chunk) { setupTriangles(chunk); });
+
+	// Rasterization and shading, one tile per task
+	jobSystem().parallelFor(tilesX * tilesY, threadCount, [&](int tile) { rasterizeTile(tile); });
+}
+
+void SoftwareBackend::setupTriangles(int chunk)
+{
+	vector<Triangle>& triangles = chunkTriangles[chunk];
+	vector<vector<uint32_t>>& bins = chunkBins[chunk];
+	triangles.clear();
+	for (auto& bin : bins)
+		bin.clear();
+
+	const size_t first = size_t(chunk) * kChunkTriangles;
+	const size_t last = min(triangleIndices.size() / 3, first + kChunkTriangles);
+
+	auto emit = [&](const Vertex* v0, const Vertex* v1, const Vertex* v2) {
+		const Vertex* v[3] = { v0, v1, v2 };
+		float sx[3], sy[3];
+		Triangle tri;
+		for (int i = 0; i < 3; i++)
+		{
+			float invW = 1.0f / v[i]->clip.w;
+			sx[i] = (v[i]->clip.x * invW * 0.5f + 0.5f) * width;
+			sy[i] = (v[i]->clip.y * invW * 0.5f + 0.5f) * height;
+			tri.z[i] = v[i]->clip.z * invW * 0.5f + 0.5f;
+			tri.invW[i] = invW;
+			for (int k = 0; k < kVaryings; k++)
+				tri.varyings[i][k] = v[i]->varyings[k] * invW;
+		}
+
+		// Counter clockwise in window coordinates is the front face, GL_CULL_FACE drops the rest
+		float area = (sx[1] - sx[0]) * (sy[2] - sy[0]) - (sx[2] - sx[0]) * (sy[1] - sy[0]);
+		if (!(area > 0.0f))
+			return;
+
+		// Clamp in float first, vertices close to the near plane can land far outside the int range
+		tri.minX = int(floor(max(0.0f, min(sx[0], min(sx[1], sx[2])))));
+		tri.minY = int(floor(max(0.0f, min(sy[0], min(sy[1], sy[2])))));
+		tri.maxX = int(ceil(min(float(width - 1), max(sx[0], max(sx[1], sx[2])))));
+		tri.maxY = int(ceil(min(float(height - 1), max(sy[0], max(sy[1], sy[2])))));
+		if (tri.minX > tri.maxX || tri.minY > tri.maxY)
+			return;
+
+		for (int i = 0; i < 3; i++)
+		{
+			int a = (i + 1) % 3, b = (i + 2) % 3;
+			float dx = sx[b] - sx[a], dy = sy[b] - sy[a];
+			tri.A[i] = -dy;
+			tri.B[i] = dx;
+			tri.C[i] = dy * sx[a] - dx * sy[a];
+			// Fill convention for counter clockwise triangles with y up: edges going down, or left along the top
+			tri.topLeft[i] = dy < 0.0f || (dy == 0.0f && dx < 0.0f);
+		}
+		tri.invArea = 1.0f / area;
+
+		// One mip level per triangle from its UV footprint, standing in for the per quad derivatives
+		glm::vec2 uv0(v0->varyings[0], v0->varyings[1]);
+		glm::vec2 e1 = glm::vec2(v1->varyings[0], v1->varyings[1]) - uv0;
+		glm::vec2 e2 = glm::vec2(v2->varyings[0], v2->varyings[1]) - uv0;
+		float uvArea = fabs(e1.x * e2.y - e1.y * e2.x);
+		tri.lodBase = 0.5f * log2(max(uvArea, 1e-12f) / area);
+
+		uint32_t index = uint32_t(triangles.size());
+		triangles.push_back(tri);
+		for (int ty = tri.minY / kTileSize; ty <= tri.maxY / kTileSize; ty++)
+			for (int tx = tri.minX / kTileSize; tx <= tri.maxX / kTileSize; tx++)
+				bins[ty * tilesX + tx].push_back(index);
+	};
+
+	for (size_t t = first; t < last; t++)
+	{
+		const Vertex* v[3] = { &vertices[triangleIndices[3 * t]], &vertices[triangleIndices[3 * t + 1]], &vertices[triangleIndices[3 * t + 2]] };
+
+		// Trivial reject against the side and far planes
+		bool outside = false;
+		for (int axis = 0; axis < 3 && !outside; axis++)
+		{
+			bool allLow = true, allHigh = true;
+			for (int i = 0; i < 3; i++)
+			{
+				allLow = allLow && v[i]->clip[axis] < -v[i]->clip.w;
+				allHigh = allHigh && v[i]->clip[axis] > v[i]->clip.w;
+			}
+			outside = (allHigh || (allLow && axis < 2));
+		}
+		if (outside)
+			continue;
+
+		// Near plane (z >= -w) clipping, one triangle becomes at most a quad
+		float d[3];
+		int inside = 0;
+		for (int i = 0; i < 3; i++)
+		{
+			d[i] = v[i]->clip.z + v[i]->clip.w;
+			inside += d[i] >= 0.0f;
+		}
+		if (inside == 3)
+		{
+			emit(v[0], v[1], v[2]);
+			continue;
+		}
+		if (inside == 0)
+			continue;
+
+		Vertex clipped[4];
+		int count = 0;
+		for (int i = 0; i < 3; i++)
+		{
+			int j = (i + 1) % 3;
+			if (d[i] >= 0.0f)
+				clipped[count++] = *v[i];
+			if ((d[i] >= 0.0f) != (d[j] >= 0.0f))
+			{
+				float s = d[i] / (d[i] - d[j]);
+				Vertex& out = clipped[count++];
+				out.clip = glm::mix(v[i]->clip, v[j]->clip, s);
+				for (int k = 0; k < kVaryings; k++)
+					out.varyings[k] = v[i]->varyings[k] + (v[j]->varyings[k] - v[i]->varyings[k]) * s;
+			}
+		}
+		for (int i = 1; i + 1 < count; i++)
+			emit(&clipped[0], &clipped[i], &clipped[i + 1]);
+	}
+}
+
+namespace
+{
+	// Port of getPhong() in Texture.frag, which currently returns only its diffuse term
+	inline glm::vec3 getPhong(const glm::vec3& diffuseColor, const glm::vec3& normalDetail, const glm::vec3& lightDir_tcs)
+	{
+		glm::vec3 normal_tcs = glm::normalize(normalDetail * 2.0f - 1.0f);
+		float diff = max(glm::dot(normal_tcs, lightDir_tcs), 0.0f);
+		return diff * diffuseColor;
+	}
+
+	inline float smoothstep(float edge0, float edge1, float x)
+	{
+		float t = min(max((x - edge0) / (edge1 - edge0), 0.0f), 1.0f);
+		return t * t * (3.0f - 2.0f * t);
+	}
+}
+
+void SoftwareBackend::rasterizeTile(int tile)
+{
+	const int x0 = (tile % tilesX) * kTileSize;
+	const int y0 = (tile / tilesX) * kTileSize;
+	const int x1 = min(width, x0 + kTileSize) - 1;
+	const int y1 = min(height, y0 + kTileSize) - 1;
+	const size_t colorStride = (size_t(width) * 3 + 3) & ~size_t(3);
+
+	// glClearColor(0.7f, 0.8f, 1.0f) and a depth of 1, done per tile so the clear is parallel too
+	for (int y = y0; y <= y1; y++)
+	{
+		unsigned char* c = &color[y * colorStride + size_t(x0) * 3];
+		for (int x = x0; x <= x1; x++, c += 3)
+		{
+			c[0] = 255;
+			c[1] = 204;
+			c[2] = 179;
+		}
+		fill(&depth[size_t(y) * depthStride + x0], &depth[size_t(y) * depthStride + x1 + 1], 1.0f);
+	}
+
+	float lodOffset[TEXTURE_COUNT];
+	for (int i = 0; i < TEXTURE_COUNT; i++)
+		lodOffset[i] = textures[i].baseLod() + log2(i == GRASS_DIFF || i == GRASS_NORM ? 20.0f : 10.0f);
+
+	auto shade = [&](const Triangle& tri, int x, int y, float e1, float e2) {
+		float b1 = e1 * tri.invArea, b2 = e2 * tri.invArea, b0 = 1.0f - b1 - b2;
+		float w = 1.0f / (b0 * tri.invW[0] + b1 * tri.invW[1] + b2 * tri.invW[2]);
+		float a[kVaryings];
+		for (int k = 0; k < kVaryings; k++)
+			a[k] = (b0 * tri.varyings[0][k] + b1 * tri.varyings[1][k] + b2 * tri.varyings[2][k]) * w;
+
+		glm::vec2 te_UV(a[0], a[1]);
+		glm::vec3 lightDir_tcs(a[2], a[3], a[4]);
+		float currHeight = a[5];
+
+		auto sample = [&](int slot, float tiling) {
+			int level = int(floor(tri.lodBase + lodOffset[slot] + 0.5f));
+			return textures[slot].sample(te_UV.x * tiling, te_UV.y * tiling, level);
+		};
+		glm::vec3 rockPhongColor = getPhong(sample(ROCK_DIFF, 10), sample(ROCK_NORM, 10), lightDir_tcs);
+		glm::vec3 grassPhongColor = getPhong(sample(GRASS_DIFF, 20), sample(GRASS_NORM, 20), lightDir_tcs);
+		glm::vec3 snowPhongColor = getPhong(sample(SNOW_DIFF, 10), sample(SNOW_NORM, 10), lightDir_tcs);
+
+		// Height blending, same thresholds as the shader
+		const float rockHeight = 1, snowHeight = 2;
+		glm::vec3 result;
+		if (currHeight < 0.0f + 0.001f)
+			result = grassPhongColor;
+		else if (currHeight <= rockHeight + 0.25f)
+		{
+			float blendRock = smoothstep(rockHeight - 0.25f, rockHeight + 0.25f, currHeight);
+			result = (1 - blendRock) * grassPhongColor + blendRock * rockPhongColor;
+		}
+		else if (currHeight <= snowHeight + 0.25f)
+		{
+			float blendSnow = smoothstep(snowHeight - 0.25f, snowHeight + 0.25f, currHeight);
+			result = blendSnow * snowPhongColor + (1 - blendSnow) * rockPhongColor;
+		}
+		else
+			result = snowPhongColor;
+
+		// Steep ground shows rock whatever its height, nearest sample of the slope layer
+		int sx = min(max(int(te_UV.x * heightmapWidth), 0), heightmapWidth - 1);
+		int sy = min(max(int(te_UV.y * heightmapHeight), 0), heightmapHeight - 1);
+		float steepRock = smoothstep(0.35f, 0.5f, slopes[size_t(sy) * heightmapWidth + sx] / 90.0f);
+		result = glm::mix(result, rockPhongColor, steepRock);
+
+		result = glm::clamp(result, 0.0f, 1.0f) * 255.0f + 0.5f;
+		unsigned char* c = &color[y * colorStride + size_t(x) * 3];
+		c[0] = (unsigned char)result.b;
+		c[1] = (unsigned char)result.g;
+		c[2] = (unsigned char)result.r;
+	};
+
+	for (size_t chunk = 0; chunk < chunkTriangles.size(); chunk++)
+	{
+		for (uint32_t index : chunkBins[chunk][tile])
+		{
+			const Triangle& tri = chunkTriangles[chunk][index];
+			const int minX = max(x0, tri.minX), maxX = min(x1, tri.maxX);
+			const int minY = max(y0, tri.minY), maxY = min(y1, tri.maxY);
+
+			for (int y = minY; y <= maxY; y++)
+			{
+				const float py = y + 0.5f;
+				float* depthRow = &depth[size_t(y) * depthStride];
+#if defined(SOFTRASTER_AVX2)
+				const __m256 laneOffset = _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f);
+				__m256 A[3], rowC[3], topLeftMask[3];
+				for (int i = 0; i < 3; i++)
+				{
+					A[i] = _mm256_set1_ps(tri.A[i]);
+					rowC[i] = _mm256_set1_ps(tri.B[i] * py + tri.C[i]);
+					topLeftMask[i] = _mm256_castsi256_ps(_mm256_set1_epi32(tri.topLeft[i] ? -1 : 0));
+				}
+				const __m256 zero = _mm256_setzero_ps();
+				const __m256 invArea = _mm256_set1_ps(tri.invArea);
+				const __m256 z0 = _mm256_set1_ps(tri.z[0]);
+				const __m256 dz1 = _mm256_set1_ps(tri.z[1] - tri.z[0]);
+				const __m256 dz2 = _mm256_set1_ps(tri.z[2] - tri.z[0]);
+
+				for (int x = minX; x <= maxX; x += 8)
+				{
+					__m256 px = _mm256_add_ps(_mm256_set1_ps(float(x)), laneOffset);
+					__m256 e[3];
+					// Lanes past maxX belong to the next tile (or the row padding), they are neither read nor written:
+					// a load / blend / store of all 8 lanes would race with the thread rasterizing that tile
+					const __m256 inRange = _mm256_cmp_ps(px, _mm256_set1_ps(float(maxX + 1)), _CMP_LT_OQ);
+					__m256 mask = inRange;
+					for (int i = 0; i < 3; i++)
+					{
+						e[i] = _mm256_fmadd_ps(A[i], px, rowC[i]);
+						__m256 inside = _mm256_or_ps(_mm256_cmp_ps(e[i], zero, _CMP_GT_OQ),
+							_mm256_and_ps(_mm256_cmp_ps(e[i], zero, _CMP_EQ_OQ), topLeftMask[i]));
+						mask = _mm256_and_ps(mask, inside);
+					}
+					if (_mm256_movemask_ps(mask) == 0)
+						continue;
+
+					// Depth is affine in screen space, GL_LESS test for all 8 lanes at once
+					__m256 b1 = _mm256_mul_ps(e[1], invArea);
+					__m256 b2 = _mm256_mul_ps(e[2], invArea);
+					__m256 z = _mm256_fmadd_ps(b2, dz2, _mm256_fmadd_ps(b1, dz1, z0));
+					__m256 stored = _mm256_maskload_ps(depthRow + x, _mm256_castps_si256(inRange));
+					mask = _mm256_and_ps(mask, _mm256_cmp_ps(z, stored, _CMP_LT_OQ));
+					int bits = _mm256_movemask_ps(mask);
+					if (bits == 0)
+						continue;
+					_mm256_maskstore_ps(depthRow + x, _mm256_castps_si256(mask), z);
+
+					alignas(32) float e1[8], e2[8];
+					_mm256_store_ps(e1, e[1]);
+					_mm256_store_ps(e2, e[2]);
+					while (bits)
+					{
+						int lane = __builtin_ctz(bits);
+						bits &= bits - 1;
+						shade(tri, x + lane, y, e1[lane], e2[lane]);
+					}
+				}
+#else
+				for (int x = minX; x <= maxX; x++)
+				{
+					const float px = x + 0.5f;
+					float e[3];
+					bool inside = true;
+					for (int i = 0; i < 3 && inside; i++)
+					{
+						e[i] = tri.A[i] * px + tri.B[i] * py + tri.C[i];
+						inside = e[i] > 0.0f || (e[i] == 0.0f && tri.topLeft[i]);
+					}
+					if (!inside)
+						continue;
+
+					float z = tri.z[0] + e[1] * tri.invArea * (tri.z[1] - tri.z[0]) + e[2] * tri.invArea * (tri.z[2] - tri.z[0]);
+					if (!(z < depthRow[x]))
+						continue;
+					depthRow[x] = z;
+					shade(tri, x, y, e[1], e[2]);
+				}
+#endif
+			}
+		}
+	}
+}
+
+void SoftwareBackend::ReadPixels(int w, int h, vector<unsigned char>& bgr)
+{
+	const size_t srcStride = (size_t(width) * 3 + 3) & ~size_t(3);
+	const size_t dstStride = (size_t(w) * 3 + 3) & ~size_t(3);
+	bgr.assign(dstStride * h, 0);
+	for (int y = 0; y < min(h, height); y++)
+		memcpy(&bgr[y * dstStride], &color[y * srcStride], size_t(min(w, width)) * 3);
+}
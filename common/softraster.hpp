@@ -0,0 +1,68 @@
+#ifndef SOFTRASTER_HPP
+#define SOFTRASTER_HPP
+
+#include <vector>
+#include <cstdint>
+#include "renderbackend.hpp"
+
+// CPU implementation of the terrain pipeline for hosts without a GL 4.5 context.
+// The vertex stage is a port of Basic.vert (height displacement, finite difference normal, tangent space light)
+// and the pixel stage a port of Texture.frag (height blended rock / grass / snow). Triangles are binned into
+// screen tiles, tiles are rasterized in parallel and the edge functions are evaluated 8 pixels at a time with AVX2.
+class SoftwareBackend : public RenderBackend
+{
+public:
+	// threads = 0 uses every hardware thread
+	SoftwareBackend(int width, int height, int nPoints, float scale, unsigned int threads = 0);
+	~SoftwareBackend() override;
+
+	bool Load() override;
+	void Unload() override;
+	void DrawFrame(const TerrainFrame& frame) override;
+	void ReadPixels(int width, int height, std::vector<unsigned char>& bgr) override;
+
+	// Load() from memory: the given height map and flat gray materials, no files are read
+	bool LoadHeightmap(const std::vector<int32_t>& heightmap, int heightmapWidth, int heightmapHeight);
+	// Window space depth of the last frame, width * height values, bottom row first. 1 where nothing was drawn
+	void ReadDepth(std::vector<float>& values) const;
+
+	void SetThreadCount(unsigned int threads);
+
+	struct Texture;
+	struct Vertex;
+	struct Triangle;
+
+private:
+	void buildModel();
+	void setupTriangles(int chunk);
+	void rasterizeTile(int tile);
+
+	int width, height;
+	int nPoints;
+	float scale;
+	unsigned int threadCount;
+
+	// Model
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec2> uvs;
+	std::vector<unsigned int> triangleIndices; // 3 per triangle, strip order already resolved to GL winding
+
+	// Height map as raw 24-bit values plus the material textures of Texture.frag
+	std::vector<int32_t> heights;
+	int heightmapWidth, heightmapHeight;
+	std::vector<Texture> textures;
+	// Slope layer of the terrain layer texture, rebuilt when the height scale changes
+	std::vector<float> slopes;
+	float slopesScale;
+
+	// Per frame state
+	std::vector<Vertex> vertices;
+	std::vector<std::vector<Triangle>> chunkTriangles;
+	std::vector<std::vector<std::vector<uint32_t>>> chunkBins; // [chunk][tile] -> triangles
+	int tilesX, tilesY;
+	int depthStride;
+	std::vector<float> depth;
+	std::vector<unsigned char> color;
+};
+
+#endif
@@ -0,0 +1,412 @@
+#include <algorithm>
+#include <cmath>
+
+#include "terrainedit.hpp"
+#include "heightcodec.hpp"
+using namespace std;
+
+namespace
+{
+	const int kUndoTileSize = 64;          // same as the codec tiles, one delta is a single encoded tile
+	const int32_t kMaxHeight = 0xFFFFFF;   // 24 bits, R << 16 | G << 8 | B in the texture
+}
+
+void TerrainRect::merge(const TerrainRect& other)
+{
+	if (other.empty())
+		return;
+	if (empty())
+	{
+		*this = other;
+		return;
+	}
+	x0 = min(x0, other.x0);
+	y0 = min(y0, other.y0);
+	x1 = max(x1, other.x1);
+	y1 = max(y1, other.y1);
+}
+
+TerrainEditor::TerrainEditor(int32_t* heights, int width, int height, int boundsTileSize)
+	: heights(heights), width(width), height(height), boundsTileSize(max(1, boundsTileSize)),
+	stroking(false), undoLimit(64u << 20), tilesVisited(0)
+{
+	boundsTilesX = (width + this->boundsTileSize - 1) / this->boundsTileSize;
+	boundsTilesY = (height + this->boundsTileSize - 1) / this->boundsTileSize;
+	tileMin.resize(size_t(boundsTilesX) * boundsTilesY);
+	tileMax.resize(tileMin.size());
+	TerrainRect all;
+	all.x1 = width;
+	all.y1 = height;
+	updateBounds(all);
+	tilesVisited = 0;
+}
+
+int32_t TerrainEditor::heightAt(int x, int y) const
+{
+	x = min(max(x, 0), width - 1);
+	y = min(max(y, 0), height - 1);
+	return heights[size_t(y) * width + x];
+}
+
+// Bilinear between cell centres, cell (i, j) covers [i, i + 1) x [j, j + 1)
+float TerrainEditor::sampleHeight(float x, float y) const
+{
+	x -= 0.5f;
+	y -= 0.5f;
+	int ix = int(floor(x)), iy = int(floor(y));
+	float fx = x - ix, fy = y - iy;
+	float top = heightAt(ix, iy) * (1.0f - fx) + heightAt(ix + 1, iy) * fx;
+	float bottom = heightAt(ix, iy + 1) * (1.0f - fx) + heightAt(ix + 1, iy + 1) * fx;
+	return top * (1.0f - fy) + bottom * fy;
+}
+
+void TerrainEditor::beginStroke()
+{
+	if (stroking)
+		endStroke();
+	stroking = true;
+	strokeRect = TerrainRect();
+}
+
+void TerrainEditor::saveTiles(const TerrainRect& rect)
+{
+	const int tilesX = (width + kUndoTileSize - 1) / kUndoTileSize;
+	tilesVisited += size_t((rect.y1 - 1) / kUndoTileSize - rect.y0 / kUndoTileSize + 1) *
+		size_t((rect.x1 - 1) / kUndoTileSize - rect.x0 / kUndoTileSize + 1);
+	for (int ty = rect.y0 / kUndoTileSize; ty <= (rect.y1 - 1) / kUndoTileSize; ty++)
+	{
+		for (int tx = rect.x0 / kUndoTileSize; tx <= (rect.x1 - 1) / kUndoTileSize; tx++)
+		{
+			auto inserted = strokeBefore.emplace(ty * tilesX + tx, vector<int32_t>());
+			if (!inserted.second)
+				continue;
+			const int x0 = tx * kUndoTileSize, y0 = ty * kUndoTileSize;
+			const int x1 = min(width, x0 + kUndoTileSize), y1 = min(height, y0 + kUndoTileSize);
+			vector<int32_t>& before = inserted.first->second;
+			before.reserve(size_t(x1 - x0) * (y1 - y0));
+			for (int y = y0; y < y1; y++)
+				before.insert(before.end(), heights + size_t(y) * width + x0, heights + size_t(y) * width + x1);
+		}
+	}
+}
+
+void TerrainEditor::endStroke()
+{
+	if (!stroking)
+		return;
+	stroking = false;
+
+	UndoStep step;
+	step.rect = strokeRect;
+	step.bytes = 0;
+	const int tilesX = (width + kUndoTileSize - 1) / kUndoTileSize;
+	HeightCodecOptions options;
+	options.tileSize = kUndoTileSize;
+	vector<int32_t> delta;
+	for (const auto& saved : strokeBefore)
+	{
+		DeltaTile tile;
+		tile.x0 = (saved.first % tilesX) * kUndoTileSize;
+		tile.y0 = (saved.first / tilesX) * kUndoTileSize;
+		tile.width = min(width, tile.x0 + kUndoTileSize) - tile.x0;
+		tile.height = min(height, tile.y0 + kUndoTileSize) - tile.y0;
+
+		delta.resize(size_t(tile.width) * tile.height);
+		bool changed = false;
+		for (int y = 0; y < tile.height; y++)
+		{
+			const int32_t* now = heights + size_t(tile.y0 + y) * width + tile.x0;
+			const int32_t* before = &saved.second[size_t(y) * tile.width];
+			for (int x = 0; x < tile.width; x++)
+			{
+				delta[size_t(y) * tile.width + x] = now[x] - before[x];
+				changed |= now[x] != before[x];
+			}
+		}
+		if (!changed)
+			continue;
+		// Deltas are smooth and mostly zero, the planar predictor of the codec packs them into a few bits
+		encodeHeights(delta.data(), tile.width, tile.height, options, tile.delta);
+		step.bytes += tile.delta.size();
+		step.tiles.push_back(move(tile));
+	}
+	strokeBefore.clear();
+
+	if (step.tiles.empty())
+		return;
+	undoSteps.push_back(move(step));
+	redoSteps.clear();
+	setUndoLimit(undoLimit);
+}
+
+void TerrainEditor::setUndoLimit(size_t bytes)
+{
+	undoLimit = bytes;
+	size_t total = undoBytes();
+	size_t dropped = 0;
+	while (dropped + 1 < undoSteps.size() && total > undoLimit)
+		total -= undoSteps[dropped++].bytes;
+	undoSteps.erase(undoSteps.begin(), undoSteps.begin() + dropped);
+}
+
+size_t TerrainEditor::undoBytes() const
+{
+	size_t total = 0;
+	for (const UndoStep& step : undoSteps)
+		total += step.bytes;
+	for (const UndoStep& step : redoSteps)
+		total += step.bytes;
+	return total;
+}
+
+TerrainRect TerrainEditor::applyBrush(const TerrainBrush& brush, float x, float y)
+{
+	const float radius = max(0.5f, brush.radius);
+	TerrainRect rect;
+	rect.x0 = max(0, int(floor(x - radius)));
+	rect.y0 = max(0, int(floor(y - radius)));
+	rect.x1 = min(width, int(ceil(x + radius)) + 1);
+	rect.y1 = min(height, int(ceil(y + radius)) + 1);
+	if (rect.empty())
+		return TerrainRect();
+
+	const bool ownStroke = !stroking;
+	if (ownStroke)
+		beginStroke();
+	saveTiles(rect);
+
+	// Smoothing reads the neighbours from before the dab, grown by one cell and clamped to the map
+	const int sx0 = max(0, rect.x0 - 1), sy0 = max(0, rect.y0 - 1);
+	const int sx1 = min(width, rect.x1 + 1), sy1 = min(height, rect.y1 + 1);
+	const int sw = sx1 - sx0;
+	if (brush.mode == BRUSH_SMOOTH)
+	{
+		scratch.resize(size_t(sw) * (sy1 - sy0));
+		for (int sy = sy0; sy < sy1; sy++)
+			copy(heights + size_t(sy) * width + sx0, heights + size_t(sy) * width + sx1, &scratch[size_t(sy - sy0) * sw]);
+	}
+	auto source = [&](int cx, int cy) {
+		cx = min(max(cx, sx0), sx1 - 1);
+		cy = min(max(cy, sy0), sy1 - 1);
+		return scratch[size_t(cy - sy0) * sw + (cx - sx0)];
+	};
+
+	// The cells that actually change, the footprint corners and clamped heights do not
+	TerrainRect changed;
+	changed.x0 = rect.x1;
+	changed.y0 = rect.y1;
+	const float invRadius2 = 1.0f / (radius * radius);
+	const float blend = min(1.0f, max(0.0f, brush.strength));
+	for (int cy = rect.y0; cy < rect.y1; cy++)
+	{
+		int32_t* row = heights + size_t(cy) * width;
+		const float ddy = cy + 0.5f - y;
+		for (int cx = rect.x0; cx < rect.x1; cx++)
+		{
+			const float ddx = cx + 0.5f - x;
+			const float t = (ddx * ddx + ddy * ddy) * invRadius2;
+			if (t >= 1.0f)
+				continue;
+			const float weight = (1.0f - t) * (1.0f - t);
+			const float h = float(row[cx]);
+			float value = h;
+			switch (brush.mode)
+			{
+			case BRUSH_RAISE:
+				value = h + brush.strength * weight;
+				break;
+			case BRUSH_LOWER:
+				value = h - brush.strength * weight;
+				break;
+			case BRUSH_SMOOTH:
+			{
+				int64_t sum = 0;
+				for (int ny = -1; ny <= 1; ny++)
+					for (int nx = -1; nx <= 1; nx++)
+						sum += source(cx + nx, cy + ny);
+				value = h + (float(sum) / 9.0f - h) * blend * weight;
+				break;
+			}
+			case BRUSH_FLATTEN:
+				value = h + (float(brush.flattenHeight) - h) * blend * weight;
+				break;
+			}
+			const int32_t result = int32_t(min(float(kMaxHeight), max(0.0f, floor(value + 0.5f))));
+			if (result == row[cx])
+				continue;
+			row[cx] = result;
+			changed.x0 = min(changed.x0, cx);
+			changed.y0 = min(changed.y0, cy);
+			changed.x1 = max(changed.x1, cx + 1);
+			changed.y1 = max(changed.y1, cy + 1);
+		}
+	}
+
+	if (changed.empty())
+		changed = TerrainRect();
+	strokeRect.merge(changed);
+	dirty.merge(changed);
+	updateBounds(changed);
+	if (ownStroke)
+		endStroke();
+	return changed;
+}
+
+void TerrainEditor::applyStep(const UndoStep& step, int sign)
+{
+	int w, h;
+	vector<int32_t> delta;
+	for (const DeltaTile& tile : step.tiles)
+	{
+		if (!decodeHeights(tile.delta.data(), tile.delta.size(), w, h, delta) || w != tile.width || h != tile.height)
+			continue;
+		for (int y = 0; y < h; y++)
+		{
+			int32_t* row = heights + size_t(tile.y0 + y) * width + tile.x0;
+			for (int x = 0; x < w; x++)
+				row[x] += sign * delta[size_t(y) * w + x];
+		}
+	}
+	dirty.merge(step.rect);
+	updateBounds(step.rect);
+}
+
+bool TerrainEditor::undo()
+{
+	endStroke();
+	if (undoSteps.empty())
+		return false;
+	applyStep(undoSteps.back(), -1);
+	redoSteps.push_back(move(undoSteps.back()));
+	undoSteps.pop_back();
+	return true;
+}
+
+bool TerrainEditor::redo()
+{
+	endStroke();
+	if (redoSteps.empty())
+		return false;
+	applyStep(redoSteps.back(), 1);
+	undoSteps.push_back(move(redoSteps.back()));
+	redoSteps.pop_back();
+	return true;
+}
+
+TerrainRect TerrainEditor::takeDirty()
+{
+	TerrainRect rect = dirty;
+	dirty = TerrainRect();
+	return rect;
+}
+
+void TerrainEditor::updateBounds(const TerrainRect& rect)
+{
+	if (rect.empty())
+		return;
+	tilesVisited += size_t((rect.y1 - 1) / boundsTileSize - rect.y0 / boundsTileSize + 1) *
+		size_t((rect.x1 - 1) / boundsTileSize - rect.x0 / boundsTileSize + 1);
+	for (int ty = rect.y0 / boundsTileSize; ty <= (rect.y1 - 1) / boundsTileSize; ty++)
+	{
+		for (int tx = rect.x0 / boundsTileSize; tx <= (rect.x1 - 1) / boundsTileSize; tx++)
+		{
+			const int x0 = tx * boundsTileSize, x1 = min(width, x0 + boundsTileSize);
+			const int y0 = ty * boundsTileSize, y1 = min(height, y0 + boundsTileSize);
+			int32_t lo = kMaxHeight, hi = 0;
+			for (int y = y0; y < y1; y++)
+			{
+				const int32_t* row = heights + size_t(y) * width;
+				for (int x = x0; x < x1; x++)
+				{
+					lo = min(lo, row[x]);
+					hi = max(hi, row[x]);
+				}
+			}
+			tileMin[size_t(ty) * boundsTilesX + tx] = lo;
+			tileMax[size_t(ty) * boundsTilesX + tx] = hi;
+		}
+	}
+}
+
+bool TerrainEditor::raycast(float ox, float oy, float oh, float dx, float dy, float dh, float maxDistance, float& hitX, float& hitY) const
+{
+	const float length = sqrt(dx * dx + dy * dy);
+	if (length < 1e-6f)
+	{
+		// Straight down onto the cell below
+		if (dh >= 0.0f || ox < 0.0f || oy < 0.0f || ox >= width || oy >= height || oh < sampleHeight(ox, oy))
+			return false;
+		hitX = ox;
+		hitY = oy;
+		return true;
+	}
+	// One unit of t is one cell horizontally
+	dx /= length;
+	dy /= length;
+	dh /= length;
+
+	// Clip to the map
+	float tEnter = 0.0f, tExit = maxDistance;
+	auto clip = [&](float o, float d, float size) {
+		if (fabs(d) < 1e-9f)
+			return o >= 0.0f && o <= size;
+		float a = (0.0f - o) / d, b = (size - o) / d;
+		tEnter = max(tEnter, min(a, b));
+		tExit = min(tExit, max(a, b));
+		return true;
+	};
+	if (!clip(ox, dx, float(width)) || !clip(oy, dy, float(height)) || tEnter >= tExit)
+		return false;
+
+	auto above = [&](float t) { return oh + dh * t >= sampleHeight(ox + dx * t, oy + dy * t); };
+	if (!above(tEnter))
+		return false;
+
+	const float step = 0.25f;
+	float t = tEnter;
+	while (t < tExit)
+	{
+		const float px = ox + dx * t, py = oy + dy * t;
+		const int tx = min(boundsTilesX - 1, max(0, int(px) / boundsTileSize));
+		const int ty = min(boundsTilesY - 1, max(0, int(py) / boundsTileSize));
+
+		// Where the ray leaves the bounds tile
+		float tTile = tExit;
+		if (dx > 0.0f) tTile = min(tTile, t + ((tx + 1) * boundsTileSize - px) / dx);
+		if (dx < 0.0f) tTile = min(tTile, t + (tx * boundsTileSize - px) / dx);
+		if (dy > 0.0f) tTile = min(tTile, t + ((ty + 1) * boundsTileSize - py) / dy);
+		if (dy < 0.0f) tTile = min(tTile, t + (ty * boundsTileSize - py) / dy);
+		tTile = max(tTile, t + 1e-3f);
+
+		// Skip the segment when it passes over the highest cell of the tile. Filtering near the tile edges also
+		// reads the cells of the surrounding tiles
+		const float lowest = min(oh + dh * t, oh + dh * tTile);
+		int32_t highest = 0;
+		for (int ny = max(ty - 1, 0); ny <= min(ty + 1, boundsTilesY - 1); ny++)
+			for (int nx = max(tx - 1, 0); nx <= min(tx + 1, boundsTilesX - 1); nx++)
+				highest = max(highest, tileMaxHeight(nx, ny));
+		if (lowest <= float(highest))
+		{
+			for (float previous = t, s = min(t + step, tTile); ; previous = s, s = min(s + step, tTile))
+			{
+				if (!above(s))
+				{
+					// Refine between the last sample above and the first one below
+					float a = previous, b = s;
+					for (int i = 0; i < 8; i++)
+					{
+						float m = 0.5f * (a + b);
+						(above(m) ? a : b) = m;
+					}
+					hitX = ox + dx * b;
+					hitY = oy + dy * b;
+					return true;
+				}
+				if (s >= tTile)
+					break;
+			}
+		}
+		t = tTile;
+	}
+	return false;
+}
@@ -0,0 +1,114 @@
+#ifndef TERRAINEDIT_HPP
+#define TERRAINEDIT_HPP
+
+#include <vector>
+#include <unordered_map>
+#include <cstddef>
+#include <cstdint>
+
+// Brush based sculpting of the CPU height buffer (heights as returned by unpackHeightsBGR). Every operation only
+// touches the cells under the brush: edits are reported as dirty rectangles for incremental uploads, the per tile
+// min / max bounds are refreshed for the touched tiles only, and undo steps are stored as compressed deltas of the
+// tiles a stroke changed. Nothing here depends on GL.
+
+enum BrushMode
+{
+	BRUSH_RAISE,
+	BRUSH_LOWER,
+	BRUSH_SMOOTH,    // towards the 3x3 mean
+	BRUSH_FLATTEN    // towards flattenHeight
+};
+
+struct TerrainBrush
+{
+	BrushMode mode = BRUSH_RAISE;
+	float radius = 16.0f;        // in cells, the weight falls off smoothly to 0 at the radius
+	float strength = 1.0f;       // raise / lower: height units at the centre, smooth / flatten: blend factor (0, 1]
+	int32_t flattenHeight = 0;
+};
+
+// Cells [x0, x1) x [y0, y1)
+struct TerrainRect
+{
+	int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+
+	bool empty() const { return x0 >= x1 || y0 >= y1; }
+	void merge(const TerrainRect& other);
+};
+
+class TerrainEditor
+{
+public:
+	// heights stays owned by the caller and must outlive the editor. Heights are kept in the 24 bit range of the texture
+	TerrainEditor(int32_t* heights, int width, int height, int boundsTileSize = 16);
+
+	// A stroke groups any number of dabs into one undo step
+	void beginStroke();
+	void endStroke();
+	bool inStroke() const { return stroking; }
+
+	// One dab centred on cell (x, y), outside a stroke it is a stroke of its own. Returns the bounding rectangle
+	// of the cells whose height changed, empty when none did
+	TerrainRect applyBrush(const TerrainBrush& brush, float x, float y);
+
+	bool undo();
+	bool redo();
+	bool canUndo() const { return !undoSteps.empty(); }
+	bool canRedo() const { return !redoSteps.empty(); }
+	// Oldest steps are dropped once their compressed size exceeds the limit
+	void setUndoLimit(size_t bytes);
+	size_t undoBytes() const;
+
+	// Union of everything changed since the last call (dabs, undo, redo), cleared by the call
+	TerrainRect takeDirty();
+	// Undo tiles saved and bounds tiles refreshed by the edits so far: the work of a stroke, independent of the map size
+	size_t getTilesVisited() const { return tilesVisited; }
+
+	int32_t heightAt(int x, int y) const;
+	// Conservative height range of the cells of a bounds tile, kept current for every edit
+	int getBoundsTileSize() const { return boundsTileSize; }
+	int32_t tileMinHeight(int tx, int ty) const { return tileMin[size_t(ty) * boundsTilesX + tx]; }
+	int32_t tileMaxHeight(int tx, int ty) const { return tileMax[size_t(ty) * boundsTilesX + tx]; }
+
+	// First crossing of a ray with the height field, in cells and height units: the origin is (ox, oy, oh), the
+	// direction (dx, dy, dh) and at most maxDistance cells are walked horizontally. Bounds tiles entirely below
+	// the ray are skipped. Returns false when nothing is hit.
+	bool raycast(float ox, float oy, float oh, float dx, float dy, float dh, float maxDistance, float& hitX, float& hitY) const;
+
+private:
+	// Compressed (encodeHeights) difference of one undo tile, after minus before
+	struct DeltaTile
+	{
+		int x0, y0, width, height;
+		std::vector<unsigned char> delta;
+	};
+	struct UndoStep
+	{
+		std::vector<DeltaTile> tiles;
+		TerrainRect rect;
+		size_t bytes;
+	};
+
+	void saveTiles(const TerrainRect& rect);
+	void updateBounds(const TerrainRect& rect);
+	void applyStep(const UndoStep& step, int sign);
+	float sampleHeight(float x, float y) const;
+
+	int32_t* heights;
+	int width, height;
+
+	int boundsTileSize, boundsTilesX, boundsTilesY;
+	std::vector<int32_t> tileMin, tileMax;
+
+	bool stroking;
+	TerrainRect strokeRect;
+	std::unordered_map<int, std::vector<int32_t>> strokeBefore; // original heights of the undo tiles touched so far
+	std::vector<UndoStep> undoSteps, redoSteps;
+	size_t undoLimit;
+
+	TerrainRect dirty;
+	std::vector<int32_t> scratch;
+	size_t tilesVisited;
+};
+
+#endif
@@ -0,0 +1,426 @@
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#define TERRAINLAYERS_AVX2 1
+#include <immintrin.h>
+#endif
+
+#include "terrainlayers.hpp"
+#include "jobsystem.hpp"
+using namespace std;
+
+namespace
+{
+	const float kPi = 3.14159265358979f;
+	const float kRadToDeg = 180.0f / kPi;
+
+	// D8 neighbours, same order as the direction codes
+	const int kFlowDX[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+	const int kFlowDY[8] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+	const float kFlowWeight[8] = { 1.0f, 0.70710678f, 1.0f, 0.70710678f, 1.0f, 0.70710678f, 1.0f, 0.70710678f };
+
+	// Rows [y0, y1) and columns [x0, x1) of a tile
+	struct Tile
+	{
+		int x0, y0, x1, y1;
+	};
+
+	// Tiles covering [x0, x1) x [y0, y1)
+	template<typename F>
+	void forEachTile(int x0, int y0, int x1, int y1, const TerrainLayerOptions& options, F&& fn)
+	{
+		const int size = max(16, options.tileSize);
+		const int tilesX = (x1 - x0 + size - 1) / size;
+		const int tilesY = (y1 - y0 + size - 1) / size;
+		jobSystem().parallelFor(tilesX * tilesY, options.threads, [&](int i) {
+			Tile tile;
+			tile.x0 = x0 + (i % tilesX) * size;
+			tile.y0 = y0 + (i / tilesX) * size;
+			tile.x1 = min(x1, tile.x0 + size);
+			tile.y1 = min(y1, tile.y0 + size);
+			fn(tile);
+		});
+	}
+
+	template<typename F>
+	void forEachTile(int width, int height, const TerrainLayerOptions& options, F&& fn)
+	{
+		forEachTile(0, 0, width, height, options, fn);
+	}
+
+	// atan on [0, 1], minimax polynomial, error below 1e-5 degrees. The SIMD path uses the same coefficients
+	// so border and interior cells agree.
+	inline float atanUnit(float a)
+	{
+		float s = a * a;
+		return a * (0.99997726f + s * (-0.33262347f + s * (0.19354346f + s * (-0.11643287f + s * (0.05265332f + s * -0.01172120f)))));
+	}
+
+	inline float atan2Approx(float y, float x)
+	{
+		float ax = fabs(x), ay = fabs(y);
+		float mx = max(ax, ay), mn = min(ax, ay);
+		float r = mx > 0.0f ? atanUnit(mn / mx) : 0.0f;
+		if (ay > ax) r = 0.5f * kPi - r;
+		if (x < 0.0f) r = kPi - r;
+		if (y < 0.0f) r = -r;
+		return r;
+	}
+
+	struct SurfaceScale
+	{
+		float gradient;     // Horn sums to dz/dx
+		float curvature;    // second differences to curvature * 100
+	};
+
+	inline SurfaceScale surfaceScale(const TerrainLayerOptions& options)
+	{
+		SurfaceScale s;
+		s.gradient = options.zFactor / (8.0f * options.cellSize);
+		s.curvature = 100.0f * options.zFactor / (options.cellSize * options.cellSize);
+		return s;
+	}
+
+	// One cell from its 3x3 neighbourhood
+	//   a b c
+	//   d e f      rows: y - 1, y, y + 1
+	//   g h i
+	inline void surfaceCell(int32_t a, int32_t b, int32_t c, int32_t d, int32_t e, int32_t f, int32_t g, int32_t h, int32_t i,
+		const SurfaceScale& scale, float& slope, float& aspect, float& curvature)
+	{
+		float dzdx = float((c + 2 * f + i) - (a + 2 * d + g)) * scale.gradient;
+		float dzdy = float((g + 2 * h + i) - (a + 2 * b + c)) * scale.gradient;
+		slope = atan2Approx(sqrt(dzdx * dzdx + dzdy * dzdy), 1.0f) * kRadToDeg;
+
+		// Downhill direction, -1 when there is none
+		if (dzdx == 0.0f && dzdy == 0.0f)
+			aspect = -1.0f;
+		else
+		{
+			aspect = atan2Approx(-dzdy, -dzdx) * kRadToDeg;
+			if (aspect < 0.0f)
+				aspect += 360.0f;
+		}
+
+		// -2 (D + E) with D = ((d + f) / 2 - e) / L^2 and E = ((b + h) / 2 - e) / L^2
+		curvature = -float((d + f - 2 * e) + (b + h - 2 * e)) * scale.curvature;
+	}
+
+	void surfaceScalar(const int32_t* heights, int width, int height, int x, int y, const SurfaceScale& scale,
+		float& slope, float& aspect, float& curvature)
+	{
+		int xm = max(x - 1, 0), xp = min(x + 1, width - 1);
+		const int32_t* above = heights + size_t(max(y - 1, 0)) * width;
+		const int32_t* row = heights + size_t(y) * width;
+		const int32_t* below = heights + size_t(min(y + 1, height - 1)) * width;
+		surfaceCell(above[xm], above[x], above[xp], row[xm], row[x], row[xp], below[xm], below[x], below[xp],
+			scale, slope, aspect, curvature);
+	}
+
+#if defined(TERRAINLAYERS_AVX2)
+	inline __m256 atanUnit8(__m256 a)
+	{
+		__m256 s = _mm256_mul_ps(a, a);
+		__m256 p = _mm256_fmadd_ps(s, _mm256_set1_ps(-0.01172120f), _mm256_set1_ps(0.05265332f));
+		p = _mm256_fmadd_ps(s, p, _mm256_set1_ps(-0.11643287f));
+		p = _mm256_fmadd_ps(s, p, _mm256_set1_ps(0.19354346f));
+		p = _mm256_fmadd_ps(s, p, _mm256_set1_ps(-0.33262347f));
+		p = _mm256_fmadd_ps(s, p, _mm256_set1_ps(0.99997726f));
+		return _mm256_mul_ps(a, p);
+	}
+
+	inline __m256 atan2Approx8(__m256 y, __m256 x)
+	{
+		const __m256 signMask = _mm256_set1_ps(-0.0f);
+		const __m256 zero = _mm256_setzero_ps();
+		__m256 ax = _mm256_andnot_ps(signMask, x), ay = _mm256_andnot_ps(signMask, y);
+		__m256 mx = _mm256_max_ps(ax, ay), mn = _mm256_min_ps(ax, ay);
+		__m256 r = _mm256_and_ps(atanUnit8(_mm256_div_ps(mn, mx)), _mm256_cmp_ps(mx, zero, _CMP_GT_OQ));
+		r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(0.5f * kPi), r), _mm256_cmp_ps(ay, ax, _CMP_GT_OQ));
+		r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(kPi), r), _mm256_cmp_ps(x, zero, _CMP_LT_OQ));
+		return _mm256_blendv_ps(r, _mm256_xor_ps(r, signMask), _mm256_cmp_ps(y, zero, _CMP_LT_OQ));
+	}
+
+	// Cells [x, x + 8) of a row, x - 1 and x + 8 must be inside the row. The outputs point at the slot of column x
+	inline void surface8(const int32_t* above, const int32_t* row, const int32_t* below, int x, const SurfaceScale& scale,
+		float* slope, float* aspect, float* curvature)
+	{
+		auto load = [](const int32_t* p) { return _mm256_loadu_si256((const __m256i*)p); };
+		__m256i a = load(above + x - 1), b = load(above + x), c = load(above + x + 1);
+		__m256i d = load(row + x - 1), e = load(row + x), f = load(row + x + 1);
+		__m256i g = load(below + x - 1), h = load(below + x), i = load(below + x + 1);
+
+		__m256i right = _mm256_add_epi32(_mm256_add_epi32(c, i), _mm256_slli_epi32(f, 1));
+		__m256i left = _mm256_add_epi32(_mm256_add_epi32(a, g), _mm256_slli_epi32(d, 1));
+		__m256i bottom = _mm256_add_epi32(_mm256_add_epi32(g, i), _mm256_slli_epi32(h, 1));
+		__m256i top = _mm256_add_epi32(_mm256_add_epi32(a, c), _mm256_slli_epi32(b, 1));
+		__m256 gradientScale = _mm256_set1_ps(scale.gradient);
+		__m256 dzdx = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(right, left)), gradientScale);
+		__m256 dzdy = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(bottom, top)), gradientScale);
+		const __m256 degrees = _mm256_set1_ps(kRadToDeg);
+		const __m256 zero = _mm256_setzero_ps();
+
+		if (slope)
+		{
+			__m256 magnitude = _mm256_sqrt_ps(_mm256_fmadd_ps(dzdx, dzdx, _mm256_mul_ps(dzdy, dzdy)));
+			_mm256_storeu_ps(slope, _mm256_mul_ps(atan2Approx8(magnitude, _mm256_set1_ps(1.0f)), degrees));
+		}
+		if (aspect)
+		{
+			const __m256 signMask = _mm256_set1_ps(-0.0f);
+			__m256 angle = _mm256_mul_ps(atan2Approx8(_mm256_xor_ps(dzdy, signMask), _mm256_xor_ps(dzdx, signMask)), degrees);
+			angle = _mm256_add_ps(angle, _mm256_and_ps(_mm256_cmp_ps(angle, zero, _CMP_LT_OQ), _mm256_set1_ps(360.0f)));
+			__m256 flat = _mm256_and_ps(_mm256_cmp_ps(dzdx, zero, _CMP_EQ_OQ), _mm256_cmp_ps(dzdy, zero, _CMP_EQ_OQ));
+			_mm256_storeu_ps(aspect, _mm256_blendv_ps(angle, _mm256_set1_ps(-1.0f), flat));
+		}
+		if (curvature)
+		{
+			__m256i twoE = _mm256_slli_epi32(e, 1);
+			__m256i sum = _mm256_add_epi32(_mm256_sub_epi32(_mm256_add_epi32(d, f), twoE), _mm256_sub_epi32(_mm256_add_epi32(b, h), twoE));
+			_mm256_storeu_ps(curvature, _mm256_mul_ps(_mm256_cvtepi32_ps(sum), _mm256_set1_ps(-scale.curvature)));
+		}
+	}
+
+	// Flow directions of cells [x, x + 8) of an interior row: the neighbour rows and columns must exist
+	inline void flow8(const int32_t* heights, int width, size_t index, unsigned char* directions)
+	{
+		__m256 center = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)(heights + index)));
+		__m256 best = _mm256_setzero_ps();
+		__m256i code = _mm256_set1_epi32(kNoFlow);
+		for (int k = 0; k < 8; k++)
+		{
+			const int32_t* neighbour = heights + index + ptrdiff_t(kFlowDY[k]) * width + kFlowDX[k];
+			__m256 drop = _mm256_mul_ps(_mm256_sub_ps(center, _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)neighbour))),
+				_mm256_set1_ps(kFlowWeight[k]));
+			__m256 steeper = _mm256_cmp_ps(drop, best, _CMP_GT_OQ);
+			best = _mm256_max_ps(best, drop);
+			code = _mm256_blendv_epi8(code, _mm256_set1_epi32(k), _mm256_castps_si256(steeper));
+		}
+		// 8 x int32 codes down to 8 bytes
+		__m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(code), _mm256_extracti128_si256(code, 1));
+		_mm_storel_epi64((__m128i*)(directions + index), _mm_packus_epi16(packed, packed));
+	}
+#endif
+
+	// Cells [x0, x1) of row y, the outputs hold x1 - x0 values starting with column x0 and may be null
+	void surfaceRow(const int32_t* heights, int width, int height, int y, int x0, int x1, const SurfaceScale& scale,
+		float* slope, float* aspect, float* curvature)
+	{
+		// Scratch outputs for the layers the caller does not want
+		float unusedSlope, unusedAspect, unusedCurvature;
+		auto scalarCell = [&](int x) {
+			const int i = x - x0;
+			surfaceScalar(heights, width, height, x, y, scale,
+				slope ? slope[i] : unusedSlope, aspect ? aspect[i] : unusedAspect, curvature ? curvature[i] : unusedCurvature);
+		};
+
+		int x = x0;
+#if defined(TERRAINLAYERS_AVX2)
+		// Columns 0 and width - 1 need clamped neighbours, everything in between goes 8 at a time
+		if (x == 0)
+			scalarCell(x++);
+		const int32_t* above = heights + size_t(max(y - 1, 0)) * width;
+		const int32_t* row = heights + size_t(y) * width;
+		const int32_t* below = heights + size_t(min(y + 1, height - 1)) * width;
+		const int simdEnd = min(x1, width - 1);
+		for (; x + 8 <= simdEnd; x += 8)
+		{
+			const int i = x - x0;
+			surface8(above, row, below, x, scale, slope ? slope + i : nullptr, aspect ? aspect + i : nullptr,
+				curvature ? curvature + i : nullptr);
+		}
+#endif
+		for (; x < x1; x++)
+			scalarCell(x);
+	}
+
+	// Texel channels, see packTerrainLayers
+	inline unsigned char packSlope(float slope)
+	{
+		return (unsigned char)(min(max(slope, 0.0f), 90.0f) * (255.0f / 90.0f) + 0.5f);
+	}
+
+	inline unsigned char packAspect(float aspect)
+	{
+		return aspect < 0.0f ? 0 : (unsigned char)(1.0f + aspect * (254.0f / 360.0f) + 0.5f);
+	}
+
+	inline unsigned char packCurvature(float curvature, float curvatureScale)
+	{
+		return (unsigned char)(128.0f + min(max(curvature * curvatureScale, -127.0f), 127.0f) + 0.5f);
+	}
+
+	unsigned char flowScalar(const int32_t* heights, int width, int height, int x, int y)
+	{
+		const float center = float(heights[size_t(y) * width + x]);
+		float best = 0.0f;
+		unsigned char code = kNoFlow;
+		for (int k = 0; k < 8; k++)
+		{
+			int nx = x + kFlowDX[k], ny = y + kFlowDY[k];
+			if (nx < 0 || ny < 0 || nx >= width || ny >= height)
+				continue;
+			float drop = (center - float(heights[size_t(ny) * width + nx])) * kFlowWeight[k];
+			if (drop > best)
+			{
+				best = drop;
+				code = (unsigned char)k;
+			}
+		}
+		return code;
+	}
+}
+
+void computeSlopeAspectCurvature(const int32_t* heights, int width, int height, const TerrainLayerOptions& options,
+	float* slope, float* aspect, float* curvature)
+{
+	const SurfaceScale scale = surfaceScale(options);
+	forEachTile(width, height, options, [&](const Tile& tile) {
+		for (int y = tile.y0; y < tile.y1; y++)
+		{
+			const size_t rowStart = size_t(y) * width + tile.x0;
+			surfaceRow(heights, width, height, y, tile.x0, tile.x1, scale, slope ? slope + rowStart : nullptr,
+				aspect ? aspect + rowStart : nullptr, curvature ? curvature + rowStart : nullptr);
+		}
+	});
+}
+
+void computeFlowDirections(const int32_t* heights, int width, int height, const TerrainLayerOptions& options, unsigned char* directions)
+{
+	forEachTile(width, height, options, [&](const Tile& tile) {
+		for (int y = tile.y0; y < tile.y1; y++)
+		{
+			int x = tile.x0;
+#if defined(TERRAINLAYERS_AVX2)
+			if (y > 0 && y < height - 1)
+			{
+				if (x == 0)
+				{
+					directions[size_t(y) * width] = flowScalar(heights, width, height, 0, y);
+					x++;
+				}
+				const int simdEnd = min(tile.x1, width - 1);
+				for (; x + 8 <= simdEnd; x += 8)
+					flow8(heights, width, size_t(y) * width + x, directions);
+			}
+#endif
+			for (; x < tile.x1; x++)
+				directions[size_t(y) * width + x] = flowScalar(heights, width, height, x, y);
+		}
+	});
+}
+
+void computeFlowAccumulation(const int32_t* heights, int width, int height, const TerrainLayerOptions& options, uint32_t* accumulation)
+{
+	const size_t count = size_t(width) * height;
+	vector<unsigned char> directions(count);
+	computeFlowDirections(heights, width, height, options, directions.data());
+
+	int offset[8];
+	for (int k = 0; k < 8; k++)
+		offset[k] = kFlowDY[k] * width + kFlowDX[k];
+
+	// Number of neighbours still to drain into each cell, at most 8
+	vector<unsigned char> pending(count, 0);
+	for (size_t i = 0; i < count; i++)
+		if (directions[i] != kNoFlow)
+			pending[i + offset[directions[i]]]++;
+
+	// Topological order without a queue: a chain starts at every cell nothing drains into and follows the flow
+	// downstream for as long as the next cell has received everything from upstream. Finished chain cells are
+	// marked so the scan does not start from them again.
+	const unsigned char kDone = 0xff;
+	fill(accumulation, accumulation + count, 1u);
+	for (size_t i = 0; i < count; i++)
+	{
+		if (pending[i] != 0)
+			continue;
+		size_t cell = i;
+		while (directions[cell] != kNoFlow)
+		{
+			size_t target = cell + offset[directions[cell]];
+			accumulation[target] += accumulation[cell];
+			if (--pending[target] != 0)
+				break;
+			pending[target] = kDone;
+			cell = target;
+		}
+	}
+}
+
+void packTerrainLayers(const float* slope, const float* aspect, const float* curvature, const uint32_t* accumulation,
+	int width, int height, const TerrainLayerOptions& options, vector<unsigned char>& rgba)
+{
+	const size_t count = size_t(width) * height;
+	rgba.assign(count * 4, 0);
+
+	float curvatureRange = options.curvatureRange;
+	if (curvatureRange <= 0.0f && curvature)
+		curvatureRange = terrainCurvatureRange(curvature, count);
+	float curvatureScale = curvatureRange > 0.0f ? 127.0f / curvatureRange : 0.0f;
+
+	uint32_t maxAccumulation = 1;
+	if (accumulation)
+		maxAccumulation = max(maxAccumulation, *max_element(accumulation, accumulation + count));
+	float flowScale = maxAccumulation > 1 ? 255.0f / log2(float(maxAccumulation)) : 0.0f;
+
+	jobSystem().parallelFor(height, options.threads, [&](int y) {
+		for (size_t i = size_t(y) * width; i < size_t(y + 1) * width; i++)
+		{
+			unsigned char* texel = &rgba[i * 4];
+			if (slope)
+				texel[0] = packSlope(slope[i]);
+			if (aspect)
+				texel[1] = packAspect(aspect[i]);
+			if (curvature)
+				texel[2] = packCurvature(curvature[i], curvatureScale);
+			if (accumulation)
+				texel[3] = (unsigned char)(min(255.0f, log2(float(accumulation[i])) * flowScale) + 0.5f);
+		}
+	});
+}
+
+float terrainCurvatureRange(const float* curvature, size_t count)
+{
+	// Curvature is unbounded, the mean magnitude maps to a quarter of the half range
+	double sum = 0;
+	for (size_t i = 0; i < count; i++)
+		sum += fabs(curvature[i]);
+	return float(4.0 * sum / max<size_t>(count, 1));
+}
+
+void updateTerrainLayersRegion(const int32_t* heights, int width, int height, const TerrainLayerOptions& options,
+	int x0, int y0, int x1, int y1, vector<unsigned char>& rgba)
+{
+	x0 = max(x0, 0);
+	y0 = max(y0, 0);
+	x1 = min(x1, width);
+	y1 = min(y1, height);
+	if (x0 >= x1 || y0 >= y1 || rgba.size() != size_t(width) * height * 4)
+		return;
+
+	const SurfaceScale scale = surfaceScale(options);
+	const float curvatureScale = options.curvatureRange > 0.0f ? 127.0f / options.curvatureRange : 0.0f;
+	forEachTile(x0, y0, x1, y1, options, [&](const Tile& tile) {
+		// One tile row of scratch per worker, reused by every edit: the cost follows the brush, not the map width
+		thread_local vector<float> scratch;
+		const int columns = tile.x1 - tile.x0;
+		if (scratch.size() < size_t(columns) * 3)
+			scratch.resize(size_t(columns) * 3);
+		float* slope = scratch.data();
+		float* aspect = slope + columns;
+		float* curvature = aspect + columns;
+		for (int y = tile.y0; y < tile.y1; y++)
+		{
+			surfaceRow(heights, width, height, y, tile.x0, tile.x1, scale, slope, aspect, curvature);
+			unsigned char* texel = &rgba[(size_t(y) * width + tile.x0) * 4];
+			for (int i = 0; i < columns; i++, texel += 4)
+			{
+				texel[0] = packSlope(slope[i]);
+				texel[1] = packAspect(aspect[i]);
+				texel[2] = packCurvature(curvature[i], curvatureScale);
+			}
+		}
+	});
+}
@@ -0,0 +1,53 @@
+#ifndef TERRAINLAYERS_HPP
+#define TERRAINLAYERS_HPP
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Derived terrain layers computed on the CPU from the decoded heightmap (heights as returned by unpackHeightsBGR).
+// Every layer is a width * height raster in the same row order as the heights. The local layers are evaluated on
+// the 3x3 neighbourhood of each cell, rows are processed in tiles on all threads and 8 cells at a time with AVX2.
+// Cells on the map border repeat the edge heights.
+
+struct TerrainLayerOptions
+{
+	float cellSize = 1.0f;          // horizontal distance between two cells
+	float zFactor = 1.0f;           // height map units to horizontal units
+	int tileSize = 256;             // tile edge in cells, one tile per task
+	unsigned int threads = 0;       // 0 = every hardware thread
+	float curvatureRange = 0.0f;    // packTerrainLayers: curvature mapped to the full byte range, 0 = from the data
+};
+
+// D8 flow directions: index into the 8 neighbours E, SE, S, SW, W, NW, N, NE (S = next row), kNoFlow for pits and flats
+const unsigned char kNoFlow = 255;
+
+// Horn's method: slope in degrees, aspect in degrees counterclockwise from the +x (column) axis towards +y (row)
+// and pointing downhill, -1 where the terrain is flat. Curvature is the Zevenbergen & Thorne general curvature
+// (positive on convex ground) times 100, as GIS packages report it. Any of the outputs may be null.
+void computeSlopeAspectCurvature(const int32_t* heights, int width, int height, const TerrainLayerOptions& options,
+	float* slope, float* aspect, float* curvature);
+
+// Every cell drains to the neighbour with the steepest descent, distance weighted for the diagonals
+void computeFlowDirections(const int32_t* heights, int width, int height, const TerrainLayerOptions& options, unsigned char* directions);
+
+// Number of cells draining through each cell, itself included. Cells are visited in topological order of the
+// flow graph, so this pass is sequential; the flow directions it starts from are computed in parallel.
+void computeFlowAccumulation(const int32_t* heights, int width, int height, const TerrainLayerOptions& options, uint32_t* accumulation);
+
+// Compact RGBA8 texture for material blending and overlays, all channels normalized to [0, 1] in the shader:
+// R = slope / 90 deg, G = aspect / 360 deg with 0 reserved for flat, B = curvature around 0.5, A = log flow accumulation
+void packTerrainLayers(const float* slope, const float* aspect, const float* curvature, const uint32_t* accumulation,
+	int width, int height, const TerrainLayerOptions& options, std::vector<unsigned char>& rgba);
+
+// Curvature mapped to the full byte range when packTerrainLayers is not given one: four times the mean magnitude
+float terrainCurvatureRange(const float* curvature, size_t count);
+
+// Incremental update after a height edit: slope, aspect and curvature of the cells in [x0, x1) x [y0, y1) are
+// recomputed and written into rgba, the full texture from packTerrainLayers. Flow accumulation (alpha) is left
+// as it is, it depends on the whole drainage basin. options.curvatureRange must be the range rgba was packed with.
+// Cells next to an edit change too, callers pass the edited rectangle grown by one cell.
+void updateTerrainLayersRegion(const int32_t* heights, int width, int height, const TerrainLayerOptions& options,
+	int x0, int y0, int x1, int y1, std::vector<unsigned char>& rgba);
+
+#endif
@@ -0,0 +1,77 @@
+#include "terrainmesh.hpp"
+
+void buildTerrainGrid(int nPoints, float scale, unsigned int restartIndex,
+	std::vector<glm::vec3>& vertices, std::vector<glm::vec2>& uvs, std::vector<unsigned int>& indices)
+{
+	vertices.clear();
+	uvs.clear();
+	vertices.reserve(size_t(nPoints) * nPoints);
+	uvs.reserve(size_t(nPoints) * nPoints);
+
+	//Calculate the x and z coordinates of each point through nested loops, set the y coordinate to 0, and assume it is a plane
+	for (int i = 0; i < nPoints; i++)
+	{
+		float x = (scale) * ((i / float(nPoints - 1)) - 0.5f) * 2.0f;
+		for (int j = 0; j < nPoints; j++)
+		{
+			float z = (scale) * ((j / float(nPoints - 1)) - 0.5f) * 2.0f;
+			vertices.push_back(glm::vec3(x, 0, z));
+			uvs.push_back(glm::vec2(float(i + 0.5f) / float(nPoints - 1),
+				float(j + 0.5f) / float(nPoints - 1)));
+		}
+	}
+
+	buildTerrainStrips(nPoints, 1, restartIndex, indices);
+}
+
+void buildTerrainStrips(int nPoints, int stride, unsigned int restartIndex, std::vector<unsigned int>& indices)
+{
+	indices.clear();
+
+	// Rows / columns used at this stride
+	std::vector<unsigned int> samples;
+	for (int i = 0; i < nPoints - 1; i += stride)
+		samples.push_back(i);
+	samples.push_back(nPoints - 1);
+
+	//Index array used to generate the grid
+	indices.reserve((samples.size() - 1) * (2 * samples.size() + 1));
+	// row
+	for (size_t r = 0; r + 1 < samples.size(); r++)
+	{
+		// line
+		for (unsigned int j : samples)
+		{
+			//Calculate and add index
+			unsigned int topLeft = samples[r] * nPoints + j;
+			unsigned int bottomLeft = samples[r + 1] * nPoints + j;
+			indices.push_back(bottomLeft);
+			indices.push_back(topLeft);
+		}
+		//Tells OpenGL that the current primitive ends and the next primitive is about to begin
+		indices.push_back(restartIndex);
+	}
+}
+
+void stripToTriangles(const std::vector<unsigned int>& strip, unsigned int restartIndex, std::vector<unsigned int>& triangles)
+{
+	triangles.clear();
+	triangles.reserve(strip.size() * 3);
+
+	int stripLength = 0;
+	for (size_t k = 0; k < strip.size(); k++)
+	{
+		if (strip[k] == restartIndex)
+		{
+			stripLength = 0;
+			continue;
+		}
+		if (++stripLength < 3)
+			continue;
+
+		bool odd = (stripLength & 1) == 0;
+		triangles.push_back(odd ? strip[k - 1] : strip[k - 2]);
+		triangles.push_back(odd ? strip[k - 2] : strip[k - 1]);
+		triangles.push_back(strip[k]);
+	}
+}
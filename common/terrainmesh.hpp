@@ -0,0 +1,20 @@
+#ifndef TERRAINMESH_HPP
+#define TERRAINMESH_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+
+// Flat n_points x n_points grid in [-scale, scale] on the XZ plane, drawn as one triangle strip per row
+// with restartIndex separating the rows (see glPrimitiveRestartIndex)
+void buildTerrainGrid(int nPoints, float scale, unsigned int restartIndex,
+	std::vector<glm::vec3>& vertices, std::vector<glm::vec2>& uvs, std::vector<unsigned int>& indices);
+
+// Strip indices for the same grid using only every stride-th row and column (the last row / column is always
+// kept so the terrain keeps its extent). buildTerrainGrid uses stride 1, coarser strides are LOD levels.
+void buildTerrainStrips(int nPoints, int stride, unsigned int restartIndex, std::vector<unsigned int>& indices);
+
+// Resolve triangle strips (with restart indices) into a triangle list, keeping the GL_TRIANGLE_STRIP winding:
+// every other triangle of a strip is flipped. Used for 3 vertex patches and by the software rasterizer.
+void stripToTriangles(const std::vector<unsigned int>& strip, unsigned int restartIndex, std::vector<unsigned int>& triangles);
+
+#endif
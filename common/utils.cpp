@@ -55,4 +55,31 @@ bool loadBMP_custom(const char* imagepath, int& width, int& height, unsigned cha
 	// Everything is in memory now, the file can be closed.
 	fclose(file);
 	return true;
-}
\ No newline at end of file
+}
+
+bool saveBMP_custom(const char* imagepath, int width, int height, const unsigned char* data) {
+
+	unsigned int rowStride = (width * 3 + 3) & ~3u;
+	unsigned int imageSize = rowStride * height;
+
+	// Only the fields loadBMP_custom reads plus the ones image viewers insist on
+	unsigned char header[54] = { 'B', 'M' };
+	*(unsigned int*)&(header[0x02]) = 54 + imageSize;
+	*(unsigned int*)&(header[0x0A]) = 54;
+	*(unsigned int*)&(header[0x0E]) = 40;
+	*(int*)&(header[0x12]) = width;
+	*(int*)&(header[0x16]) = height;
+	*(unsigned short*)&(header[0x1A]) = 1;
+	*(unsigned short*)&(header[0x1C]) = 24;
+	*(unsigned int*)&(header[0x22]) = imageSize;
+
+	FILE* file = fopen(imagepath, "wb");
+	if (!file) {
+		cout << imagepath << " could not be opened for writing." << endl;
+		return false;
+	}
+
+	bool ok = fwrite(header, 1, 54, file) == 54 && fwrite(data, 1, imageSize, file) == imageSize;
+	fclose(file);
+	return ok;
+}
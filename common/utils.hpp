@@ -2,5 +2,7 @@
 #define UTILS_HPP
 
 bool loadBMP_custom(const char* imagepath, int& width, int& height, unsigned char* &data);
+// Writes a 24bpp BMP, data uses the same BGR layout (rows padded to 4 bytes, bottom row first) loadBMP_custom returns
+bool saveBMP_custom(const char* imagepath, int width, int height, const unsigned char* data);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,342 @@
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <cmath>
+#include <limits>
+
+#if defined(__AVX2__)
+#define VIEWSHED_AVX2 1
+#include <immintrin.h>
+#endif
+
+#include "viewshed.hpp"
+#include "jobsystem.hpp"
+using namespace std;
+
+namespace
+{
+	// Every observer is split into 8 tasks: the octants of the sweep, or row bands of the exact method
+	const int kTasksPerObserver = 8;
+
+	// Octant o covers the cells at local (u, v) with 0 <= v <= u, u and v being steps along the two directions.
+	// Cells on the axes and diagonals are shared with the neighbouring octant, so even octants own [0, u) and odd
+	// octants (0, u]: every cell has exactly one owner and the sweep tasks of one observer never write the same byte.
+	struct Octant
+	{
+		int ux, uy;
+		int vx, vy;
+		bool ownsDiagonal;
+	};
+
+	const Octant kOctants[8] = {
+		{ 1, 0, 0, 1, false }, { 0, 1, 1, 0, true }, { 0, 1, -1, 0, false }, { -1, 0, 0, 1, true },
+		{ -1, 0, 0, -1, false }, { 0, -1, -1, 0, true }, { 0, -1, 1, 0, false }, { 1, 0, 0, -1, true }
+	};
+
+	// Analysis window of one observer and its private result, merged into the counts when its last task ends
+	struct ObserverJob
+	{
+		int x0, y0, w, h;
+		vector<unsigned char> visible;
+		once_flag allocated;
+		atomic<int> remaining;
+	};
+
+	// Cells from (x, y) to the map border along one axis direction
+	inline int extentTo(int x, int y, int dx, int dy, int width, int height)
+	{
+		if (dx > 0) return width - 1 - x;
+		if (dx < 0) return x;
+		if (dy > 0) return height - 1 - y;
+		return y;
+	}
+
+	inline double eyeElevation(const int32_t* heights, int width, const ViewshedObserver& observer)
+	{
+		return double(heights[size_t(observer.y) * width + observer.x]) + observer.height;
+	}
+
+	// R3 line of sight: sample the segment where it crosses each grid line of its major axis
+	bool exactLineOfSight(const int32_t* heights, int width, const ViewshedObserver& observer, double eye, int tx, int ty)
+	{
+		int dx = tx - observer.x;
+		int dy = ty - observer.y;
+		int n = max(abs(dx), abs(dy));
+		if (n <= 1)
+			return true;
+
+		// Walk the major axis, the minor coordinate of step i is i * dm / n
+		bool xMajor = abs(dx) >= abs(dy);
+		int dm = xMajor ? dy : dx;
+		int majorStep = (xMajor ? dx : dy) > 0 ? 1 : -1;
+		int minorStep = dm >= 0 ? 1 : -1;
+		size_t majorStride = xMajor ? 1 : size_t(width);
+		size_t minorStride = xMajor ? size_t(width) : 1;
+		int adm = abs(dm);
+
+		double target = double(heights[size_t(ty) * width + tx]) + observer.targetHeight - eye;
+		const int32_t* origin = heights + size_t(observer.y) * width + observer.x;
+		for (int i = 1; i < n; i++)
+		{
+			int64_t num = int64_t(i) * adm;
+			int m0 = int(num / n);
+			int rem = int(num - int64_t(m0) * n);
+			const int32_t* p = origin + ptrdiff_t(i * majorStep) * ptrdiff_t(majorStride) + ptrdiff_t(m0 * minorStep) * ptrdiff_t(minorStride);
+			double h = p[0];
+			if (rem)
+				h += (double(p[ptrdiff_t(minorStep) * ptrdiff_t(minorStride)]) - h) * rem / n;
+
+			// Blocked when the sample is above the segment: (h - eye) / i > target / n
+			if ((h - eye) * n > target * i)
+				return false;
+		}
+		return true;
+	}
+
+	// Exact method: every cell of a band of window rows gets its own line of sight
+	void exactBand(const int32_t* heights, int width, const ViewshedObserver& observer, int band, ObserverJob& job)
+	{
+		double eye = eyeElevation(heights, width, observer);
+		int64_t r2 = int64_t(observer.radius) * observer.radius;
+		int y0 = job.y0 + job.h * band / kTasksPerObserver;
+		int y1 = job.y0 + job.h * (band + 1) / kTasksPerObserver;
+		for (int y = y0; y < y1; y++)
+		{
+			unsigned char* row = job.visible.data() + size_t(y - job.y0) * job.w;
+			for (int x = job.x0; x < job.x0 + job.w; x++)
+			{
+				int64_t dx = x - observer.x, dy = y - observer.y;
+				if (observer.radius > 0 && dx * dx + dy * dy > r2)
+					continue;
+				if (exactLineOfSight(heights, width, observer, eye, x, y))
+					row[x - job.x0] = 1;
+			}
+		}
+	}
+
+	// Geometry of one octant sweep. Ray p runs from the observer to the border cell (U, p), so every cell of the
+	// octant lies on (or next to) at least one ray. Along a ray the horizon is the steepest gradient so far of the
+	// terrain interpolated on the ray, a cell is visible when the gradient to its top is not below that horizon.
+	struct SweepSetup
+	{
+		int U, V;                   // octant extent along u and v (clipped to the radius)
+		int heightU, heightV;       // height map offsets of one step along u / v
+		int localU, localV;         // same in the observer window
+		int heightOrigin, localOrigin;
+		int64_t r2;                 // squared radius, 0 = unlimited
+		float eye, targetHeight;
+		bool ownsDiagonal;
+	};
+
+#if !defined(VIEWSHED_AVX2)
+	// One ray at a time, used when AVX2 is not available
+	void sweepRaysScalar(const int32_t* heights, const SweepSetup& s, int firstRay, int rayCount, unsigned char* visible)
+	{
+		for (int p = firstRay; p < firstRay + rayCount; p++)
+		{
+			float slope = float(p) / float(s.U);
+			float invK = 1.0f / sqrt(1.0f + slope * slope);
+			float horizon = -numeric_limits<float>::infinity();
+			for (int x = 1; x <= s.U; x++)
+			{
+				float yf = x * slope;
+				int y0 = int(yf);
+				int vr = int(yf + 0.5f);
+				if (vr > s.V || (s.r2 && int64_t(x) * x + int64_t(vr) * vr > s.r2))
+					break;
+				int y1 = min(y0 + 1, s.V);
+				float fr = yf - float(y0);
+
+				const int32_t* column = heights + s.heightOrigin + x * s.heightU;
+				float cell = float(column[vr * s.heightV]) + s.targetHeight - s.eye;
+				float gradient = cell / sqrt(float(x * x + vr * vr));
+				bool owned = s.ownsDiagonal ? vr > 0 : vr < x;
+				if (owned && gradient >= horizon)
+					visible[s.localOrigin + x * s.localU + vr * s.localV] = 1;
+
+				float h0 = float(column[y0 * s.heightV]);
+				float h1 = float(column[y1 * s.heightV]);
+				float ray = (h0 + (h1 - h0) * fr - s.eye) * invK / float(x);
+				horizon = max(horizon, ray);
+			}
+		}
+	}
+#else
+	// Eight neighbouring rays in the lanes of one register, heights are gathered for all of them at once
+	void sweepRays8(const int32_t* heights, const SweepSetup& s, int firstRay, int rayCount, unsigned char* visible)
+	{
+		const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		const __m256i valid = _mm256_cmpgt_epi32(_mm256_set1_epi32(rayCount), lane);
+		__m256 slope = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(firstRay), lane)), _mm256_set1_ps(float(s.U)));
+		__m256 invK = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_sqrt_ps(_mm256_add_ps(_mm256_set1_ps(1.0f), _mm256_mul_ps(slope, slope))));
+		__m256 horizon = _mm256_set1_ps(-numeric_limits<float>::infinity());
+
+		const __m256i maxV = _mm256_set1_epi32(s.V);
+		const __m256i heightV = _mm256_set1_epi32(s.heightV);
+		const __m256i localV = _mm256_set1_epi32(s.localV);
+		const __m256 eye = _mm256_set1_ps(s.eye);
+		const __m256 cellOffset = _mm256_set1_ps(s.targetHeight - s.eye);
+		const __m256 half = _mm256_set1_ps(0.5f);
+		alignas(32) int32_t localIndex[8];
+
+		for (int x = 1; x <= s.U; x++)
+		{
+			__m256 xf = _mm256_set1_ps(float(x));
+			__m256 yf = _mm256_mul_ps(xf, slope);
+			__m256i y0 = _mm256_cvttps_epi32(yf);
+			__m256i vr = _mm256_cvttps_epi32(_mm256_add_ps(yf, half));
+
+			// A ray ends when it leaves the map or the radius, and stays ended: v only grows along a ray
+			__m256i active = _mm256_andnot_si256(_mm256_cmpgt_epi32(vr, maxV), valid);
+			if (s.r2)
+			{
+				__m256i d2 = _mm256_add_epi32(_mm256_set1_epi32(x * x), _mm256_mullo_epi32(vr, vr));
+				active = _mm256_andnot_si256(_mm256_cmpgt_epi32(d2, _mm256_set1_epi32(int32_t(s.r2))), active);
+			}
+			int activeMask = _mm256_movemask_ps(_mm256_castsi256_ps(active));
+			if (!activeMask)
+				break;
+
+			// Ended lanes read the observer's column to stay inside the map
+			vr = _mm256_and_si256(vr, active);
+			y0 = _mm256_and_si256(_mm256_min_epi32(y0, maxV), active);
+			__m256i y1 = _mm256_min_epi32(_mm256_add_epi32(y0, _mm256_set1_epi32(1)), maxV);
+			__m256i column = _mm256_set1_epi32(s.heightOrigin + x * s.heightU);
+
+			__m256 cell = _mm256_cvtepi32_ps(_mm256_i32gather_epi32(heights, _mm256_add_epi32(column, _mm256_mullo_epi32(vr, heightV)), 4));
+			__m256i vr2 = _mm256_add_epi32(_mm256_set1_epi32(x * x), _mm256_mullo_epi32(vr, vr));
+			__m256 gradient = _mm256_div_ps(_mm256_add_ps(cell, cellOffset), _mm256_sqrt_ps(_mm256_cvtepi32_ps(vr2)));
+			__m256i owned = s.ownsDiagonal ? _mm256_cmpgt_epi32(vr, _mm256_setzero_si256())
+				: _mm256_cmpgt_epi32(_mm256_set1_epi32(x), vr);
+			int visibleMask = activeMask & _mm256_movemask_ps(_mm256_castsi256_ps(owned))
+				& _mm256_movemask_ps(_mm256_cmp_ps(gradient, horizon, _CMP_GE_OQ));
+
+			if (visibleMask)
+			{
+				__m256i local = _mm256_add_epi32(_mm256_set1_epi32(s.localOrigin + x * s.localU), _mm256_mullo_epi32(vr, localV));
+				_mm256_store_si256((__m256i*)localIndex, local);
+				for (; visibleMask; visibleMask &= visibleMask - 1)
+					visible[localIndex[__builtin_ctz(visibleMask)]] = 1;
+			}
+
+			__m256 h0 = _mm256_cvtepi32_ps(_mm256_i32gather_epi32(heights, _mm256_add_epi32(column, _mm256_mullo_epi32(y0, heightV)), 4));
+			__m256 h1 = _mm256_cvtepi32_ps(_mm256_i32gather_epi32(heights, _mm256_add_epi32(column, _mm256_mullo_epi32(y1, heightV)), 4));
+			__m256 fr = _mm256_sub_ps(yf, _mm256_cvtepi32_ps(y0));
+			__m256 h = _mm256_add_ps(h0, _mm256_mul_ps(_mm256_sub_ps(h1, h0), fr));
+			__m256 ray = _mm256_div_ps(_mm256_mul_ps(_mm256_sub_ps(h, eye), invK), xf);
+			horizon = _mm256_max_ps(horizon, ray);
+		}
+	}
+#endif
+
+	void sweepOctant(const int32_t* heights, int width, int height, const ViewshedObserver& observer, int octant, ObserverJob& job)
+	{
+		const Octant& o = kOctants[octant];
+		SweepSetup s;
+		s.U = extentTo(observer.x, observer.y, o.ux, o.uy, width, height);
+		s.V = extentTo(observer.x, observer.y, o.vx, o.vy, width, height);
+		if (observer.radius > 0)
+		{
+			s.U = min(s.U, observer.radius);
+			s.V = min(s.V, observer.radius);
+		}
+		if (s.U == 0)
+			return;
+
+		s.heightU = o.ux + o.uy * width;
+		s.heightV = o.vx + o.vy * width;
+		s.localU = o.ux + o.uy * job.w;
+		s.localV = o.vx + o.vy * job.w;
+		s.heightOrigin = observer.y * width + observer.x;
+		s.localOrigin = (observer.y - job.y0) * job.w + (observer.x - job.x0);
+		s.r2 = int64_t(observer.radius) * observer.radius;
+		s.eye = float(eyeElevation(heights, width, observer));
+		s.targetHeight = observer.targetHeight;
+		s.ownsDiagonal = o.ownsDiagonal;
+
+		for (int p = 0; p <= s.U; p += 8)
+		{
+#if defined(VIEWSHED_AVX2)
+			sweepRays8(heights, s, p, min(8, s.U + 1 - p), job.visible.data());
+#else
+			sweepRaysScalar(heights, s, p, min(8, s.U + 1 - p), job.visible.data());
+#endif
+		}
+	}
+}
+
+void computeViewshedBatch(const int32_t* heights, int width, int height, const vector<ViewshedObserver>& observers,
+	const ViewshedOptions& options, vector<uint16_t>& counts)
+{
+	counts.assign(size_t(width) * height, 0);
+	if (observers.empty() || width <= 0 || height <= 0)
+		return;
+
+	// Windows are allocated by the first task of an observer and released by its last one,
+	// so only the observers currently being worked on hold memory
+	const int count = int(observers.size());
+	unique_ptr<ObserverJob[]> jobs(new ObserverJob[count]);
+	for (int i = 0; i < count; i++)
+	{
+		const ViewshedObserver& observer = observers[i];
+		ObserverJob& job = jobs[i];
+		bool inside = observer.x >= 0 && observer.y >= 0 && observer.x < width && observer.y < height;
+		int r = observer.radius > 0 ? observer.radius : max(width, height);
+		job.x0 = max(0, observer.x - r);
+		job.y0 = max(0, observer.y - r);
+		job.w = inside ? min(width, observer.x + r + 1) - job.x0 : 0;
+		job.h = inside ? min(height, observer.y + r + 1) - job.y0 : 0;
+		job.remaining = inside ? kTasksPerObserver : 0;
+	}
+
+	mutex mergeMutex;
+	jobSystem().parallelFor(count * kTasksPerObserver, options.threads, [&](int task) {
+		const ViewshedObserver& observer = observers[task / kTasksPerObserver];
+		ObserverJob& job = jobs[task / kTasksPerObserver];
+		if (job.w == 0)
+			return;
+
+		call_once(job.allocated, [&]() {
+			job.visible.assign(size_t(job.w) * job.h, 0);
+			// The observer always sees its own cell
+			job.visible[size_t(observer.y - job.y0) * job.w + (observer.x - job.x0)] = 1;
+		});
+
+		if (options.method == VIEWSHED_EXACT)
+			exactBand(heights, width, observer, task % kTasksPerObserver, job);
+		else
+			sweepOctant(heights, width, height, observer, task % kTasksPerObserver, job);
+
+		if (--job.remaining == 0)
+		{
+			lock_guard<mutex> lock(mergeMutex);
+			for (int y = 0; y < job.h; y++)
+			{
+				const unsigned char* src = job.visible.data() + size_t(y) * job.w;
+				uint16_t* dst = counts.data() + size_t(job.y0 + y) * width + job.x0;
+				for (int x = 0; x < job.w; x++)
+					dst[x] = uint16_t(min(0xFFFF, dst[x] + src[x]));
+			}
+			vector<unsigned char>().swap(job.visible);
+		}
+	});
+}
+
+void computeViewshed(const int32_t* heights, int width, int height, const ViewshedObserver& observer,
+	const ViewshedOptions& options, vector<unsigned char>& visible)
+{
+	vector<uint16_t> counts;
+	computeViewshedBatch(heights, width, height, vector<ViewshedObserver>(1, observer), options, counts);
+	visible.resize(counts.size());
+	for (size_t i = 0; i < counts.size(); i++)
+		visible[i] = counts[i] ? 255 : 0;
+}
+
+bool lineOfSight(const int32_t* heights, int width, int height, const ViewshedObserver& observer, int targetX, int targetY)
+{
+	if (observer.x < 0 || observer.y < 0 || observer.x >= width || observer.y >= height ||
+		targetX < 0 || targetY < 0 || targetX >= width || targetY >= height)
+		return false;
+	return exactLineOfSight(heights, width, observer, eyeElevation(heights, width, observer), targetX, targetY);
+}
@@ -0,0 +1,50 @@
+#ifndef VIEWSHED_HPP
+#define VIEWSHED_HPP
+
+#include <vector>
+#include <cstdint>
+
+// Viewshed (line of sight) analysis on the decoded heightmap, heights as returned by unpackHeightsBGR.
+// Positions are heightmap cells, heights are in raw height map units, like the texture the shaders sample.
+//
+// Line of sight from the observer to a target cell follows Franklin's R3 definition: the segment between the
+// two cell centers is sampled where it crosses every column (or row, along its major axis), the terrain height
+// there is interpolated between the two neighbouring cells, and the target is visible when none of those
+// samples rises above the segment.
+// VIEWSHED_EXACT evaluates that definition for every cell (O(r^3)). VIEWSHED_SWEEP is the R2 approximation: one
+// ray per cell of the analysis square's border, a running horizon per ray, O(r^2). Cells it judges differently
+// from R3 are rare and lie on the edge of a visible region.
+
+enum ViewshedMethod
+{
+	VIEWSHED_SWEEP,
+	VIEWSHED_EXACT
+};
+
+struct ViewshedObserver
+{
+	int x = 0, y = 0;             // heightmap cell
+	float height = 0.0f;          // eye height above the ground
+	float targetHeight = 0.0f;    // height above the ground of what has to be seen (a mast, a person)
+	int radius = 0;               // analysis radius in cells, 0 = whole map
+};
+
+struct ViewshedOptions
+{
+	ViewshedMethod method = VIEWSHED_SWEEP;
+	unsigned int threads = 0;     // 0 = every hardware thread
+};
+
+// One observer: visible is resized to width * height, 255 where the observer sees the cell, 0 elsewhere
+void computeViewshed(const int32_t* heights, int width, int height, const ViewshedObserver& observer,
+	const ViewshedOptions& options, std::vector<unsigned char>& visible);
+
+// Cumulative viewshed of many observers: number of observers that see each cell, saturated at 65535.
+// Observers and the sectors around each observer are spread over the job system.
+void computeViewshedBatch(const int32_t* heights, int width, int height, const std::vector<ViewshedObserver>& observers,
+	const ViewshedOptions& options, std::vector<uint16_t>& counts);
+
+// Brute force line of sight to a single cell, the definition VIEWSHED_EXACT implements
+bool lineOfSight(const int32_t* heights, int width, int height, const ViewshedObserver& observer, int targetX, int targetY);
+
+#endif
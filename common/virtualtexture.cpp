@@ -0,0 +1,449 @@
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+
+#include "virtualtexture.hpp"
+#include "utils.hpp"
+#include "jobsystem.hpp"
+using namespace std;
+
+namespace
+{
+	int nextPowerOfTwo(int v)
+	{
+		int p = 1;
+		while (p < v)
+			p <<= 1;
+		return p;
+	}
+
+	// Size from the BMP header only, the pixels are read when the first page of the layer is needed
+	bool readBMPSize(const char* imagepath, int& width, int& height)
+	{
+		unsigned char header[54];
+		FILE* file = fopen(imagepath, "rb");
+		if (!file)
+			return false;
+		bool ok = fread(header, 1, 54, file) == 54 && header[0] == 'B' && header[1] == 'M';
+		fclose(file);
+		if (!ok)
+			return false;
+		width = *(int*)&(header[0x12]);
+		height = *(int*)&(header[0x16]);
+		return width > 0 && height > 0;
+	}
+}
+
+int VirtualTextureLayout::mipCount(int layer) const
+{
+	int count = 1;
+	for (int size = layerSize[layer]; size > pageSize; size >>= 1)
+		count++;
+	return count;
+}
+
+int VirtualTextureLayout::pagesAcross(int layer, int mip) const
+{
+	return max(1, (layerSize[layer] >> mip) / pageSize);
+}
+
+int VirtualTextureLayout::tableOffset(int layer, int mip) const
+{
+	int offset = 0;
+	for (int l = 0; l <= layer && l < layerCount(); l++)
+	{
+		int mips = l == layer ? mip : mipCount(l);
+		for (int m = 0; m < mips; m++)
+			offset += pagesAcross(l, m) * pagesAcross(l, m);
+	}
+	return offset;
+}
+
+int VirtualTextureLayout::tableSize() const
+{
+	return tableOffset(layerCount());
+}
+
+VirtualPageCache::VirtualPageCache(const VirtualTextureLayout& layout, int slotsX, int slotsY)
+	: layout(layout), slotsX(slotsX), slotsY(slotsY), frame(1), version(0), evictions(0)
+{
+	slotPage.assign(slotsX * slotsY, kNoVirtualPage);
+}
+
+VirtualPageId VirtualPageCache::parentOf(VirtualPageId page) const
+{
+	int layer = virtualPageLayer(page), mip = virtualPageMip(page);
+	if (mip + 1 >= layout.mipCount(layer))
+		return kNoVirtualPage;
+	return makeVirtualPage(layer, mip + 1, virtualPageX(page) / 2, virtualPageY(page) / 2);
+}
+
+int VirtualPageCache::slotOf(VirtualPageId page) const
+{
+	auto it = resident.find(page);
+	return it == resident.end() ? -1 : it->second.slot;
+}
+
+void VirtualPageCache::beginFrame()
+{
+	frame++;
+	requested.clear();
+}
+
+void VirtualPageCache::request(VirtualPageId page)
+{
+	// Feedback texels without terrain and anything outside the layout are ignored
+	int layer = virtualPageLayer(page);
+	if (page == kNoVirtualPage || layer >= layout.layerCount() || virtualPageMip(page) >= layout.mipCount(layer))
+		return;
+	int pages = layout.pagesAcross(layer, virtualPageMip(page));
+	if (virtualPageX(page) >= pages || virtualPageY(page) >= pages)
+		return;
+
+	if (requested[page]++ != 0)
+		return;
+	for (VirtualPageId p = page; p != kNoVirtualPage; p = parentOf(p))
+	{
+		auto it = resident.find(p);
+		if (it != resident.end())
+			it->second.lastUsed = frame;
+	}
+}
+
+void VirtualPageCache::collectLoads(int maxLoads, vector<VirtualPageId>& loads)
+{
+	loads.clear();
+
+	// A missing page also wants its missing ancestors: they are smaller to fill the gap and load first
+	unordered_map<VirtualPageId, unsigned int> wanted;
+	for (const auto& r : requested)
+	{
+		for (VirtualPageId p = r.first; p != kNoVirtualPage; p = parentOf(p))
+		{
+			if (resident.count(p))
+				break;
+			if (!loading.count(p))
+				wanted[p] += r.second;
+		}
+	}
+
+	vector<pair<VirtualPageId, unsigned int>> order(wanted.begin(), wanted.end());
+	sort(order.begin(), order.end(), [](const pair<VirtualPageId, unsigned int>& a, const pair<VirtualPageId, unsigned int>& b) {
+		int mipA = virtualPageMip(a.first), mipB = virtualPageMip(b.first);
+		if (mipA != mipB)
+			return mipA > mipB;
+		if (a.second != b.second)
+			return a.second > b.second;
+		return a.first < b.first;
+	});
+
+	for (size_t i = 0; i < order.size() && int(loads.size()) < maxLoads; i++)
+	{
+		loads.push_back(order[i].first);
+		loading.insert(order[i].first);
+	}
+}
+
+int VirtualPageCache::commit(VirtualPageId page)
+{
+	loading.erase(page);
+	auto it = resident.find(page);
+	if (it != resident.end())
+		return it->second.slot;
+
+	int slot = int(find(slotPage.begin(), slotPage.end(), kNoVirtualPage) - slotPage.begin());
+	if (slot == slotCount())
+	{
+		// Least recently used page that the current frame does not need
+		slot = -1;
+		unsigned int oldest = frame;
+		for (int s = 0; s < slotCount(); s++)
+		{
+			const Residency& r = resident[slotPage[s]];
+			if (!r.pinned && r.lastUsed < oldest)
+			{
+				oldest = r.lastUsed;
+				slot = s;
+			}
+		}
+		if (slot < 0)
+			return -1;
+		resident.erase(slotPage[slot]);
+		evictions++;
+	}
+
+	Residency r;
+	r.slot = slot;
+	r.lastUsed = frame;
+	r.pinned = virtualPageMip(page) == layout.mipCount(virtualPageLayer(page)) - 1;
+	resident[page] = r;
+	slotPage[slot] = page;
+	version++;
+	return slot;
+}
+
+void VirtualPageCache::cancel(VirtualPageId page)
+{
+	loading.erase(page);
+}
+
+void VirtualPageCache::buildIndirection(vector<uint32_t>& table) const
+{
+	table.assign(layout.tableSize(), kNoVirtualEntry);
+	for (int layer = 0; layer < layout.layerCount(); layer++)
+	{
+		// Coarse to fine, so a missing page can copy the entry of its parent
+		for (int mip = layout.mipCount(layer) - 1; mip >= 0; mip--)
+		{
+			int pages = layout.pagesAcross(layer, mip);
+			uint32_t* level = &table[layout.tableOffset(layer, mip)];
+			const uint32_t* parent = mip + 1 < layout.mipCount(layer) ? &table[layout.tableOffset(layer, mip + 1)] : nullptr;
+			int parentPages = parent ? layout.pagesAcross(layer, mip + 1) : 0;
+			for (int y = 0; y < pages; y++)
+			{
+				for (int x = 0; x < pages; x++)
+				{
+					auto it = resident.find(makeVirtualPage(layer, mip, x, y));
+					if (it != resident.end())
+					{
+						int slot = it->second.slot;
+						level[y * pages + x] = uint32_t(slot % slotsX) | (uint32_t(slot / slotsX) << 8) | (uint32_t(mip) << 16);
+					}
+					else if (parent)
+						level[y * pages + x] = parent[(y / 2) * parentPages + x / 2];
+				}
+			}
+		}
+	}
+}
+
+VirtualTextureLoader::VirtualTextureLoader(const vector<string>& files, int pageSize, int border, size_t decodeBudget)
+	: decodeBudget(decodeBudget), decoded(0), decodes(0), useClock(0), pending(0), stop(false)
+{
+	layout.pageSize = pageSize;
+	layout.border = border;
+	for (const string& file : files)
+	{
+		Layer layer;
+		layer.file = file;
+		layer.bytes = 0;
+		layer.lastUse = 0;
+		if (!readBMPSize(file.c_str(), layer.width, layer.height))
+		{
+			cout << file << " could not be opened, the layer stays gray" << endl;
+			layer.width = layer.height = 0;
+		}
+		layers.push_back(layer);
+		layout.layerSize.push_back(max(pageSize, nextPowerOfTwo(max(layer.width, layer.height))));
+	}
+	decoding.reset(new std::mutex[layers.size()]);
+}
+
+VirtualTextureLoader::~VirtualTextureLoader()
+{
+	// Jobs that have not started skip their page, the running ones are waited for
+	unique_lock<std::mutex> lock(mutex);
+	stop = true;
+	finished.wait(lock, [&]() { return pending == 0; });
+}
+
+void VirtualTextureLoader::setReadyCallback(function<void()> callback)
+{
+	lock_guard<std::mutex> lock(mutex);
+	ready = callback;
+}
+
+void VirtualTextureLoader::enqueue(const vector<VirtualPageId>& pages)
+{
+	if (pages.empty())
+		return;
+	{
+		lock_guard<std::mutex> lock(mutex);
+		pending += int(pages.size());
+	}
+	for (VirtualPageId page : pages)
+		jobSystem().submit([this, page]() { loadPage(page); }, JOB_BACKGROUND);
+}
+
+bool VirtualTextureLoader::pop(VirtualPageData& page)
+{
+	lock_guard<std::mutex> lock(mutex);
+	if (done.empty())
+		return false;
+	page = move(done.front());
+	done.pop_front();
+	return true;
+}
+
+bool VirtualTextureLoader::isIdle()
+{
+	lock_guard<std::mutex> lock(mutex);
+	return pending == 0 && done.empty();
+}
+
+size_t VirtualTextureLoader::decodedBytes()
+{
+	lock_guard<std::mutex> lock(mutex);
+	return decoded;
+}
+
+unsigned int VirtualTextureLoader::decodeCount()
+{
+	lock_guard<std::mutex> lock(mutex);
+	return decodes;
+}
+
+void VirtualTextureLoader::loadPage(VirtualPageId page)
+{
+	bool cancelled;
+	{
+		lock_guard<std::mutex> lock(mutex);
+		cancelled = stop;
+	}
+
+	function<void()> callback;
+	if (!cancelled)
+	{
+		VirtualPageData data;
+		data.page = page;
+		cutPage(page, data.texels);
+
+		lock_guard<std::mutex> lock(mutex);
+		done.push_back(move(data));
+		callback = ready;
+	}
+	if (callback)
+		callback();
+
+	// Last access to the loader, the destructor may run as soon as the lock is released
+	lock_guard<std::mutex> lock(mutex);
+	if (--pending == 0)
+		finished.notify_all();
+}
+
+bool VirtualTextureLoader::decodeLayer(const Layer& layer, int size, MipChain& mips) const
+{
+	int width = 0, height = 0;
+	unsigned char* data = nullptr;
+	bool loaded = layer.width > 0 && loadBMP_custom(layer.file.c_str(), width, height, data);
+
+	// Mip 0 at the virtual size, images that are not a power of two are resampled (nearest)
+	vector<unsigned char> base(size_t(size) * size * 4, 128);
+	if (loaded)
+	{
+		const size_t stride = (size_t(width) * 3 + 3) & ~size_t(3);
+		for (int y = 0; y < size; y++)
+		{
+			const unsigned char* row = data + (size_t(y) * height / size) * stride;
+			unsigned char* out = &base[size_t(y) * size * 4];
+			for (int x = 0; x < size; x++, out += 4)
+			{
+				const unsigned char* bgr = row + (size_t(x) * width / size) * 3;
+				out[0] = bgr[2];
+				out[1] = bgr[1];
+				out[2] = bgr[0];
+				out[3] = 255;
+			}
+		}
+		delete[] data;
+	}
+
+	// Box filtered chain down to the tail level
+	mips.clear();
+	mips.push_back(move(base));
+	for (int s = size / 2; s >= layout.pageSize; s /= 2)
+	{
+		const vector<unsigned char>& src = mips.back();
+		vector<unsigned char> dst(size_t(s) * s * 4);
+		for (int y = 0; y < s; y++)
+			for (int x = 0; x < s; x++)
+				for (int c = 0; c < 4; c++)
+				{
+					size_t i = (size_t(2 * y) * 2 * s + 2 * x) * 4 + c;
+					dst[(size_t(y) * s + x) * 4 + c] = (unsigned char)((src[i] + src[i + 4] + src[i + 8 * s] + src[i + 8 * s + 4] + 2) / 4);
+				}
+		mips.push_back(move(dst));
+	}
+	return loaded;
+}
+
+shared_ptr<const VirtualTextureLoader::MipChain> VirtualTextureLoader::acquireLayer(int l)
+{
+	{
+		lock_guard<std::mutex> lock(mutex);
+		if (layers[l].mips)
+		{
+			layers[l].lastUse = ++useClock;
+			return layers[l].mips;
+		}
+	}
+
+	// One job decodes, the others needing the layer wait for it instead of decoding it too
+	lock_guard<std::mutex> decodeLock(decoding[l]);
+	{
+		lock_guard<std::mutex> lock(mutex);
+		if (layers[l].mips)
+		{
+			layers[l].lastUse = ++useClock;
+			return layers[l].mips;
+		}
+	}
+	shared_ptr<MipChain> mips = make_shared<MipChain>();
+	decodeLayer(layers[l], layout.layerSize[l], *mips);
+	size_t bytes = 0;
+	for (const vector<unsigned char>& level : *mips)
+		bytes += level.size();
+
+	lock_guard<std::mutex> lock(mutex);
+	Layer& layer = layers[l];
+	layer.mips = mips;
+	layer.bytes = bytes;
+	layer.lastUse = ++useClock;
+	decoded += bytes;
+	decodes++;
+	// Over the budget: drop the least recently used other layers, a job still cutting from one keeps it alive
+	while (decoded > decodeBudget)
+	{
+		int oldest = -1;
+		for (int i = 0; i < int(layers.size()); i++)
+			if (i != l && layers[i].mips && (oldest < 0 || layers[i].lastUse < layers[oldest].lastUse))
+				oldest = i;
+		if (oldest < 0)
+			break;
+		layers[oldest].mips.reset();
+		decoded -= layers[oldest].bytes;
+		layers[oldest].bytes = 0;
+	}
+	return mips;
+}
+
+void VirtualTextureLoader::cutPage(VirtualPageId page, vector<unsigned char>& texels)
+{
+	const int l = virtualPageLayer(page), mip = virtualPageMip(page);
+	const int slot = layout.slotSize();
+	texels.assign(size_t(slot) * slot * 4, 128);
+	if (l >= layout.layerCount() || mip >= layout.mipCount(l))
+		return;
+
+	const shared_ptr<const MipChain> mips = acquireLayer(l);
+
+	// The materials repeat (GL_REPEAT), so the border wraps around the level
+	const int size = layout.layerSize[l] >> mip;
+	const vector<unsigned char>& level = (*mips)[mip];
+	const int x0 = virtualPageX(page) * layout.pageSize - layout.border;
+	const int y0 = virtualPageY(page) * layout.pageSize - layout.border;
+	for (int y = 0; y < slot; y++)
+	{
+		int sy = ((y0 + y) % size + size) % size;
+		for (int x = 0; x < slot; x++)
+		{
+			int sx = ((x0 + x) % size + size) % size;
+			const unsigned char* src = &level[(size_t(sy) * size + sx) * 4];
+			unsigned char* dst = &texels[(size_t(y) * slot + x) * 4];
+			dst[0] = src[0];
+			dst[1] = src[1];
+			dst[2] = src[2];
+			dst[3] = src[3];
+		}
+	}
+}
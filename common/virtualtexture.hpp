@@ -0,0 +1,172 @@
+#ifndef VIRTUALTEXTURE_HPP
+#define VIRTUALTEXTURE_HPP
+
+#include <vector>
+#include <string>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdint>
+
+// Virtual texturing for the material layers. Every layer is cut into square pages at every mip level down to
+// the level that is exactly one page (the mip tail). Only the pages the feedback pass reports as sampled are
+// kept in a fixed pool of physical slots; an indirection table maps each virtual page to the slot of the page
+// itself or, while it is not resident, of its nearest resident ancestor. The classes here have no GL dependency:
+// main.cpp owns the textures, feeds the feedback samples in and uploads the pages and the table.
+
+struct VirtualTextureLayout
+{
+	int pageSize = 128;             // texels per page edge
+	int border = 4;                 // texels copied from the neighbouring pages on every side, for filtering
+	std::vector<int> layerSize;     // virtual size of every layer, a power of two no smaller than pageSize
+
+	int slotSize() const { return pageSize + 2 * border; }
+	int layerCount() const { return int(layerSize.size()); }
+	int mipCount(int layer) const;              // mip 0 .. tail
+	int pagesAcross(int layer, int mip) const;
+	int tableOffset(int layer, int mip = 0) const; // first indirection entry of a layer / mip
+	int tableSize() const;
+};
+
+// Page ids: layer (6 bits), mip (4 bits), page row and column (11 bits each). VTFeedback.frag packs them the same way.
+typedef uint32_t VirtualPageId;
+const VirtualPageId kNoVirtualPage = 0xffffffffu;
+
+inline VirtualPageId makeVirtualPage(int layer, int mip, int x, int y)
+{
+	return (uint32_t(layer) << 26) | (uint32_t(mip) << 22) | (uint32_t(y) << 11) | uint32_t(x);
+}
+inline int virtualPageLayer(VirtualPageId page) { return int(page >> 26); }
+inline int virtualPageMip(VirtualPageId page) { return int((page >> 22) & 0xf); }
+inline int virtualPageY(VirtualPageId page) { return int((page >> 11) & 0x7ff); }
+inline int virtualPageX(VirtualPageId page) { return int(page & 0x7ff); }
+
+// Indirection entries: slot column, slot row and the mip of the page that is actually resident
+const uint32_t kNoVirtualEntry = 0xffffffffu;
+
+// Page residency: which pages are wanted, which slot holds what, what to evict
+class VirtualPageCache
+{
+public:
+	VirtualPageCache(const VirtualTextureLayout& layout, int slotsX, int slotsY);
+
+	// Start collecting a new feedback buffer. Only call it when one was read back: the requests of the last buffer
+	// stay the current set until then, so the frames in between neither evict pages on screen nor lose the loads
+	void beginFrame();
+	// One feedback sample; the ancestors of the page count as used too, they are its fallback
+	void request(VirtualPageId page);
+	// Wanted pages that are neither resident nor loading, coarsest first then by number of samples.
+	// They are marked as loading until commit() or cancel().
+	void collectLoads(int maxLoads, std::vector<VirtualPageId>& loads);
+	// A loaded page gets a free slot or the least recently used one not needed by the current feedback set.
+	// Returns the slot index, or -1 when every slot is in use this frame and the page is dropped.
+	int commit(VirtualPageId page);
+	void cancel(VirtualPageId page);
+
+	// Table of layout.tableSize() entries, rebuilt from scratch (it has a few hundred entries per layer)
+	void buildIndirection(std::vector<uint32_t>& table) const;
+	// Bumped whenever the table would change
+	unsigned int getVersion() const { return version; }
+
+	bool isResident(VirtualPageId page) const { return resident.count(page) != 0; }
+	bool isLoading(VirtualPageId page) const { return loading.count(page) != 0; }
+	int slotOf(VirtualPageId page) const;
+	int slotCount() const { return slotsX * slotsY; }
+	int getSlotsX() const { return slotsX; }
+	int residentCount() const { return int(resident.size()); }
+	unsigned long long evictionCount() const { return evictions; }
+	const VirtualTextureLayout& getLayout() const { return layout; }
+
+private:
+	struct Residency
+	{
+		int slot;
+		unsigned int lastUsed;
+		bool pinned; // mip tail pages stay, every lookup can fall back to them
+	};
+
+	VirtualPageId parentOf(VirtualPageId page) const;
+
+	VirtualTextureLayout layout;
+	int slotsX, slotsY;
+	unsigned int frame;   // feedback sets begun, what lastUsed is compared with
+	unsigned int version;
+	unsigned long long evictions;
+	std::unordered_map<VirtualPageId, Residency> resident;
+	std::unordered_set<VirtualPageId> loading;
+	std::unordered_map<VirtualPageId, unsigned int> requested; // samples of the current feedback set
+	std::vector<VirtualPageId> slotPage;                       // kNoVirtualPage for free slots
+};
+
+// One loaded page: slotSize * slotSize RGBA8 texels, border included
+struct VirtualPageData
+{
+	VirtualPageId page;
+	std::vector<unsigned char> texels;
+};
+
+// Background page loader. The layout is known from the image headers right away; a layer's image is decoded
+// and its mip chain built the first time one of its pages is needed, pages are then cut from it. Every page is
+// a background job of the job system, so the pages of a frame are cut in parallel.
+// The physical texture bounds the GPU memory, the decoded chains in CPU memory are bounded by decodeBudget: past
+// it the least recently used layers are dropped and decoded again from their file when a page needs them. The
+// layer being cut is always kept, so one chain larger than the budget still works.
+class VirtualTextureLoader
+{
+public:
+	VirtualTextureLoader(const std::vector<std::string>& files, int pageSize = 128, int border = 4,
+		size_t decodeBudget = size_t(256) << 20);
+	~VirtualTextureLoader();
+
+	const VirtualTextureLayout& getLayout() const { return layout; }
+
+	// Called from a worker thread whenever a page is ready
+	void setReadyCallback(std::function<void()> ready);
+
+	void enqueue(const std::vector<VirtualPageId>& pages);
+	// Non-blocking, false when nothing is ready
+	bool pop(VirtualPageData& page);
+	bool isIdle();
+
+	// Bytes of the decoded mip chains held right now, and how many times a layer was decoded
+	size_t decodedBytes();
+	unsigned int decodeCount();
+
+private:
+	typedef std::vector<std::vector<unsigned char>> MipChain; // RGBA8, virtual size and below
+
+	struct Layer
+	{
+		std::string file;
+		int width, height;                     // image size from the header
+		std::shared_ptr<const MipChain> mips;  // null until used or after it was dropped, jobs cutting a page hold their own reference
+		size_t bytes;
+		unsigned long long lastUse;
+	};
+
+	void loadPage(VirtualPageId page);
+	bool decodeLayer(const Layer& layer, int size, MipChain& mips) const;
+	std::shared_ptr<const MipChain> acquireLayer(int l);
+	void cutPage(VirtualPageId page, std::vector<unsigned char>& texels);
+
+	VirtualTextureLayout layout;
+	std::vector<Layer> layers;
+	std::unique_ptr<std::mutex[]> decoding; // one per layer, a single job decodes it while the others wait
+	size_t decodeBudget;
+	size_t decoded;                         // bytes, under mutex
+	unsigned int decodes;
+	unsigned long long useClock;
+
+	std::mutex mutex;
+	std::condition_variable finished;
+	std::deque<VirtualPageData> done;
+	std::function<void()> ready;
+	int pending; // page jobs not finished yet
+	bool stop;
+};
+
+#endif
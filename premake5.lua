@@ -92,4 +92,38 @@ project "common"
 
 	files( sources )
 
+project "bench"
+	local sources = { 
+		"bench/**.cpp",
+		"bench/**.hpp",
+	}
+
+	kind "ConsoleApp"
+	location "bench"
+
+	files( sources )
+
+	links "common"
+
+	includedirs( "." );
+
+	dependson "x-glm" 
+
+project "tests"
+	local sources = { 
+		"tests/**.cpp",
+		"tests/**.hpp",
+	}
+
+	kind "ConsoleApp"
+	location "tests"
+
+	files( sources )
+
+	links "common"
+
+	includedirs( "." );
+
+	dependson "x-glm" 
+
 --EOF
@@ -1,8 +1,14 @@
 #include <iostream>
 #include <vector>
+#include <algorithm>
 #include <limits>
 #include <fstream>
 #include <sstream>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <memory>
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
@@ -12,6 +18,18 @@
 #include <glm/gtc/matrix_transform.hpp>
 using namespace glm;
 #include "common/utils.hpp"
+#include "common/heightcodec.hpp"
+#include "common/terrainmesh.hpp"
+#include "common/renderbackend.hpp"
+#include "common/softraster.hpp"
+#include "common/framescheduler.hpp"
+#include "common/framegovernor.hpp"
+#include "common/viewshed.hpp"
+#include "common/terrainlayers.hpp"
+#include "common/virtualtexture.hpp"
+#include "common/terrainedit.hpp"
+#include "common/jobsystem.hpp"
+#include "common/farfield.hpp"
 #include <common/controls.hpp>
 
 using namespace std;
@@ -22,7 +40,6 @@ static const int window_width = 800;
 static const int window_height = 600;
 static const int n_points = 200; // Minimum 2
 static const float m_scale = 5;
-unsigned int nIndices;
 bool glPolygonModeState = false; // State for wireframe mode
 
 // VAO
@@ -49,6 +66,130 @@ GLuint programID;
 // Light direction and height map scale - Global
 glm::vec3 lightDir = glm::normalize(glm::vec3(0, -0.15, 1)); // Light source direction
 float heightMapScaleValue = 0.000002f; // Heightmap scaling
+float tessLevel = 1.0f; // Tessellation level of every patch
+
+// Height map kept on the CPU for terrain analysis, same rows as the texture
+vector<int32_t> terrainHeights;
+int terrainWidth = 0;
+int terrainHeight = 0;
+
+// Viewshed overlay: how many of the placed observers see each height map cell, drawn over the materials
+bool viewshedOverlay = false;
+GLuint viewshedTextureID;
+vector<ViewshedObserver> viewshedObservers;
+unsigned int viewshedGeneration = 0; // bumped by every change of the observers or heights, older bakes are dropped
+
+// Derived terrain layers (slope, aspect, curvature, flow accumulation) packed in one RGBA8 texture,
+// slope steers the material blend and every layer can be shown as an analysis overlay
+GLuint terrainLayersID;
+vector<uint32_t> terrainFlow; // does not depend on the height scale, computed once and again after edits when it is shown
+int terrainLayerOverlay = 0; // 0 = none, 1 = slope, 2 = aspect, 3 = curvature, 4 = flow accumulation
+vector<unsigned char> terrainLayerTexels; // the texture contents, patched in place after edits
+float terrainLayerCurvatureRange = 0.0f; // curvature range the texture was packed with
+
+// Sculpting: brushes edit terrainHeights, only the changed rectangle of the height map and of the derived layers is
+// updated. E toggles sculpt mode, the brush follows the centre of the screen while a mouse button is held
+unique_ptr<TerrainEditor> terrainEditor;
+bool sculptMode = false;
+bool sculpting = false;
+bool sculptInvert = false; // right button: lower instead of raise and the other way round
+TerrainBrush sculptBrush;
+float sculptRate = 200000.0f; // raise / lower, height units per second at the brush centre
+double sculptLastTime = 0.0;
+GLuint heightmapUploadPBO;
+
+// Render on demand: frames are only drawn when the camera, light, scale or other inputs changed
+FrameScheduler frameScheduler;
+static const double idleWaitTimeout = 0.25; // seconds the loop may sleep between checks when nothing changes
+
+// Visibility buffer: a cheap geometry pass stores depth + UV / height, then one full screen pass shades every pixel once
+bool visibilityBufferMode = false;
+GLuint visProgramID;
+GLuint visShadeProgramID;
+GLuint visFramebuffer;
+GLuint visibilityTextureID;
+GLuint visDepthTextureID;
+GLuint fullScreenVAO;
+
+// Frame time governor: the GPU time of every frame (timer queries) drives the internal resolution and the LOD level
+bool governorEnabled = true;
+FrameGovernor frameGovernor;
+int governorLod = 0; // 0 = full detail, every level moves to the next mesh LOD and halves the tessellation
+double governorTitleTime = 0.0; // when the window title last showed the governor state
+// Scaled rendering goes to an offscreen target and is upscaled to the window, renderTarget 0 draws to the window directly
+GLuint sceneFramebuffer;
+GLuint sceneColorTextureID;
+GLuint sceneDepthTextureID;
+GLuint renderTarget = 0;
+int renderWidth = window_width;
+int renderHeight = window_height;
+// Index ranges of the grid at strides 1, 2 and 4, all in elementbuffer
+static const int lodLevels = 3;
+unsigned int lodIndexOffset[lodLevels];
+unsigned int lodIndexCount[lodLevels];
+int terrainLod = 0;
+// Ring of timer queries, results are read a few frames later so the CPU never waits for the GPU
+static const int frameQueryCount = 4;
+GLuint frameQueries[frameQueryCount];
+int frameQueryNext = 0;
+int frameQueriesPending = 0;
+
+// Virtual texturing of the materials: a low resolution feedback pass reports the pages that are sampled, a loader
+// thread cuts them from the images and they are copied into a physical texture of fixed size, however many or large
+// the material layers are. Decided before loading, the classic material textures are not created when it is on
+bool virtualTexturing = true;
+static const int vtSlotsAcross = 16;     // the physical texture holds 16 x 16 pages
+static const int vtFeedbackDivider = 8;  // feedback resolution = window / 8
+static const int vtMaxRequests = 32;     // pages requested from the loader per frame
+static const int vtMaxUploads = 16;      // loaded pages copied to the physical texture per frame
+unique_ptr<VirtualTextureLoader> vtLoader;
+unique_ptr<VirtualPageCache> vtCache;
+GLuint vtPhysicalTextureID;
+GLuint vtIndirectionBuffer;
+GLuint vtIndirectionTextureID;
+unsigned int vtTableVersion = 0;
+GLuint vtFeedbackProgramID;
+GLuint vtFeedbackFramebuffer;
+GLuint vtFeedbackTextureID;
+GLuint vtFeedbackDepthID;
+// Feedback is read back through two pixel buffers, each one is mapped two frames after it was written
+GLuint vtFeedbackPBO[2];
+GLsync vtFeedbackFence[2] = { 0, 0 };
+int vtFrame = 0;
+int vtSettleFrames = 0; // frames still drawn after the view changed, until its feedback has been read
+unsigned int drawnFrameFlags = DIRTY_ALL; // why the frame being drawn was requested
+
+// Far field impostor: terrain beyond a radius around the camera comes from a cube map rendered a face per frame,
+// only the near field is drawn every frame. Two cubes, one shown while the other is built. I toggles it
+bool farFieldEnabled = true;
+FarField farField;
+static const int farFieldFaceSize = 512;
+GLuint farFieldColorID[2];
+GLuint farFieldDepthID[2];
+GLuint farFieldFramebuffer;
+GLuint farFieldProgramID;
+unsigned int farFieldTableVersion = 0; // virtual texture pages the cube was built with
+double farFieldInvalidateTime = 0.0;     // glfwGetTime() of the last refresh for new pages
+static const double farFieldInvalidateInterval = 1.0;
+TerrainRect farFieldEditRect;            // cells uploaded since the sectors were last invalidated for edits
+bool farFieldEditFinished = false;       // a stroke, undo or redo ended, FinishTerrainEdit
+
+// Camera and light run on the fixed timestep simulation thread, fed with input events by the loop. Frames show its
+// snapshots interpolated to the present time. Latency is measured from an input to the present of the first frame
+// showing it, jitter as the deviation of the intervals between frames drawn back to back
+Simulation simulation;
+TimingStats inputLatency;
+TimingStats frameIntervals;
+unsigned long long latencyInputCount = 0; // inputs consumed by the last snapshot taken
+double latencyInputTime = 0.0;            // newest of them, 0 once measured
+
+// CPU side of the terrain model, built on the job system while the textures load
+struct TerrainModelData
+{
+	std::vector<glm::vec3> vertices;
+	std::vector<glm::vec2> uvs;
+	std::vector<unsigned int> indices;
+};
 
 // Functions for cleaning resources
 void UnloadShaders();
@@ -57,13 +198,35 @@ void UnloadModel();
 
 // Function prototypes for shader and model loading
 void LoadShaders(GLuint& program, const char* vertex_file_path, const char* fragment_file_path, const char* tcsPath = nullptr, const char* tesPath = nullptr);
-void LoadTextures();
-void LoadModel();
+bool LoadTextures();
+vector<JobHandle> LoadMaterialTextures();
+void UploadMaterialTexture(GLuint& id, int width, int height, unsigned char* data);
+void BuildTerrainModel(TerrainModelData& model);
+void LoadModel(const TerrainModelData& model);
+void LoadVisibilityBuffer();
+void UnloadVisibilityBuffer();
+void LoadRenderTarget();
+void UnloadRenderTarget();
+void LoadVirtualTexturing();
+void UnloadVirtualTexturing();
+void LoadFarField();
+void UnloadFarField();
+void UpdateFarField(const TerrainFrame& frame);
+TerrainFrame MakeNearFieldFrame(const TerrainFrame& frame);
+void DrawFarField(const TerrainFrame& frame);
 
 // Additional function prototypes
 void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods);
-void RotateLightDirection(int key);
 void AdjustHeightMapScaling(int key);
+void RunVisibilityBenchmark();
+void AddViewshedObserverAtCamera();
+void UpdateViewshed();
+void UpdateTerrainLayers();
+void FinishTerrainEdit();
+void SetRenderScale(float scale);
+void ApplyGovernor();
+void SetGovernorLodRange();
+void SetVirtualTextureUniforms(GLuint program);
 
 //Clean shader program
 void UnloadShaders()
@@ -86,6 +249,9 @@ void UnloadTextures()
 	glDeleteTextures(1, &rockSpecularID);
 	glDeleteTextures(1, &rockDiffuseID);
 	glDeleteTextures(1, &heightmapID);
+	glDeleteBuffers(1, &heightmapUploadPBO);
+	glDeleteTextures(1, &viewshedTextureID);
+	glDeleteTextures(1, &terrainLayersID);
 }
 
 //Used to clean up model-related resources
@@ -97,23 +263,45 @@ void UnloadModel()
 	glDeleteVertexArrays(1, &VertexArrayID);
 }
 
-//Read the shader code from the specified path, compile it, and check whether the compilation was successful
-bool readAndCompileShader(const char* shader_path, const GLuint& id)
+//Read shader code, a line #include "file" is replaced by the code of that file (the GLSL shared by several shaders)
+bool readShaderCode(const char* shader_path, string& shaderCode, int depth = 0)
 {
-	//Read shader code
-	string shaderCode;
 	ifstream shaderStream(shader_path, std::ios::in);
-	if (shaderStream.is_open()) {
-		stringstream sstr;
-		sstr << shaderStream.rdbuf();
-		shaderCode = sstr.str();
-		shaderStream.close();
-	}
-	else
+	if (!shaderStream.is_open())
 	{
 		cout << "Impossible to open " << shader_path << ". Are you in the right directory ? " << endl;
 		return false;
 	}
+	if (depth > 8)
+	{
+		cout << "Shader includes nested too deeply in " << shader_path << endl;
+		return false;
+	}
+
+	string line;
+	while (getline(shaderStream, line))
+	{
+		const size_t directive = line.find("#include");
+		const size_t open = line.find('"');
+		const size_t close = line.rfind('"');
+		if (directive != string::npos && line.find_first_not_of(" \t") == directive && open != string::npos && close > open)
+		{
+			if (!readShaderCode(line.substr(open + 1, close - open - 1).c_str(), shaderCode, depth + 1))
+				return false;
+		}
+		else
+			shaderCode += line + "\n";
+	}
+	return true;
+}
+
+//Read the shader code from the specified path, compile it, and check whether the compilation was successful
+bool readAndCompileShader(const char* shader_path, const GLuint& id)
+{
+	//Read shader code
+	string shaderCode;
+	if (!readShaderCode(shader_path, shaderCode))
+		return false;
 
 	//Compile shader
 	cout << "Compiling shader :" << shader_path << endl;
@@ -199,12 +387,25 @@ void LoadShaders(GLuint& program, const char* vertex_file_path, const char* frag
 }
 
 
-void LoadTextures()
+bool LoadTextures()
 {
-	// height map loads BMP images
+	// The material images decode on the workers while the height map is read and its layers are computed.
+	// With virtual texturing the materials are streamed as pages by LoadVirtualTexturing instead
+	vector<JobHandle> materialJobs;
+	if (!virtualTexturing)
+		materialJobs = LoadMaterialTextures();
+
+	// height map: prefer the compressed terrain codec, the BMP is only read again when it changed since the .thm cache
 	int width, height;
 	unsigned char* data = nullptr;
-	loadBMP_custom("mountains_height.bmp", width, height, data);
+	if (!loadHeightmapCached("mountains_height.bmp", "mountains_height.thm", width, height, data))
+	{
+		// The decoded materials still post their uploads, they are made before giving up
+		for (const JobHandle& job : materialJobs)
+			jobSystem().wait(job);
+		jobSystem().runMainThreadJobs();
+		return false;
+	}
 
 	//Create and bind textures
 	glGenTextures(1, &heightmapID);
@@ -214,6 +415,11 @@ void LoadTextures()
     //Set the pixel storage mode to ensure that the image data is correctly aligned
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, data);
+	//Keep the decoded heights for the viewshed analysis
+	terrainWidth = width;
+	terrainHeight = height;
+	terrainHeights.resize(size_t(width) * height);
+	unpackHeightsBGR(data, width, height, terrainHeights.data());
 	//Clear previously allocated image data memory
 	delete[] data;
 
@@ -225,235 +431,141 @@ void LoadTextures()
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	//Set the texture's magnification filter to: Select the color of the nearest texture element as the output color
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	//Set the texture reduction filter to: trilinear filtering = mipmap linear interpolation
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-
-	// generate Mipmap
-	glGenerateMipmap(GL_TEXTURE_2D);
-
-	//Unbind texture
-	glBindTexture(GL_TEXTURE_2D, -1);
-
-	// rocks diffuse loads and sets the "rock" diffuse texture in OpenGL
-    //Load BMP pictures
-	data = nullptr;
-	loadBMP_custom("rocks.bmp", width, height, data);
-
-	//Create and bind textures
-	glGenTextures(1, &rockDiffuseID);
-	glBindTexture(GL_TEXTURE_2D, rockDiffuseID);
-
-	//Set up textures and upload data
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, data);
-
-	//Clean image data memory
-	delete[] data;
-
-	//Set texture parameters
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-
-	//Generate mipmap
-	glGenerateMipmap(GL_TEXTURE_2D);
+	//Set the texture reduction filter to: nearest as well. The shaders only read the base level (blending packed
+	//24 bit heights would be meaningless), and without mipmaps an edit only has to upload the cells it changed
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 
 	//Unbind texture
 	glBindTexture(GL_TEXTURE_2D, -1);
 
-	// rocks specular
-	data = nullptr;
-	loadBMP_custom("rocks-r.bmp", width, height, data);
-
-	glGenTextures(1, &rockSpecularID);
-	glBindTexture(GL_TEXTURE_2D, rockSpecularID);
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, data);
-	//The function before delete transfers data from cpu to gpu
-	delete[] data;
-
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glGenerateMipmap(GL_TEXTURE_2D);
-
-	glBindTexture(GL_TEXTURE_2D, -1);
-
-	// rocks normal
-	data = nullptr;
-	loadBMP_custom("rocks-n.bmp", width, height, data);
-
-	glGenTextures(1, &rockNormalID);
-	glBindTexture(GL_TEXTURE_2D, rockNormalID);
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, data);
-	delete[] data;
-
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glGenerateMipmap(GL_TEXTURE_2D);
-
-	glBindTexture(GL_TEXTURE_2D, -1);
-
-	// grass diffuse
-	data = nullptr;
-	loadBMP_custom("grass.bmp", width, height, data);
+	// Sculpting edits the CPU heights, changed rectangles are streamed through this buffer
+	glGenBuffers(1, &heightmapUploadPBO);
+	terrainEditor.reset(new TerrainEditor(terrainHeights.data(), terrainWidth, terrainHeight));
 
-	glGenTextures(1, &grassDiffuseID);
-	glBindTexture(GL_TEXTURE_2D, grassDiffuseID);
+	// viewshed overlay, one byte per height map cell, empty until observers are placed
+	vector<unsigned char> noObservers(size_t(terrainWidth) * terrainHeight, 0);
+	glGenTextures(1, &viewshedTextureID);
+	glBindTexture(GL_TEXTURE_2D, viewshedTextureID);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, terrainWidth, terrainHeight, 0, GL_RED, GL_UNSIGNED_BYTE, noObservers.data());
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, data);
-	delete[] data;
-
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glGenerateMipmap(GL_TEXTURE_2D);
-
-	glBindTexture(GL_TEXTURE_2D, -1);
-
-	// grass specular
-	data = nullptr;
-	loadBMP_custom("grass-r.bmp", width, height, data);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
 
-	glGenTextures(1, &grassSpecularID);
-	glBindTexture(GL_TEXTURE_2D, grassSpecularID);
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, data);
-	delete[] data;
+	// derived terrain layers, filled from the heights for the current height scale
+	glGenTextures(1, &terrainLayersID);
+	glBindTexture(GL_TEXTURE_2D, terrainLayersID);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, terrainWidth, terrainHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	UpdateTerrainLayers();
 
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glGenerateMipmap(GL_TEXTURE_2D);
+	// Each decoded material posts its upload to the main thread queue before its job finishes
+	for (const JobHandle& job : materialJobs)
+	{
+		jobSystem().wait(job);
+		jobSystem().runMainThreadJobs();
+	}
+	return true;
+}
 
-	glBindTexture(GL_TEXTURE_2D, -1);
+//Decode the nine material images on the job system, each one is uploaded on the main thread once decoded
+vector<JobHandle> LoadMaterialTextures()
+{
+	struct Material
+	{
+		const char* file;
+		GLuint* id;
+	};
+	const Material materials[] = {
+		{ "rocks.bmp", &rockDiffuseID }, { "rocks-r.bmp", &rockSpecularID }, { "rocks-n.bmp", &rockNormalID },
+		{ "grass.bmp", &grassDiffuseID }, { "grass-r.bmp", &grassSpecularID }, { "grass-n.bmp", &grassNormalID },
+		{ "snow.bmp", &snowDiffuseID }, { "snow-r.bmp", &snowSpecularID }, { "snow-n.bmp", &snowNormalID },
+	};
+
+	vector<JobHandle> jobs;
+	for (const Material& material : materials)
+	{
+		jobs.push_back(jobSystem().submit([material]() {
+			//Load BMP pictures
+			int width = 0, height = 0;
+			unsigned char* data = nullptr;
+			loadBMP_custom(material.file, width, height, data);
+			jobSystem().postToMainThread([material, width, height, data]() { UploadMaterialTexture(*material.id, width, height, data); });
+		}));
+	}
+	return jobs;
+}
 
-	// grass normal
-	data = nullptr;
-	loadBMP_custom("grass-n.bmp", width, height, data);
+//Create a repeating, mipmapped material texture from a decoded image and free the image
+void UploadMaterialTexture(GLuint& id, int width, int height, unsigned char* data)
+{
+	//Create and bind textures
+	glGenTextures(1, &id);
+	glBindTexture(GL_TEXTURE_2D, id);
 
-	glGenTextures(1, &grassNormalID);
-	glBindTexture(GL_TEXTURE_2D, grassNormalID);
+	//Set up textures and upload data
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, data);
-	delete[] data;
-
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glGenerateMipmap(GL_TEXTURE_2D);
-
-	glBindTexture(GL_TEXTURE_2D, -1);
-
-	// snow diffuse
-	data = nullptr;
-	loadBMP_custom("snow.bmp", width, height, data);
 
-	glGenTextures(1, &snowDiffuseID);
-	glBindTexture(GL_TEXTURE_2D, snowDiffuseID);
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, data);
+	//Clean image data memory, the function before delete transfers data from cpu to gpu
 	delete[] data;
 
+	//Set texture parameters
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glGenerateMipmap(GL_TEXTURE_2D);
-
-	glBindTexture(GL_TEXTURE_2D, -1);
-
-	// snow specular
-	data = nullptr;
-	loadBMP_custom("snow-r.bmp", width, height, data);
-
-	glGenTextures(1, &snowSpecularID);
-	glBindTexture(GL_TEXTURE_2D, snowSpecularID);
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, data);
-	delete[] data;
 
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	//Generate mipmap
 	glGenerateMipmap(GL_TEXTURE_2D);
 
+	//Unbind texture
 	glBindTexture(GL_TEXTURE_2D, -1);
+}
 
-	// snow normal
-	data = nullptr;
-	loadBMP_custom("snow-n.bmp", width, height, data);
-
-	glGenTextures(1, &snowNormalID);
-	glBindTexture(GL_TEXTURE_2D, snowNormalID);
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, data);
-	delete[] data;
-
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glGenerateMipmap(GL_TEXTURE_2D);
+//Index that ends a strip, see LoadModel
+constexpr unsigned int restartIndex = std::numeric_limits<std::uint32_t>::max();
 
-	glBindTexture(GL_TEXTURE_2D, -1);
+//Creation of vertex, UV and index data, no GL calls so it can run on a worker
+void BuildTerrainModel(TerrainModelData& model)
+{
+	//The grid itself is shared with the software backend
+	std::vector<unsigned int> strips;
+	buildTerrainGrid(n_points, m_scale, restartIndex, model.vertices, model.uvs, strips);
+	//The program has tessellation stages, so the strips are resolved into 3 vertex patches.
+	//Coarser LOD levels reuse the same vertices with every 2nd / 4th row and column and follow in the same index buffer
+	std::vector<unsigned int> triangles;
+	for (int lod = 0; lod < lodLevels; lod++)
+	{
+		if (lod > 0)
+			buildTerrainStrips(n_points, 1 << lod, restartIndex, strips);
+		stripToTriangles(strips, restartIndex, triangles);
+		lodIndexOffset[lod] = model.indices.size();
+		lodIndexCount[lod] = triangles.size();
+		model.indices.insert(model.indices.end(), triangles.begin(), triangles.end());
+	}
 }
 
 //Loading models using vertex buffer objects and element buffer objects
-void LoadModel()
+void LoadModel(const TerrainModelData& model)
 {
-	//Creation of vertex, UV and index data
-	std::vector<glm::vec3> vertices;
-	std::vector<glm::vec2> uvs;
-	std::vector<unsigned int> indices;
-	//Calculate the x and z coordinates of each point through nested loops, set the y coordinate to 0, and assume it is a plane
-	for (int i = 0; i < n_points; i++)
-	{
-		float x = (m_scale) * ((i / float(n_points - 1)) - 0.5f) * 2.0f;
-		for (int j = 0; j < n_points; j++)
-		{
-			float z = (m_scale) * ((j / float(n_points - 1)) - 0.5f) * 2.0f;
-			vertices.push_back(vec3(x, 0, z));
-			uvs.push_back(vec2(float(i + 0.5f) / float(n_points - 1),
-				float(j + 0.5f) / float(n_points - 1)));
-		}
-	}
+	const std::vector<glm::vec3>& vertices = model.vertices;
+	const std::vector<glm::vec2>& uvs = model.uvs;
+	const std::vector<unsigned int>& indices = model.indices;
 	//Enable primitive restart: a mechanism that allows restarting the primitive drawing sequence when drawing
     // Because it allows you to use the same index array to draw multiple separate primitives in a single draw call. This reduces the number of draw calls, thus improving performance.
 	glEnable(GL_PRIMITIVE_RESTART);
-	constexpr unsigned int restartIndex = std::numeric_limits<std::uint32_t>::max();
  	//When OpenGL encounters this value when drawing the index array, it will end the current primitive drawing and start drawing a new primitive from the next index.
     //Then the function of the above function is to run the function after you reach the specified index, allowing you to restart the above process from the first point of the third line.
 	glPrimitiveRestartIndex(restartIndex);
 
-	//Index array used to generate the grid
-	int n = 0;
-	// row
-	for (int i = 0; i < n_points - 1; i++)
-	{
-		// line
-		for (int j = 0; j < n_points; j++)
-		{
-			//Calculate and add index
-			unsigned int topLeft = n;
-			unsigned int bottomLeft = topLeft + n_points;
-			indices.push_back(bottomLeft);
-			indices.push_back(topLeft);
-			n++;
-		}
-		//Tells OpenGL that the current primitive ends and the next primitive is about to begin
-		indices.push_back(restartIndex);
-	}
-
 	//Create and set up vertex array objects and vertex buffer objects to store and manage vertex data
     //Create and bind VAO
 	glGenVertexArrays(1, &VertexArrayID);
@@ -498,8 +610,6 @@ void LoadModel()
 	//Fill index data into buffer
 	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0],
 		GL_STATIC_DRAW);
-	//Set the number of indexes
-	nIndices = indices.size();
 }
 
 //Steps to set up the OpenGL environment and create a rendering window
@@ -560,11 +670,16 @@ bool initializeGL()
 void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
 	// Handle both press and repeat actions
 	if (action == GLFW_PRESS || action == GLFW_REPEAT) {
+		// Toggles and reloads that change the picture flag it themselves, scale is flagged in its own function and edits
+		// as DIRTY_TERRAIN. W / S / A / D turn the light and the arrow keys move the camera on the simulation thread,
+		// see pollSimulationInput. Everything else (sculpt brush settings, repeats of toggles) draws nothing new
 		switch (key) {
 		case GLFW_KEY_SPACE:
 			if (action == GLFW_PRESS) { // Only toggle on a fresh press
 				glPolygonMode(GL_FRONT_AND_BACK, glPolygonModeState ? GL_FILL : GL_LINE);
 				glPolygonModeState = !glPolygonModeState;
+				farField.invalidate();
+				frameScheduler.markDirty(DIRTY_SETTINGS);
 			}
 			break;
 
@@ -572,21 +687,143 @@ void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
 			// Reload shaders - maybe only on press to avoid too frequent reloads
 			if (action == GLFW_PRESS) {
 				LoadShaders(programID, "Basic.vert", "Texture.frag", "dLod.tesc", "dLod.tese");
+				LoadShaders(visProgramID, "Basic.vert", "VisBuffer.frag", "dLod.tesc", "dLod.tese");
+				LoadShaders(visShadeProgramID, "FullScreen.vert", "TerrainShade.frag");
+				if (virtualTexturing)
+					LoadShaders(vtFeedbackProgramID, "Basic.vert", "VTFeedback.frag", "dLod.tesc", "dLod.tese");
+				LoadShaders(farFieldProgramID, "FullScreen.vert", "FarField.frag");
+				farField.invalidate();
+				frameScheduler.markDirty(DIRTY_SETTINGS);
 			}
 			break;
 
-		case GLFW_KEY_W:
-		case GLFW_KEY_S:
-		case GLFW_KEY_A:
-		case GLFW_KEY_D:
-			RotateLightDirection(key);
-			break;
-
 		case GLFW_KEY_T:
 		case GLFW_KEY_G:
 			AdjustHeightMapScaling(key);
 			break;
 
+		case GLFW_KEY_V:
+			// Toggle between forward shading and the visibility buffer
+			if (action == GLFW_PRESS) {
+				visibilityBufferMode = !visibilityBufferMode;
+				frameScheduler.markDirty(DIRTY_SETTINGS);
+				cout << (visibilityBufferMode ? "Visibility buffer shading" : "Forward shading") << endl;
+			}
+			break;
+
+		case GLFW_KEY_LEFT_BRACKET:
+		case GLFW_KEY_RIGHT_BRACKET:
+			// Halve / double the tessellation level
+			if (action == GLFW_PRESS) {
+				tessLevel = std::min(64.0f, std::max(1.0f, key == GLFW_KEY_RIGHT_BRACKET ? tessLevel * 2.0f : tessLevel * 0.5f));
+				farField.invalidate();
+				SetGovernorLodRange();
+				frameScheduler.markDirty(DIRTY_SETTINGS);
+				cout << "Tessellation level " << tessLevel << endl;
+			}
+			break;
+
+		case GLFW_KEY_F:
+			// Toggle the frame time governor, off renders at full resolution and detail
+			if (action == GLFW_PRESS) {
+				governorEnabled = !governorEnabled;
+				frameGovernor.reset();
+				ApplyGovernor();
+				if (!governorEnabled)
+					glfwSetWindowTitle(window, "OpenGLRenderer");
+				frameScheduler.markDirty(DIRTY_SETTINGS);
+				cout << (governorEnabled ? "Frame time governor on" : "Frame time governor off") << endl;
+			}
+			break;
+
+		case GLFW_KEY_O:
+			// Place a viewshed observer at the camera, Shift+O removes all of them
+			if (action == GLFW_PRESS) {
+				if (mods & GLFW_MOD_SHIFT) {
+					viewshedObservers.clear();
+					viewshedGeneration++;
+					viewshedOverlay = false;
+					farField.invalidate();
+				}
+				else {
+					AddViewshedObserverAtCamera();
+				}
+				frameScheduler.markDirty(DIRTY_SETTINGS);
+			}
+			break;
+
+		case GLFW_KEY_L:
+			// Cycle the terrain layer overlays
+			if (action == GLFW_PRESS) {
+				const char* names[] = { "none", "slope", "aspect", "curvature", "flow accumulation" };
+				terrainLayerOverlay = (terrainLayerOverlay + 1) % 5;
+				// Flow accumulation is not kept current while sculpting, see FinishTerrainEdit
+				if (terrainLayerOverlay == 4 && terrainFlow.empty())
+					UpdateTerrainLayers();
+				farField.invalidate();
+				frameScheduler.markDirty(DIRTY_SETTINGS);
+				cout << "Terrain layer overlay: " << names[terrainLayerOverlay] << endl;
+			}
+			break;
+
+		case GLFW_KEY_I:
+			// Toggle the far field impostor, off draws the whole terrain every frame
+			if (action == GLFW_PRESS) {
+				farFieldEnabled = !farFieldEnabled;
+				farField.reset();
+				frameScheduler.markDirty(DIRTY_SETTINGS);
+				cout << (farFieldEnabled ? "Far field impostor on" : "Far field impostor off") << endl;
+			}
+			break;
+
+		case GLFW_KEY_B:
+			if (action == GLFW_PRESS) {
+				// The benchmark leaves its last frame in the window
+				RunVisibilityBenchmark();
+				frameScheduler.markDirty(DIRTY_SETTINGS);
+			}
+			break;
+
+		case GLFW_KEY_E:
+			// Toggle sculpt mode: left mouse button applies the brush, right button the opposite
+			if (action == GLFW_PRESS) {
+				sculptMode = !sculptMode;
+				cout << (sculptMode ? "Sculpt mode on: 1 raise, 2 lower, 3 smooth, 4 flatten, -/= brush size, Ctrl+Z / Ctrl+Y undo / redo"
+					: "Sculpt mode off") << endl;
+			}
+			break;
+
+		case GLFW_KEY_1:
+		case GLFW_KEY_2:
+		case GLFW_KEY_3:
+		case GLFW_KEY_4:
+			if (action == GLFW_PRESS && sculptMode) {
+				const char* names[] = { "raise", "lower", "smooth", "flatten" };
+				sculptBrush.mode = BrushMode(key - GLFW_KEY_1);
+				cout << "Brush: " << names[sculptBrush.mode] << endl;
+			}
+			break;
+
+		case GLFW_KEY_MINUS:
+		case GLFW_KEY_EQUAL:
+			if (sculptMode) {
+				sculptBrush.radius = std::min(256.0f, std::max(2.0f, sculptBrush.radius * (key == GLFW_KEY_EQUAL ? 1.25f : 0.8f)));
+				cout << "Brush radius " << sculptBrush.radius << " cells" << endl;
+			}
+			break;
+
+		case GLFW_KEY_Z:
+		case GLFW_KEY_Y:
+			// Undo / redo a whole stroke, once per key press: a held key does not auto-repeat through the history
+			if (action == GLFW_PRESS && (mods & GLFW_MOD_CONTROL) && terrainEditor && !sculpting) {
+				bool redo = key == GLFW_KEY_Y || (mods & GLFW_MOD_SHIFT);
+				if (redo ? terrainEditor->redo() : terrainEditor->undo()) {
+					frameScheduler.markDirty(DIRTY_TERRAIN);
+					FinishTerrainEdit();
+				}
+			}
+			break;
+
 		case GLFW_KEY_ESCAPE:
 			if (action == GLFW_PRESS) {
 				glfwSetWindowShouldClose(window, GLFW_TRUE);
@@ -597,36 +834,17 @@ void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
 			break;
 		}
 	}
-}
-
-// Function to rotate light direction based on key input
-void RotateLightDirection(int key) {
-	float speed = 0.6f;
-	glm::vec3 rotationAxis;
-
-	switch (key) {
-	case GLFW_KEY_W:
-		rotationAxis = glm::vec3(1, 0, 0);
-		break;
-	case GLFW_KEY_S:
-		rotationAxis = glm::vec3(-1, 0, 0);
-		break;
-	case GLFW_KEY_A:
-		rotationAxis = glm::vec3(0, 1, 0);
-		break;
-	case GLFW_KEY_D:
-		rotationAxis = glm::vec3(0, -1, 0);
-		break;
-	default:
-		return;
+	// Slope and curvature depend on the height scale, recompute them once the scale key is released
+	else if (action == GLFW_RELEASE && (key == GLFW_KEY_T || key == GLFW_KEY_G)) {
+		UpdateTerrainLayers();
+		frameScheduler.markDirty(DIRTY_HEIGHT_SCALE);
 	}
-
-	lightDir = glm::vec3(glm::rotate(glm::mat4(1.0f), glm::radians(speed), rotationAxis) * glm::vec4(lightDir, 0.0f));
 }
 
 // Function to adjust height map scaling based on key input
 void AdjustHeightMapScaling(int key) {
 	float heightTransitionSpeed = 0.00000006f;
+	float previousScale = heightMapScaleValue;
 
 	if (key == GLFW_KEY_T) {
 		heightMapScaleValue += heightTransitionSpeed;
@@ -636,152 +854,1476 @@ void AdjustHeightMapScaling(int key) {
 	}
 
 	heightMapScaleValue = std::min(0.000006f, std::max(0.0f, heightMapScaleValue));
+	if (heightMapScaleValue != previousScale)
+		frameScheduler.markDirty(DIRTY_HEIGHT_SCALE);
 }
 
-//Render and control 3D graphics
-int main()
+// Gathers the uniforms of one frame from the camera and the global light / height map state
+TerrainFrame MakeTerrainFrame()
 {
-	// Initialize the OpenGL environment
-	if (!initializeGL())
-		return -1;
+	TerrainFrame frame;
+	frame.Model = glm::mat4(1.0);
+	frame.MVP = getProjectionMatrix() * getViewMatrix() * frame.Model;
+	frame.lightDir = lightDir;
+	frame.viewPos = getCameraPosition();
+	frame.heightMapScale = heightMapScaleValue;
+	frame.numOfVertices = n_points;
+	// The governor trades tessellation for frame time, each LOD level halves it
+	frame.tessLevel = std::max(1.0f, tessLevel * std::pow(0.5f, float(governorLod)));
+	frame.field = FIELD_ALL;
+	frame.fieldCentre = frame.viewPos;
+	frame.fieldRadius = 0.0f;
+	return frame;
+}
 
-	// Load models and textures
-	LoadModel();
-	LoadTextures();
+//Set the per frame uniforms read by Basic.vert and the tessellation stages, the program must be in use
+void SetTerrainUniforms(GLuint program, const TerrainFrame& frame)
+{
+	// Get a handle for our uniforms and set MVP matrix uniform
+	GLuint MatrixID = glGetUniformLocation(program, "MVP");
+	// Pass the previously calculated MVP matrix to the shader
+	glUniformMatrix4fv(MatrixID, 1, GL_FALSE, &frame.MVP[0][0]);
+
+	// Bind model matrix and set model matrix uniform
+	GLuint modelMatrix = glGetUniformLocation(program, "Model");
+	// Transform object from model space to world space
+	glUniformMatrix4fv(modelMatrix, 1, GL_FALSE, &frame.Model[0][0]);
+
+	// Bind height map texture
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, heightmapID);
+	GLuint heightMapSampler = glGetUniformLocation(program, "heightMapSampler");
+	glUniform1i(heightMapSampler, 0);
 
-	// Create and load shader programs
-	programID = glCreateProgram();
-	LoadShaders(programID, "Basic.vert", "Texture.frag", "dLod.tesc", "dLod.tese");
+	// Uniform: height map scale, retrieve the uniform location of heightMapScale, and pass the value of heightMapScaleValue to the shader
+	GLuint heightMapScale = glGetUniformLocation(program, "heightMapScale");
+	glUniform1f(heightMapScale, frame.heightMapScale);
 
-	// Register key callback
-	glfwSetKeyCallback(window, KeyCallback);
+	// Uniform: number of vertices
+	GLuint numOfVertices = glGetUniformLocation(program, "numOfVertices");
+	glUniform1i(numOfVertices, frame.numOfVertices);
 
-	//Set rendering state
-	glClearColor(0.7f, 0.8f, 1.0f, 0.0f);
-	glEnable(GL_DEPTH_TEST);
-	glDepthFunc(GL_LESS);
-	glEnable(GL_CULL_FACE);
+	// Uniform: light direction (WCS)
+	GLuint lightDir_wcs = glGetUniformLocation(program, "lightDir_wcs");
+	glUniform3f(lightDir_wcs, frame.lightDir.x, frame.lightDir.y, frame.lightDir.z);
 
-	// Set rendering state
-	do {
-		// Clear the screen and depth buffer
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		// Compute the MVP matrix from keyboard and mouse input
-		computeMatricesFromInputs();
-
-		// Set and compute MVP matrix
-		glm::mat4 ProjectionMatrix = getProjectionMatrix();
-		glm::mat4 ViewMatrix = getViewMatrix();
-		glm::mat4 ModelMatrix = glm::mat4(1.0);
-		glm::mat4 MVP = ProjectionMatrix * ViewMatrix * ModelMatrix;
-
-		// we will add more code here
-		// First pass: Base mesh
-		// Use shader program
-		glUseProgram(programID);
-		// Get a handle for our uniforms and set MVP matrix uniform
-		GLuint MatrixID = glGetUniformLocation(programID, "MVP");
-		// Pass the previously calculated MVP matrix to the shader
-		glUniformMatrix4fv(MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-		// Bind model matrix and set model matrix uniform
-		GLuint modelMatrix = glGetUniformLocation(programID, "Model");
-		// Transform object from model space to world space
-		glUniformMatrix4fv(modelMatrix, 1, GL_FALSE, &ModelMatrix[0][0]);
-
-		// Bind height map texture
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, heightmapID);
-		GLuint heightMapSampler = glGetUniformLocation(programID, "heightMapSampler");
-		glUniform1i(heightMapSampler, 0);
-
-		// Uniform: height map scale, retrieve the uniform location of heightMapScale, and pass the value of heightMapScaleValue to the shader
-		GLuint heightMapScale = glGetUniformLocation(programID, "heightMapScale");
-		glUniform1f(heightMapScale, heightMapScaleValue);
-
-		// Uniform: number of vertices
-		GLuint numOfVertices = glGetUniformLocation(programID, "numOfVertices");
-		glUniform1i(numOfVertices, n_points);
-
-		// Uniform: light direction (WCS)
-		GLuint lightDir_wcs = glGetUniformLocation(programID, "lightDir_wcs");
-		glUniform3f(lightDir_wcs, lightDir.x, lightDir.y, lightDir.z);
-
-		// Uniform: view position (WCS)
-		auto camPos = getCameraPosition();
-		GLuint viewPos_wcs = glGetUniformLocation(programID, "viewPos_wcs");
-		glUniform3f(viewPos_wcs, camPos.x, camPos.y, camPos.z);
-
-		// Bind rock diffuse texture
-		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, rockDiffuseID);
-		GLuint rockDiffSampler = glGetUniformLocation(programID, "rockDiffSampler");
-		glUniform1i(rockDiffSampler, 1);
-
-		// Bind rock specular texture
-		glActiveTexture(GL_TEXTURE2);
-		glBindTexture(GL_TEXTURE_2D, rockSpecularID);
-		GLuint rockSpecSampler = glGetUniformLocation(programID, "rockSpecSampler");
-		glUniform1i(rockSpecSampler, 2);
-
-		// Bind rock normal texture
-		glActiveTexture(GL_TEXTURE3);
-		glBindTexture(GL_TEXTURE_2D, rockNormalID);
-		GLuint rockNormSampler = glGetUniformLocation(programID, "rockNormSampler");
-		glUniform1i(rockNormSampler, 3);
-
-		// Bind grass diffuse texture
-		glActiveTexture(GL_TEXTURE4);
-		glBindTexture(GL_TEXTURE_2D, grassDiffuseID);
-		GLuint grassDiffSampler = glGetUniformLocation(programID, "grassDiffSampler");
-		glUniform1i(grassDiffSampler, 4);
-
-		// Bind grass specular texture
-		glActiveTexture(GL_TEXTURE5);
-		glBindTexture(GL_TEXTURE_2D, grassSpecularID);
-		GLuint grassSpecSampler = glGetUniformLocation(programID, "grassSpecSampler");
-		glUniform1i(grassSpecSampler, 5);
-
-		// Bind grass normal texture
-		glActiveTexture(GL_TEXTURE6);
-		glBindTexture(GL_TEXTURE_2D, grassNormalID);
-		GLuint grassNormSampler = glGetUniformLocation(programID, "grassNormSampler");
-		glUniform1i(grassNormSampler, 6);
-
-		// Bind snow diffuse texture
-		glActiveTexture(GL_TEXTURE7);
-		glBindTexture(GL_TEXTURE_2D, snowDiffuseID);
-		GLuint snowDiffSampler = glGetUniformLocation(programID, "snowDiffSampler");
-		glUniform1i(snowDiffSampler, 7);
-
-		// Bind snow specular texture
-		glActiveTexture(GL_TEXTURE8);
-		glBindTexture(GL_TEXTURE_2D, snowSpecularID);
-		GLuint snowSpecSampler = glGetUniformLocation(programID, "snowSpecSampler");
-		glUniform1i(snowSpecSampler, 8);
-
-		// Bind snow normal texture
-		glActiveTexture(GL_TEXTURE9);
-		glBindTexture(GL_TEXTURE_2D, snowNormalID);
-		GLuint snowNormSampler = glGetUniformLocation(programID, "snowNormSampler");
-		glUniform1i(snowNormSampler, 9);
-
-		// Render vertex data
-		glDrawElements(
-			GL_TRIANGLE_STRIP, // mode
-			(GLsizei)nIndices, // count
-			GL_UNSIGNED_INT, // type
-			(void*)0 // element array buffer offset
-		);
-		// Swap buffers
-		glfwSwapBuffers(window);
-		glfwPollEvents(); // Ensure the OpenGL application can respond to user interaction
+	// Uniform: view position (WCS)
+	GLuint viewPos_wcs = glGetUniformLocation(program, "viewPos_wcs");
+	glUniform3f(viewPos_wcs, frame.viewPos.x, frame.viewPos.y, frame.viewPos.z);
+
+	// Uniform: tessellation level of every patch
+	GLuint tessLevelID = glGetUniformLocation(program, "tessLevel");
+	glUniform1f(tessLevelID, frame.tessLevel);
+
+	// Uniform: part of the terrain to draw, near or far field of the impostor
+	glUniform1i(glGetUniformLocation(program, "fieldMode"), frame.field);
+	glUniform3f(glGetUniformLocation(program, "fieldCentre"), frame.fieldCentre.x, frame.fieldCentre.y, frame.fieldCentre.z);
+	glUniform1f(glGetUniformLocation(program, "fieldRadius"), frame.fieldRadius);
+}
+
+//Bind the material textures to units 1-9 and point the samplers of the program in use at them
+void BindMaterialTextures(GLuint program)
+{
+	// Bind rock diffuse texture
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, rockDiffuseID);
+	GLuint rockDiffSampler = glGetUniformLocation(program, "rockDiffSampler");
+	glUniform1i(rockDiffSampler, 1);
+
+	// Bind rock specular texture
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, rockSpecularID);
+	GLuint rockSpecSampler = glGetUniformLocation(program, "rockSpecSampler");
+	glUniform1i(rockSpecSampler, 2);
+
+	// Bind rock normal texture
+	glActiveTexture(GL_TEXTURE3);
+	glBindTexture(GL_TEXTURE_2D, rockNormalID);
+	GLuint rockNormSampler = glGetUniformLocation(program, "rockNormSampler");
+	glUniform1i(rockNormSampler, 3);
+
+	// Bind grass diffuse texture
+	glActiveTexture(GL_TEXTURE4);
+	glBindTexture(GL_TEXTURE_2D, grassDiffuseID);
+	GLuint grassDiffSampler = glGetUniformLocation(program, "grassDiffSampler");
+	glUniform1i(grassDiffSampler, 4);
+
+	// Bind grass specular texture
+	glActiveTexture(GL_TEXTURE5);
+	glBindTexture(GL_TEXTURE_2D, grassSpecularID);
+	GLuint grassSpecSampler = glGetUniformLocation(program, "grassSpecSampler");
+	glUniform1i(grassSpecSampler, 5);
+
+	// Bind grass normal texture
+	glActiveTexture(GL_TEXTURE6);
+	glBindTexture(GL_TEXTURE_2D, grassNormalID);
+	GLuint grassNormSampler = glGetUniformLocation(program, "grassNormSampler");
+	glUniform1i(grassNormSampler, 6);
+
+	// Bind snow diffuse texture
+	glActiveTexture(GL_TEXTURE7);
+	glBindTexture(GL_TEXTURE_2D, snowDiffuseID);
+	GLuint snowDiffSampler = glGetUniformLocation(program, "snowDiffSampler");
+	glUniform1i(snowDiffSampler, 7);
+
+	// Bind snow specular texture
+	glActiveTexture(GL_TEXTURE8);
+	glBindTexture(GL_TEXTURE_2D, snowSpecularID);
+	GLuint snowSpecSampler = glGetUniformLocation(program, "snowSpecSampler");
+	glUniform1i(snowSpecSampler, 8);
+
+	// Bind snow normal texture
+	glActiveTexture(GL_TEXTURE9);
+	glBindTexture(GL_TEXTURE_2D, snowNormalID);
+	GLuint snowNormSampler = glGetUniformLocation(program, "snowNormSampler");
+	glUniform1i(snowNormSampler, 9);
+
+	// Bind the viewshed overlay
+	glActiveTexture(GL_TEXTURE12);
+	glBindTexture(GL_TEXTURE_2D, viewshedTextureID);
+	glUniform1i(glGetUniformLocation(program, "viewshedSampler"), 12);
+	glUniform1i(glGetUniformLocation(program, "viewshedOverlay"), viewshedOverlay ? 1 : 0);
+
+	// Bind the derived terrain layers
+	glActiveTexture(GL_TEXTURE13);
+	glBindTexture(GL_TEXTURE_2D, terrainLayersID);
+	glUniform1i(glGetUniformLocation(program, "terrainLayerSampler"), 13);
+	glUniform1i(glGetUniformLocation(program, "terrainLayerOverlay"), terrainLayerOverlay);
+
+	// Virtual texturing replaces the nine samplers above when it is on
+	SetVirtualTextureUniforms(program);
+}
+
+//Draw the model as 3 vertex patches with whatever program is in use, at the current LOD level
+void DrawTerrainPatches()
+{
+	// Render vertex data
+	glPatchParameteri(GL_PATCH_VERTICES, 3);
+	glDrawElements(
+		GL_PATCHES, // mode
+		(GLsizei)lodIndexCount[terrainLod], // count
+		GL_UNSIGNED_INT, // type
+		(void*)(lodIndexOffset[terrainLod] * sizeof(unsigned int)) // element array buffer offset
+	);
+}
+
+//Draw the terrain with the current shader program, textures and model
+void DrawTerrain(const TerrainFrame& frame)
+{
+	// Draw into the scaled render target (or the window)
+	glBindFramebuffer(GL_FRAMEBUFFER, renderTarget);
+	glViewport(0, 0, renderWidth, renderHeight);
+
+	// Clear the screen and depth buffer
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	// First pass: Base mesh
+	// Use shader program
+	glUseProgram(programID);
+	SetTerrainUniforms(programID, frame);
+	BindMaterialTextures(programID);
+	DrawTerrainPatches();
+}
+
+//Create the visibility buffer render target and its two programs
+void LoadVisibilityBuffer()
+{
+	// UV + height in a float target, alpha marks covered pixels
+	glGenTextures(1, &visibilityTextureID);
+	glBindTexture(GL_TEXTURE_2D, visibilityTextureID);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, window_width, window_height, 0, GL_RGBA, GL_FLOAT, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	// Depth is sampled by the shading pass to rebuild the world position
+	glGenTextures(1, &visDepthTextureID);
+	glBindTexture(GL_TEXTURE_2D, visDepthTextureID);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32F, window_width, window_height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenFramebuffers(1, &visFramebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, visFramebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, visibilityTextureID, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, visDepthTextureID, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		cerr << "Visibility buffer framebuffer is incomplete" << endl;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	// The full screen triangle is generated from gl_VertexID, but core profile still wants a VAO bound
+	glGenVertexArrays(1, &fullScreenVAO);
+
+	LoadShaders(visProgramID, "Basic.vert", "VisBuffer.frag", "dLod.tesc", "dLod.tese");
+	LoadShaders(visShadeProgramID, "FullScreen.vert", "TerrainShade.frag");
+}
+
+void UnloadVisibilityBuffer()
+{
+	glDeleteProgram(visShadeProgramID);
+	glDeleteProgram(visProgramID);
+	glDeleteVertexArrays(1, &fullScreenVAO);
+	glDeleteFramebuffers(1, &visFramebuffer);
+	glDeleteTextures(1, &visDepthTextureID);
+	glDeleteTextures(1, &visibilityTextureID);
+}
+
+//Draw the terrain through the visibility buffer, the optional queries time the two passes separately
+void DrawTerrainVisibility(const TerrainFrame& frame, GLuint geometryQuery = 0, GLuint shadingQuery = 0)
+{
+	// Geometry pass: only depth, UV and height are written, no material work at all
+	if (geometryQuery) glBeginQuery(GL_TIME_ELAPSED, geometryQuery);
+	const GLfloat noCoverage[4] = { 0, 0, 0, 0 };
+	const GLfloat farDepth = 1.0f;
+	glBindFramebuffer(GL_FRAMEBUFFER, visFramebuffer);
+	glClearBufferfv(GL_COLOR, 0, noCoverage);
+	glClearBufferfv(GL_DEPTH, 0, &farDepth);
+	// With a reduced render scale only the lower left part of the buffer is used
+	glViewport(0, 0, renderWidth, renderHeight);
+
+	glUseProgram(visProgramID);
+	SetTerrainUniforms(visProgramID, frame);
+	DrawTerrainPatches();
+	glBindFramebuffer(GL_FRAMEBUFFER, renderTarget);
+	if (geometryQuery) glEndQuery(GL_TIME_ELAPSED);
+
+	// Shading pass: one full screen triangle, every covered pixel is shaded exactly once
+	if (shadingQuery) glBeginQuery(GL_TIME_ELAPSED, shadingQuery);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glUseProgram(visShadeProgramID);
+	SetTerrainUniforms(visShadeProgramID, frame);
+	BindMaterialTextures(visShadeProgramID);
+
+	glActiveTexture(GL_TEXTURE10);
+	glBindTexture(GL_TEXTURE_2D, visibilityTextureID);
+	glUniform1i(glGetUniformLocation(visShadeProgramID, "visibilitySampler"), 10);
+	glActiveTexture(GL_TEXTURE11);
+	glBindTexture(GL_TEXTURE_2D, visDepthTextureID);
+	glUniform1i(glGetUniformLocation(visShadeProgramID, "depthSampler"), 11);
+
+	glm::mat4 invMVP = glm::inverse(frame.MVP);
+	glUniformMatrix4fv(glGetUniformLocation(visShadeProgramID, "invMVP"), 1, GL_FALSE, &invMVP[0][0]);
+	glUniform2f(glGetUniformLocation(visShadeProgramID, "viewportSize"), float(renderWidth), float(renderHeight));
+
+	// The pass writes the stored depth back, so it must not be depth tested against the cleared buffer
+	glDepthFunc(GL_ALWAYS);
+	glBindVertexArray(fullScreenVAO);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	glBindVertexArray(VertexArrayID);
+	glDepthFunc(GL_LESS);
+	if (shadingQuery) glEndQuery(GL_TIME_ELAPSED);
+}
+
+//Create the offscreen target used when the governor lowers the render scale, it has the window size so any scale fits
+void LoadRenderTarget()
+{
+	glGenTextures(1, &sceneColorTextureID);
+	glBindTexture(GL_TEXTURE_2D, sceneColorTextureID);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, window_width, window_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+	glGenTextures(1, &sceneDepthTextureID);
+	glBindTexture(GL_TEXTURE_2D, sceneDepthTextureID);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, window_width, window_height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenFramebuffers(1, &sceneFramebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, sceneColorTextureID, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, sceneDepthTextureID, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		cerr << "Scene framebuffer is incomplete" << endl;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	glGenQueries(frameQueryCount, frameQueries);
+}
+
+void UnloadRenderTarget()
+{
+	glDeleteQueries(frameQueryCount, frameQueries);
+	glDeleteFramebuffers(1, &sceneFramebuffer);
+	glDeleteTextures(1, &sceneDepthTextureID);
+	glDeleteTextures(1, &sceneColorTextureID);
+}
+
+//Choose the internal resolution, full scale draws straight into the window
+void SetRenderScale(float scale)
+{
+	renderWidth = std::max(1, int(window_width * scale + 0.5f));
+	renderHeight = std::max(1, int(window_height * scale + 0.5f));
+	renderTarget = (renderWidth < window_width || renderHeight < window_height) ? sceneFramebuffer : 0;
+}
+
+//Upscale the render target into the window, nothing to do at full scale
+void PresentRenderTarget()
+{
+	if (renderTarget != 0)
+	{
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, renderTarget);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		glBlitFramebuffer(0, 0, renderWidth, renderHeight, 0, 0, window_width, window_height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(0, 0, window_width, window_height);
+}
+
+//Start timing a frame. When every query of the ring is still in flight and the oldest one has no result yet, the
+//frame is not timed rather than stalling the CPU until the GPU caught up: returns false
+bool BeginFrameTiming(vector<float>& finishedMs)
+{
+	if (frameQueriesPending == frameQueryCount)
+	{
+		GLint available = 0;
+		glGetQueryObjectiv(frameQueries[frameQueryNext], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			return false;
+		GLuint64 ns;
+		glGetQueryObjectui64v(frameQueries[frameQueryNext], GL_QUERY_RESULT, &ns);
+		finishedMs.push_back(float(ns * 1e-6));
+		frameQueriesPending--;
+	}
+	glBeginQuery(GL_TIME_ELAPSED, frameQueries[frameQueryNext]);
+	return true;
+}
+
+//Stop timing the frame if it was timed and collect every earlier frame whose result is available, oldest first
+void EndFrameTiming(bool timed, vector<float>& finishedMs)
+{
+	if (timed)
+	{
+		glEndQuery(GL_TIME_ELAPSED);
+		frameQueryNext = (frameQueryNext + 1) % frameQueryCount;
+		frameQueriesPending++;
+	}
+
+	while (frameQueriesPending > 0)
+	{
+		GLuint query = frameQueries[(frameQueryNext - frameQueriesPending + frameQueryCount) % frameQueryCount];
+		GLint available = 0;
+		glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			break;
+		GLuint64 ns;
+		glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+		finishedMs.push_back(float(ns * 1e-6));
+		frameQueriesPending--;
+	}
+}
+
+//LOD levels of the governor that change the cost: the coarser meshes, then halving the tessellation down to 1.
+//Beyond both a level would draw exactly the same
+void SetGovernorLodRange()
+{
+	int tessSteps = 0;
+	while (tessLevel * std::pow(0.5f, float(tessSteps)) > 1.0f)
+		tessSteps++;
+	if (frameGovernor.setMaxLod(std::max(lodLevels - 1, tessSteps)))
+		ApplyGovernor();
+}
+
+//Apply the governor state to the render scale, the mesh LOD and (in MakeTerrainFrame) the tessellation
+void ApplyGovernor()
+{
+	if (!governorEnabled)
+	{
+		SetRenderScale(1.0f);
+		governorLod = 0;
+		terrainLod = 0;
+		return;
+	}
+	SetRenderScale(frameGovernor.renderScale());
+	governorLod = frameGovernor.lodLevel();
+	terrainLod = std::min(lodLevels - 1, governorLod);
+}
+
+//Show the governor state in the window title, at most twice a second: setting the title is a round trip to the
+//window system and the average changes with every frame
+void UpdateGovernorTitle()
+{
+	const double now = glfwGetTime();
+	if (!governorEnabled || now - governorTitleTime < 0.5)
+		return;
+	governorTitleTime = now;
+	char title[128];
+	snprintf(title, sizeof(title), "OpenGLRenderer - %.1f ms, %dx%d, LOD %d",
+		frameGovernor.averageMs(), renderWidth, renderHeight, governorLod);
+	glfwSetWindowTitle(window, title);
+}
+
+//Compare forward shading with the visibility buffer at several tessellation levels using GPU timer queries
+void RunVisibilityBenchmark()
+{
+	// Always measure at full resolution and detail
+	bool wasEnabled = governorEnabled;
+	governorEnabled = false;
+	ApplyGovernor();
+
+	const float levels[] = { 1, 2, 4, 8, 16 };
+	const int frames = 32;
+	GLuint queries[4];
+	glGenQueries(4, queries);
+
+	TerrainFrame frame = MakeTerrainFrame();
+	cout << "tess\tforward ms\tvis geometry ms\tvis shading ms\tvis total ms\tnear + far field ms" << endl;
+	for (float level : levels)
+	{
+		frame.tessLevel = level;
+
+		// The far field column draws the near field and composites a cube built beforehand at this level
+		farField.reset();
+		do
+			UpdateFarField(frame);
+		while (farField.isBuilding());
+		const TerrainFrame nearFrame = MakeNearFieldFrame(frame);
+
+		double forwardMs = 0, geometryMs = 0, shadingMs = 0, farFieldMs = 0;
+		for (int i = 0; i < frames; i++)
+		{
+			glBeginQuery(GL_TIME_ELAPSED, queries[0]);
+			DrawTerrain(frame);
+			glEndQuery(GL_TIME_ELAPSED);
+			DrawTerrainVisibility(frame, queries[1], queries[2]);
+			glBeginQuery(GL_TIME_ELAPSED, queries[3]);
+			DrawTerrain(nearFrame);
+			if (nearFrame.field == FIELD_NEAR)
+				DrawFarField(frame);
+			glEndQuery(GL_TIME_ELAPSED);
+			PresentRenderTarget();
+			glfwSwapBuffers(window);
+
+			GLuint64 ns[4];
+			for (int q = 0; q < 4; q++)
+				glGetQueryObjectui64v(queries[q], GL_QUERY_RESULT, &ns[q]);
+			forwardMs += ns[0] * 1e-6;
+			geometryMs += ns[1] * 1e-6;
+			shadingMs += ns[2] * 1e-6;
+			farFieldMs += ns[3] * 1e-6;
+		}
+		cout << level << "\t" << forwardMs / frames << "\t" << geometryMs / frames << "\t"
+			<< shadingMs / frames << "\t" << (geometryMs + shadingMs) / frames << "\t" << farFieldMs / frames << endl;
+	}
+	glDeleteQueries(4, queries);
+	// The last cube was built at another tessellation level
+	farField.invalidate();
+
+	governorEnabled = wasEnabled;
+	ApplyGovernor();
+}
+
+//Recompute the cumulative viewshed of all observers and upload it to the overlay texture
+void UpdateViewshed()
+{
+	// Baked in the background from a copy of the heights, so sculpting and drawing go on meanwhile.
+	// The result is uploaded by the main thread queue unless the observers or heights changed again
+	const unsigned int generation = ++viewshedGeneration;
+	auto heights = make_shared<vector<int32_t>>(terrainHeights);
+	const vector<ViewshedObserver> observers = viewshedObservers;
+	const int width = terrainWidth, height = terrainHeight;
+	jobSystem().submit([=]() {
+		vector<uint16_t> counts;
+		auto start = chrono::steady_clock::now();
+		computeViewshedBatch(heights->data(), width, height, observers, ViewshedOptions(), counts);
+		double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+		// The R8 overlay gets the share of observers: any visible cell stays above zero, a cell seen by the most
+		// observers is 1 in the shader
+		const unsigned int maxCount = std::max(1u, (unsigned int)*max_element(counts.begin(), counts.end()));
+		auto overlay = make_shared<vector<unsigned char>>(counts.size());
+		for (size_t i = 0; i < counts.size(); i++)
+			(*overlay)[i] = counts[i] ? (unsigned char)(64 + 191 * counts[i] / maxCount) : 0;
+
+		jobSystem().postToMainThread([=]() {
+			if (generation != viewshedGeneration)
+				return;
+			glBindTexture(GL_TEXTURE_2D, viewshedTextureID);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RED, GL_UNSIGNED_BYTE, overlay->data());
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+			glBindTexture(GL_TEXTURE_2D, 0);
+			farField.invalidate();
+			frameScheduler.markDirty(DIRTY_STREAMING);
+
+			cout << "Viewshed of " << observers.size() << " observers: " << ms << " ms" << endl;
+		});
+	}, JOB_BACKGROUND);
+}
+
+//Height map cell coordinates of a world position, cell (i, j) covers [i, i + 1) x [j, j + 1).
+//Inverse of the grid layout in buildTerrainGrid: x / z span [-m_scale, m_scale], UVs are shifted by half a cell
+glm::vec2 WorldToTerrainCell(const glm::vec3& position)
+{
+	float u = position.x / (2.0f * m_scale) + 0.5f + 0.5f / (n_points - 1);
+	float v = position.z / (2.0f * m_scale) + 0.5f + 0.5f / (n_points - 1);
+	return glm::vec2(u * terrainWidth, v * terrainHeight);
+}
+
+//Inverse of WorldToTerrainCell on the ground plane
+glm::vec3 TerrainCellToWorld(float x, float y)
+{
+	float u = x / terrainWidth - 0.5f - 0.5f / (n_points - 1);
+	float v = y / terrainHeight - 0.5f - 0.5f / (n_points - 1);
+	return glm::vec3(u * 2.0f * m_scale, 0.0f, v * 2.0f * m_scale);
+}
+
+//Add an observer at the height map cell below the camera, with the eye at the camera height
+void AddViewshedObserverAtCamera()
+{
+	glm::vec3 position = getCameraPosition();
+	glm::vec2 cell = WorldToTerrainCell(position);
+	if (terrainHeights.empty() || cell.x < 0.0f || cell.x >= terrainWidth || cell.y < 0.0f || cell.y >= terrainHeight)
+	{
+		cout << "The camera is not above the terrain" << endl;
+		return;
+	}
+
+	ViewshedObserver observer;
+	observer.x = std::min(terrainWidth - 1, int(cell.x));
+	observer.y = std::min(terrainHeight - 1, int(cell.y));
+	float ground = float(terrainHeights[size_t(observer.y) * terrainWidth + observer.x]);
+	if (heightMapScaleValue > 0.0f)
+		observer.height = std::max(0.0f, position.y / heightMapScaleValue - ground);
+	viewshedObservers.push_back(observer);
+	viewshedOverlay = true;
+	UpdateViewshed();
+}
+
+//Headless cumulative viewshed: observers are read from a text file, one "x y height [targetHeight [radius]]" per line
+//in height map cells and units, the number of observers seeing each cell is written to viewshed.bmp
+int RunViewshedBatch(const char* observerPath, ViewshedMethod method, unsigned int threads)
+{
+	int width, height;
+	unsigned char* data = nullptr;
+	if (!loadHeightmapCached("mountains_height.bmp", "mountains_height.thm", width, height, data))
+		return -1;
+	vector<int32_t> heights(size_t(width) * height);
+	unpackHeightsBGR(data, width, height, heights.data());
+	delete[] data;
+
+	ifstream observerStream(observerPath, std::ios::in);
+	if (!observerStream.is_open())
+	{
+		cout << "Impossible to open " << observerPath << endl;
+		return -1;
+	}
+	vector<ViewshedObserver> observers;
+	string line;
+	while (getline(observerStream, line))
+	{
+		if (line.empty() || line[0] == '#')
+			continue;
+		istringstream fields(line);
+		ViewshedObserver observer;
+		if (fields >> observer.x >> observer.y >> observer.height)
+		{
+			fields >> observer.targetHeight >> observer.radius;
+			observers.push_back(observer);
+		}
+	}
+
+	ViewshedOptions options;
+	options.method = method;
+	options.threads = threads;
+	vector<uint16_t> counts;
+	auto start = chrono::steady_clock::now();
+	computeViewshedBatch(heights.data(), width, height, observers, options, counts);
+	double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	cout << "Viewshed of " << observers.size() << " observers on " << width << "x" << height << ": " << ms << " ms" << endl;
+
+	// Gray levels are observer counts, scaled down when more than 255 observers see a cell
+	const unsigned int maxCount = counts.empty() ? 0 : *max_element(counts.begin(), counts.end());
+	const unsigned int divisor = std::max(255u, maxCount);
+	if (maxCount > 255)
+		cout << "Up to " << maxCount << " observers see a cell, gray level 255 is " << maxCount << " observers" << endl;
+	vector<unsigned char> bgr(heightmapRowStride(width) * height, 0);
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+		{
+			unsigned char* pixel = &bgr[y * heightmapRowStride(width) + x * 3];
+			pixel[0] = pixel[1] = pixel[2] = (unsigned char)(counts[size_t(y) * width + x] * 255u / divisor);
+		}
+	return saveBMP_custom("viewshed.bmp", width, height, bgr.data()) ? 0 : -1;
+}
+
+//Layer options matching the rendered terrain: the grid spans 2 * m_scale over the height map width
+TerrainLayerOptions MakeTerrainLayerOptions(int heightmapWidth, float heightScale)
+{
+	TerrainLayerOptions options;
+	options.cellSize = 2.0f * m_scale / heightmapWidth;
+	options.zFactor = heightScale;
+	return options;
+}
+
+//Recompute the derived terrain layers for the current height scale and upload them
+void UpdateTerrainLayers()
+{
+	if (terrainHeights.empty())
+		return;
+	TerrainLayerOptions options = MakeTerrainLayerOptions(terrainWidth, heightMapScaleValue);
+	const size_t count = terrainHeights.size();
+	vector<float> slope(count), aspect(count), curvature(count);
+	computeSlopeAspectCurvature(terrainHeights.data(), terrainWidth, terrainHeight, options, slope.data(), aspect.data(), curvature.data());
+	if (terrainFlow.size() != count)
+	{
+		terrainFlow.resize(count);
+		computeFlowAccumulation(terrainHeights.data(), terrainWidth, terrainHeight, options, terrainFlow.data());
+	}
+
+	// The range is kept so edited regions are packed the same way as the rest
+	options.curvatureRange = terrainCurvatureRange(curvature.data(), count);
+	terrainLayerCurvatureRange = options.curvatureRange;
+	packTerrainLayers(slope.data(), aspect.data(), curvature.data(), terrainFlow.data(), terrainWidth, terrainHeight, options, terrainLayerTexels);
+	glBindTexture(GL_TEXTURE_2D, terrainLayersID);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, terrainWidth, terrainHeight, GL_RGBA, GL_UNSIGNED_BYTE, terrainLayerTexels.data());
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+//Cell under the centre of the screen: where the view ray first meets the terrain
+bool PickTerrainCell(float& x, float& y)
+{
+	if (!terrainEditor || heightMapScaleValue <= 0.0f)
+		return false;
+	glm::mat4 view = getViewMatrix();
+	glm::vec3 forward = -glm::vec3(view[0][2], view[1][2], view[2][2]);
+	glm::vec3 position = getCameraPosition();
+	glm::vec2 origin = WorldToTerrainCell(position);
+	// The ray in cells and height map units
+	float cellsPerUnitX = terrainWidth / (2.0f * m_scale);
+	float cellsPerUnitZ = terrainHeight / (2.0f * m_scale);
+	return terrainEditor->raycast(origin.x, origin.y, position.y / heightMapScaleValue, forward.x * cellsPerUnitX,
+		forward.z * cellsPerUnitZ, forward.y / heightMapScaleValue, 4.0f * std::max(terrainWidth, terrainHeight), x, y);
+}
+
+//Mouse buttons start and end sculpting strokes, one stroke is one undo step
+void MouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
+{
+	if (!terrainEditor || (button != GLFW_MOUSE_BUTTON_LEFT && button != GLFW_MOUSE_BUTTON_RIGHT))
+		return;
+	if (action == GLFW_PRESS && sculptMode && !sculpting)
+	{
+		sculpting = true;
+		sculptInvert = button == GLFW_MOUSE_BUTTON_RIGHT;
+		sculptLastTime = glfwGetTime();
+		terrainEditor->beginStroke();
+		// Flatten levels to the height where the stroke starts
+		float x, y;
+		if (PickTerrainCell(x, y))
+			sculptBrush.flattenHeight = terrainEditor->heightAt(int(x), int(y));
+	}
+	else if (action == GLFW_RELEASE && sculpting)
+	{
+		sculpting = false;
+		terrainEditor->endStroke();
+		FinishTerrainEdit();
+	}
+}
+
+//One dab of the brush where the view centre meets the terrain, the strength follows the time since the previous dab
+void ApplySculptBrush()
+{
+	double now = glfwGetTime();
+	float seconds = std::min(0.05f, float(now - sculptLastTime));
+	sculptLastTime = now;
+
+	float x, y;
+	if (!PickTerrainCell(x, y))
+		return;
+	TerrainBrush brush = sculptBrush;
+	if (sculptInvert && brush.mode == BRUSH_RAISE)
+		brush.mode = BRUSH_LOWER;
+	else if (sculptInvert && brush.mode == BRUSH_LOWER)
+		brush.mode = BRUSH_RAISE;
+	// Raise / lower move the heights at a fixed rate, smooth and flatten blend a fraction per frame
+	brush.strength = (brush.mode == BRUSH_RAISE || brush.mode == BRUSH_LOWER) ? sculptRate * seconds : std::min(1.0f, 4.0f * seconds);
+	if (!terrainEditor->applyBrush(brush, x, y).empty())
+		frameScheduler.markDirty(DIRTY_TERRAIN);
+}
+
+//Upload the cells changed since the last frame: heights through the pixel buffer, then the derived layers of the
+//same rectangle grown by the one cell their 3x3 neighbourhood reaches. The cost follows the edited area only
+void UploadTerrainEdits()
+{
+	TerrainRect rect = terrainEditor->takeDirty();
+	if (rect.empty())
+		return;
+	farFieldEditRect.merge(rect);
+	const int width = rect.x1 - rect.x0, height = rect.y1 - rect.y0;
+
+	vector<int32_t> patch(size_t(width) * height);
+	for (int y = 0; y < height; y++)
+		copy_n(&terrainHeights[size_t(rect.y0 + y) * terrainWidth + rect.x0], width, &patch[size_t(y) * width]);
+
+	// The buffer is orphaned on every upload, so mapping never waits for the previous transfer
+	const size_t bytes = heightmapRowStride(width) * height;
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, heightmapUploadPBO);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+	unsigned char* bgr = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (bgr)
+	{
+		packHeightsBGR(patch.data(), width, height, bgr);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		glBindTexture(GL_TEXTURE_2D, heightmapID);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x0, rect.y0, width, height, GL_BGR, GL_UNSIGNED_BYTE, nullptr);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	const int x0 = std::max(0, rect.x0 - 1), y0 = std::max(0, rect.y0 - 1);
+	const int x1 = std::min(terrainWidth, rect.x1 + 1), y1 = std::min(terrainHeight, rect.y1 + 1);
+	TerrainLayerOptions options = MakeTerrainLayerOptions(terrainWidth, heightMapScaleValue);
+	options.curvatureRange = terrainLayerCurvatureRange;
+	updateTerrainLayersRegion(terrainHeights.data(), terrainWidth, terrainHeight, options, x0, y0, x1, y1, terrainLayerTexels);
+	glBindTexture(GL_TEXTURE_2D, terrainLayersID);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, terrainWidth);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, x0, y0, x1 - x0, y1 - y0, GL_RGBA, GL_UNSIGNED_BYTE,
+		&terrainLayerTexels[(size_t(y0) * terrainWidth + x0) * 4]);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+//After a stroke, undo or redo: the analyses that depend on the whole map are refreshed once, not on every dab.
+//Flow accumulation is only recomputed while it is shown, otherwise when the overlay is selected again. The far
+//field sectors that see the edit are rendered again with the next frame, see UpdateFarField
+void FinishTerrainEdit()
+{
+	farFieldEditFinished = true;
+	frameScheduler.markDirty(DIRTY_TERRAIN);
+	terrainFlow.clear();
+	if (terrainLayerOverlay == 4)
+		UpdateTerrainLayers();
+	if (!viewshedObservers.empty())
+		UpdateViewshed();
+}
+
+//Create the virtual texturing resources: loader and page cache for the nine material layers, the physical page
+//texture, the indirection table and the feedback target with its readback buffers
+void LoadVirtualTexturing()
+{
+	// Same layers and order as the material samplers, units 1-9
+	vtLoader.reset(new VirtualTextureLoader({ "rocks.bmp", "rocks-r.bmp", "rocks-n.bmp", "grass.bmp", "grass-r.bmp",
+		"grass-n.bmp", "snow.bmp", "snow-r.bmp", "snow-n.bmp" }));
+	const VirtualTextureLayout& layout = vtLoader->getLayout();
+	vtCache.reset(new VirtualPageCache(layout, vtSlotsAcross, vtSlotsAcross));
+	// Pages finished in the background wake the render loop
+	vtLoader->setReadyCallback([]() { frameScheduler.markDirty(DIRTY_STREAMING); });
+
+	// Physical pages, borders included, so plain bilinear filtering never reads a neighbouring slot
+	const int physicalSize = vtSlotsAcross * layout.slotSize();
+	glGenTextures(1, &vtPhysicalTextureID);
+	glBindTexture(GL_TEXTURE_2D, vtPhysicalTextureID);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, physicalSize, physicalSize, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	// Indirection table in a texture buffer, one entry per virtual page of every layer and mip
+	vector<uint32_t> table;
+	vtCache->buildIndirection(table);
+	vtTableVersion = vtCache->getVersion();
+	glGenBuffers(1, &vtIndirectionBuffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, vtIndirectionBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, table.size() * sizeof(uint32_t), table.data(), GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	glGenTextures(1, &vtIndirectionTextureID);
+	glBindTexture(GL_TEXTURE_BUFFER, vtIndirectionTextureID);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, vtIndirectionBuffer);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+
+	// Feedback target: one page id per pixel and a depth buffer, so only visible surfaces report pages
+	const int feedbackWidth = window_width / vtFeedbackDivider;
+	const int feedbackHeight = window_height / vtFeedbackDivider;
+	glGenTextures(1, &vtFeedbackTextureID);
+	glBindTexture(GL_TEXTURE_2D, vtFeedbackTextureID);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, feedbackWidth, feedbackHeight, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glGenRenderbuffers(1, &vtFeedbackDepthID);
+	glBindRenderbuffer(GL_RENDERBUFFER, vtFeedbackDepthID);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, feedbackWidth, feedbackHeight);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glGenFramebuffers(1, &vtFeedbackFramebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, vtFeedbackFramebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, vtFeedbackTextureID, 0);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, vtFeedbackDepthID);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		cerr << "Virtual texturing feedback framebuffer is incomplete" << endl;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	glGenBuffers(2, vtFeedbackPBO);
+	for (int i = 0; i < 2; i++)
+	{
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, vtFeedbackPBO[i]);
+		glBufferData(GL_PIXEL_PACK_BUFFER, feedbackWidth * feedbackHeight * sizeof(uint32_t), nullptr, GL_STREAM_READ);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	LoadShaders(vtFeedbackProgramID, "Basic.vert", "VTFeedback.frag", "dLod.tesc", "dLod.tese");
+
+	cout << "Virtual texturing: " << layout.layerCount() << " layers, " << vtCache->slotCount() << " pages of "
+		<< layout.pageSize << "x" << layout.pageSize << ", " << physicalSize << "x" << physicalSize << " physical texture" << endl;
+}
+
+void UnloadVirtualTexturing()
+{
+	for (GLsync& fence : vtFeedbackFence)
+	{
+		if (fence)
+			glDeleteSync(fence);
+		fence = 0;
+	}
+	glDeleteProgram(vtFeedbackProgramID);
+	glDeleteBuffers(2, vtFeedbackPBO);
+	glDeleteFramebuffers(1, &vtFeedbackFramebuffer);
+	glDeleteRenderbuffers(1, &vtFeedbackDepthID);
+	glDeleteTextures(1, &vtFeedbackTextureID);
+	glDeleteTextures(1, &vtIndirectionTextureID);
+	glDeleteBuffers(1, &vtIndirectionBuffer);
+	glDeleteTextures(1, &vtPhysicalTextureID);
+	// The loader thread is joined before the cache it reports to goes away
+	vtLoader.reset();
+	vtCache.reset();
+}
+
+//Point the virtual texturing uniforms of the program in use at the physical texture, the table and the layout
+void SetVirtualTextureUniforms(GLuint program)
+{
+	glUniform1i(glGetUniformLocation(program, "virtualTexturing"), virtualTexturing ? 1 : 0);
+	// Always on their own units: samplers of different types must never share the default unit 0
+	glUniform1i(glGetUniformLocation(program, "vtPhysicalSampler"), 14);
+	glUniform1i(glGetUniformLocation(program, "vtIndirectionSampler"), 15);
+	if (!virtualTexturing)
+		return;
+
+	glActiveTexture(GL_TEXTURE14);
+	glBindTexture(GL_TEXTURE_2D, vtPhysicalTextureID);
+	glActiveTexture(GL_TEXTURE15);
+	glBindTexture(GL_TEXTURE_BUFFER, vtIndirectionTextureID);
+
+	const VirtualTextureLayout& layout = vtCache->getLayout();
+	const int layers = std::min(9, layout.layerCount());
+	GLint layerSize[9], layerOffset[9], layerMips[9];
+	for (int l = 0; l < layers; l++)
+	{
+		layerSize[l] = layout.layerSize[l];
+		layerOffset[l] = layout.tableOffset(l);
+		layerMips[l] = layout.mipCount(l);
+	}
+	glUniform1iv(glGetUniformLocation(program, "vtLayerSize"), layers, layerSize);
+	glUniform1iv(glGetUniformLocation(program, "vtLayerOffset"), layers, layerOffset);
+	glUniform1iv(glGetUniformLocation(program, "vtLayerMips"), layers, layerMips);
+	glUniform1i(glGetUniformLocation(program, "vtPageSize"), layout.pageSize);
+	glUniform1i(glGetUniformLocation(program, "vtBorder"), layout.border);
+	const float physicalSize = float(vtSlotsAcross * layout.slotSize());
+	glUniform2f(glGetUniformLocation(program, "vtPhysicalSize"), physicalSize, physicalSize);
+}
+
+//Feed the feedback of an earlier frame to the page cache, request the missing pages from the loader and copy the
+//pages it has finished into the physical texture. Runs before the frame is drawn, so it samples the new pages
+void UpdateVirtualTexturing()
+{
+	// The buffer written two frames ago, only mapped once the GPU is done with it so the CPU never waits. Until it
+	// is, the cache keeps the requests of the last buffer read
+	const int index = vtFrame % 2;
+	GLsync fence = vtFeedbackFence[index];
+	if (fence && glClientWaitSync(fence, 0, 0) != GL_TIMEOUT_EXPIRED)
+	{
+		vtCache->beginFrame();
+		glDeleteSync(fence);
+		vtFeedbackFence[index] = 0;
+		const int count = (window_width / vtFeedbackDivider) * (window_height / vtFeedbackDivider);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, vtFeedbackPBO[index]);
+		const uint32_t* pages = (const uint32_t*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, count * sizeof(uint32_t), GL_MAP_READ_BIT);
+		if (pages)
+		{
+			for (int i = 0; i < count; i++)
+				vtCache->request(pages[i]);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+
+	vector<VirtualPageId> loads;
+	vtCache->collectLoads(vtMaxRequests, loads);
+	vtLoader->enqueue(loads);
+
+	// Loaded pages go to their slot, a page that finds no slot is dropped and requested again later
+	const VirtualTextureLayout& layout = vtCache->getLayout();
+	const int slotSize = layout.slotSize();
+	VirtualPageData page;
+	int uploads = 0;
+	glBindTexture(GL_TEXTURE_2D, vtPhysicalTextureID);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	while (uploads < vtMaxUploads && vtLoader->pop(page))
+	{
+		int slot = vtCache->commit(page.page);
+		if (slot < 0)
+			continue;
+		glTexSubImage2D(GL_TEXTURE_2D, 0, (slot % vtSlotsAcross) * slotSize, (slot / vtSlotsAcross) * slotSize,
+			slotSize, slotSize, GL_RGBA, GL_UNSIGNED_BYTE, page.texels.data());
+		uploads++;
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	if (vtCache->getVersion() != vtTableVersion)
+	{
+		vector<uint32_t> table;
+		vtCache->buildIndirection(table);
+		glBindBuffer(GL_TEXTURE_BUFFER, vtIndirectionBuffer);
+		glBufferSubData(GL_TEXTURE_BUFFER, 0, table.size() * sizeof(uint32_t), table.data());
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+		vtTableVersion = vtCache->getVersion();
+	}
+
+	// A new view is only known to the cache once its feedback is read back, keep drawing until then.
+	// Pages finished later wake the loop through the ready callback
+	if (drawnFrameFlags & ~DIRTY_STREAMING)
+		vtSettleFrames = 3;
+	else if (vtSettleFrames > 0)
+		vtSettleFrames--;
+	if (vtSettleFrames > 0 || uploads == vtMaxUploads)
+		frameScheduler.markDirty(DIRTY_STREAMING);
+}
+
+//Draw the terrain into the feedback target and start reading it back into this frame's pixel buffer
+void DrawVirtualTextureFeedback(const TerrainFrame& frame)
+{
+	const int feedbackWidth = window_width / vtFeedbackDivider;
+	const int feedbackHeight = window_height / vtFeedbackDivider;
+	const GLuint noPage[4] = { kNoVirtualPage, 0, 0, 0 };
+	const GLfloat farDepth = 1.0f;
+	glBindFramebuffer(GL_FRAMEBUFFER, vtFeedbackFramebuffer);
+	glViewport(0, 0, feedbackWidth, feedbackHeight);
+	glClearBufferuiv(GL_COLOR, 0, noPage);
+	glClearBufferfv(GL_DEPTH, 0, &farDepth);
+
+	glUseProgram(vtFeedbackProgramID);
+	SetTerrainUniforms(vtFeedbackProgramID, frame);
+	SetVirtualTextureUniforms(vtFeedbackProgramID);
+	glUniform1i(glGetUniformLocation(vtFeedbackProgramID, "vtFrame"), vtFrame);
+	glUniform1f(glGetUniformLocation(vtFeedbackProgramID, "vtLodBias"), std::log2(float(vtFeedbackDivider)));
+	DrawTerrainPatches();
+
+	const int index = vtFrame % 2;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, vtFeedbackPBO[index]);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(0, 0, feedbackWidth, feedbackHeight, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	if (vtFeedbackFence[index])
+		glDeleteSync(vtFeedbackFence[index]);
+	vtFeedbackFence[index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	vtFrame++;
+}
+
+//Create the two far field cubes (colour and depth) and the program that composites them
+void LoadFarField()
+{
+	glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+	glGenTextures(2, farFieldColorID);
+	glGenTextures(2, farFieldDepthID);
+	for (int c = 0; c < 2; c++)
+	{
+		glBindTexture(GL_TEXTURE_CUBE_MAP, farFieldColorID[c]);
+		for (int face = 0; face < 6; face++)
+			glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_RGBA8, farFieldFaceSize, farFieldFaceSize, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+
+		// Depth is not filtered, a sample between terrain and sky would put the sky at some made up distance
+		glBindTexture(GL_TEXTURE_CUBE_MAP, farFieldDepthID[c]);
+		for (int face = 0; face < 6; face++)
+			glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_DEPTH_COMPONENT32F, farFieldFaceSize, farFieldFaceSize, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	}
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+	// Faces are attached when they are rendered
+	glGenFramebuffers(1, &farFieldFramebuffer);
+
+	LoadShaders(farFieldProgramID, "FullScreen.vert", "FarField.frag");
+	farField.reset();
+}
+
+void UnloadFarField()
+{
+	glDeleteProgram(farFieldProgramID);
+	glDeleteFramebuffers(1, &farFieldFramebuffer);
+	glDeleteTextures(2, farFieldDepthID);
+	glDeleteTextures(2, farFieldColorID);
+}
+
+//Render, copy or clear the far field sectors planned for this frame in the cube being built, it is shown once its
+//last sector is done
+void UpdateFarField(const TerrainFrame& frame)
+{
+	// The terrain box for the sector selection, as high as the height scale allows
+	farField.setBounds(glm::vec3(-m_scale, 0.0f, -m_scale), glm::vec3(m_scale, float(0xFFFFFF) * frame.heightMapScale, m_scale));
+	if (drawnFrameFlags & (DIRTY_LIGHT | DIRTY_HEIGHT_SCALE))
+		farField.invalidate();
+	// Sculpting leaves the far field alone until the stroke ends, then only the sectors that see the edited cells,
+	// grown by one cell for the filtering, are rendered again
+	if (farFieldEditFinished && !farFieldEditRect.empty())
+	{
+		const glm::vec3 cellMin = TerrainCellToWorld(float(farFieldEditRect.x0 - 1), float(farFieldEditRect.y0 - 1));
+		const glm::vec3 cellMax = TerrainCellToWorld(float(farFieldEditRect.x1 + 1), float(farFieldEditRect.y1 + 1));
+		farField.invalidateRegion(glm::vec3(cellMin.x, 0.0f, cellMin.z), glm::vec3(cellMax.x, float(0xFFFFFF) * frame.heightMapScale, cellMax.z));
+		farFieldEditRect = TerrainRect();
+	}
+	farFieldEditFinished = false;
+	// Sectors rendered before their pages arrived show coarser mips or gray. Pages keep arriving while the camera
+	// moves, so the cube is rendered again once the loader has nothing left to do, or at most once a second
+	if (virtualTexturing && vtTableVersion != farFieldTableVersion)
+	{
+		const double now = glfwGetTime();
+		if (vtLoader->isIdle() || now - farFieldInvalidateTime >= farFieldInvalidateInterval)
+		{
+			farFieldTableVersion = vtTableVersion;
+			farFieldInvalidateTime = now;
+			farField.invalidate();
+		}
+	}
+
+	vector<FarFieldSector> sectors;
+	const bool complete = farField.plan(frame.viewPos, sectors);
+	if (!sectors.empty())
+	{
+		const int cube = farField.buildingCube();
+		const int shown = farField.shownCube();
+		TerrainFrame faceFrame = frame;
+		faceFrame.viewPos = farField.buildingCentre();
+		faceFrame.field = FIELD_FAR;
+		faceFrame.fieldCentre = farField.buildingCentre();
+		faceFrame.fieldRadius = farField.getSettings().radius;
+
+		glBindFramebuffer(GL_FRAMEBUFFER, farFieldFramebuffer);
+		glViewport(0, 0, farFieldFaceSize, farFieldFaceSize);
+		glUseProgram(programID);
+		SetTerrainUniforms(programID, faceFrame);
+		BindMaterialTextures(programID);
+		GLuint matrixID = glGetUniformLocation(programID, "MVP");
+		glEnable(GL_SCISSOR_TEST);
+		int attached = -1;
+		for (const FarFieldSector& sector : sectors)
+		{
+			int x, y, width, height;
+			farField.sectorRect(sector.x, sector.y, farFieldFaceSize, x, y, width, height);
+			if (sector.action == FarFieldSector::COPY)
+			{
+				// Layer of a cube map texture is its face
+				glCopyImageSubData(farFieldColorID[shown], GL_TEXTURE_CUBE_MAP, 0, x, y, sector.face,
+					farFieldColorID[cube], GL_TEXTURE_CUBE_MAP, 0, x, y, sector.face, width, height, 1);
+				glCopyImageSubData(farFieldDepthID[shown], GL_TEXTURE_CUBE_MAP, 0, x, y, sector.face,
+					farFieldDepthID[cube], GL_TEXTURE_CUBE_MAP, 0, x, y, sector.face, width, height, 1);
+				continue;
+			}
+
+			if (sector.face != attached)
+			{
+				const GLenum target = GL_TEXTURE_CUBE_MAP_POSITIVE_X + sector.face;
+				glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, target, farFieldColorID[cube], 0);
+				glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, target, farFieldDepthID[cube], 0);
+				glm::mat4 MVP = farField.faceViewProjection(sector.face, faceFrame.viewPos) * faceFrame.Model;
+				glUniformMatrix4fv(matrixID, 1, GL_FALSE, &MVP[0][0]);
+				attached = sector.face;
+			}
+			glScissor(x, y, width, height);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			if (sector.action == FarFieldSector::RENDER)
+				DrawTerrainPatches();
+		}
+		glDisable(GL_SCISSOR_TEST);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+	if (complete)
+		farField.swap();
+
+	// Keep drawing until the cube is complete, even with a still camera
+	if (farField.isBuilding())
+		frameScheduler.markDirty(DIRTY_STREAMING);
+}
+
+//The near field of the frame when a far field cube is shown, otherwise the frame as it is
+TerrainFrame MakeNearFieldFrame(const TerrainFrame& frame)
+{
+	TerrainFrame nearFrame = frame;
+	if (farFieldEnabled && farField.hasCube())
+	{
+		nearFrame.field = FIELD_NEAR;
+		nearFrame.fieldCentre = frame.viewPos;
+		nearFrame.fieldRadius = farField.nearRadius(frame.viewPos);
+	}
+	return nearFrame;
+}
+
+//Composite the shown far field cube into the render target, depth tested against the near field drawn before
+void DrawFarField(const TerrainFrame& frame)
+{
+	const int cube = farField.shownCube();
+	glBindFramebuffer(GL_FRAMEBUFFER, renderTarget);
+	glViewport(0, 0, renderWidth, renderHeight);
+	glUseProgram(farFieldProgramID);
+
+	glActiveTexture(GL_TEXTURE16);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, farFieldColorID[cube]);
+	glUniform1i(glGetUniformLocation(farFieldProgramID, "farFieldColorSampler"), 16);
+	glActiveTexture(GL_TEXTURE17);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, farFieldDepthID[cube]);
+	glUniform1i(glGetUniformLocation(farFieldProgramID, "farFieldDepthSampler"), 17);
+	glUniform1f(glGetUniformLocation(farFieldProgramID, "farFieldNear"), farField.getSettings().nearPlane);
+	glUniform1f(glGetUniformLocation(farFieldProgramID, "farFieldFar"), farField.getSettings().farPlane);
+
+	glm::mat4 invMVP = glm::inverse(frame.MVP);
+	glUniformMatrix4fv(glGetUniformLocation(farFieldProgramID, "MVP"), 1, GL_FALSE, &frame.MVP[0][0]);
+	glUniformMatrix4fv(glGetUniformLocation(farFieldProgramID, "invMVP"), 1, GL_FALSE, &invMVP[0][0]);
+	glUniform3f(glGetUniformLocation(farFieldProgramID, "viewPos_wcs"), frame.viewPos.x, frame.viewPos.y, frame.viewPos.z);
+	glUniform2f(glGetUniformLocation(farFieldProgramID, "viewportSize"), float(renderWidth), float(renderHeight));
+
+	glBindVertexArray(fullScreenVAO);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	glBindVertexArray(VertexArrayID);
+}
+
+// OpenGL implementation of the backend interface, wraps the load / draw functions above
+class GLBackend : public RenderBackend
+{
+public:
+	bool Load() override
+	{
+		// Load models and textures, the grid is built on a worker meanwhile
+		TerrainModelData model;
+		JobHandle modelJob = jobSystem().submit([&model]() { BuildTerrainModel(model); });
+		const bool texturesLoaded = LoadTextures();
+		jobSystem().wait(modelJob);
+		if (!texturesLoaded)
+			return false;
+		LoadModel(model);
+
+		// Create and load shader programs
+		programID = glCreateProgram();
+		LoadShaders(programID, "Basic.vert", "Texture.frag", "dLod.tesc", "dLod.tese");
+		LoadVisibilityBuffer();
+		LoadRenderTarget();
+		if (virtualTexturing)
+			LoadVirtualTexturing();
+		LoadFarField();
+		return true;
+	}
+
+	void Unload() override
+	{
+		UnloadFarField();
+		if (virtualTexturing)
+			UnloadVirtualTexturing();
+		UnloadRenderTarget();
+		UnloadVisibilityBuffer();
+		UnloadModel();
+		UnloadShaders();
+		UnloadTextures();
+	}
+
+	void DrawFrame(const TerrainFrame& frame) override
+	{
+		UploadTerrainEdits();
+		if (virtualTexturing)
+			UpdateVirtualTexturing();
+		if (farFieldEnabled)
+			UpdateFarField(frame);
+
+		// Only the near field is drawn when a far field cube is shown, the cube fills in the rest
+		TerrainFrame nearFrame = MakeNearFieldFrame(frame);
+		if (visibilityBufferMode)
+			DrawTerrainVisibility(nearFrame);
+		else
+			DrawTerrain(nearFrame);
+		if (nearFrame.field == FIELD_NEAR)
+			DrawFarField(frame);
+
+		// Feedback covers the whole terrain, the far field faces need their pages too
+		if (virtualTexturing)
+			DrawVirtualTextureFeedback(frame);
+		PresentRenderTarget();
+	}
+
+	void ReadPixels(int width, int height, vector<unsigned char>& bgr) override
+	{
+		bgr.resize(((size_t(width) * 3 + 3) & ~size_t(3)) * height);
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		glReadPixels(0, 0, width, height, GL_BGR, GL_UNSIGNED_BYTE, bgr.data());
+	}
+};
+
+//Take camera and light from the latest simulation snapshot, interpolated to now. Returns true when they moved
+bool ApplySimulationSnapshot()
+{
+	if (simulation.acquire() && simulation.snapshot().inputCount != latencyInputCount)
+	{
+		latencyInputCount = simulation.snapshot().inputCount;
+		latencyInputTime = simulation.snapshot().lastInputTime;
+	}
+
+	SimulationState current = simulation.interpolate(simulationClock());
+	CameraState camera = getCameraState();
+	bool moved = false;
+	if (current.camera.position != camera.position || current.camera.horizontalAngle != camera.horizontalAngle ||
+		current.camera.verticalAngle != camera.verticalAngle)
+	{
+		setCameraState(current.camera);
+		frameScheduler.markDirty(DIRTY_CAMERA);
+		moved = true;
+	}
+	if (current.lightDir != lightDir)
+	{
+		lightDir = current.lightDir;
+		frameScheduler.markDirty(DIRTY_LIGHT);
+		moved = true;
+	}
+	return moved;
+}
+
+// Render the scripted camera path with a backend and write every frame as <prefix>_NNN.bmp
+void RenderCameraPath(RenderBackend& backend, const char* prefix, int frames)
+{
+	vector<unsigned char> pixels;
+	double totalMs = 0;
+	for (int i = 0; i < frames; i++)
+	{
+		computeMatricesFromPath(i / float(frames));
+
+		auto start = chrono::steady_clock::now();
+		backend.DrawFrame(MakeTerrainFrame());
+		backend.ReadPixels(window_width, window_height, pixels);
+		totalMs += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+		char name[256];
+		snprintf(name, sizeof(name), "%s_%03d.bmp", prefix, i);
+		saveBMP_custom(name, window_width, window_height, pixels.data());
+
+		if (window)
+			glfwSwapBuffers(window);
+	}
+	cout << "Rendered " << frames << " frames, " << totalMs / std::max(frames, 1) << " ms per frame" << endl;
+}
+
+//Render and control 3D graphics
+//  --software       render the camera path on the CPU (also used when no GL 4.5 context is available)
+//  --capture        render the camera path with OpenGL
+//  --frames N       length of the camera path
+//  --threads N      worker threads of the software rasterizer (default: all cores)
+//  --continuous     redraw every frame instead of only when something changed
+//  --target-ms MS   frame budget of the governor (default 16.6)
+//  --no-governor    always render at full resolution and detail
+//  --viewshed FILE  compute the cumulative viewshed of the observers in FILE into viewshed.bmp and exit
+//  --exact          use exact line of sight for --viewshed instead of the sweep
+//  --no-virtual-texturing  load every material texture with all its mips instead of streaming pages
+//  --far-field-radius R  distance where the far field impostor takes over (default 2.5)
+//  --no-far-field   draw the whole terrain every frame
+int main(int argc, char** argv)
+{
+	bool software = false;
+	bool capture = false;
+	bool continuous = false;
+	FrameGovernorSettings governorSettings;
+	FarFieldSettings farFieldSettings;
+	const char* viewshedPath = nullptr;
+	ViewshedMethod viewshedMethod = VIEWSHED_SWEEP;
+	int pathFrames = 60;
+	unsigned int threads = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		if (arg == "--software")
+			software = true;
+		else if (arg == "--capture")
+			capture = true;
+		else if (arg == "--continuous")
+			continuous = true;
+		else if (arg == "--frames" && i + 1 < argc)
+			pathFrames = std::max(1, atoi(argv[++i]));
+		else if (arg == "--threads" && i + 1 < argc)
+			threads = (unsigned int)std::max(0, atoi(argv[++i]));
+		else if (arg == "--target-ms" && i + 1 < argc)
+			governorSettings.targetMs = std::max(1.0f, float(atof(argv[++i])));
+		else if (arg == "--no-governor")
+			governorEnabled = false;
+		else if (arg == "--viewshed" && i + 1 < argc)
+			viewshedPath = argv[++i];
+		else if (arg == "--exact")
+			viewshedMethod = VIEWSHED_EXACT;
+		else if (arg == "--no-virtual-texturing")
+			virtualTexturing = false;
+		else if (arg == "--far-field-radius" && i + 1 < argc)
+			farFieldSettings.radius = std::max(0.1f, float(atof(argv[++i])));
+		else if (arg == "--no-far-field")
+			farFieldEnabled = false;
+	}
+	if (viewshedPath)
+		return RunViewshedBatch(viewshedPath, viewshedMethod, threads);
+	frameGovernor = FrameGovernor(governorSettings);
+	SetGovernorLodRange();
+	farField = FarField(farFieldSettings);
+
+	// Initialize the OpenGL environment, hosts without a GPU fall back to the software rasterizer
+	if (software || !initializeGL())
+	{
+		if (!software)
+			cout << "No OpenGL 4.5 context, rendering the camera path with the software rasterizer" << endl;
+		window = nullptr;
+
+		SoftwareBackend backend(window_width, window_height, n_points, m_scale, threads);
+		if (!backend.Load())
+			return -1;
+		RenderCameraPath(backend, "soft_frame", pathFrames);
+		backend.Unload();
+		return 0;
+	}
+
+	// Captured frames are compared between runs, they must not depend on which pages happened to be loaded
+	// or on how far the far field cube got
+	if (capture)
+	{
+		virtualTexturing = false;
+		farFieldEnabled = false;
+	}
+
+	GLBackend backend;
+	if (!backend.Load())
+	{
+		glfwTerminate();
+		return -1;
+	}
+
+	// Register key and mouse button callbacks
+	glfwSetKeyCallback(window, KeyCallback);
+	glfwSetMouseButtonCallback(window, MouseButtonCallback);
+
+	//Set rendering state
+	glClearColor(0.7f, 0.8f, 1.0f, 0.0f);
+	glEnable(GL_DEPTH_TEST);
+	glDepthFunc(GL_LESS);
+	glEnable(GL_CULL_FACE);
+
+	if (capture)
+	{
+		// Captured frames are compared between runs, so they are not subject to the governor
+		governorEnabled = false;
+		RenderCameraPath(backend, "gl_frame", pathFrames);
+		backend.Unload();
+		glfwTerminate();
+		return 0;
+	}
+
+	// Render on demand: wake the loop from glfwWaitEventsTimeout when another thread marks the frame dirty,
+	// and draw again when the window needs its contents back
+	frameScheduler.setContinuous(continuous);
+	frameScheduler.setWakeCallback([]() { glfwPostEmptyEvent(); });
+	jobSystem().setMainThreadWakeCallback([]() { glfwPostEmptyEvent(); });
+	glfwSetWindowRefreshCallback(window, [](GLFWwindow*) { frameScheduler.markDirty(DIRTY_WINDOW); });
+	glfwSetFramebufferSizeCallback(window, [](GLFWwindow*, int, int) { frameScheduler.markDirty(DIRTY_WINDOW); });
+
+	// The simulation starts where the camera and light are, every step with news wakes the loop
+	SimulationState initialState;
+	initialState.camera = getCameraState();
+	initialState.lightDir = lightDir;
+	setCameraState(initialState.camera);
+	simulation.reset(initialState);
+	simulation.start([]() { glfwPostEmptyEvent(); });
+
+	// Set rendering state
+	vector<float> frameTimes;
+	double lastPresentTime = 0.0;
+	bool presentedLastIteration = false;
+	do {
+		// GL work of finished background jobs (uploads), it marks the frame dirty itself
+		jobSystem().runMainThreadJobs();
+
+		// Keyboard and mouse input go to the simulation, camera and light come back from it. They keep moving
+		// between two steps, so the loop does not sleep until they arrived where the last step put them
+		pollSimulationInput(simulation);
+		bool cameraMoving = ApplySimulationSnapshot();
+		// A held brush keeps editing, even with a still camera
+		if (sculpting)
+			ApplySculptBrush();
+
+		// Only draw when something changed, otherwise the last presented frame stays on screen
+		drawnFrameFlags = frameScheduler.beginFrame();
+		if (drawnFrameFlags)
+		{
+			// Draw the terrain with the current camera, light and height map scale
+			frameTimes.clear();
+			const bool timed = BeginFrameTiming(frameTimes);
+			backend.DrawFrame(MakeTerrainFrame());
+			EndFrameTiming(timed, frameTimes);
+
+			// Swap buffers
+			glfwSwapBuffers(window);
+
+			const double presentTime = simulationClock();
+			if (latencyInputTime > 0.0)
+				inputLatency.add((presentTime - latencyInputTime) * 1000.0);
+			if (presentedLastIteration)
+				frameIntervals.add((presentTime - lastPresentTime) * 1000.0);
+			lastPresentTime = presentTime;
+
+			// Feed finished GPU timings to the governor, its changes take effect with the next frame that is drawn
+			// anyway, a still view is not redrawn just to adjust the quality
+			bool governorChanged = false;
+			for (float ms : frameTimes)
+				governorChanged |= governorEnabled && frameGovernor.update(ms);
+			if (governorChanged)
+				ApplyGovernor();
+			if (!frameTimes.empty())
+				UpdateGovernorTitle();
+		}
+		presentedLastIteration = drawnFrameFlags != 0;
+		// Input that changed nothing on screen is not measured
+		latencyInputTime = 0.0;
+
+		// Ensure the OpenGL application can respond to user interaction, sleeping until it does when idle.
+		// A held movement key or mouse button sends no events, so keep polling while the camera is moving or sculpting
+		if (!cameraMoving && !sculpting && frameScheduler.isIdle())
+			glfwWaitEventsTimeout(idleWaitTimeout);
+		else
+			glfwPollEvents();
 	} while (glfwGetKey(window, GLFW_KEY_ESCAPE) != GLFW_PRESS &&
 		glfwWindowShouldClose(window) == 0); // Check if ESC key is not pressed and there are no requests to close the window, continue looping
 
-	UnloadModel();
-	UnloadShaders();
-	UnloadTextures();
+	cout << "Frames drawn: " << frameScheduler.framesDrawn() << ", skipped: " << frameScheduler.framesSkipped() << endl;
+	if (virtualTexturing)
+		cout << "Virtual texturing: " << vtCache->residentCount() << " pages resident, " << vtCache->evictionCount() << " evicted" << endl;
+	cout << "Simulation: " << simulation.stepCount() << " steps, " << simulation.droppedSteps() << " dropped, "
+		<< simulation.droppedEvents() << " input events lost" << endl;
+	// The picture is interpolated one simulation step behind the newest state, that step is part of every latency
+	if (inputLatency.count())
+		cout << "Input to present latency: mean " << inputLatency.mean() << " ms, p50 " << inputLatency.percentile(50) << " ms, p99 "
+			<< inputLatency.percentile(99) << " ms, max " << inputLatency.maximum() << " ms over the last " << inputLatency.count()
+			<< " of " << inputLatency.total() << " inputs, including the " << simulation.getSettings().stepSeconds * 1000.0
+			<< " ms interpolation delay" << endl;
+	if (frameIntervals.count())
+		cout << "Frame interval: mean " << frameIntervals.mean() << " ms, jitter " << frameIntervals.deviation() << " ms, p99 "
+			<< frameIntervals.percentile(99) << " ms" << endl;
+	cout << "Far field: " << farField.cubesBuilt() << " cubes built, " << farField.sectorsRendered() << " sectors rendered, "
+		<< farField.sectorsCopied() << " copied" << endl;
+
+	// Jobs still running and the simulation must not wake a terminated GLFW. Background jobs (page loads, layer
+	// updates) post their GL uploads to the main thread: drain both while the context and the resources exist
+	simulation.stop();
+	jobSystem().setMainThreadWakeCallback(nullptr);
+	do
+		jobSystem().waitIdle();
+	while (jobSystem().runMainThreadJobs() > 0);
+	backend.Unload();
 	glfwTerminate(); // Release model, shader, and texture resources
 
 	return 0;
@@ -0,0 +1,308 @@
+#include <vector>
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+#include "common/farfield.hpp"
+#include "tests/testing.hpp"
+
+using namespace std;
+
+namespace
+{
+	// Builds a whole cube around the camera, checks the per frame budget on the way. Returns the sectors handed
+	// out, the frames it took in frames
+	vector<FarFieldSector> buildCube(FarField& farField, const glm::vec3& camera, int& frames)
+	{
+		vector<FarFieldSector> all, sectors;
+		frames = 0;
+		bool complete = false;
+		while (!complete && frames < 1000)
+		{
+			complete = farField.plan(camera, sectors);
+			int renders = 0;
+			for (const FarFieldSector& sector : sectors)
+				renders += sector.action == FarFieldSector::RENDER ? 1 : 0;
+			CHECK(renders <= farField.getSettings().sectorsPerFrame);
+			all.insert(all.end(), sectors.begin(), sectors.end());
+			frames++;
+		}
+		CHECK(complete);
+		farField.swap();
+		return all;
+	}
+
+	int countAction(const vector<FarFieldSector>& sectors, FarFieldSector::Action action)
+	{
+		int count = 0;
+		for (const FarFieldSector& sector : sectors)
+			count += sector.action == action ? 1 : 0;
+		return count;
+	}
+
+	// Terrain all around and far beyond the radius, the camera a little above it
+	FarField makeWideField()
+	{
+		FarField farField;
+		farField.setBounds(glm::vec3(-50, 0, -50), glm::vec3(50, 2, 50));
+		return farField;
+	}
+}
+
+TEST_CASE("farfield/first cube renders every sector with terrain")
+{
+	FarField farField = makeWideField();
+	const int n = farField.getSettings().sectors;
+	const glm::vec3 camera(0, 3, 0);
+	CHECK(!farField.hasCube());
+	int frames = 0;
+	const vector<FarFieldSector> sectors = buildCube(farField, camera, frames);
+	CHECK(farField.hasCube() && farField.shownCube() == 0);
+	CHECK(int(sectors.size()) == 6 * n * n);
+	CHECK(countAction(sectors, FarFieldSector::COPY) == 0);
+
+	// Above the terrain: nothing up there, every sector below the horizon sees it
+	int terrain = 0;
+	for (const FarFieldSector& sector : sectors)
+	{
+		const bool sees = farField.sectorSeesTerrain(sector.face, sector.x, sector.y, camera);
+		CHECK(sees == (sector.action == FarFieldSector::RENDER));
+		CHECK(sector.face != 2 || !sees);
+		CHECK(sector.face != 3 || sees);
+		terrain += sees ? 1 : 0;
+	}
+	CHECK(terrain < 6 * n * n);
+	const int perFrame = farField.getSettings().sectorsPerFrame;
+	CHECK(frames == (terrain + perFrame - 1) / perFrame);
+	CHECK(int(farField.sectorsRendered()) == terrain);
+
+	// Small movements keep the cube, the near field covers the difference
+	vector<FarFieldSector> none;
+	CHECK(!farField.plan(camera + glm::vec3(0.1f, 0, 0), none));
+	CHECK(none.empty());
+	CHECK_NEAR(farField.nearRadius(camera + glm::vec3(0.1f, 0, 0)), farField.getSettings().radius + 0.1f, 1e-5);
+}
+
+TEST_CASE("farfield/sector selection is conservative and matches the projection")
+{
+	// Points of the terrain box beyond the radius that a face projects into a sector must be reported for it
+	FarField farField;
+	const glm::vec3 boxMin(-6, 0, -4), boxMax(5, 2, 7);
+	farField.setBounds(boxMin, boxMax);
+	const FarFieldSettings& settings = farField.getSettings();
+	const int faceSize = 512;
+	const glm::vec3 centres[] = { glm::vec3(0, 1, 0), glm::vec3(3, 8, -2), glm::vec3(-5.5f, 0.5f, 6) };
+	uint32_t seed = 12345;
+	auto random = [&]() {
+		seed = seed * 1664525u + 1013904223u;
+		return float(seed >> 8) / float(1 << 24);
+	};
+	int hits = 0, missed = 0;
+	for (const glm::vec3& centre : centres)
+		for (int i = 0; i < 4000; i++)
+		{
+			const glm::vec3 point = boxMin + (boxMax - boxMin) * glm::vec3(random(), random(), random());
+			if (glm::length(glm::vec2(point.x - centre.x, point.z - centre.z)) <= settings.radius)
+				continue;
+			for (int face = 0; face < 6; face++)
+			{
+				const glm::vec4 clip = farField.faceViewProjection(face, centre) * glm::vec4(point, 1.0f);
+				if (clip.w <= 0.0f || fabs(clip.x) > clip.w || fabs(clip.y) > clip.w)
+					continue;
+				const int px = min(faceSize - 1, int((clip.x / clip.w * 0.5f + 0.5f) * faceSize));
+				const int py = min(faceSize - 1, int((clip.y / clip.w * 0.5f + 0.5f) * faceSize));
+				for (int y = 0; y < settings.sectors; y++)
+					for (int x = 0; x < settings.sectors; x++)
+					{
+						int x0, y0, width, height;
+						farField.sectorRect(x, y, faceSize, x0, y0, width, height);
+						if (px < x0 || px >= x0 + width || py < y0 || py >= y0 + height)
+							continue;
+						hits++;
+						missed += farField.sectorSeesTerrain(face, x, y, centre) && farField.faceSeesTerrain(face, centre) ? 0 : 1;
+					}
+			}
+		}
+	CHECK(hits > 1000);
+	CHECK(missed == 0);
+}
+
+TEST_CASE("farfield/sector rectangles tile the face")
+{
+	FarFieldSettings settings;
+	settings.sectors = 3;
+	FarField farField(settings);
+	const int faceSize = 511;
+	vector<int> covered(faceSize * faceSize, 0);
+	for (int y = 0; y < 3; y++)
+		for (int x = 0; x < 3; x++)
+		{
+			int x0, y0, width, height;
+			farField.sectorRect(x, y, faceSize, x0, y0, width, height);
+			for (int j = y0; j < y0 + height; j++)
+				for (int i = x0; i < x0 + width; i++)
+					covered[j * faceSize + i]++;
+		}
+	int wrong = 0;
+	for (int c : covered)
+		wrong += c == 1 ? 0 : 1;
+	CHECK(wrong == 0);
+}
+
+TEST_CASE("farfield/moving forward copies the sectors ahead and behind")
+{
+	FarField farField = makeWideField();
+	const FarFieldSettings& settings = farField.getSettings();
+	const glm::vec3 start(0, 1, 0);
+	int frames = 0;
+	const vector<FarFieldSector> first = buildCube(farField, start, frames);
+	const int terrain = countAction(first, FarFieldSector::RENDER);
+
+	// Past the tolerance along +X: the sectors looking along the motion barely change, the ones to the side do
+	const glm::vec3 camera = start + glm::vec3(0.3f, 0, 0);
+	const vector<FarFieldSector> second = buildCube(farField, camera, frames);
+	CHECK(farField.shownCube() == 1);
+	const int copies = countAction(second, FarFieldSector::COPY);
+	const int renders = countAction(second, FarFieldSector::RENDER);
+	CHECK(copies > 0);
+	CHECK(renders < terrain);
+	CHECK(copies + renders == terrain);
+	for (const FarFieldSector& sector : second)
+	{
+		const bool stale = farField.sectorNeedsRender(sector.face, sector.x, sector.y, start, camera);
+		if (sector.action == FarFieldSector::COPY)
+		{
+			CHECK(!stale);
+			CHECK(sector.face == 0 || sector.face == 1);
+			CHECK(farField.sectorCentre(sector.face, sector.x, sector.y) == start);
+		}
+		else if (sector.action == FarFieldSector::RENDER)
+		{
+			CHECK(stale);
+			CHECK(farField.sectorCentre(sector.face, sector.x, sector.y) == camera);
+		}
+		// Sideways motion for the +Z and -Z faces
+		CHECK(sector.face < 4 || sector.action == FarFieldSector::RENDER);
+	}
+	// Copied sectors still show the terrain from the old centre, the near field reaches that far
+	CHECK_NEAR(farField.nearRadius(camera), settings.radius + 0.3f, 1e-5);
+	CHECK(farField.sectorsCopied() == (unsigned long long)copies);
+}
+
+TEST_CASE("farfield/copied sectors are rendered again after max drift")
+{
+	FarField farField = makeWideField();
+	const FarFieldSettings& settings = farField.getSettings();
+	glm::vec3 camera(0, 1, 0);
+	int frames = 0;
+	buildCube(farField, camera, frames);
+	vector<FarFieldSector> sectors;
+	for (int step = 0; step < 20; step++)
+	{
+		camera.x += 0.3f;
+		if (farField.plan(camera, sectors) || farField.isBuilding())
+		{
+			while (!farField.plan(camera, sectors))
+				;
+			farField.swap();
+		}
+		CHECK(farField.nearRadius(camera) <= settings.radius + settings.maxDrift + 1e-4f);
+	}
+	CHECK(farField.cubesBuilt() > 5);
+}
+
+TEST_CASE("farfield/invalidate renders every sector again")
+{
+	FarField farField = makeWideField();
+	const glm::vec3 camera(0, 1, 0);
+	int frames = 0;
+	const int terrain = countAction(buildCube(farField, camera, frames), FarFieldSector::RENDER);
+
+	// Nothing changed: no work
+	vector<FarFieldSector> sectors;
+	CHECK(!farField.plan(camera, sectors) && sectors.empty());
+
+	farField.invalidate();
+	const vector<FarFieldSector> again = buildCube(farField, camera + glm::vec3(0.05f, 0, 0), frames);
+	CHECK(countAction(again, FarFieldSector::COPY) == 0);
+	CHECK(countAction(again, FarFieldSector::RENDER) == terrain);
+}
+
+TEST_CASE("farfield/no terrain beyond the radius")
+{
+	// Camera in the middle of a small terrain: every sector is cleared once per cube, then left alone
+	FarField farField;
+	farField.setBounds(glm::vec3(-1, 0, -1), glm::vec3(1, 2, 1));
+	const glm::vec3 camera(0, 3, 0);
+	const int n = farField.getSettings().sectors;
+	vector<FarFieldSector> sectors;
+	CHECK(farField.plan(camera, sectors));
+	CHECK(int(sectors.size()) == 6 * n * n && countAction(sectors, FarFieldSector::CLEAR) == 6 * n * n);
+	farField.swap();
+	CHECK(!farField.plan(camera, sectors));
+
+	// The other cube still holds whatever it was created with
+	farField.invalidate();
+	CHECK(farField.plan(camera, sectors) && countAction(sectors, FarFieldSector::CLEAR) == 6 * n * n);
+	farField.swap();
+	farField.invalidate();
+	CHECK(farField.plan(camera, sectors) && sectors.empty());
+	farField.swap();
+	CHECK(farField.sectorsRendered() == 0);
+}
+
+TEST_CASE("farfield/an edited region renders only the sectors that see it")
+{
+	FarField farField = makeWideField();
+	const glm::vec3 camera(0, 1, 0);
+	int frames = 0;
+	const int terrain = countAction(buildCube(farField, camera, frames), FarFieldSector::RENDER);
+
+	// Inside the radius the near field draws it, the cube stays
+	vector<FarFieldSector> sectors;
+	farField.invalidateRegion(glm::vec3(-1, 0, -1), glm::vec3(1, 2, 1));
+	CHECK(!farField.plan(camera, sectors) && sectors.empty());
+
+	// Far out along +X: the +X face sees it, the faces looking away do not
+	const glm::vec3 editMin(30, 0, -2), editMax(32, 2, 2);
+	farField.invalidateRegion(editMin, editMax);
+	const vector<FarFieldSector> again = buildCube(farField, camera, frames);
+	const int renders = countAction(again, FarFieldSector::RENDER);
+	CHECK(renders > 0 && renders < terrain);
+	CHECK(renders + countAction(again, FarFieldSector::COPY) == terrain);
+	for (const FarFieldSector& sector : again)
+	{
+		CHECK(sector.face != 1 || sector.action == FarFieldSector::COPY);
+		if (sector.action == FarFieldSector::RENDER)
+		{
+			// Some point of the box projects into the sector
+			bool sees = false;
+			for (int i = 0; i <= 8 && !sees; i++)
+				for (int j = 0; j <= 8 && !sees; j++)
+					for (int k = 0; k <= 8 && !sees; k++)
+					{
+						const glm::vec3 point = editMin + (editMax - editMin) * glm::vec3(i, j, k) / 8.0f;
+						const glm::vec4 clip = farField.faceViewProjection(sector.face, camera) * glm::vec4(point, 1.0f);
+						if (clip.w <= 0.0f)
+							continue;
+						const float u = clip.x / clip.w, v = clip.y / clip.w;
+						const float size = 2.0f / farField.getSettings().sectors;
+						const float margin = 0.02f;
+						sees = u >= -1.0f + sector.x * size - margin && u <= -1.0f + (sector.x + 1) * size + margin &&
+							v >= -1.0f + sector.y * size - margin && v <= -1.0f + (sector.y + 1) * size + margin;
+					}
+			CHECK(sees);
+		}
+	}
+
+	// Edited while a cube is being built: sectors already done in it are rendered again with the next cube
+	farField.invalidate();
+	CHECK(!farField.plan(camera, sectors) && farField.isBuilding());
+	farField.invalidateRegion(editMin, editMax);
+	while (!farField.plan(camera, sectors))
+		;
+	farField.swap();
+	const vector<FarFieldSector> last = buildCube(farField, camera, frames);
+	CHECK(countAction(last, FarFieldSector::RENDER) > 0);
+	CHECK(countAction(last, FarFieldSector::RENDER) <= renders);
+}
@@ -0,0 +1,140 @@
+#include <vector>
+#include <cmath>
+
+#include "common/framegovernor.hpp"
+#include "tests/testing.hpp"
+
+using namespace std;
+
+namespace
+{
+	// Synthetic GPU cost of a frame: a fixed part, pixels (scale^2) and geometry (halved by every LOD level), all
+	// growing with how much terrain is in view. A little deterministic jitter like real timer queries
+	struct CostModel
+	{
+		float fixedMs = 2.0f;
+		float pixelMs = 14.0f;
+		float geometryMs = 8.0f;
+
+		float frameMs(const FrameGovernor& governor, float load, int frame) const
+		{
+			const float scale = governor.renderScale();
+			const float ms = fixedMs + load * (pixelMs * scale * scale + geometryMs * std::pow(0.5f, float(governor.lodLevel())));
+			return ms * (1.0f + 0.03f * std::sin(frame * 1.7f));
+		}
+	};
+
+	struct Run
+	{
+		vector<float> scales;
+		vector<int> lods;
+		vector<float> frameMs;
+		int changes = 0;
+		int lastChange = -1;
+	};
+
+	// Feed frames of the cost model with load(frame) to the governor
+	template<typename Load>
+	Run simulate(FrameGovernor& governor, const CostModel& model, int frames, Load load)
+	{
+		Run run;
+		for (int f = 0; f < frames; f++)
+		{
+			const float ms = model.frameMs(governor, load(f), f);
+			run.frameMs.push_back(ms);
+			if (governor.update(ms))
+			{
+				run.changes++;
+				run.lastChange = f;
+			}
+			run.scales.push_back(governor.renderScale());
+			run.lods.push_back(governor.lodLevel());
+		}
+		return run;
+	}
+}
+
+TEST_CASE("framegovernor/light load stays at full quality")
+{
+	FrameGovernor governor;
+	Run run = simulate(governor, CostModel(), 300, [](int) { return 0.5f; });
+	CHECK(run.changes == 0);
+	CHECK(governor.renderScale() == governor.getSettings().maxScale);
+	CHECK(governor.lodLevel() == 0);
+}
+
+TEST_CASE("framegovernor/heavy load converges inside the budget")
+{
+	FrameGovernor governor;
+	const FrameGovernorSettings& settings = governor.getSettings();
+	Run run = simulate(governor, CostModel(), 600, [](int) { return 1.3f; });
+	// Settled well before the end, and then in budget without further changes
+	CHECK(run.changes > 0);
+	CHECK(run.lastChange < 300);
+	CHECK(governor.renderScale() < settings.maxScale);
+	CHECK(governor.averageMs() <= settings.targetMs * settings.overBudget);
+	// Resolution is traded first: the LOD only moves once the scale is at its minimum
+	for (size_t i = 0; i < run.lods.size(); i++)
+		if (run.lods[i] > 0)
+			CHECK(run.scales[i] == settings.minScale);
+}
+
+TEST_CASE("framegovernor/overload walks the LOD levels one at a time")
+{
+	FrameGovernor governor;
+	governor.setMaxLod(4);
+	Run run = simulate(governor, CostModel(), 800, [](int) { return 5.0f; });
+	// Still over budget at the coarsest level, it stays there
+	CHECK(governor.renderScale() == governor.getSettings().minScale);
+	CHECK(governor.lodLevel() == 4);
+	for (size_t i = 1; i < run.lods.size(); i++)
+		CHECK(std::abs(run.lods[i] - run.lods[i - 1]) <= 1);
+}
+
+TEST_CASE("framegovernor/recovers when the load drops")
+{
+	FrameGovernor governor;
+	governor.setMaxLod(4);
+	Run run = simulate(governor, CostModel(), 1200, [](int f) { return f < 400 ? 3.0f : 0.4f; });
+	CHECK(run.lods[399] > 0);
+	CHECK(governor.lodLevel() == 0);
+	CHECK(governor.renderScale() == governor.getSettings().maxScale);
+	// Geometry comes back before resolution
+	for (size_t i = 400; i < run.lods.size(); i++)
+		if (run.scales[i] > run.scales[i - 1])
+			CHECK(run.lods[i] == 0);
+}
+
+TEST_CASE("framegovernor/single spikes are ignored")
+{
+	FrameGovernor governor;
+	Run run = simulate(governor, CostModel(), 400, [](int f) { return f % 50 == 25 ? 4.0f : 0.5f; });
+	CHECK(run.changes == 0);
+}
+
+TEST_CASE("framegovernor/no oscillation at the budget")
+{
+	// A load right at the edge of the hysteresis band must not flip between two settings forever
+	FrameGovernor governor;
+	Run run = simulate(governor, CostModel(), 2000, [](int) { return 0.78f; });
+	int late = 0;
+	FrameGovernor replay;
+	Run again = simulate(replay, CostModel(), 2000, [](int) { return 0.78f; });
+	for (int f = 1000; f < 2000; f++)
+		late += run.scales[f] != run.scales[f - 1] || run.lods[f] != run.lods[f - 1];
+	CHECK(late == 0);
+	// Deterministic: the same frame times give the same decisions
+	CHECK(run.scales == again.scales && run.lods == again.lods);
+}
+
+TEST_CASE("framegovernor/max lod clamps the current level")
+{
+	FrameGovernor governor;
+	governor.setMaxLod(5);
+	simulate(governor, CostModel(), 800, [](int) { return 4.0f; });
+	CHECK(governor.lodLevel() == 5);
+	CHECK(governor.setMaxLod(2));
+	CHECK(governor.lodLevel() == 2);
+	CHECK(!governor.setMaxLod(6));
+	CHECK(governor.lodLevel() == 2);
+}
@@ -0,0 +1,114 @@
+#include <vector>
+#include <thread>
+#include <atomic>
+
+#include "common/framescheduler.hpp"
+#include "tests/testing.hpp"
+
+using namespace std;
+
+TEST_CASE("framescheduler/flags accumulate until the frame")
+{
+	FrameScheduler scheduler;
+	// Everything is dirty at the start, the first frame always draws
+	CHECK(!scheduler.isIdle());
+	CHECK(scheduler.beginFrame() == DIRTY_ALL);
+	CHECK(scheduler.isIdle());
+	CHECK(scheduler.beginFrame() == 0);
+
+	scheduler.markDirty(DIRTY_CAMERA);
+	scheduler.markDirty(DIRTY_TERRAIN | DIRTY_LIGHT);
+	scheduler.markDirty(DIRTY_CAMERA);
+	CHECK(!scheduler.isIdle());
+	CHECK(scheduler.beginFrame() == (DIRTY_CAMERA | DIRTY_LIGHT | DIRTY_TERRAIN));
+	CHECK(scheduler.beginFrame() == 0);
+	CHECK(scheduler.framesDrawn() == 2 && scheduler.framesSkipped() == 2);
+
+	// Continuous mode draws every frame, the real reasons still come through
+	scheduler.setContinuous(true);
+	CHECK(scheduler.isContinuous() && !scheduler.isIdle());
+	CHECK(scheduler.beginFrame() == DIRTY_SETTINGS);
+	scheduler.markDirty(DIRTY_STREAMING);
+	CHECK(scheduler.beginFrame() == (DIRTY_SETTINGS | DIRTY_STREAMING));
+	CHECK(scheduler.beginFrame() == DIRTY_SETTINGS);
+	scheduler.setContinuous(false);
+	CHECK(scheduler.beginFrame() == DIRTY_SETTINGS);
+	CHECK(scheduler.beginFrame() == 0 && scheduler.isIdle());
+}
+
+TEST_CASE("framescheduler/wakes only when going from clean to dirty")
+{
+	FrameScheduler scheduler;
+	int wakes = 0;
+	scheduler.setWakeCallback([&]() { wakes++; });
+	scheduler.beginFrame();
+
+	scheduler.markDirty(0);
+	CHECK(wakes == 0 && scheduler.isIdle());
+	scheduler.markDirty(DIRTY_CAMERA);
+	CHECK(wakes == 1);
+	// Already dirty: the loop is awake or about to draw anyway
+	scheduler.markDirty(DIRTY_CAMERA);
+	scheduler.markDirty(DIRTY_STREAMING);
+	CHECK(wakes == 1);
+
+	scheduler.beginFrame();
+	scheduler.markDirty(DIRTY_WINDOW);
+	CHECK(wakes == 2);
+	scheduler.beginFrame();
+	CHECK(wakes == 2);
+}
+
+TEST_CASE("framescheduler/no flag is lost across threads")
+{
+	// Every thread marks its own flag over and over while the loop keeps taking them: every mark is seen by a
+	// frame, and the wakes match the clean to dirty transitions the loop observed
+	FrameScheduler scheduler;
+	atomic<int> wakes(0);
+	scheduler.setWakeCallback([&]() { wakes++; });
+	scheduler.beginFrame();
+
+	const int threads = 4, marks = 20000;
+	const unsigned int flags[threads] = { DIRTY_CAMERA, DIRTY_LIGHT, DIRTY_STREAMING, DIRTY_TERRAIN };
+	// Each thread waits until a frame took its previous mark before marking again, so no mark can merge with
+	// its own previous one
+	atomic<int> seen[threads];
+	for (atomic<int>& s : seen)
+		s = 0;
+	atomic<bool> done(false);
+	vector<thread> markers;
+	for (int t = 0; t < threads; t++)
+		markers.emplace_back([&, t]() {
+			for (int i = 1; i <= marks; i++)
+			{
+				scheduler.markDirty(flags[t]);
+				while (seen[t] < i)
+					this_thread::yield();
+			}
+		});
+
+	int frames = 0;
+	while (!done)
+	{
+		const unsigned int taken = scheduler.beginFrame();
+		frames += taken ? 1 : 0;
+		for (int t = 0; t < threads; t++)
+			if (taken & flags[t])
+				seen[t]++;
+		bool all = true;
+		for (int t = 0; t < threads; t++)
+			all &= seen[t] >= marks;
+		done = all;
+		if (!taken)
+			this_thread::yield();
+	}
+	for (thread& marker : markers)
+		marker.join();
+
+	bool exact = true;
+	for (int t = 0; t < threads; t++)
+		exact &= seen[t] == marks;
+	CHECK(exact);
+	CHECK(scheduler.beginFrame() == 0);
+	CHECK(wakes == frames);
+}
@@ -0,0 +1,188 @@
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <filesystem>
+
+#include "common/heightcodec.hpp"
+#include "common/utils.hpp"
+#include "tests/testing.hpp"
+
+using namespace std;
+
+namespace
+{
+	// Smooth ridges plus a little noise around offset, so the tiles see both small and large residuals
+	vector<int32_t> makeHeights(int width, int height, int32_t offset, int32_t amplitude, uint32_t seed)
+	{
+		vector<int32_t> heights(size_t(width) * height);
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < width; x++)
+			{
+				seed = seed * 1664525u + 1013904223u;
+				double ridge = sin(x * 0.07) * cos(y * 0.05) + 0.3 * sin((x + y) * 0.31);
+				int32_t noise = int32_t(seed >> 28) - 8;
+				heights[size_t(y) * width + x] = offset + int32_t(ridge * amplitude) + noise;
+			}
+		return heights;
+	}
+
+	// Largest absolute difference, -1 when the round trip failed or changed the size
+	long long roundTrip(const vector<int32_t>& heights, int width, int height, int tileSize, unsigned int maxError, size_t* encodedSize = nullptr)
+	{
+		HeightCodecOptions options;
+		options.tileSize = tileSize;
+		options.maxError = maxError;
+		vector<unsigned char> encoded;
+		if (!encodeHeights(heights.data(), width, height, options, encoded))
+			return -1;
+		if (encodedSize)
+			*encodedSize = encoded.size();
+		int w = 0, h = 0;
+		vector<int32_t> decoded;
+		if (!decodeHeights(encoded.data(), encoded.size(), w, h, decoded) || w != width || h != height || decoded.size() != heights.size())
+			return -1;
+		long long worst = 0;
+		for (size_t i = 0; i < heights.size(); i++)
+			worst = max(worst, llabs((long long)decoded[i] - heights[i]));
+		return worst;
+	}
+}
+
+TEST_CASE("heightcodec/lossless")
+{
+	const vector<int32_t> heights = makeHeights(200, 150, 0x800000, 0x300000, 1);
+	size_t encoded = 0;
+	CHECK(roundTrip(heights, 200, 150, 64, 0, &encoded) == 0);
+	// Smooth terrain needs fewer than the 3 bytes per sample of the BMP
+	CHECK(encoded < heights.size() * 3);
+}
+
+TEST_CASE("heightcodec/odd tile and image sizes")
+{
+	const int tileSizes[] = { 16, 17, 31, 33, 63, 100 };
+	const int sizes[][2] = { { 1, 1 }, { 5, 3 }, { 17, 16 }, { 101, 37 }, { 64, 65 }, { 129, 127 } };
+	for (int tileSize : tileSizes)
+		for (const auto& size : sizes)
+		{
+			const vector<int32_t> heights = makeHeights(size[0], size[1], 0x400000, 0x100000, uint32_t(tileSize * 7 + size[0]));
+			CHECK(roundTrip(heights, size[0], size[1], tileSize, 0) == 0);
+			CHECK(roundTrip(heights, size[0], size[1], tileSize, 5) <= 5);
+		}
+}
+
+TEST_CASE("heightcodec/negative values")
+{
+	// Raw heights are signed, e.g. below sea level or differences of two maps
+	const vector<int32_t> heights = makeHeights(90, 70, -0x200000, 0x400000, 3);
+	CHECK(roundTrip(heights, 90, 70, 32, 0) == 0);
+	CHECK(roundTrip(heights, 90, 70, 32, 3) <= 3);
+
+	vector<int32_t> extremes(64 * 16);
+	for (size_t i = 0; i < extremes.size(); i++)
+		extremes[i] = (i % 3 == 0) ? -(1 << 30) : (i % 3 == 1) ? (1 << 30) : -1;
+	CHECK(roundTrip(extremes, 64, 16, 16, 0) == 0);
+}
+
+TEST_CASE("heightcodec/quantized error bound")
+{
+	const vector<int32_t> heights = makeHeights(160, 96, 0x600000, 0x200000, 5);
+	size_t lossless = 0;
+	CHECK(roundTrip(heights, 160, 96, 64, 0, &lossless) == 0);
+	const unsigned int maxErrors[] = { 1, 2, 7, 64, 1000 };
+	size_t previous = lossless;
+	for (unsigned int maxError : maxErrors)
+	{
+		size_t size = 0;
+		const long long worst = roundTrip(heights, 160, 96, 64, maxError, &size);
+		CHECK(worst >= 0 && worst <= (long long)maxError);
+		// A coarser quantization never needs more bits
+		CHECK(size <= previous);
+		previous = size;
+	}
+}
+
+TEST_CASE("heightcodec/invalid input")
+{
+	const vector<int32_t> heights = makeHeights(40, 40, 0, 1000, 9);
+	HeightCodecOptions options;
+	vector<unsigned char> encoded;
+	options.tileSize = 8;
+	CHECK(!encodeHeights(heights.data(), 40, 40, options, encoded));
+	options.tileSize = 16;
+	CHECK(encodeHeights(heights.data(), 40, 40, options, encoded));
+
+	int w, h;
+	vector<int32_t> decoded;
+	CHECK(!decodeHeights(encoded.data(), 10, w, h, decoded));
+	vector<unsigned char> corrupted = encoded;
+	corrupted[0] ^= 0xFF;
+	CHECK(!decodeHeights(corrupted.data(), corrupted.size(), w, h, decoded));
+}
+
+TEST_CASE("heightcodec/bgr layout")
+{
+	// 24 bit heights of the BMP, rows padded to 4 bytes
+	vector<int32_t> heights = makeHeights(13, 7, 0x800000, 0x7F0000, 11);
+	for (int32_t& h : heights)
+		h = min(max(h, 0), 0xFFFFFF);
+	CHECK(heightmapRowStride(13) == 40);
+	vector<unsigned char> bgr(heightmapRowStride(13) * 7);
+	packHeightsBGR(heights.data(), 13, 7, bgr.data());
+	vector<int32_t> unpacked(heights.size());
+	unpackHeightsBGR(bgr.data(), 13, 7, unpacked.data());
+	CHECK(unpacked == heights);
+}
+
+TEST_CASE("heightcodec/cache follows the bmp")
+{
+	const char* bmp = "tests_heights.bmp";
+	const char* thm = "tests_heights.thm";
+	auto write = [&](int32_t offset) {
+		vector<int32_t> heights = makeHeights(33, 21, offset, 0x10000, 13);
+		vector<unsigned char> bgr(heightmapRowStride(33) * 21);
+		packHeightsBGR(heights.data(), 33, 21, bgr.data());
+		saveBMP_custom(bmp, 33, 21, bgr.data());
+		return bgr;
+	};
+	auto load = [&](vector<unsigned char>& bgr) {
+		int w = 0, h = 0;
+		unsigned char* data = nullptr;
+		if (!loadHeightmapCached(bmp, thm, w, h, data))
+			return false;
+		bgr.assign(data, data + heightmapRowStride(w) * h);
+		delete[] data;
+		return true;
+	};
+	remove(bmp);
+	remove(thm);
+
+	vector<unsigned char> loaded;
+	CHECK(!load(loaded));
+
+	// First load writes the cache, the second one reads it
+	vector<unsigned char> first = write(0x100000);
+	CHECK(load(loaded) && loaded == first);
+	CHECK(filesystem::exists(thm));
+	CHECK(load(loaded) && loaded == first);
+
+	// Editing the BMP after the cache was written makes it stale
+	vector<unsigned char> second = write(0x200000);
+	filesystem::last_write_time(bmp, filesystem::last_write_time(thm) + chrono::seconds(2));
+	CHECK(load(loaded) && loaded == second);
+
+	// So does a BMP of the same size restored with a time older than the cache
+	vector<unsigned char> restored = write(0x300000);
+	filesystem::last_write_time(bmp, filesystem::last_write_time(thm) - chrono::hours(24));
+	CHECK(load(loaded) && loaded == restored);
+	CHECK(load(loaded) && loaded == restored);
+
+	// A cache without a recorded source is not trusted while the BMP is there
+	CHECK(saveTHM_custom(thm, first.data(), 33, 21));
+	CHECK(load(loaded) && loaded == restored);
+
+	// Without the BMP the cache alone is enough
+	remove(bmp);
+	CHECK(load(loaded) && loaded == restored);
+	remove(thm);
+}
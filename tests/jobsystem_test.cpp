@@ -0,0 +1,132 @@
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+#include "common/jobsystem.hpp"
+#include "tests/testing.hpp"
+
+using namespace std;
+
+// Schedulers of their own with a fixed number of workers, so stealing and waiting happen on any machine
+
+TEST_CASE("jobsystem/fan out")
+{
+	JobSystem jobs(3);
+	const int count = 100000;
+	atomic<int> sum(0);
+	vector<JobHandle> handles;
+	for (int i = 0; i < count; i++)
+		handles.push_back(jobs.submit([&sum]() { sum++; }));
+	jobs.wait(handles);
+	CHECK(sum == count);
+	for (const JobHandle& handle : handles)
+		CHECK(JobSystem::isDone(handle));
+}
+
+TEST_CASE("jobsystem/dependency chains")
+{
+	// Every link depends on the previous one and must see exactly its predecessors
+	JobSystem jobs(3);
+	const int chains = 64, links = 256;
+	vector<int> progress(chains, 0);
+	atomic<bool> ordered(true);
+	vector<JobHandle> last(chains);
+	for (int l = 0; l < links; l++)
+		for (int c = 0; c < chains; c++)
+			last[c] = jobs.submit([&, c, l]() {
+				if (progress[c] != l)
+					ordered = false;
+				progress[c] = l + 1;
+			}, { last[c] });
+	jobs.wait(last);
+	CHECK(ordered);
+	CHECK(count(progress.begin(), progress.end(), links) == chains);
+}
+
+TEST_CASE("jobsystem/join")
+{
+	// One job joining many, submitted while the dependencies already run
+	JobSystem jobs(3);
+	atomic<int> done(0);
+	vector<JobHandle> parts;
+	for (int i = 0; i < 4096; i++)
+		parts.push_back(jobs.submit([&done]() { done++; }));
+	int seen = -1;
+	jobs.wait(jobs.submit([&]() { seen = done; }, parts));
+	CHECK(seen == 4096);
+}
+
+TEST_CASE("jobsystem/nested parallel for")
+{
+	// Jobs running parallel loops, their waits run the loop chunks of the others
+	JobSystem jobs(3);
+	atomic<long long> sum(0);
+	vector<JobHandle> outer;
+	for (int j = 0; j < 64; j++)
+		outer.push_back(jobs.submit([&]() {
+			jobs.parallelFor(10000, 0, [&](int i) { sum += i; }, 64);
+		}));
+	jobs.wait(outer);
+	CHECK(sum == 64LL * 10000 * 9999 / 2);
+}
+
+TEST_CASE("jobsystem/parallel for covers every index once")
+{
+	JobSystem jobs(2);
+	const int counts[] = { 0, 1, 7, 1000, 12345 };
+	for (int count : counts)
+		for (int grain : { 0, 1, 100 })
+		{
+			vector<atomic<int>> hits(count);
+			for (atomic<int>& hit : hits)
+				hit = 0;
+			jobs.parallelFor(count, 0, [&](int i) { hits[i]++; }, grain);
+			CHECK(all_of(hits.begin(), hits.end(), [](const atomic<int>& hit) { return hit == 1; }));
+		}
+}
+
+TEST_CASE("jobsystem/main thread queue")
+{
+	// Background jobs handing their result to the main thread, which wakes up through the callback
+	JobSystem jobs(2);
+	atomic<int> wakes(0);
+	jobs.setMainThreadWakeCallback([&]() { wakes++; });
+	int uploads = 0;
+	vector<JobHandle> background;
+	for (int i = 0; i < 1000; i++)
+		background.push_back(jobs.submit([&]() { jobs.postToMainThread([&]() { uploads++; }); }, JOB_BACKGROUND));
+	jobs.wait(background);
+	CHECK(jobs.runMainThreadJobs() == 1000);
+	CHECK(uploads == 1000);
+	CHECK(wakes == 1000);
+	jobs.setMainThreadWakeCallback(nullptr);
+}
+
+TEST_CASE("jobsystem/wait idle")
+{
+	// Nobody holds a handle: background jobs, jobs waiting for a dependency and jobs submitted by jobs. After
+	// waitIdle() every one of them ran and posted its main thread job, nothing is posted afterwards
+	JobSystem jobs(3);
+	atomic<int> ran(0);
+	int posted = 0;
+	JobHandle gate = jobs.submit([&]() {
+		for (int i = 0; i < 200; i++)
+			jobs.submit([&]() {
+				ran++;
+				jobs.postToMainThread([&]() { posted++; });
+			}, JOB_BACKGROUND);
+	});
+	for (int i = 0; i < 100; i++)
+		jobs.submit([&]() { ran++; }, { gate });
+	gate.reset();
+
+	jobs.waitIdle();
+	CHECK(ran == 300);
+	CHECK(jobs.runMainThreadJobs() == 200);
+	CHECK(posted == 200);
+	CHECK(jobs.runMainThreadJobs() == 0);
+
+	// Idle already: returns at once
+	jobs.waitIdle();
+	CHECK(ran == 300);
+}
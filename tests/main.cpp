@@ -0,0 +1,72 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+
+#include "tests/testing.hpp"
+
+using namespace std;
+
+namespace
+{
+	struct Test
+	{
+		const char* name;
+		function<void()> fn;
+	};
+
+	vector<Test>& tests()
+	{
+		static vector<Test> registered;
+		return registered;
+	}
+
+	int failures = 0;
+}
+
+void registerTest(const char* name, const function<void()>& fn)
+{
+	tests().push_back({ name, fn });
+}
+
+void reportFailure(const char* file, int line, const string& message)
+{
+	cout << "  " << file << ":" << line << ": " << message << endl;
+	failures++;
+}
+
+//Correctness tests of the common library
+//  --filter TEXT       only run the tests whose name contains TEXT
+//Exits with 1 when a check failed
+int main(int argc, char** argv)
+{
+	string filter;
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		if (arg == "--filter" && i + 1 < argc)
+			filter = argv[++i];
+		else
+		{
+			cerr << "Unknown argument " << arg << endl;
+			return 2;
+		}
+	}
+
+	int run = 0, failed = 0;
+	for (const Test& test : tests())
+	{
+		if (!filter.empty() && string(test.name).find(filter) == string::npos)
+			continue;
+		const int before = failures;
+		const auto start = chrono::steady_clock::now();
+		test.fn();
+		const double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		const bool ok = failures == before;
+		cout << (ok ? "ok     " : "FAILED ") << test.name << " (" << int(ms) << " ms)" << endl;
+		run++;
+		failed += ok ? 0 : 1;
+	}
+	cout << run - failed << " of " << run << " tests passed" << endl;
+	return failed == 0 ? 0 : 1;
+}
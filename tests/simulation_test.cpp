@@ -0,0 +1,219 @@
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <cmath>
+#include <algorithm>
+
+#include "common/simulation.hpp"
+#include "tests/testing.hpp"
+
+using namespace std;
+
+namespace
+{
+	// A fixed session: turns every few steps, buttons pressed and released, some of them within one step
+	struct ScriptedEvent
+	{
+		int step; // queued before this step
+		SimulationEvent event;
+	};
+
+	vector<ScriptedEvent> makeScript(int steps)
+	{
+		vector<ScriptedEvent> script;
+		uint32_t seed = 2024;
+		for (int i = 0; i < steps; i++)
+		{
+			seed = seed * 1664525u + 1013904223u;
+			SimulationEvent event = SimulationEvent();
+			event.time = i * 0.01;
+			if (i % 3 == 0)
+			{
+				event.type = SimulationEvent::TURN;
+				event.turnX = float(int(seed >> 28) - 8);
+				event.turnY = float(int((seed >> 24) & 7) - 4);
+				script.push_back({ i, event });
+			}
+			if (i % 17 == 0 || i % 29 == 0)
+			{
+				event.type = SimulationEvent::BUTTON;
+				event.button = SimulationButton((seed >> 8) % SIM_BUTTON_COUNT);
+				event.down = true;
+				script.push_back({ i, event });
+				// Released again in the same step or held for a while
+				event.down = false;
+				script.push_back({ i % 2 == 0 ? i : min(i + 11, steps - 1), event });
+			}
+		}
+		return script;
+	}
+
+	SimulationState initialState()
+	{
+		SimulationState state;
+		state.camera.position = glm::vec3(3, 8, 0);
+		state.lightDir = glm::normalize(glm::vec3(0, -0.15f, 1));
+		return state;
+	}
+
+	bool sameState(const SimulationState& a, const SimulationState& b)
+	{
+		return a.camera.position == b.camera.position && a.camera.horizontalAngle == b.camera.horizontalAngle &&
+			a.camera.verticalAngle == b.camera.verticalAngle && a.lightDir == b.lightDir;
+	}
+}
+
+TEST_CASE("simulation/replay is deterministic")
+{
+	// Two instances fed the same events step for step publish bit identical snapshots
+	const int steps = 600;
+	const vector<ScriptedEvent> script = makeScript(steps);
+	Simulation a, b;
+	a.reset(initialState());
+	b.reset(initialState());
+	const double dt = a.getSettings().stepSeconds;
+	size_t next = 0;
+	int mismatches = 0, changed = 0;
+	for (int i = 0; i < steps; i++)
+	{
+		for (; next < script.size() && script[next].step <= i; next++)
+		{
+			CHECK(a.pushEvent(script[next].event));
+			CHECK(b.pushEvent(script[next].event));
+		}
+		a.step(i * dt);
+		b.step(i * dt);
+		CHECK(a.acquire() && b.acquire());
+		const SimulationSnapshot& sa = a.snapshot();
+		const SimulationSnapshot& sb = b.snapshot();
+		if (!sameState(sa.previous, sb.previous) || !sameState(sa.current, sb.current) || sa.step != sb.step ||
+			sa.changed != sb.changed || sa.inputCount != sb.inputCount || sa.lastInputTime != sb.lastInputTime)
+			mismatches++;
+		changed += sa.changed ? 1 : 0;
+	}
+	CHECK(mismatches == 0);
+	// The script moves the camera and the light for most of the session
+	CHECK(changed > steps / 2);
+	CHECK(a.snapshot().inputCount == script.size());
+	CHECK(!sameState(a.snapshot().current, initialState()));
+}
+
+TEST_CASE("simulation/a tap within one step moves for that step")
+{
+	Simulation simulation;
+	simulation.reset(initialState());
+	SimulationEvent event = SimulationEvent();
+	event.type = SimulationEvent::BUTTON;
+	event.button = SIM_FORWARD;
+	event.time = 1.0;
+	event.down = true;
+	simulation.pushEvent(event);
+	event.down = false;
+	simulation.pushEvent(event);
+
+	simulation.step(0.0);
+	CHECK(simulation.acquire());
+	const SimulationSnapshot snapshot = simulation.snapshot();
+	CHECK(snapshot.changed);
+	CHECK(snapshot.inputCount == 2 && snapshot.lastInputTime == 1.0);
+
+	// Released: the next step stands still
+	simulation.step(simulation.getSettings().stepSeconds);
+	CHECK(simulation.acquire());
+	CHECK(!simulation.snapshot().changed);
+	CHECK(sameState(simulation.snapshot().current, snapshot.current));
+}
+
+TEST_CASE("simulation/interpolation is one step behind")
+{
+	Simulation simulation;
+	simulation.reset(initialState());
+	const double dt = simulation.getSettings().stepSeconds;
+	SimulationEvent event = SimulationEvent();
+	event.type = SimulationEvent::BUTTON;
+	event.button = SIM_FORWARD;
+	event.down = true;
+	simulation.pushEvent(event);
+	simulation.step(1.0);
+	simulation.acquire();
+	const SimulationSnapshot& snapshot = simulation.snapshot();
+
+	// At the step time the previous state shows, one step later the current one, linear in between
+	CHECK(sameState(simulation.interpolate(1.0), snapshot.previous));
+	CHECK(sameState(simulation.interpolate(1.0 + dt), snapshot.current));
+	const glm::vec3 half = simulation.interpolate(1.0 + 0.5 * dt).camera.position;
+	const glm::vec3 expected = 0.5f * (snapshot.previous.camera.position + snapshot.current.camera.position);
+	CHECK_NEAR(glm::length(half - expected), 0.0, 1e-5);
+}
+
+TEST_CASE("simulation/timing stats keep a bounded window")
+{
+	TimingStats stats(4);
+	CHECK(stats.count() == 0 && stats.mean() == 0.0);
+	for (int i = 1; i <= 10; i++)
+		stats.add(double(i));
+	// The newest four: 7 8 9 10
+	CHECK(stats.count() == 4);
+	CHECK(stats.total() == 10);
+	CHECK_NEAR(stats.mean(), 8.5, 1e-12);
+	CHECK(stats.maximum() == 10.0);
+	CHECK(stats.percentile(0) == 7.0);
+	CHECK(stats.percentile(100) == 10.0);
+	CHECK_NEAR(stats.deviation(), sqrt(5.0 / 3.0), 1e-12);
+
+	TimingStats session;
+	for (int i = 0; i < 100000; i++)
+		session.add(1.0);
+	CHECK(session.count() == 4096 && session.total() == 100000);
+}
+
+TEST_CASE("simulation/queue and triple buffer across threads")
+{
+	// Every item arrives once and in order
+	SpscQueue<long long, 64> queue;
+	const long long items = 50000;
+	thread producer([&]() {
+		for (long long i = 0; i < items; i++)
+			while (!queue.push(i))
+				this_thread::yield();
+	});
+	long long expected = 0, value;
+	bool ordered = true;
+	while (expected < items)
+	{
+		if (queue.pop(value))
+			ordered &= value == expected++;
+		else
+			this_thread::yield();
+	}
+	producer.join();
+	CHECK(ordered && queue.empty());
+
+	// The reader never sees a half written buffer and never goes back in time
+	TripleBuffer<pair<long long, long long>> buffer;
+	atomic<bool> done(false);
+	thread writer([&]() {
+		for (long long i = 1; i <= items; i++)
+		{
+			buffer.writeBuffer() = make_pair(i, -i);
+			buffer.publish();
+		}
+		done = true;
+	});
+	long long last = 0;
+	bool consistent = true;
+	while (!done)
+	{
+		if (buffer.update())
+		{
+			const pair<long long, long long> p = buffer.read();
+			consistent &= p.first == -p.second && p.first >= last;
+			last = p.first;
+		}
+		this_thread::yield();
+	}
+	writer.join();
+	buffer.update();
+	CHECK(consistent);
+	CHECK(buffer.read().first == items);
+}
@@ -0,0 +1,222 @@
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "common/softraster.hpp"
+#include "common/terrainmesh.hpp"
+#include "tests/testing.hpp"
+
+using namespace std;
+
+namespace
+{
+	// Not a multiple of the 64 pixel tiles nor of the 8 pixel AVX2 groups, so rows end in masked lanes
+	const int kWidth = 203;
+	const int kHeight = 133;
+	const int kPoints = 41;
+	const float kScale = 5.0f;
+	const int kMapSize = 96;
+	const float kHeightScale = 4e-7f;
+
+	vector<int32_t> makeHills()
+	{
+		vector<int32_t> heights(size_t(kMapSize) * kMapSize);
+		for (int y = 0; y < kMapSize; y++)
+			for (int x = 0; x < kMapSize; x++)
+				heights[size_t(y) * kMapSize + x] = int32_t(500000.0 + 400000.0 * sin(x * 0.21) * cos(y * 0.13));
+		return heights;
+	}
+
+	// Low over the terrain and looking down, so the triangles below the camera cross the near plane in view
+	TerrainFrame makeFrame(const glm::vec3& eye, const glm::vec3& target)
+	{
+		TerrainFrame frame = TerrainFrame();
+		frame.Model = glm::mat4(1.0f);
+		frame.MVP = glm::perspective(glm::radians(70.0f), float(kWidth) / kHeight, 0.1f, 100.0f) *
+			glm::lookAt(eye, target, glm::vec3(0, 1, 0)) * frame.Model;
+		frame.lightDir = glm::normalize(glm::vec3(0.3f, -1.0f, 0.2f));
+		frame.viewPos = eye;
+		frame.heightMapScale = kHeightScale;
+		frame.numOfVertices = kPoints;
+		return frame;
+	}
+
+	// Scalar reference in double precision, every triangle against every pixel of its bounding box: the same grid and
+	// vertex heights, Sutherland-Hodgman against the near plane, the top left fill rule and GL_LESS on window depth.
+	// Returns the depth buffer, counts the triangles the near plane cut that still cover pixels
+	vector<double> referenceDepth(const vector<int32_t>& heights, const TerrainFrame& frame, int& clippedVisible)
+	{
+		const unsigned int restart = numeric_limits<unsigned int>::max();
+		vector<glm::vec3> positions;
+		vector<glm::vec2> uvs;
+		vector<unsigned int> strip, triangles;
+		buildTerrainGrid(kPoints, kScale, restart, positions, uvs, strip);
+		stripToTriangles(strip, restart, triangles);
+
+		vector<glm::dvec4> clip(positions.size());
+		for (size_t i = 0; i < positions.size(); i++)
+		{
+			const int x = min(max(int(floor(uvs[i].x * kMapSize)), 0), kMapSize - 1);
+			const int y = min(max(int(floor(uvs[i].y * kMapSize)), 0), kMapSize - 1);
+			glm::vec3 position = positions[i];
+			position.y += float(heights[size_t(y) * kMapSize + x]) * frame.heightMapScale;
+			clip[i] = glm::dvec4(frame.MVP * glm::vec4(position, 1.0f));
+		}
+
+		vector<double> depth(size_t(kWidth) * kHeight, 1.0);
+		clippedVisible = 0;
+		for (size_t t = 0; t < triangles.size(); t += 3)
+		{
+			vector<glm::dvec4> polygon;
+			bool clipped = false;
+			for (int i = 0; i < 3; i++)
+			{
+				const glm::dvec4& a = clip[triangles[t + i]];
+				const glm::dvec4& b = clip[triangles[t + (i + 1) % 3]];
+				const double da = a.z + a.w, db = b.z + b.w;
+				if (da >= 0.0)
+					polygon.push_back(a);
+				if ((da >= 0.0) != (db >= 0.0))
+				{
+					polygon.push_back(a + (b - a) * (da / (da - db)));
+					clipped = true;
+				}
+			}
+			bool covers = false;
+			for (size_t k = 1; k + 1 < polygon.size(); k++)
+			{
+				const glm::dvec4* v[3] = { &polygon[0], &polygon[k], &polygon[k + 1] };
+				double sx[3], sy[3], sz[3];
+				for (int i = 0; i < 3; i++)
+				{
+					sx[i] = (v[i]->x / v[i]->w * 0.5 + 0.5) * kWidth;
+					sy[i] = (v[i]->y / v[i]->w * 0.5 + 0.5) * kHeight;
+					sz[i] = v[i]->z / v[i]->w * 0.5 + 0.5;
+				}
+				const double area = (sx[1] - sx[0]) * (sy[2] - sy[0]) - (sx[2] - sx[0]) * (sy[1] - sy[0]);
+				if (!(area > 0.0))
+					continue;
+				const int x0 = max(0, int(floor(min(sx[0], min(sx[1], sx[2])))));
+				const int x1 = min(kWidth - 1, int(ceil(max(sx[0], max(sx[1], sx[2])))));
+				const int y0 = max(0, int(floor(min(sy[0], min(sy[1], sy[2])))));
+				const int y1 = min(kHeight - 1, int(ceil(max(sy[0], max(sy[1], sy[2])))));
+				for (int y = y0; y <= y1; y++)
+					for (int x = x0; x <= x1; x++)
+					{
+						const double px = x + 0.5, py = y + 0.5;
+						double e[3];
+						bool inside = true;
+						for (int i = 0; i < 3; i++)
+						{
+							const int a = (i + 1) % 3, b = (i + 2) % 3;
+							const double dx = sx[b] - sx[a], dy = sy[b] - sy[a];
+							e[i] = (px - sx[a]) * -dy + (py - sy[a]) * dx;
+							inside &= e[i] > 0.0 || (e[i] == 0.0 && (dy < 0.0 || (dy == 0.0 && dx < 0.0)));
+						}
+						if (!inside)
+							continue;
+						const double z = (e[0] * sz[0] + e[1] * sz[1] + e[2] * sz[2]) / area;
+						double& stored = depth[size_t(y) * kWidth + x];
+						if (z < stored)
+						{
+							stored = z;
+							covers = true;
+						}
+					}
+			}
+			clippedVisible += clipped && covers ? 1 : 0;
+		}
+		return depth;
+	}
+
+	struct Comparison
+	{
+		int covered = 0;          // pixels the reference draws
+		int coverageMismatch = 0; // drawn by one of them only
+		double worstDepth = 0.0;  // largest depth difference where both draw
+	};
+
+	Comparison compare(const vector<float>& depth, const vector<double>& reference)
+	{
+		Comparison result;
+		for (size_t i = 0; i < reference.size(); i++)
+		{
+			const bool drawn = depth[i] < 1.0f, expected = reference[i] < 1.0;
+			result.covered += expected ? 1 : 0;
+			if (drawn != expected)
+				result.coverageMismatch++;
+			else if (drawn)
+				result.worstDepth = max(result.worstDepth, fabs(double(depth[i]) - reference[i]));
+		}
+		return result;
+	}
+}
+
+TEST_CASE("softraster/coverage and depth match a scalar reference")
+{
+	const vector<int32_t> heights = makeHills();
+	SoftwareBackend backend(kWidth, kHeight, kPoints, kScale, 3);
+	CHECK(backend.LoadHeightmap(heights, kMapSize, kMapSize));
+
+	// Skimming just above the highest hill around, where the near plane cuts the ground in view; looking down on
+	// the hills and across the whole terrain from further up
+	int32_t highest = 0;
+	for (int y = 50; y < 62; y++)
+		for (int x = 48; x < 60; x++)
+			highest = max(highest, heights[size_t(y) * kMapSize + x]);
+	const glm::vec3 skim(0.3f, highest * kHeightScale + 0.03f, 1.2f);
+	const TerrainFrame frames[] = {
+		makeFrame(skim, skim + glm::vec3(0.0f, -0.15f, -1.0f)),
+		makeFrame(glm::vec3(0.3f, 0.65f, 1.2f), glm::vec3(0.1f, -0.6f, -0.8f)),
+		makeFrame(glm::vec3(-2.0f, 2.5f, 7.0f), glm::vec3(0.5f, 0.0f, -1.0f)),
+	};
+	int clippedVisible = 0;
+	for (const TerrainFrame& frame : frames)
+	{
+		int clipped = 0;
+		const vector<double> reference = referenceDepth(heights, frame, clipped);
+		clippedVisible += clipped;
+		backend.DrawFrame(frame);
+		vector<float> depth;
+		backend.ReadDepth(depth);
+		CHECK(depth.size() == reference.size());
+
+		// Pixel centres exactly on an edge are rare, float rounding may put a handful on the other side
+		const Comparison result = compare(depth, reference);
+		CHECK(result.covered > kWidth * kHeight / 4);
+		CHECK(result.coverageMismatch <= 4);
+		CHECK(result.worstDepth < 1e-5);
+	}
+	// The near plane cut triangles that are in view, the clipped parts were compared too
+	CHECK(clippedVisible > 0);
+}
+
+TEST_CASE("softraster/result does not depend on the thread count")
+{
+	// Neighbouring tiles on other threads: the masked lanes past a tile edge must neither read nor write its pixels
+	const vector<int32_t> heights = makeHills();
+	const TerrainFrame frame = makeFrame(glm::vec3(0.3f, 0.65f, 1.2f), glm::vec3(0.1f, -0.6f, -0.8f));
+	SoftwareBackend backend(kWidth, kHeight, kPoints, kScale, 1);
+	CHECK(backend.LoadHeightmap(heights, kMapSize, kMapSize));
+	backend.DrawFrame(frame);
+	vector<float> single, depth;
+	vector<unsigned char> singleColor, color;
+	backend.ReadDepth(single);
+	backend.ReadPixels(kWidth, kHeight, singleColor);
+	for (unsigned int threads : { 2u, 4u, 7u })
+	{
+		backend.SetThreadCount(threads);
+		for (int repeat = 0; repeat < 3; repeat++)
+		{
+			backend.DrawFrame(frame);
+			backend.ReadDepth(depth);
+			backend.ReadPixels(kWidth, kHeight, color);
+			CHECK(depth == single);
+			CHECK(color == singleColor);
+		}
+	}
+}
@@ -0,0 +1,265 @@
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "common/terrainedit.hpp"
+#include "tests/testing.hpp"
+
+using namespace std;
+
+namespace
+{
+	// Odd sizes so the undo and bounds tiles at the right and bottom edges are partial
+	const int kWidth = 150;
+	const int kHeight = 101;
+
+	vector<int32_t> makeHills(int width, int height)
+	{
+		vector<int32_t> heights(size_t(width) * height);
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < width; x++)
+				heights[size_t(y) * width + x] = int32_t(400000.0 + 150000.0 * sin(x * 0.05) * cos(y * 0.04) + 1000.0 * ((x * 7 + y * 3) % 5));
+		return heights;
+	}
+
+	// Bounding rectangle of the cells that differ
+	TerrainRect changedCells(const vector<int32_t>& a, const vector<int32_t>& b, int width)
+	{
+		TerrainRect rect;
+		rect.x0 = width;
+		rect.y0 = int(a.size() / width);
+		for (size_t i = 0; i < a.size(); i++)
+			if (a[i] != b[i])
+			{
+				const int x = int(i % width), y = int(i / width);
+				rect.x0 = min(rect.x0, x);
+				rect.y0 = min(rect.y0, y);
+				rect.x1 = max(rect.x1, x + 1);
+				rect.y1 = max(rect.y1, y + 1);
+			}
+		return rect.empty() ? TerrainRect() : rect;
+	}
+
+	bool sameRect(const TerrainRect& a, const TerrainRect& b)
+	{
+		return a.x0 == b.x0 && a.y0 == b.y0 && a.x1 == b.x1 && a.y1 == b.y1;
+	}
+
+	// Bilinear between cell centres, as the editor samples
+	float sample(const vector<int32_t>& heights, int width, int height, float x, float y)
+	{
+		auto at = [&](int i, int j) {
+			return float(heights[size_t(min(max(j, 0), height - 1)) * width + min(max(i, 0), width - 1)]);
+		};
+		x -= 0.5f;
+		y -= 0.5f;
+		const int ix = int(floor(x)), iy = int(floor(y));
+		const float fx = x - ix, fy = y - iy;
+		const float top = at(ix, iy) * (1.0f - fx) + at(ix + 1, iy) * fx;
+		const float bottom = at(ix, iy + 1) * (1.0f - fx) + at(ix + 1, iy + 1) * fx;
+		return top * (1.0f - fy) + bottom * fy;
+	}
+
+	// Every edit in turn: a stroke of raise dabs, lower, smooth and flatten, partly over the map edge
+	void sculpt(TerrainEditor& editor, int stroke)
+	{
+		TerrainBrush brush;
+		brush.mode = BrushMode(stroke % 4);
+		brush.radius = 6.0f + 3.0f * stroke;
+		brush.strength = brush.mode == BRUSH_RAISE || brush.mode == BRUSH_LOWER ? 20000.0f : 0.6f;
+		brush.flattenHeight = 300000;
+		editor.beginStroke();
+		for (int dab = 0; dab < 5; dab++)
+			editor.applyBrush(brush, 10.0f + 31.0f * stroke + 7.3f * dab, 5.0f + 19.0f * stroke + 4.1f * dab);
+		editor.endStroke();
+	}
+}
+
+TEST_CASE("terrainedit/undo and redo are bit exact")
+{
+	vector<int32_t> heights = makeHills(kWidth, kHeight);
+	TerrainEditor editor(heights.data(), kWidth, kHeight, 8);
+	vector<vector<int32_t>> states = { heights };
+	for (int stroke = 0; stroke < 5; stroke++)
+	{
+		sculpt(editor, stroke);
+		CHECK(heights != states.back());
+		states.push_back(heights);
+	}
+	CHECK(!editor.canRedo());
+
+	for (int i = int(states.size()) - 2; i >= 0; i--)
+	{
+		CHECK(editor.undo());
+		CHECK(heights == states[i]);
+	}
+	CHECK(!editor.undo() && editor.canRedo());
+	for (size_t i = 1; i < states.size(); i++)
+	{
+		CHECK(editor.redo());
+		CHECK(heights == states[i]);
+	}
+	CHECK(!editor.redo());
+
+	// A new stroke after undo drops the redo steps
+	editor.undo();
+	editor.undo();
+	sculpt(editor, 1);
+	CHECK(!editor.canRedo());
+	editor.undo();
+	CHECK(heights == states[3]);
+}
+
+TEST_CASE("terrainedit/dirty rectangle is exactly the changed cells")
+{
+	vector<int32_t> heights = makeHills(kWidth, kHeight);
+	TerrainEditor editor(heights.data(), kWidth, kHeight);
+	TerrainBrush brush;
+	brush.radius = 9.5f;
+	brush.strength = 5000.0f;
+	const float centres[][2] = { { 40.3f, 50.0f }, { 2.0f, 3.0f }, { 148.7f, 99.5f } };
+	for (const auto& centre : centres)
+	{
+		const vector<int32_t> before = heights;
+		const TerrainRect rect = editor.applyBrush(brush, centre[0], centre[1]);
+		const TerrainRect expected = changedCells(before, heights, kWidth);
+		CHECK(!expected.empty());
+		CHECK(sameRect(rect, expected));
+		CHECK(sameRect(editor.takeDirty(), expected));
+		CHECK(editor.takeDirty().empty());
+	}
+
+	// Flattening cells that are already flat changes nothing, nothing is dirty and no undo step is made
+	vector<int32_t> flat(size_t(kWidth) * kHeight, 1234);
+	TerrainEditor level(flat.data(), kWidth, kHeight);
+	brush.mode = BRUSH_FLATTEN;
+	brush.flattenHeight = 1234;
+	CHECK(level.applyBrush(brush, 60.0f, 60.0f).empty());
+	CHECK(level.takeDirty().empty() && !level.canUndo());
+
+	// Undo and redo report the cells of the step
+	const vector<int32_t> before = heights;
+	brush.mode = BRUSH_SMOOTH;
+	brush.strength = 1.0f;
+	editor.beginStroke();
+	editor.applyBrush(brush, 70.0f, 20.0f);
+	editor.applyBrush(brush, 90.0f, 30.0f);
+	editor.endStroke();
+	const TerrainRect stroke = changedCells(before, heights, kWidth);
+	editor.takeDirty();
+	editor.undo();
+	const TerrainRect undone = editor.takeDirty();
+	CHECK(heights == before);
+	CHECK(undone.x0 <= stroke.x0 && undone.y0 <= stroke.y0 && undone.x1 >= stroke.x1 && undone.y1 >= stroke.y1);
+}
+
+TEST_CASE("terrainedit/bounds follow every edit")
+{
+	vector<int32_t> heights = makeHills(kWidth, kHeight);
+	const int tileSize = 7;
+	TerrainEditor editor(heights.data(), kWidth, kHeight, tileSize);
+	auto boundsMatch = [&]() {
+		int wrong = 0;
+		for (int ty = 0; ty * tileSize < kHeight; ty++)
+			for (int tx = 0; tx * tileSize < kWidth; tx++)
+			{
+				int32_t lo = 0x7fffffff, hi = -1;
+				for (int y = ty * tileSize; y < min(kHeight, (ty + 1) * tileSize); y++)
+					for (int x = tx * tileSize; x < min(kWidth, (tx + 1) * tileSize); x++)
+					{
+						lo = min(lo, heights[size_t(y) * kWidth + x]);
+						hi = max(hi, heights[size_t(y) * kWidth + x]);
+					}
+				wrong += editor.tileMinHeight(tx, ty) == lo && editor.tileMaxHeight(tx, ty) == hi ? 0 : 1;
+			}
+		return wrong == 0;
+	};
+	CHECK(boundsMatch());
+	for (int stroke = 0; stroke < 4; stroke++)
+	{
+		sculpt(editor, stroke);
+		CHECK(boundsMatch());
+	}
+	editor.undo();
+	CHECK(boundsMatch());
+	editor.undo();
+	editor.redo();
+	CHECK(boundsMatch());
+}
+
+TEST_CASE("terrainedit/raycast matches a brute force march")
+{
+	vector<int32_t> heights = makeHills(kWidth, kHeight);
+	TerrainEditor editor(heights.data(), kWidth, kHeight, 8);
+	sculpt(editor, 0);
+	uint32_t seed = 99;
+	auto random = [&]() {
+		seed = seed * 1664525u + 1013904223u;
+		return float(seed >> 8) / float(1 << 24);
+	};
+	int hits = 0, misses = 0, wrong = 0;
+	for (int i = 0; i < 300; i++)
+	{
+		// From above the hills, downwards at various angles, some of them leaving the map first
+		const float ox = random() * kWidth, oy = random() * kHeight, oh = 700000.0f;
+		const float angle = random() * 6.2831853f;
+		const float dx = cos(angle), dy = sin(angle), dh = -1000.0f - 20000.0f * random();
+		const float maxDistance = 400.0f;
+
+		// The first sample below the surface, refined between it and the one before
+		float expected = -1.0f;
+		const float step = 0.01f;
+		for (float t = 0.0f; t < maxDistance; t += step)
+		{
+			const float px = ox + dx * t, py = oy + dy * t;
+			if (px < 0.0f || py < 0.0f || px > kWidth || py > kHeight)
+				break;
+			if (oh + dh * t < sample(heights, kWidth, kHeight, px, py))
+			{
+				expected = t;
+				break;
+			}
+		}
+
+		float hitX, hitY;
+		const bool hit = editor.raycast(ox, oy, oh, dx, dy, dh, maxDistance, hitX, hitY);
+		if (expected < 0.0f)
+		{
+			misses++;
+			wrong += hit ? 1 : 0;
+			continue;
+		}
+		hits++;
+		const float t = hypot(hitX - ox, hitY - oy);
+		wrong += hit && fabs(t - expected) < 0.02f ? 0 : 1;
+	}
+	CHECK(wrong == 0);
+	CHECK(hits > 100 && misses > 10);
+}
+
+TEST_CASE("terrainedit/stroke cost does not grow with the map")
+{
+	// The same stroke at the same place of a small and a large map: same tiles visited, same undo data
+	const int sizes[] = { 256, 2048 };
+	size_t visited[2], bytes[2];
+	TerrainRect dirty[2];
+	for (int i = 0; i < 2; i++)
+	{
+		vector<int32_t> heights(size_t(sizes[i]) * sizes[i], 500000);
+		TerrainEditor editor(heights.data(), sizes[i], sizes[i]);
+		CHECK(editor.getTilesVisited() == 0);
+		TerrainBrush brush;
+		brush.radius = 20.0f;
+		brush.strength = 3000.0f;
+		editor.beginStroke();
+		for (int dab = 0; dab < 10; dab++)
+			editor.applyBrush(brush, 100.0f + 3.0f * dab, 90.0f + 2.0f * dab);
+		editor.endStroke();
+		visited[i] = editor.getTilesVisited();
+		bytes[i] = editor.undoBytes();
+		dirty[i] = editor.takeDirty();
+	}
+	CHECK(visited[0] > 0 && visited[0] == visited[1]);
+	CHECK(bytes[0] > 0 && bytes[0] == bytes[1]);
+	CHECK(sameRect(dirty[0], dirty[1]));
+}
@@ -0,0 +1,162 @@
+#include <vector>
+#include <cmath>
+
+#include "common/terrainlayers.hpp"
+#include "tests/testing.hpp"
+
+using namespace std;
+
+namespace
+{
+	const double kDegrees = 180.0 / 3.14159265358979;
+
+	// Odd sizes so rows end with a partial SIMD block and a partial tile
+	const int kWidth = 67;
+	const int kHeight = 45;
+
+	template<typename F>
+	vector<int32_t> makeSurface(F&& z)
+	{
+		vector<int32_t> heights(size_t(kWidth) * kHeight);
+		for (int y = 0; y < kHeight; y++)
+			for (int x = 0; x < kWidth; x++)
+				heights[size_t(y) * kWidth + x] = int32_t(lround(z(x, y)));
+		return heights;
+	}
+
+	TerrainLayerOptions smallTiles()
+	{
+		TerrainLayerOptions options;
+		options.tileSize = 16;
+		return options;
+	}
+
+	struct Layers
+	{
+		vector<float> slope, aspect, curvature;
+
+		Layers(const vector<int32_t>& heights, const TerrainLayerOptions& options)
+			: slope(heights.size()), aspect(heights.size()), curvature(heights.size())
+		{
+			computeSlopeAspectCurvature(heights.data(), kWidth, kHeight, options, slope.data(), aspect.data(), curvature.data());
+		}
+	};
+
+	double angleDifference(double a, double b)
+	{
+		double d = fabs(a - b);
+		return min(d, 360.0 - d);
+	}
+}
+
+TEST_CASE("terrainlayers/plane")
+{
+	// z = 3x + 4y: gradient (3, 4), downhill towards (-3, -4), no curvature
+	const vector<int32_t> heights = makeSurface([](int x, int y) { return 3.0 * x + 4.0 * y + 1000.0; });
+	const Layers layers(heights, smallTiles());
+	const double slope = atan(5.0) * kDegrees;
+	const double aspect = atan2(-4.0, -3.0) * kDegrees + 360.0;
+	for (int y = 1; y < kHeight - 1; y++)
+		for (int x = 1; x < kWidth - 1; x++)
+		{
+			const size_t i = size_t(y) * kWidth + x;
+			CHECK_NEAR(layers.slope[i], slope, 1e-3);
+			CHECK_NEAR(layers.aspect[i], aspect, 1e-3);
+			CHECK_NEAR(layers.curvature[i], 0.0, 1e-6);
+		}
+}
+
+TEST_CASE("terrainlayers/paraboloid")
+{
+	// z = (x - 30)^2 + (y - 20)^2 with cells 2 apart: dz/dx = x - 30 exactly for Horn's sums, the second differences
+	// are 2 along both axes, general curvature -100 * (2 + 2) / 2^2 everywhere (a bowl is concave)
+	const vector<int32_t> heights = makeSurface([](int x, int y) { return double((x - 30) * (x - 30) + (y - 20) * (y - 20)); });
+	TerrainLayerOptions options = smallTiles();
+	options.cellSize = 2.0f;
+	const Layers layers(heights, options);
+	for (int y = 1; y < kHeight - 1; y++)
+		for (int x = 1; x < kWidth - 1; x++)
+		{
+			const size_t i = size_t(y) * kWidth + x;
+			const double dx = x - 30, dy = y - 20;
+			CHECK_NEAR(layers.curvature[i], -100.0, 1e-3);
+			CHECK_NEAR(layers.slope[i], atan(sqrt(dx * dx + dy * dy)) * kDegrees, 1e-3);
+			if (dx != 0.0 || dy != 0.0)
+				CHECK(angleDifference(layers.aspect[i], atan2(-dy, -dx) * kDegrees) < 1e-3);
+		}
+	CHECK(layers.aspect[20 * kWidth + 30] == -1.0f);
+}
+
+TEST_CASE("terrainlayers/cone")
+{
+	// Peak z = 100 - r in horizontal units: slope 45 degrees, downhill away from the apex, convex with the
+	// Laplacian 1 / r, so the curvature is 100 / r. Heights are in thousandths to keep the rounding small
+	const double cx = 33.0, cy = 22.0;
+	const vector<int32_t> heights = makeSurface([&](int x, int y) { return 1000.0 * (100.0 - hypot(x - cx, y - cy)); });
+	TerrainLayerOptions options = smallTiles();
+	options.zFactor = 0.001f;
+	const Layers layers(heights, options);
+	int checked = 0;
+	for (int y = 1; y < kHeight - 1; y++)
+		for (int x = 1; x < kWidth - 1; x++)
+		{
+			const double r = hypot(x - cx, y - cy);
+			if (r < 8.0 || r > 20.0)
+				continue;
+			const size_t i = size_t(y) * kWidth + x;
+			CHECK_NEAR(layers.slope[i], 45.0, 0.5);
+			CHECK(angleDifference(layers.aspect[i], atan2(y - cy, x - cx) * kDegrees) < 1.0);
+			CHECK_NEAR(layers.curvature[i], 100.0 / r, 0.1 * 100.0 / r);
+			checked++;
+		}
+	CHECK(checked > 500);
+}
+
+TEST_CASE("terrainlayers/d8 on a tilted plane")
+{
+	// z = 2x + 7y: north (drop 7) beats north west (9 / sqrt 2) and west (2). The top row has no north and drains
+	// west, so everything ends in the corner cell, the only pit
+	const vector<int32_t> heights = makeSurface([](int x, int y) { return 2.0 * x + 7.0 * y; });
+	const TerrainLayerOptions options = smallTiles();
+	vector<unsigned char> directions(heights.size());
+	computeFlowDirections(heights.data(), kWidth, kHeight, options, directions.data());
+	for (int y = 0; y < kHeight; y++)
+		for (int x = 0; x < kWidth; x++)
+		{
+			const unsigned char expected = y > 0 ? 6 : (x > 0 ? 4 : kNoFlow);
+			CHECK(directions[size_t(y) * kWidth + x] == expected);
+		}
+
+	vector<uint32_t> accumulation(heights.size());
+	computeFlowAccumulation(heights.data(), kWidth, kHeight, options, accumulation.data());
+	CHECK(accumulation[0] == uint32_t(kWidth * kHeight));
+	for (int x = 1; x < kWidth; x++)
+		CHECK(accumulation[x] == uint32_t((kWidth - x) * kHeight));
+	CHECK(accumulation[size_t(kHeight - 1) * kWidth + 10] == 1u);
+}
+
+TEST_CASE("terrainlayers/region update matches a full pack")
+{
+	vector<int32_t> heights = makeSurface([](int x, int y) { return 50000.0 * sin(x * 0.11) * cos(y * 0.07) + 300.0 * ((x * 7 + y * 13) % 11); });
+	TerrainLayerOptions options = smallTiles();
+	options.cellSize = 30.0f;
+	Layers before(heights, options);
+	options.curvatureRange = terrainCurvatureRange(before.curvature.data(), before.curvature.size());
+	vector<unsigned char> rgba;
+	packTerrainLayers(before.slope.data(), before.aspect.data(), before.curvature.data(), nullptr, kWidth, kHeight, options, rgba);
+
+	// A brush stroke at an odd offset, the update gets the rectangle grown by one cell
+	for (int y = 9; y < 30; y++)
+		for (int x = 13; x < 42; x++)
+			heights[size_t(y) * kWidth + x] += 20000 - 40 * ((x - 27) * (x - 27) + (y - 19) * (y - 19));
+	updateTerrainLayersRegion(heights.data(), kWidth, kHeight, options, 12, 8, 43, 31, rgba);
+
+	const Layers after(heights, options);
+	vector<unsigned char> expected;
+	packTerrainLayers(after.slope.data(), after.aspect.data(), after.curvature.data(), nullptr, kWidth, kHeight, options, expected);
+	int mismatches = 0;
+	for (size_t i = 0; i < rgba.size(); i++)
+		if (i % 4 != 3 && rgba[i] != expected[i])
+			mismatches++;
+	CHECK(mismatches == 0);
+}
@@ -0,0 +1,38 @@
+#ifndef TESTING_HPP
+#define TESTING_HPP
+
+#include <string>
+#include <functional>
+
+// Minimal test harness for the common library. TEST_CASE registers a function at static initialization, CHECK
+// records a failure with its location and keeps going, so one run reports every broken expectation. The tests use
+// synthetic data only and run without a window, a GPU or the assets.
+
+void registerTest(const char* name, const std::function<void()>& fn);
+void reportFailure(const char* file, int line, const std::string& message);
+
+struct TestRegistrar
+{
+	TestRegistrar(const char* name, void (*fn)()) { registerTest(name, fn); }
+};
+
+#define TEST_CONCAT_(a, b) a##b
+#define TEST_CONCAT(a, b) TEST_CONCAT_(a, b)
+
+#define TEST_CASE(name) \
+	static void TEST_CONCAT(testFunction, __LINE__)(); \
+	static TestRegistrar TEST_CONCAT(testRegistrar, __LINE__)(name, &TEST_CONCAT(testFunction, __LINE__)); \
+	static void TEST_CONCAT(testFunction, __LINE__)()
+
+#define CHECK(condition) \
+	do { if (!(condition)) reportFailure(__FILE__, __LINE__, #condition); } while (0)
+
+// |a - b| <= tolerance, both values are part of the message
+#define CHECK_NEAR(a, b, tolerance) \
+	do { \
+		const double testA_ = double(a), testB_ = double(b); \
+		if (!(testA_ - testB_ <= (tolerance) && testB_ - testA_ <= (tolerance))) \
+			reportFailure(__FILE__, __LINE__, std::string(#a " ~ " #b ": ") + std::to_string(testA_) + " vs " + std::to_string(testB_)); \
+	} while (0)
+
+#endif
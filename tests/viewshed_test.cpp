@@ -0,0 +1,166 @@
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+
+#include "common/viewshed.hpp"
+#include "tests/testing.hpp"
+
+using namespace std;
+
+namespace
+{
+	// Rolling hills with a little noise, in raw height map units
+	vector<int32_t> makeTerrain(int width, int height, uint32_t seed)
+	{
+		vector<int32_t> heights(size_t(width) * height);
+		const double a = 0.05 + (seed % 7) * 0.01, b = 0.07 + (seed % 5) * 0.01;
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < width; x++)
+			{
+				seed = seed * 1664525u + 1013904223u;
+				double h = 100000.0 * sin(x * a + 1.3) * cos(y * b - 0.4) + 40000.0 * sin((x - y) * 0.19);
+				heights[size_t(y) * width + x] = int32_t(500000.0 + h) + int32_t(seed >> 22);
+			}
+		return heights;
+	}
+
+	// Closest margin between the segment and the terrain below it, written from the definition in viewshed.hpp:
+	// the segment between the cell centres is sampled where it crosses every grid line of its major axis, the
+	// terrain there is interpolated between the two neighbouring cells. Negative when something blocks the view
+	double referenceMargin(const vector<int32_t>& heights, int width, const ViewshedObserver& observer, int tx, int ty)
+	{
+		const int dx = tx - observer.x, dy = ty - observer.y;
+		const int n = max(abs(dx), abs(dy));
+		const double eye = heights[size_t(observer.y) * width + observer.x] + double(observer.height);
+		const double target = heights[size_t(ty) * width + tx] + double(observer.targetHeight);
+		double margin = 1e30;
+		for (int i = 1; i < n; i++)
+		{
+			const double t = double(i) / n;
+			const double px = observer.x + dx * t, py = observer.y + dy * t;
+			double terrain;
+			if (abs(dx) >= abs(dy))
+			{
+				const int x = int(lround(px)), y0 = int(floor(py));
+				const double f = py - y0;
+				const double h0 = heights[size_t(y0) * width + x];
+				terrain = f > 0.0 ? h0 + (heights[size_t(y0 + 1) * width + x] - h0) * f : h0;
+			}
+			else
+			{
+				const int y = int(lround(py)), x0 = int(floor(px));
+				const double f = px - x0;
+				const double h0 = heights[size_t(y) * width + x0];
+				terrain = f > 0.0 ? h0 + (heights[size_t(y) * width + x0 + 1] - h0) * f : h0;
+			}
+			margin = min(margin, eye + (target - eye) * t - terrain);
+		}
+		return margin;
+	}
+
+	bool inRadius(const ViewshedObserver& observer, int x, int y)
+	{
+		const long long dx = x - observer.x, dy = y - observer.y;
+		return observer.radius == 0 || dx * dx + dy * dy <= (long long)observer.radius * observer.radius;
+	}
+}
+
+TEST_CASE("viewshed/exact method matches brute force")
+{
+	ViewshedOptions options;
+	options.method = VIEWSHED_EXACT;
+	int checked = 0, mismatches = 0, ties = 0;
+	for (int trial = 0; trial < 12; trial++)
+	{
+		const int width = 37 + trial * 5, height = 29 + trial * 3;
+		const vector<int32_t> heights = makeTerrain(width, height, uint32_t(trial + 1));
+		ViewshedObserver observer;
+		observer.x = (trial * 17) % width;
+		observer.y = (trial * 11 + 3) % height;
+		observer.height = 3000.0f;
+		observer.targetHeight = trial % 2 ? 0.0f : 800.0f;
+		observer.radius = trial % 3 == 0 ? 14 : 0;
+
+		vector<unsigned char> visible;
+		computeViewshed(heights.data(), width, height, observer, options, visible);
+		CHECK(visible.size() == size_t(width) * height);
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < width; x++)
+			{
+				const bool computed = visible[size_t(y) * width + x] != 0;
+				if (!inRadius(observer, x, y))
+				{
+					mismatches += computed;
+					continue;
+				}
+				const double margin = referenceMargin(heights, width, observer, x, y);
+				// A sample exactly on the segment is decided by rounding, not by the definition
+				if (fabs(margin) < 1e-6)
+				{
+					ties++;
+					continue;
+				}
+				checked++;
+				mismatches += computed != (margin >= 0.0);
+				// lineOfSight() answers the same for a single cell
+				mismatches += lineOfSight(heights.data(), width, height, observer, x, y) != (margin >= 0.0);
+			}
+	}
+	CHECK(mismatches == 0);
+	CHECK(checked > 10000);
+	CHECK(ties < checked / 100);
+}
+
+TEST_CASE("viewshed/sweep is close to exact")
+{
+	const int width = 120, height = 90;
+	const vector<int32_t> heights = makeTerrain(width, height, 42);
+	ViewshedObserver observer;
+	observer.x = 50;
+	observer.y = 40;
+	observer.height = 2000.0f;
+	ViewshedOptions exact, sweep;
+	exact.method = VIEWSHED_EXACT;
+	vector<unsigned char> a, b;
+	computeViewshed(heights.data(), width, height, observer, exact, a);
+	computeViewshed(heights.data(), width, height, observer, sweep, b);
+	int differ = 0;
+	for (size_t i = 0; i < a.size(); i++)
+		differ += a[i] != b[i];
+	// Rare cells on the edge of visible regions
+	CHECK(differ < int(a.size()) / 50);
+	CHECK(a[size_t(observer.y) * width + observer.x] == 255);
+}
+
+TEST_CASE("viewshed/counts do not saturate at 255")
+{
+	// Flat ground: every observer sees every cell
+	const int width = 24, height = 16;
+	const vector<int32_t> heights(size_t(width) * height, 1000);
+	vector<ViewshedObserver> observers(300);
+	for (size_t i = 0; i < observers.size(); i++)
+	{
+		observers[i].x = int(i) % width;
+		observers[i].y = int(i / width) % height;
+		observers[i].height = 10.0f;
+	}
+	vector<uint16_t> counts;
+	computeViewshedBatch(heights.data(), width, height, observers, ViewshedOptions(), counts);
+	CHECK(counts.size() == size_t(width) * height);
+	bool all = true;
+	for (uint16_t c : counts)
+		all &= c == 300;
+	CHECK(all);
+
+	// Observers outside the map and limited radii
+	observers.assign(2, ViewshedObserver());
+	observers[0].x = -5;
+	observers[1].x = 3;
+	observers[1].y = 3;
+	observers[1].radius = 2;
+	computeViewshedBatch(heights.data(), width, height, observers, ViewshedOptions(), counts);
+	int seen = 0;
+	for (uint16_t c : counts)
+		seen += c;
+	CHECK(seen == 13);
+}
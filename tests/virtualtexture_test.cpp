@@ -0,0 +1,243 @@
+#include <vector>
+#include <string>
+#include <thread>
+#include <cstdio>
+
+#include "common/virtualtexture.hpp"
+#include "common/utils.hpp"
+#include "tests/testing.hpp"
+
+using namespace std;
+
+namespace
+{
+	// Layer 0 is 4x4 pages at mip 0, 2x2 at mip 1 and its tail at mip 2; layer 1 is 2x2 pages and its tail
+	VirtualTextureLayout makeLayout()
+	{
+		VirtualTextureLayout layout;
+		layout.layerSize = { 512, 256 };
+		return layout;
+	}
+
+	uint32_t entry(int slot, int slotsX, int mip)
+	{
+		return uint32_t(slot % slotsX) | (uint32_t(slot / slotsX) << 8) | (uint32_t(mip) << 16);
+	}
+
+	VirtualPageData loadOne(VirtualTextureLoader& loader, VirtualPageId page)
+	{
+		loader.enqueue({ page });
+		VirtualPageData data;
+		while (!loader.pop(data))
+			this_thread::yield();
+		return data;
+	}
+}
+
+TEST_CASE("virtualtexture/layout")
+{
+	const VirtualTextureLayout layout = makeLayout();
+	CHECK(layout.mipCount(0) == 3 && layout.mipCount(1) == 2);
+	CHECK(layout.pagesAcross(0, 0) == 4 && layout.pagesAcross(0, 2) == 1 && layout.pagesAcross(1, 0) == 2);
+	CHECK(layout.tableOffset(0, 1) == 16 && layout.tableOffset(0, 2) == 20 && layout.tableOffset(1) == 21);
+	CHECK(layout.tableSize() == 26);
+}
+
+TEST_CASE("virtualtexture/loads coarse mips first then by samples")
+{
+	VirtualPageCache cache(makeLayout(), 4, 4);
+	cache.beginFrame();
+	for (int i = 0; i < 3; i++)
+		cache.request(makeVirtualPage(0, 0, 1, 1));
+	cache.request(makeVirtualPage(0, 0, 2, 2));
+	cache.request(makeVirtualPage(1, 0, 0, 0));
+
+	// The missing ancestors come along and collect the samples of their descendants, ties go by page id
+	vector<VirtualPageId> loads;
+	cache.collectLoads(2, loads);
+	CHECK(loads.size() == 2);
+	CHECK(loads[0] == makeVirtualPage(0, 2, 0, 0));
+	CHECK(loads[1] == makeVirtualPage(0, 1, 0, 0));
+	cache.collectLoads(100, loads);
+	const vector<VirtualPageId> rest = { makeVirtualPage(1, 1, 0, 0), makeVirtualPage(0, 1, 1, 1),
+		makeVirtualPage(0, 0, 1, 1), makeVirtualPage(0, 0, 2, 2), makeVirtualPage(1, 0, 0, 0) };
+	CHECK(loads.size() == 5);
+	CHECK(loads[0] == rest[1] && loads[1] == rest[0]);
+	CHECK(loads[2] == rest[2] && loads[3] == rest[3] && loads[4] == rest[4]);
+	for (VirtualPageId page : rest)
+		CHECK(cache.isLoading(page));
+
+	// Loading already: nothing twice, cancelled pages come back
+	cache.collectLoads(100, loads);
+	CHECK(loads.empty());
+	cache.cancel(rest[4]);
+	cache.collectLoads(100, loads);
+	CHECK(loads.size() == 1 && loads[0] == rest[4]);
+}
+
+TEST_CASE("virtualtexture/out of layout pages are ignored")
+{
+	VirtualPageCache cache(makeLayout(), 2, 2);
+	cache.beginFrame();
+	cache.request(kNoVirtualPage);
+	cache.request(makeVirtualPage(2, 0, 0, 0)); // no such layer
+	cache.request(makeVirtualPage(1, 2, 0, 0)); // below the tail of layer 1
+	cache.request(makeVirtualPage(0, 0, 4, 0)); // past the edge
+	cache.request(makeVirtualPage(0, 1, 0, 2));
+	cache.request(makeVirtualPage(1, 1, 1, 0));
+	vector<VirtualPageId> loads;
+	cache.collectLoads(100, loads);
+	CHECK(loads.empty());
+
+	cache.request(makeVirtualPage(1, 1, 0, 0));
+	cache.collectLoads(100, loads);
+	CHECK(loads.size() == 1 && loads[0] == makeVirtualPage(1, 1, 0, 0));
+}
+
+TEST_CASE("virtualtexture/eviction spares the current feedback set")
+{
+	VirtualPageCache cache(makeLayout(), 2, 2);
+	const VirtualPageId tail = makeVirtualPage(0, 2, 0, 0);
+	const VirtualPageId a = makeVirtualPage(0, 0, 0, 0), aParent = makeVirtualPage(0, 1, 0, 0);
+	const VirtualPageId b = makeVirtualPage(0, 0, 3, 3), bParent = makeVirtualPage(0, 1, 1, 1);
+	cache.beginFrame();
+	cache.request(a);
+	CHECK(cache.commit(tail) == 0 && cache.commit(aParent) == 1 && cache.commit(a) == 2);
+
+	// The next feedback set looks elsewhere: the pages of the last one are the ones to go, oldest first
+	cache.beginFrame();
+	cache.request(b);
+	CHECK(cache.commit(bParent) == 3);
+	const int slot = cache.commit(b);
+	CHECK(slot == 1 || slot == 2);
+	CHECK(cache.evictionCount() == 1);
+	CHECK(cache.isResident(tail) && cache.isResident(bParent) && cache.isResident(b));
+	CHECK(cache.isResident(a) != cache.isResident(aParent));
+
+	// A page the current set does not need takes the last old slot, after that everything is in use
+	const VirtualPageId c = makeVirtualPage(0, 0, 2, 2);
+	CHECK(cache.commit(c) == 3 - slot);
+	CHECK(!cache.isResident(a) && !cache.isResident(aParent));
+	CHECK(cache.commit(makeVirtualPage(0, 0, 1, 1)) == -1);
+	CHECK(cache.isResident(b) && cache.isResident(bParent) && cache.isResident(c));
+	CHECK(cache.evictionCount() == 2);
+
+	// Frames without a new feedback buffer keep that set: still protected, still wanted
+	vector<VirtualPageId> loads;
+	CHECK(cache.commit(makeVirtualPage(0, 0, 0, 1)) == -1);
+	cache.request(a);
+	cache.collectLoads(100, loads);
+	CHECK(loads.size() == 2 && loads[0] == aParent && loads[1] == a);
+	CHECK(cache.commit(aParent) == -1);
+	CHECK(cache.isResident(b) && cache.isResident(bParent));
+}
+
+TEST_CASE("virtualtexture/the mip tail is never evicted")
+{
+	VirtualPageCache cache(makeLayout(), 2, 1);
+	const VirtualPageId tail = makeVirtualPage(1, 1, 0, 0);
+	cache.beginFrame();
+	CHECK(cache.commit(tail) == 0);
+	for (int i = 0; i < 40; i++)
+	{
+		cache.beginFrame();
+		const VirtualPageId page = makeVirtualPage(1, 0, i % 2, (i / 2) % 2);
+		cache.request(page);
+		CHECK(cache.commit(page) == 1);
+	}
+	CHECK(cache.isResident(tail) && cache.slotOf(tail) == 0);
+	CHECK(cache.evictionCount() == 39);
+
+	// Only the tail left to evict: the new page is dropped
+	VirtualPageCache pinned(makeLayout(), 1, 1);
+	pinned.beginFrame();
+	pinned.commit(tail);
+	pinned.beginFrame();
+	CHECK(pinned.commit(makeVirtualPage(1, 0, 0, 0)) == -1);
+	CHECK(pinned.isResident(tail));
+}
+
+TEST_CASE("virtualtexture/indirection falls back to the nearest resident ancestor")
+{
+	const VirtualTextureLayout layout = makeLayout();
+	const int slotsX = 2;
+	VirtualPageCache cache(layout, slotsX, 2);
+	cache.beginFrame();
+	CHECK(cache.commit(makeVirtualPage(0, 2, 0, 0)) == 0);
+	CHECK(cache.commit(makeVirtualPage(0, 1, 1, 0)) == 1);
+	CHECK(cache.commit(makeVirtualPage(0, 0, 2, 1)) == 2);
+	const unsigned int version = cache.getVersion();
+
+	vector<uint32_t> table;
+	cache.buildIndirection(table);
+	CHECK(int(table.size()) == layout.tableSize());
+	const uint32_t tail = entry(0, slotsX, 2), mip1 = entry(1, slotsX, 1), mip0 = entry(2, slotsX, 0);
+	const uint32_t* level0 = &table[layout.tableOffset(0, 0)];
+	const uint32_t* level1 = &table[layout.tableOffset(0, 1)];
+	CHECK(table[layout.tableOffset(0, 2)] == tail);
+	CHECK(level1[1] == mip1 && level1[0] == tail && level1[2] == tail && level1[3] == tail);
+	for (int y = 0; y < 4; y++)
+		for (int x = 0; x < 4; x++)
+		{
+			const uint32_t expected = x == 2 && y == 1 ? mip0 : (x >= 2 && y < 2 ? mip1 : tail);
+			CHECK(level0[y * 4 + x] == expected);
+		}
+	// Layer 1 has nothing resident, not even its tail
+	for (int i = layout.tableOffset(1); i < layout.tableSize(); i++)
+		CHECK(table[i] == kNoVirtualEntry);
+
+	// Committing a resident page again changes nothing
+	CHECK(cache.commit(makeVirtualPage(0, 1, 1, 0)) == 1);
+	CHECK(cache.getVersion() == version);
+}
+
+TEST_CASE("virtualtexture/loader keeps decoded layers within the budget")
+{
+	// Three solid layers, 64 texel pages: a chain is 256, 128 and 64 texels square, the budget holds one
+	const int size = 256;
+	const size_t chain = size_t(4) * (size * size + 128 * 128 + 64 * 64);
+	vector<string> files;
+	for (int l = 0; l < 3; l++)
+	{
+		files.push_back("tests_layer" + to_string(l) + ".bmp");
+		vector<unsigned char> bgr(size_t(size) * size * 3);
+		for (size_t i = 0; i < bgr.size(); i++)
+			bgr[i] = (unsigned char)(40 * l + 20 * (i % 3));
+		saveBMP_custom(files.back().c_str(), size, size, bgr.data());
+	}
+
+	{
+		VirtualTextureLoader loader(files, 64, 4, chain + chain / 2);
+		CHECK(loader.getLayout().mipCount(0) == 3);
+		vector<unsigned char> colours[3];
+		const int order[] = { 0, 1, 2, 0, 0 };
+		for (int l : order)
+		{
+			const VirtualPageData data = loadOne(loader, makeVirtualPage(l, l % 3, 0, 0));
+			const int slotSize = loader.getLayout().slotSize();
+			CHECK(int(data.texels.size()) == slotSize * slotSize * 4);
+			bool solid = true;
+			for (size_t i = 4; i < data.texels.size(); i++)
+				solid &= data.texels[i] == data.texels[i % 4];
+			CHECK(solid);
+			const vector<unsigned char> colour(data.texels.begin(), data.texels.begin() + 4);
+			CHECK(colours[l].empty() || colours[l] == colour);
+			colours[l] = colour;
+			CHECK(loader.decodedBytes() <= chain);
+		}
+		CHECK(colours[0] != colours[1] && colours[1] != colours[2]);
+		// Layer 0 was dropped for the others and decoded again, then kept
+		CHECK(loader.decodeCount() == 4);
+		CHECK(loader.isIdle());
+	}
+	{
+		// Room for all of them: every layer is decoded once
+		VirtualTextureLoader loader(files, 64, 4);
+		for (int l : { 0, 1, 2, 0, 1 })
+			loadOne(loader, makeVirtualPage(l, 0, 1, 1));
+		CHECK(loader.decodeCount() == 3);
+		CHECK(loader.decodedBytes() == 3 * chain);
+	}
+	for (const string& file : files)
+		remove(file.c_str());
+}